@@ -0,0 +1,819 @@
+#include "animation.h"
+
+#include "draw_interface.h"
+#include "mat4.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define SNORM16_MAX 32767.0f
+#define UNORM16_MAX 65535.0f
+
+static float *allocate_floats(size_t count) {
+    // aligned_alloc wants a multiple of the alignment
+    size_t size = ((count > 0 ? count : 1) * sizeof(float) + 15) & ~(size_t)15;
+    float *floats = aligned_alloc(16, size);
+    if (floats) {
+        memset(floats, 0x0, size);
+    }
+
+    return floats;
+}
+
+struct animation_skeleton *animation_skeleton_create(
+    uint32_t bone_count, const int32_t *parent, const float *inverse_bind) {
+    for (uint32_t i = 0; i < bone_count; i++) {
+        if (parent[i] < -1 || parent[i] >= (int32_t)i) {
+            return NULL;
+        }
+    }
+
+    struct animation_skeleton *skeleton = calloc(1, sizeof(*skeleton));
+    if (!skeleton) {
+        return NULL;
+    }
+
+    skeleton->bone_count = bone_count;
+    skeleton->parent = malloc((bone_count > 0 ? bone_count : 1) *
+                              sizeof(*skeleton->parent));
+    skeleton->inverse_bind = allocate_floats(bone_count * 16);
+    if (!skeleton->parent || !skeleton->inverse_bind) {
+        animation_skeleton_destroy(skeleton);
+        return NULL;
+    }
+
+    memcpy(skeleton->parent, parent, bone_count * sizeof(*parent));
+    for (uint32_t i = 0; i < bone_count; i++) {
+        if (inverse_bind) {
+            memcpy(&skeleton->inverse_bind[i * 16], &inverse_bind[i * 16],
+                   16 * sizeof(float));
+        } else {
+            mat4_identity(&skeleton->inverse_bind[i * 16]);
+        }
+    }
+
+    return skeleton;
+}
+
+void animation_skeleton_destroy(struct animation_skeleton *skeleton) {
+    free(skeleton->parent);
+    free(skeleton->inverse_bind);
+    free(skeleton);
+}
+
+static void quantize_rotations(struct animation_clip *clip,
+                               const float *rotations) {
+    uint32_t bones = clip->bone_count;
+
+    for (uint32_t frame = 0; frame < clip->frame_count; frame++) {
+        for (uint32_t bone = 0; bone < bones; bone++) {
+            size_t index = ((size_t)frame * bones + bone) * 4;
+            const float *q = &rotations[index];
+
+            float length = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] +
+                                 q[3] * q[3]);
+            float scale = length > 0 ? 1 / length : 0;
+
+            // q and -q are the same rotation. Keeping each frame on the
+            // same side as the last one means interpolating between them
+            // takes the short way round without a check when sampling.
+            if (frame > 0) {
+                const int16_t *last = &clip->rotations[index - bones * 4];
+                float dot = 0;
+                for (int i = 0; i < 4; i++) {
+                    dot += last[i] * q[i];
+                }
+                if (dot < 0) {
+                    scale = -scale;
+                }
+            }
+
+            for (int i = 0; i < 4; i++) {
+                clip->rotations[index + i] =
+                    (int16_t)lrintf(q[i] * scale * SNORM16_MAX);
+            }
+        }
+    }
+}
+
+static void quantize_translations(struct animation_clip *clip,
+                                  const float *translations) {
+    uint32_t bones = clip->bone_count;
+
+    for (uint32_t bone = 0; bone < bones; bone++) {
+        float *min = &clip->translation_min[bone * 4];
+        float *scale = &clip->translation_scale[bone * 4];
+
+        for (int i = 0; i < 3; i++) {
+            float low = translations[bone * 3 + i];
+            float high = low;
+            for (uint32_t frame = 1; frame < clip->frame_count; frame++) {
+                float t = translations[((size_t)frame * bones + bone) * 3 + i];
+                low = fminf(low, t);
+                high = fmaxf(high, t);
+            }
+
+            min[i] = low;
+            scale[i] = (high - low) / UNORM16_MAX;
+        }
+
+        for (uint32_t frame = 0; frame < clip->frame_count; frame++) {
+            size_t index = (size_t)frame * bones + bone;
+            for (int i = 0; i < 3; i++) {
+                float t = translations[index * 3 + i];
+                clip->translations[index * 4 + i] = scale[i] > 0 ?
+                    (uint16_t)lrintf((t - min[i]) / scale[i]) : 0;
+            }
+            clip->translations[index * 4 + 3] = 0;
+        }
+    }
+}
+
+struct animation_clip *animation_clip_create(uint32_t bone_count,
+                                             uint32_t frame_count,
+                                             float frame_rate,
+                                             const float *rotations,
+                                             const float *translations) {
+    if (frame_count == 0 || frame_rate <= 0) {
+        return NULL;
+    }
+
+    struct animation_clip *clip = calloc(1, sizeof(*clip));
+    if (!clip) {
+        return NULL;
+    }
+
+    clip->bone_count = bone_count;
+    clip->frame_count = frame_count;
+    clip->frame_rate = frame_rate;
+    clip->duration = (frame_count - 1) / frame_rate;
+
+    size_t samples = (size_t)frame_count * bone_count;
+    clip->rotations = malloc((samples > 0 ? samples : 1) * 4 *
+                             sizeof(*clip->rotations));
+    clip->translations = malloc((samples > 0 ? samples : 1) * 4 *
+                                sizeof(*clip->translations));
+    clip->translation_min = allocate_floats(bone_count * 4);
+    clip->translation_scale = allocate_floats(bone_count * 4);
+    if (!clip->rotations || !clip->translations || !clip->translation_min ||
+        !clip->translation_scale) {
+        animation_clip_destroy(clip);
+        return NULL;
+    }
+
+    quantize_rotations(clip, rotations);
+    quantize_translations(clip, translations);
+
+    return clip;
+}
+
+void animation_clip_destroy(struct animation_clip *clip) {
+    free(clip->rotations);
+    free(clip->translations);
+    free(clip->translation_min);
+    free(clip->translation_scale);
+    free(clip);
+}
+
+int animation_pose_init(struct animation_pose *pose, uint32_t bone_count) {
+    pose->bone_count = bone_count;
+    pose->rotations = allocate_floats(bone_count * 4);
+    pose->translations = allocate_floats(bone_count * 4);
+    if (!pose->rotations || !pose->translations) {
+        animation_pose_free(pose);
+        return 1;
+    }
+
+    return 0;
+}
+
+void animation_pose_free(struct animation_pose *pose) {
+    free(pose->rotations);
+    free(pose->translations);
+    pose->rotations = NULL;
+    pose->translations = NULL;
+}
+
+// Frame to start from and how far towards the next one the time falls
+static uint32_t find_frame(const struct animation_clip *clip, float time,
+                           int loop, float *fraction) {
+    if (clip->frame_count == 1) {
+        *fraction = 0;
+        return 0;
+    }
+
+    if (loop) {
+        time = fmodf(time, clip->duration);
+        if (time < 0) {
+            time += clip->duration;
+        }
+    } else {
+        time = fminf(fmaxf(time, 0), clip->duration);
+    }
+
+    float position = time * clip->frame_rate;
+    uint32_t frame = (uint32_t)position;
+    if (frame >= clip->frame_count - 1) {
+        *fraction = 1;
+        return clip->frame_count - 2;
+    }
+
+    *fraction = position - frame;
+    return frame;
+}
+
+#if defined(__SSE2__)
+// Sum of a * b in every lane
+static inline __m128 dot4(__m128 a, __m128 b) {
+    __m128 m = _mm_mul_ps(a, b);
+    m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+static inline __m128 normalize4(__m128 q) {
+    return _mm_div_ps(q, _mm_sqrt_ps(dot4(q, q)));
+}
+
+static inline __m128 load_rotation(const int16_t *q) {
+    __m128i packed = _mm_loadl_epi64((const __m128i *)q);
+    // Sign extend by putting each value in the top half of a 32 bit lane
+    __m128i wide = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16);
+    return _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(1 / SNORM16_MAX));
+}
+
+static inline __m128 load_translation(const uint16_t *t) {
+    __m128i packed = _mm_loadl_epi64((const __m128i *)t);
+    __m128i wide = _mm_unpacklo_epi16(packed, _mm_setzero_si128());
+    return _mm_cvtepi32_ps(wide);
+}
+#endif
+
+void animation_sample(const struct animation_clip *clip, float time, int loop,
+                      struct animation_pose *pose) {
+    float fraction;
+    uint32_t frame = find_frame(clip, time, loop, &fraction);
+    uint32_t next = clip->frame_count > 1 ? frame + 1 : frame;
+    uint32_t bones = clip->bone_count;
+
+    const int16_t *r0 = &clip->rotations[(size_t)frame * bones * 4];
+    const int16_t *r1 = &clip->rotations[(size_t)next * bones * 4];
+    const uint16_t *t0 = &clip->translations[(size_t)frame * bones * 4];
+    const uint16_t *t1 = &clip->translations[(size_t)next * bones * 4];
+
+#if defined(__SSE2__)
+    __m128 f = _mm_set1_ps(fraction);
+
+    for (uint32_t bone = 0; bone < bones; bone++) {
+        size_t i = bone * 4;
+
+        __m128 a = load_rotation(&r0[i]);
+        __m128 b = load_rotation(&r1[i]);
+        __m128 q = normalize4(_mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f)));
+        _mm_store_ps(&pose->rotations[i], q);
+
+        // Interpolating before scaling into the bone's range gives the same
+        // result with one multiply fewer
+        a = load_translation(&t0[i]);
+        b = load_translation(&t1[i]);
+        __m128 t = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f));
+        t = _mm_add_ps(_mm_load_ps(&clip->translation_min[i]),
+                       _mm_mul_ps(t, _mm_load_ps(&clip->translation_scale[i])));
+        _mm_store_ps(&pose->translations[i], t);
+    }
+#else
+    for (uint32_t bone = 0; bone < bones; bone++) {
+        size_t i = bone * 4;
+        float *q = &pose->rotations[i];
+        float length = 0;
+
+        for (int j = 0; j < 4; j++) {
+            float a = r0[i + j] / SNORM16_MAX;
+            float b = r1[i + j] / SNORM16_MAX;
+            q[j] = a + (b - a) * fraction;
+            length += q[j] * q[j];
+        }
+        length = sqrtf(length);
+        for (int j = 0; j < 4; j++) {
+            q[j] /= length;
+        }
+
+        for (int j = 0; j < 4; j++) {
+            float t = t0[i + j] + ((float)t1[i + j] - t0[i + j]) * fraction;
+            pose->translations[i + j] = clip->translation_min[i + j] +
+                                        t * clip->translation_scale[i + j];
+        }
+    }
+#endif
+}
+
+void animation_blend(const struct animation_pose *a,
+                     const struct animation_pose *b, float weight,
+                     struct animation_pose *out) {
+#if defined(__SSE2__)
+    __m128 w = _mm_set1_ps(weight);
+    __m128 sign = _mm_set1_ps(-0.0f);
+
+    for (uint32_t bone = 0; bone < out->bone_count; bone++) {
+        size_t i = bone * 4;
+
+        // Poses from different clips can be on opposite sides, so flip b
+        // over to a's side to take the short way round
+        __m128 qa = _mm_load_ps(&a->rotations[i]);
+        __m128 qb = _mm_load_ps(&b->rotations[i]);
+        qb = _mm_xor_ps(qb, _mm_and_ps(dot4(qa, qb), sign));
+        __m128 q = normalize4(_mm_add_ps(qa, _mm_mul_ps(_mm_sub_ps(qb, qa), w)));
+        _mm_store_ps(&out->rotations[i], q);
+
+        __m128 ta = _mm_load_ps(&a->translations[i]);
+        __m128 tb = _mm_load_ps(&b->translations[i]);
+        _mm_store_ps(&out->translations[i],
+                     _mm_add_ps(ta, _mm_mul_ps(_mm_sub_ps(tb, ta), w)));
+    }
+#else
+    for (uint32_t bone = 0; bone < out->bone_count; bone++) {
+        size_t i = bone * 4;
+        const float *qa = &a->rotations[i];
+        const float *qb = &b->rotations[i];
+
+        float dot = 0;
+        for (int j = 0; j < 4; j++) {
+            dot += qa[j] * qb[j];
+        }
+        float side = dot < 0 ? -1 : 1;
+
+        float q[4];
+        float length = 0;
+        for (int j = 0; j < 4; j++) {
+            q[j] = qa[j] + (qb[j] * side - qa[j]) * weight;
+            length += q[j] * q[j];
+        }
+        length = sqrtf(length);
+
+        for (int j = 0; j < 4; j++) {
+            out->rotations[i + j] = q[j] / length;
+            out->translations[i + j] =
+                a->translations[i + j] +
+                (b->translations[i + j] - a->translations[i + j]) * weight;
+        }
+    }
+#endif
+}
+
+void animation_palette(const struct animation_skeleton *skeleton,
+                       const struct animation_pose *pose, float *model,
+                       float *palette) {
+    static const float one[3] = {1, 1, 1};
+
+    for (uint32_t bone = 0; bone < skeleton->bone_count; bone++) {
+        float *bone_model = &model[bone * 16];
+        mat4_from_trs(bone_model, &pose->translations[bone * 4],
+                      &pose->rotations[bone * 4], one);
+
+        // Parents come first, so theirs is already done
+        int32_t parent = skeleton->parent[bone];
+        if (parent >= 0) {
+            mat4_multiply(bone_model, &model[parent * 16], bone_model);
+        }
+
+        mat4_multiply(&palette[bone * 16], bone_model,
+                      &skeleton->inverse_bind[bone * 16]);
+    }
+}
+
+struct animation_animator *animation_animator_create(
+    const struct animation_skeleton *skeleton, size_t count) {
+    struct animation_animator *animator = calloc(1, sizeof(*animator));
+    if (!animator) {
+        return NULL;
+    }
+
+    animator->skeleton = skeleton;
+    animator->count = count;
+
+    uint32_t bones = skeleton->bone_count;
+    animator->layers = calloc((count > 0 ? count : 1) * ANIMATION_MAX_LAYERS,
+                              sizeof(*animator->layers));
+    animator->palettes = allocate_floats(count * bones * 16);
+    animator->model = allocate_floats(bones * 16);
+    if (!animator->layers || !animator->palettes || !animator->model ||
+        animation_pose_init(&animator->pose, bones) != 0 ||
+        animation_pose_init(&animator->layer_pose, bones) != 0) {
+        animation_animator_destroy(animator);
+        return NULL;
+    }
+
+    // Identity matrices leave meshes in their bind pose until something
+    // plays
+    for (size_t i = 0; i < count * bones; i++) {
+        mat4_identity(&animator->palettes[i * 16]);
+    }
+
+    return animator;
+}
+
+void animation_animator_destroy(struct animation_animator *animator) {
+    free(animator->layers);
+    free(animator->palettes);
+    free(animator->model);
+    animation_pose_free(&animator->pose);
+    animation_pose_free(&animator->layer_pose);
+    free(animator);
+}
+
+static void advance_layer(struct animation_layer *layer, float dt) {
+    float duration = layer->clip->duration;
+
+    layer->time += dt * layer->speed;
+    // Wrapped here as well as when sampling so the time doesn't lose
+    // precision as it grows
+    if (layer->loop && duration > 0) {
+        layer->time = fmodf(layer->time, duration);
+        if (layer->time < 0) {
+            layer->time += duration;
+        }
+    } else {
+        layer->time = fminf(fmaxf(layer->time, 0), duration);
+    }
+}
+
+void animation_animator_update(struct animation_animator *animator,
+                               float dt) {
+    const struct animation_skeleton *skeleton = animator->skeleton;
+    uint32_t bones = skeleton->bone_count;
+
+    for (size_t character = 0; character < animator->count; character++) {
+        struct animation_layer *layers =
+            &animator->layers[character * ANIMATION_MAX_LAYERS];
+        int sampled = 0;
+
+        for (int i = 0; i < ANIMATION_MAX_LAYERS; i++) {
+            struct animation_layer *layer = &layers[i];
+            if (!layer->clip) {
+                continue;
+            }
+
+            advance_layer(layer, dt);
+
+            if (!sampled) {
+                animation_sample(layer->clip, layer->time, layer->loop,
+                                 &animator->pose);
+                sampled = 1;
+            } else if (layer->weight > 0) {
+                animation_sample(layer->clip, layer->time, layer->loop,
+                                 &animator->layer_pose);
+                animation_blend(&animator->pose, &animator->layer_pose,
+                                fminf(layer->weight, 1), &animator->pose);
+            }
+        }
+
+        // Characters with nothing playing keep their last palette
+        if (sampled) {
+            animation_palette(skeleton, &animator->pose, animator->model,
+                              &animator->palettes[character * bones * 16]);
+        }
+    }
+}
+
+static struct animation_skeleton *check_skeleton(lua_State *L, int index) {
+    struct animation_skeleton *skeleton = lua_touserdata(L, index);
+    if (!skeleton) {
+        luaL_error(L, "Expected a skeleton");
+    }
+
+    return skeleton;
+}
+
+static struct animation_clip *check_clip(lua_State *L, int index) {
+    struct animation_clip *clip = lua_touserdata(L, index);
+    if (!clip) {
+        luaL_error(L, "Expected an animation clip");
+    }
+
+    return clip;
+}
+
+static struct animation_animator *check_animator(lua_State *L, int index) {
+    struct animation_animator *animator = lua_touserdata(L, index);
+    if (!animator) {
+        luaL_error(L, "Expected an animator");
+    }
+
+    return animator;
+}
+
+static struct animation_layer *check_layer(lua_State *L,
+                                           struct animation_animator *animator,
+                                           int index) {
+    lua_Integer character = luaL_checkinteger(L, index);
+    lua_Integer layer = luaL_checkinteger(L, index + 1);
+
+    if (character < 0 || (size_t)character >= animator->count) {
+        luaL_error(L, "Bad character %d", (int)character);
+    }
+    if (layer < 0 || layer >= ANIMATION_MAX_LAYERS) {
+        luaL_error(L, "Bad animation layer %d", (int)layer);
+    }
+
+    return &animator->layers[character * ANIMATION_MAX_LAYERS + layer];
+}
+
+// Reads a list of numbers into a userdata left on the stack, so nothing
+// leaks on an error
+static float *read_floats(lua_State *L, int index, size_t *count) {
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    *count = get_lua_len(L, index);
+    float *values = lua_newuserdata(L, (*count > 0 ? *count : 1) *
+                                       sizeof(float));
+    read_into_float_array(L, index, *count, values);
+
+    return values;
+}
+
+// {parent, ...} with bones numbered from 0 and -1 for roots, then
+// optionally the inverse bind matrices as a list of 16 numbers per bone
+int animation_lua_CreateSkeleton(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    size_t bone_count = get_lua_len(L, 1);
+    int32_t *parents = lua_newuserdata(L, (bone_count > 0 ? bone_count : 1) *
+                                          sizeof(*parents));
+    for (size_t i = 0; i < bone_count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        parents[i] = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    const float *inverse_bind = NULL;
+    if (!lua_isnoneornil(L, 2)) {
+        size_t count;
+        inverse_bind = read_floats(L, 2, &count);
+        if (count != bone_count * 16) {
+            return luaL_error(L, "Expected %d inverse bind matrix values, "
+                              "got %d", (int)bone_count * 16, (int)count);
+        }
+    }
+
+    struct animation_skeleton *skeleton =
+        animation_skeleton_create(bone_count, parents, inverse_bind);
+    if (!skeleton) {
+        return luaL_error(L, "Error creating skeleton, each bone's parent "
+                          "has to come before it");
+    }
+
+    lua_pushlightuserdata(L, skeleton);
+
+    return 1;
+}
+
+// Animators and clips made for the skeleton have to be deleted first
+int animation_lua_DeleteSkeleton(lua_State *L) {
+    animation_skeleton_destroy(check_skeleton(L, 1));
+
+    return 0;
+}
+
+// skeleton, frames per second, rotations, translations. Every frame has a
+// quaternion (x, y, z, w) and a translation (x, y, z) for every bone, frame
+// by frame.
+int animation_lua_CreateClip(lua_State *L) {
+    struct animation_skeleton *skeleton = check_skeleton(L, 1);
+    float frame_rate = luaL_checknumber(L, 2);
+    size_t rotation_count, translation_count;
+    const float *rotations = read_floats(L, 3, &rotation_count);
+    const float *translations = read_floats(L, 4, &translation_count);
+
+    uint32_t bones = skeleton->bone_count;
+    size_t frames = bones > 0 ? rotation_count / (bones * 4) : 0;
+    if (frames == 0 || rotation_count != frames * bones * 4 ||
+        translation_count != frames * bones * 3) {
+        return luaL_error(L, "Expected 4 rotation and 3 translation values "
+                          "per bone per frame for %d bones", (int)bones);
+    }
+    if (frame_rate <= 0) {
+        return luaL_error(L, "Bad frame rate %f", frame_rate);
+    }
+
+    struct animation_clip *clip = animation_clip_create(
+        bones, frames, frame_rate, rotations, translations);
+    if (!clip) {
+        return luaL_error(L, "Error creating animation clip");
+    }
+
+    lua_pushlightuserdata(L, clip);
+
+    return 1;
+}
+
+// Characters still playing the clip have to stop first
+int animation_lua_DeleteClip(lua_State *L) {
+    animation_clip_destroy(check_clip(L, 1));
+
+    return 0;
+}
+
+int animation_lua_ClipDuration(lua_State *L) {
+    lua_pushnumber(L, check_clip(L, 1)->duration);
+
+    return 1;
+}
+
+// skeleton, number of characters
+int animation_lua_CreateAnimator(lua_State *L) {
+    struct animation_skeleton *skeleton = check_skeleton(L, 1);
+    lua_Integer count = luaL_checkinteger(L, 2);
+    if (count < 0) {
+        return luaL_error(L, "Bad character count %d", (int)count);
+    }
+
+    struct animation_animator *animator =
+        animation_animator_create(skeleton, count);
+    if (!animator) {
+        return luaL_error(L, "Error creating animator");
+    }
+
+    lua_pushlightuserdata(L, animator);
+
+    return 1;
+}
+
+int animation_lua_DeleteAnimator(lua_State *L) {
+    animation_animator_destroy(check_animator(L, 1));
+
+    return 0;
+}
+
+static void read_field(lua_State *L, int index, const char *name,
+                       float *value) {
+    lua_getfield(L, index, name);
+    if (!lua_isnil(L, -1)) {
+        *value = luaL_checknumber(L, -1);
+    }
+    lua_pop(L, 1);
+}
+
+// animator, character, layer, clip or nil to stop, and optionally
+// {time=, speed=, weight=, loop=}. Characters and layers are numbered from
+// 0, and layers blend over the ones below them.
+int animation_lua_Play(lua_State *L) {
+    struct animation_animator *animator = check_animator(L, 1);
+    struct animation_layer *layer = check_layer(L, animator, 2);
+
+    if (lua_isnoneornil(L, 4)) {
+        layer->clip = NULL;
+        return 0;
+    }
+
+    struct animation_clip *clip = check_clip(L, 4);
+    if (clip->bone_count != animator->skeleton->bone_count) {
+        return luaL_error(L, "Clip has %d bones, the skeleton has %d",
+                          (int)clip->bone_count,
+                          (int)animator->skeleton->bone_count);
+    }
+
+    *layer = (struct animation_layer){
+        .clip = clip,
+        .speed = 1,
+        .weight = 1,
+        .loop = 1,
+    };
+
+    if (!lua_isnoneornil(L, 5)) {
+        luaL_checktype(L, 5, LUA_TTABLE);
+        read_field(L, 5, "time", &layer->time);
+        read_field(L, 5, "speed", &layer->speed);
+        read_field(L, 5, "weight", &layer->weight);
+
+        lua_getfield(L, 5, "loop");
+        if (!lua_isnil(L, -1)) {
+            layer->loop = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+
+    return 0;
+}
+
+// animator, character, layer, weight. For fading between clips.
+int animation_lua_SetWeight(lua_State *L) {
+    struct animation_animator *animator = check_animator(L, 1);
+
+    check_layer(L, animator, 2)->weight = luaL_checknumber(L, 4);
+
+    return 0;
+}
+
+// animator, character, layer. Returns the time into the clip, or nil if
+// nothing is playing.
+int animation_lua_LayerTime(lua_State *L) {
+    struct animation_animator *animator = check_animator(L, 1);
+    struct animation_layer *layer = check_layer(L, animator, 2);
+
+    if (!layer->clip) {
+        lua_pushnil(L);
+    } else {
+        lua_pushnumber(L, layer->time);
+    }
+
+    return 1;
+}
+
+// animator, dt
+int animation_lua_Update(lua_State *L) {
+    struct animation_animator *animator = check_animator(L, 1);
+
+    animation_animator_update(animator, luaL_checknumber(L, 2));
+
+    return 0;
+}
+
+// animator, character. The palette as a list of 16 numbers per bone, for
+// debugging or CPU-side use.
+int animation_lua_Palette(lua_State *L) {
+    struct animation_animator *animator = check_animator(L, 1);
+    lua_Integer character = luaL_checkinteger(L, 2);
+    if (character < 0 || (size_t)character >= animator->count) {
+        return luaL_error(L, "Bad character %d", (int)character);
+    }
+
+    size_t count = animator->skeleton->bone_count * 16;
+    const float *palette = &animator->palettes[character * count];
+
+    lua_createtable(L, count, 0);
+    for (size_t i = 0; i < count; i++) {
+        lua_pushnumber(L, palette[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+// target, animator. Streams every character's palette into the bound
+// buffer, each starting at a multiple of the uniform buffer offset alignment
+// so it can be bound as a uniform block with glBindBufferRange. Returns the
+// bytes between characters, which is also the range size to bind.
+int draw_lua_StreamPalettes(struct draw_data *data, lua_State *L) {
+    GLenum target = get_integer_arg(L);
+    struct animation_animator *animator = check_animator(L, 1);
+
+    GLint alignment = data->uniform_buffer_alignment;
+
+    size_t palette_size = animator->skeleton->bone_count * 16 * sizeof(float);
+    size_t stride = (palette_size + alignment - 1) / alignment * alignment;
+    size_t size = animator->count * stride;
+
+    lua_pushinteger(L, stride);
+    if (size == 0) {
+        return 1;
+    }
+
+    // Orphan last frame's palettes rather than waiting for draws still
+    // reading them
+    glBufferData(target, size, NULL, GL_STREAM_DRAW);
+    memory_gpu_alloc_lua(data->memory, MEMORY_GPU_BUFFER,
+                         handle_bound_buffer(&data->handles, target), size,
+                         GL_STREAM_DRAW, L);
+
+    char *mapped = glMapBufferRange(target, 0, size,
+                                    GL_MAP_WRITE_BIT |
+                                    GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!mapped) {
+        return luaL_error(L, "Error mapping palette buffer");
+    }
+
+    const char *palettes = (const char *)animator->palettes;
+    if (stride == palette_size) {
+        memcpy(mapped, palettes, size);
+    } else {
+        for (size_t i = 0; i < animator->count; i++) {
+            memcpy(mapped + i * stride, palettes + i * palette_size,
+                   palette_size);
+        }
+    }
+
+    glUnmapBuffer(target);
+
+    return 1;
+}
+
+void animation_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(StreamPalettes);
+
+    lua_register(L, "animation_CreateSkeleton", animation_lua_CreateSkeleton);
+    lua_register(L, "animation_DeleteSkeleton", animation_lua_DeleteSkeleton);
+    lua_register(L, "animation_CreateClip", animation_lua_CreateClip);
+    lua_register(L, "animation_DeleteClip", animation_lua_DeleteClip);
+    lua_register(L, "animation_ClipDuration", animation_lua_ClipDuration);
+    lua_register(L, "animation_CreateAnimator", animation_lua_CreateAnimator);
+    lua_register(L, "animation_DeleteAnimator", animation_lua_DeleteAnimator);
+    lua_register(L, "animation_Play", animation_lua_Play);
+    lua_register(L, "animation_SetWeight", animation_lua_SetWeight);
+    lua_register(L, "animation_LayerTime", animation_lua_LayerTime);
+    lua_register(L, "animation_Update", animation_lua_Update);
+    lua_register(L, "animation_Palette", animation_lua_Palette);
+}
@@ -0,0 +1,120 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "lua.h"
+#include "draw.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Clips a character can play at once, blended in order
+#define ANIMATION_MAX_LAYERS 4
+
+// Bones in parent-first order: each bone's parent comes before it, or is -1
+// for a root
+struct animation_skeleton {
+    uint32_t bone_count;
+    int32_t *parent;
+    // 16 floats per bone, column-major: from model space to the bone's bind
+    // pose space
+    float *inverse_bind;
+};
+
+// Every bone sampled at a fixed rate. Rotations are unit quaternions
+// (x, y, z, w) stored as four snorm16s, translations as three unorm16s plus
+// padding, scaled into each bone's range. A bone sample is 16 bytes where
+// floats would take 28. Frames are stored one after another so sampling a
+// time reads two contiguous runs.
+struct animation_clip {
+    uint32_t bone_count;
+    uint32_t frame_count;
+    float frame_rate;
+    float duration;
+
+    int16_t *rotations;
+    uint16_t *translations;
+    // Per bone, x, y, z and a zero pad so they load as one vector
+    float *translation_min;
+    float *translation_scale;
+};
+
+// Local bone transforms, 16 byte aligned and padded to four floats per bone:
+// quaternion (x, y, z, w) and translation (x, y, z, 0)
+struct animation_pose {
+    uint32_t bone_count;
+    float *rotations;
+    float *translations;
+};
+
+struct animation_layer {
+    const struct animation_clip *clip;
+    float time;
+    float speed;
+    // How much of this layer replaces the layers under it. The lowest layer
+    // playing anything always counts fully.
+    float weight;
+    int loop;
+};
+
+// A set of characters sharing a skeleton. Each update samples and blends
+// every character's layers, then writes its bone palette: the model space
+// bone matrices times the inverse bind matrices, ready for skinning. All
+// the palettes sit in one array so they can be uploaded in one go.
+struct animation_animator {
+    const struct animation_skeleton *skeleton;
+    size_t count;
+
+    struct animation_layer *layers;
+
+    // 16 floats per bone, bone_count per character
+    float *palettes;
+
+    // Scratch space for an update
+    struct animation_pose pose;
+    struct animation_pose layer_pose;
+    float *model;
+};
+
+// parents has bone_count entries; inverse_bind 16 * bone_count floats, or
+// NULL for identity matrices. Returns NULL if a parent doesn't come before
+// its child, or on allocation failure.
+struct animation_skeleton *animation_skeleton_create(uint32_t, const int32_t *,
+                                                     const float *);
+void animation_skeleton_destroy(struct animation_skeleton *);
+
+// frame_count frames of bone_count rotations (4 floats) and translations
+// (3 floats). Returns NULL on allocation failure.
+struct animation_clip *animation_clip_create(uint32_t bone_count,
+                                             uint32_t frame_count,
+                                             float frame_rate,
+                                             const float *rotations,
+                                             const float *translations);
+void animation_clip_destroy(struct animation_clip *);
+
+int animation_pose_init(struct animation_pose *, uint32_t);
+void animation_pose_free(struct animation_pose *);
+
+// Samples the clip at time seconds, interpolating between frames. Times
+// outside the clip wrap when looping and clamp otherwise.
+void animation_sample(const struct animation_clip *, float, int,
+                      struct animation_pose *);
+// out = a blended towards b by weight. out may be a or b.
+void animation_blend(const struct animation_pose *,
+                     const struct animation_pose *, float,
+                     struct animation_pose *);
+// Writes the skinning matrices for the pose, 16 floats per bone. model is
+// scratch space for 16 floats per bone.
+void animation_palette(const struct animation_skeleton *,
+                       const struct animation_pose *, float *, float *);
+
+struct animation_animator *animation_animator_create(
+    const struct animation_skeleton *, size_t);
+void animation_animator_destroy(struct animation_animator *);
+
+// Advances every layer by dt seconds times its speed and rewrites the
+// palettes
+void animation_animator_update(struct animation_animator *, float);
+
+void animation_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,67 @@
+-- Skeletal animation. Clips are sampled and blended in C, and each frame
+-- every character's bone palette is streamed into one uniform buffer for
+-- skinning in the vertex shader, see skinning.glsl.
+local gl = require 'gl'
+
+local M = {}
+
+-- Animation functions exposed from C
+local copy_funcs = {
+  CreateSkeleton="create_skeleton",
+  DeleteSkeleton="delete_skeleton",
+  CreateClip="create_clip",
+  DeleteClip="delete_clip",
+  ClipDuration="clip_duration",
+  CreateAnimator="create_animator",
+  DeleteAnimator="delete_animator",
+  Play="play",
+  SetWeight="set_weight",
+  LayerTime="layer_time",
+  Update="update",
+  Palette="palette",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["animation_" .. c_name]
+end
+
+-- Uniform buffer binding the Palette block reads from
+M.PALETTE_BINDING = 0
+
+-- Program from shaders as gl.create_program takes them, with MAX_BONES
+-- defined for skinning.glsl and the Palette block pointed at
+-- PALETTE_BINDING
+function M.create_skinned_program(shaders, skeleton_bones)
+  local variants = {}
+  for i, shader in ipairs(shaders) do
+    local defines = {}
+    for name, value in pairs(shader[3] or {}) do
+      defines[name] = value
+    end
+    defines.MAX_BONES = tostring(skeleton_bones)
+    variants[i] = {shader[1], shader[2], defines}
+  end
+
+  local program = gl.create_program(variants)
+  gl.uniform_block_binding(program, "Palette", M.PALETTE_BINDING)
+
+  return program
+end
+
+-- Streams every character's palette into the buffer. Returns the bytes
+-- between characters, to pass to bind_palette.
+function M.upload(animator, buffer)
+  gl.bind_buffer(gl.UNIFORM_BUFFER, buffer)
+  local stride = gl.stream_palettes(gl.UNIFORM_BUFFER, animator)
+  gl.bind_buffer(gl.UNIFORM_BUFFER, nil)
+
+  return stride
+end
+
+-- Binds a character's palette, numbered from 0, for the next draw
+function M.bind_palette(buffer, character, stride)
+  gl.bind_buffer_range(gl.UNIFORM_BUFFER, M.PALETTE_BINDING, buffer,
+                       character * stride, stride)
+end
+
+return M
@@ -0,0 +1,54 @@
+-- Timing helpers for the benchmarks in bench/. Each of those is a main
+-- script run from the top of the tree, e.g. ./lua-game bench/serialize.lua,
+-- or all of them with make bench (make bench-luajit for the LuaJIT build).
+local M = {}
+
+M.now = stats_Now
+
+-- Prints a heading naming the Lua the numbers came from
+function M.header(name)
+  print(string.format("== %s (%s)", name, jit and jit.version or _VERSION))
+end
+
+-- Calls func(i) for i = 1, iterations, after a tenth as many untimed calls
+-- to warm up. Prints and returns the average ms per call.
+function M.time(name, iterations, func)
+  for i = 1, math.ceil(iterations / 10) do
+    func(i)
+  end
+
+  local start = M.now()
+  for i = 1, iterations do
+    func(i)
+  end
+  local ms = (M.now() - start) / iterations
+
+  print(string.format("%-44s %10.4f ms", name, ms))
+  return ms
+end
+
+-- Prints a value measured some other way
+function M.report(name, value, unit)
+  print(string.format("%-44s %10.4f %s", name, value, unit or ""))
+end
+
+-- Defines the main script functions for a benchmark that does its work in
+-- run at startup, with the GL context up, and quits on the first frame
+function M.main(run)
+  function startup()
+    run()
+    return {}
+  end
+
+  function update(data)
+    return data, true
+  end
+
+  function render(data)
+  end
+
+  function cleanup(data)
+  end
+end
+
+return M
@@ -0,0 +1,66 @@
+-- CPU cost of the per-frame calls gl_ffi.lua swaps for FFI calls under
+-- LuaJIT. make bench runs this on the lua_CFunction path and make
+-- bench-luajit on the FFI path, so the two back ends time the same script.
+local bench = require 'bench'
+local gl = require 'gl'
+
+local DRAWS = 1000
+
+local function run()
+  bench.header("backends, " .. gl.backend .. " calls")
+
+  local program = gl.create_program({
+    {gl.VERTEX_SHADER, "main.vertex.glsl"},
+    {gl.FRAGMENT_SHADER, "main.fragment.glsl"},
+  })
+  local model_matrix = gl.get_uniform_location(program, "model_matrix")
+  local vertex_array = gl.create_vertex_array()
+  local buffer = gl.create_buffer_object()
+
+  local matrix = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}
+  local values = {}
+  for i = 1, 1024 do
+    values[i] = i
+  end
+
+  bench.time("clear_color", 100000, function()
+    gl.clear_color(0, 0, 0, 1)
+  end)
+
+  bench.time("use_program and bind_vertex_array", 100000, function()
+    gl.use_program(program)
+    gl.bind_vertex_array(vertex_array)
+  end)
+
+  bench.time("uniform_matrix_float", 100000, function(i)
+    matrix[13] = i
+    gl.uniform_matrix_float(model_matrix, 4, 4, matrix)
+  end)
+
+  -- The shape of render() in a scene of small objects: a uniform and a
+  -- draw each. No arrays are enabled and each draw is one point, so this
+  -- is all call overhead.
+  bench.time(DRAWS .. " draws with a matrix each", 100, function()
+    for i = 1, DRAWS do
+      matrix[13] = i
+      gl.uniform_matrix_float(model_matrix, 4, 4, matrix)
+      gl.draw_arrays(gl.POINTS, 0, 1)
+    end
+  end)
+
+  gl.bind_vertex_array(nil)
+  gl.use_program(nil)
+
+  gl.bind_buffer(gl.ARRAY_BUFFER, buffer)
+  gl.buffer_data(gl.ARRAY_BUFFER, #values * 8, gl.STREAM_DRAW)
+  bench.time("buffer_sub_double_data, 1024 values", 10000, function()
+    gl.buffer_sub_double_data(gl.ARRAY_BUFFER, 0, values)
+  end)
+  gl.bind_buffer(gl.ARRAY_BUFFER, nil)
+
+  gl.delete_buffer_object(buffer)
+  gl.delete_vertex_array(vertex_array)
+  gl.delete_program(program)
+end
+
+bench.main(run)
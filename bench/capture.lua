@@ -0,0 +1,82 @@
+-- CPU cost of GL capture on a scene of small draws, like backends.lua's:
+-- per frame before the window, where binds and uniforms only update what's
+-- kept in memory, and inside it, where every call is written. make
+-- bench-capture runs this, then replays the trace it writes with gl-replay
+-- for the same calls' cost per frame and per call without the capture.
+local bench = require 'bench'
+local gl = require 'gl'
+
+local DRAWS = 1000
+-- Frames armed before the window opens, and frames in it
+local ARMED_FRAMES = 120
+local WINDOW_FRAMES = 30
+
+gl_capture = {file = "bench/capture.trace"}
+
+local function draw_scene(scene)
+  gl.use_program(scene.program)
+  gl.bind_vertex_array(scene.vertex_array)
+  for i = 1, DRAWS do
+    scene.matrix[13] = i + scene.frame
+    gl.uniform_matrix_float(scene.model_matrix, 4, 4, scene.matrix)
+    gl.draw_arrays(gl.POINTS, 0, 1)
+  end
+  gl.bind_vertex_array(nil)
+  gl.use_program(nil)
+end
+
+function startup()
+  bench.header("capture")
+
+  local program = gl.create_program({
+    {gl.VERTEX_SHADER, "main.vertex.glsl"},
+    {gl.FRAGMENT_SHADER, "main.fragment.glsl"},
+  })
+
+  return {
+    program = program,
+    model_matrix = gl.get_uniform_location(program, "model_matrix"),
+    vertex_array = gl.create_vertex_array(),
+    matrix = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1},
+    frame = 0,
+    armed_ms = 0,
+    window_ms = 0,
+  }
+end
+
+function update(scene)
+  scene.frame = scene.frame + 1
+  return scene, scene.frame > ARMED_FRAMES + WINDOW_FRAMES
+end
+
+function render(scene)
+  local start = bench.now()
+  draw_scene(scene)
+  local ms = bench.now() - start
+
+  -- The window opens after this frame
+  if scene.frame == ARMED_FRAMES then
+    gl.capture_frames(WINDOW_FRAMES)
+  end
+
+  if scene.frame <= ARMED_FRAMES then
+    scene.armed_ms = scene.armed_ms + ms
+  elseif scene.frame <= ARMED_FRAMES + WINDOW_FRAMES then
+    scene.window_ms = scene.window_ms + ms
+  end
+end
+
+function cleanup(scene)
+  -- Binds, a uniform and a draw each, and the binds back to nil
+  local calls = DRAWS * 2 + 4
+  local armed_ms = scene.armed_ms / ARMED_FRAMES
+  local window_ms = scene.window_ms / WINDOW_FRAMES
+
+  bench.report("armed, per frame", armed_ms, "ms")
+  bench.report("armed, per call", armed_ms / calls * 1000, "us")
+  bench.report("in the window, per frame", window_ms, "ms")
+  bench.report("in the window, per call", window_ms / calls * 1000, "us")
+
+  gl.delete_vertex_array(scene.vertex_array)
+  gl.delete_program(scene.program)
+end
@@ -0,0 +1,45 @@
+-- CPU particle simulation at the million particles a frame the system is
+-- meant to keep up with, and streaming them into a vertex buffer
+local bench = require 'bench'
+local gl = require 'gl'
+local particle_system = require 'particle_system'
+
+local PARTICLES = 1000000
+local DT = 1 / 60
+
+local function run()
+  bench.header("particles")
+
+  local system = particle_system.create_system(PARTICLES)
+  particle_system.set_gravity(system, 0, -9.8, 0)
+  particle_system.set_drag(system, 0.1)
+  -- Spawns as many as die each frame, so the system stays full
+  particle_system.add_emitter(system, {
+    vx = 0, vy = 5, vz = 0, spread = 2,
+    rate = PARTICLES / 2, life_min = 2, life_max = 2,
+  })
+
+  local live = 0
+  for i = 1, 240 do
+    live = particle_system.update(system, DT)
+  end
+  bench.report("live particles", live)
+
+  local update_ms = bench.time("update", 60, function()
+    particle_system.update(system, DT)
+  end)
+  bench.report("particles per ms", live / update_ms)
+  bench.report("share of a 60 Hz frame", update_ms / (DT * 1000) * 100, "%")
+
+  local buffer = gl.create_buffer_object()
+  gl.bind_buffer(gl.ARRAY_BUFFER, buffer)
+  bench.time("stream_particles", 60, function()
+    gl.stream_particles(gl.ARRAY_BUFFER, system)
+  end)
+  gl.bind_buffer(gl.ARRAY_BUFFER, nil)
+
+  gl.delete_buffer_object(buffer)
+  particle_system.delete_system(system)
+end
+
+bench.main(run)
@@ -0,0 +1,93 @@
+-- Sorting a frame's worth of draws submitted in scene order, and the binds
+-- it saves. Each draw is one point with no arrays enabled, so the times are
+-- the queue's overhead and the GL calls it makes.
+local bench = require 'bench'
+local gl = require 'gl'
+local render_queue = require 'render_queue'
+
+local DRAWS = 10000
+local PROGRAMS = 8
+local VERTEX_ARRAYS = 64
+local MATERIALS = 32
+-- Share of draws that are translucent
+local TRANSLUCENT = 0.1
+
+local function run()
+  bench.header("render_queue")
+
+  local programs, vertex_arrays, materials = {}, {}, {}
+  for i = 1, PROGRAMS do
+    programs[i] = gl.create_program({
+      {gl.VERTEX_SHADER, "main.vertex.glsl"},
+      {gl.FRAGMENT_SHADER, "main.fragment.glsl"},
+    })
+  end
+  for i = 1, VERTEX_ARRAYS do
+    vertex_arrays[i] = gl.create_vertex_array()
+  end
+  for i = 1, MATERIALS do
+    materials[i] = gl.create_buffer_object()
+    gl.bind_buffer(gl.UNIFORM_BUFFER, materials[i])
+    gl.buffer_data(gl.UNIFORM_BUFFER, 256, gl.STATIC_DRAW)
+  end
+  gl.bind_buffer(gl.UNIFORM_BUFFER, nil)
+
+  -- Objects in the order a scene walk would find them, which is no order
+  -- as far as state goes
+  math.randomseed(1)
+  local draws = {}
+  for i = 1, DRAWS do
+    draws[i] = {
+      program = programs[math.random(PROGRAMS)],
+      vertex_array = vertex_arrays[math.random(VERTEX_ARRAYS)],
+      material = materials[math.random(MATERIALS)],
+      depth = math.random() * 100,
+      translucent = math.random() < TRANSLUCENT,
+    }
+  end
+
+  local queue = render_queue.create(0, DRAWS)
+
+  local function submit_all()
+    for i = 1, DRAWS do
+      local draw = draws[i]
+      render_queue.submit_draw(queue, draw.program, draw.vertex_array,
+                               draw.material, 0, 0, draw.depth,
+                               draw.translucent, gl.POINTS, 1, 0)
+    end
+  end
+
+  -- Split into its halves, over the timed calls and the warm up
+  local submit_ms, execute_ms, frames = 0, 0, 0
+  bench.time("submit and execute " .. DRAWS .. " draws", 100, function()
+    local start = bench.now()
+    submit_all()
+    local submitted = bench.now()
+    render_queue.execute(queue)
+    submit_ms = submit_ms + submitted - start
+    execute_ms = execute_ms + bench.now() - submitted
+    frames = frames + 1
+  end)
+  bench.report("submit", submit_ms / frames, "ms")
+  bench.report("execute", execute_ms / frames, "ms")
+
+  local stats = render_queue.stats(queue)
+  bench.report("sort", stats.sort_ms, "ms")
+  for _, state in ipairs({"program", "vertex_array", "material"}) do
+    bench.report(state .. " changes sorted", stats.changes[state])
+    bench.report(state .. " changes unsorted", stats.unsorted_changes[state])
+  end
+
+  render_queue.delete(queue)
+  for i = 1, MATERIALS do
+    gl.delete_buffer_object(materials[i])
+  end
+  for i = 1, VERTEX_ARRAYS do
+    gl.delete_vertex_array(vertex_arrays[i])
+  end
+  for i = 1, PROGRAMS do
+    gl.delete_program(programs[i])
+  end
+end
+
+bench.main(run)
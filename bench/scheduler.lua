@@ -0,0 +1,113 @@
+-- What the scheduler itself costs per task: resuming tasks that yield
+-- straight away, polling predicates, spawning short tasks, and how close
+-- busy tasks are held to the budget.
+local bench = require 'bench'
+local scheduler = require 'scheduler'
+
+-- Tasks alive at once, e.g. one per entity behaviour
+local TASKS = 1000
+-- Short lived tasks spawned per frame, e.g. one-off effects
+local SPAWNS = 100
+-- Tasks that would each take the whole frame if let run
+local BUSY = 4
+local BUDGET_MS = 2
+
+local function run()
+  bench.header("scheduler")
+
+  -- Every task resumed once a frame, doing nothing but yielding
+  local tasks = scheduler.create(1000)
+  for i = 1, TASKS do
+    scheduler.spawn(tasks, "idle", function()
+      while true do
+        scheduler.wait_frames()
+      end
+    end)
+  end
+  local update_ms = bench.time("update " .. TASKS .. " yielding tasks", 100,
+                               function()
+    scheduler.update(tasks)
+  end)
+  bench.report("per resume", update_ms / TASKS * 1000, "us")
+  scheduler.delete(tasks)
+
+  -- Every task waiting on a future that isn't done, so each update polls
+  -- the predicates without resuming anything
+  tasks = scheduler.create(1000)
+  local future = scheduler.future()
+  for i = 1, TASKS do
+    scheduler.spawn(tasks, "waiting", scheduler.await, future)
+  end
+  scheduler.update(tasks)
+  update_ms = bench.time("update " .. TASKS .. " waiting tasks", 100,
+                         function()
+    scheduler.update(tasks)
+  end)
+  bench.report("per poll", update_ms / TASKS * 1000, "us")
+  scheduler.complete(future, true)
+  scheduler.update(tasks)
+  scheduler.delete(tasks)
+
+  -- Tasks that finish on their first resume, so their coroutines go back
+  -- to the pool for the next frame's
+  tasks = scheduler.create(1000)
+  local function effect(value)
+    return value + 1
+  end
+  update_ms = bench.time("spawn and finish " .. SPAWNS .. " tasks", 100,
+                         function()
+    for j = 1, SPAWNS do
+      scheduler.spawn(tasks, "effect", effect, j)
+    end
+    scheduler.update(tasks)
+  end)
+  bench.report("per short task", update_ms / SPAWNS * 1000, "us")
+  bench.report("coroutines pooled", scheduler.stats(tasks).pooled)
+  scheduler.delete(tasks)
+
+  -- Busy tasks, which the hook stops at the budget outside LuaJIT. Under
+  -- LuaJIT they only stop where they check.
+  tasks = scheduler.create(BUDGET_MS)
+  for i = 1, BUSY do
+    scheduler.spawn(tasks, "busy " .. i, function()
+      local x = 0
+      while true do
+        for j = 1, 1000 do
+          x = x + math.sin(j)
+        end
+        scheduler.check(tasks)
+      end
+    end)
+  end
+
+  local frames, frame_ms, late_ms, accounted_ms = 0, 0, 0, 0
+  bench.time("update " .. BUSY .. " busy tasks, " .. BUDGET_MS .. " ms budget",
+             100, function()
+    scheduler.update(tasks)
+
+    local stats = scheduler.stats(tasks)
+    frames = frames + 1
+    frame_ms = frame_ms + stats.frame_ms
+    late_ms = late_ms + stats.late_ms
+    for _, task in ipairs(stats.tasks) do
+      accounted_ms = accounted_ms + task.ms
+    end
+  end)
+
+  local stats = scheduler.stats(tasks)
+  bench.report("update", frame_ms / frames, "ms")
+  bench.report("past the budget", late_ms / frames, "ms")
+  bench.report("worst past the budget", stats.max_late_ms, "ms")
+  bench.report("update not charged to a task",
+               (frame_ms - accounted_ms) / frames, "ms")
+  local resumes, preemptions = 0, 0
+  for _, task in ipairs(stats.tasks) do
+    resumes = resumes + task.resumes
+    preemptions = preemptions + task.preemptions
+  end
+  bench.report("resumes per update", resumes / frames)
+  bench.report("stopped by the hook", preemptions / resumes * 100, "%")
+  scheduler.delete(tasks)
+end
+
+bench.main(run)
@@ -0,0 +1,92 @@
+-- Round trip and throughput of the snapshot serializer on a state table
+-- shaped like a game's: entities with float positions, integer ids,
+-- strings, flags and shared references
+local bench = require 'bench'
+local serialize = require 'serialize'
+
+local ENTITIES = 5000
+
+local function make_state()
+  local kinds = {{name = "tree"}, {name = "rock"}, {name = "enemy"}}
+  local entities = {}
+
+  for i = 1, ENTITIES do
+    entities[i] = {
+      id = i,
+      x = i * 0.37, y = i * -1.25, z = 2.5,
+      health = 100,
+      name = "entity" .. i,
+      visible = i % 2 == 0,
+      kind = kinds[i % #kinds + 1],
+    }
+  end
+
+  return {frame = 1, kinds = kinds, entities = entities}
+end
+
+local function same(a, b, seen)
+  if type(a) ~= "table" or type(b) ~= "table" then
+    return a == b and (not math.type or math.type(a) == math.type(b))
+  end
+  seen = seen or {}
+  if seen[a] then
+    return seen[a] == b
+  end
+  seen[a] = b
+  for k, v in pairs(a) do
+    if not same(v, b[k], seen) then
+      return false
+    end
+  end
+  for k in pairs(b) do
+    if a[k] == nil then
+      return false
+    end
+  end
+  return true
+end
+
+local function run()
+  bench.header("serialize")
+
+  local state = make_state()
+  local snapshot = serialize.encode(state)
+  local decoded = serialize.decode(snapshot)
+
+  assert(same(state, decoded), "round trip changed the state")
+  assert(decoded.entities[1].kind == decoded.entities[4].kind,
+         "round trip lost a shared reference")
+  bench.report("snapshot size", #snapshot / 1024, "KiB")
+
+  local mb = #snapshot / (1024 * 1024)
+  local encode_ms = bench.time("encode", 50, function()
+    serialize.encode(state)
+  end)
+  local decode_ms = bench.time("decode", 50, function()
+    serialize.decode(snapshot)
+  end)
+  bench.report("encode throughput", mb / (encode_ms / 1000), "MiB/s")
+  bench.report("decode throughput", mb / (decode_ms / 1000), "MiB/s")
+
+  -- A typical frame moves a few entities
+  local prev = snapshot
+  for i = 1, ENTITIES, 100 do
+    state.entities[i].x = state.entities[i].x + 1
+  end
+  state.frame = 2
+
+  local next_snapshot, delta = serialize.encode_delta(prev, state)
+  local rebuilt, value = serialize.decode_delta(prev, delta)
+  assert(rebuilt == next_snapshot and same(state, value),
+         "delta round trip changed the state")
+  bench.report("delta size, 1% of entities moved", #delta, "bytes")
+
+  bench.time("encode_delta", 50, function()
+    serialize.encode_delta(prev, state)
+  end)
+  bench.time("decode_delta", 50, function()
+    serialize.decode_delta(prev, delta)
+  end)
+end
+
+bench.main(run)
@@ -0,0 +1,19 @@
+-- Loads every module, then quits on the first frame. make bench-startup
+-- runs it from source and from a bundle and compares the load times lua.c
+-- logs.
+local bench = require 'bench'
+
+local MODULES = {
+  'animation', 'broadphase', 'gl', 'glm', 'gpu_particles', 'input', 'log',
+  'mesh', 'particle_system', 'render_queue', 'resolution', 'scheduler',
+  'serialize', 'sprite', 'text', 'transform', 'util', 'voxel',
+}
+
+for _, name in ipairs(MODULES) do
+  require(name)
+end
+
+bench.main(function()
+  bench.header("startup")
+  bench.report("modules loaded", #MODULES)
+end)
@@ -0,0 +1,177 @@
+-- Drawing text that doesn't change, text that changes every frame, and text
+-- with more distinct glyphs than the atlas holds. The font is made up here,
+-- an 8x16 BDF with ASCII and a few thousand CJK ideographs, since the repo
+-- doesn't ship one.
+local bench = require 'bench'
+local text = require 'text'
+
+local WIDTH, HEIGHT = 1280, 720
+local SIZE = 16
+-- HUD labels drawn every frame, and how many of them show a changing number
+local LABELS = 200
+local COUNTERS = 20
+-- Ideographs in the font, more than fit in the small atlas at once
+local IDEOGRAPHS = 2048
+local FIRST_IDEOGRAPH = 0x4e00
+-- Strings of two random ideographs drawn per frame, e.g. names over heads
+local NAMES = 8
+
+local function write_font(file_name)
+  local lines = {
+    "STARTFONT 2.1",
+    "FONT bench",
+    "SIZE 16 75 75",
+    "FONTBOUNDINGBOX 8 16 0 -4",
+    "STARTPROPERTIES 4",
+    "PIXEL_SIZE 16",
+    "FONT_ASCENT 12",
+    "FONT_DESCENT 4",
+    "DEFAULT_CHAR 63",
+    "ENDPROPERTIES",
+    "CHARS " .. (95 + IDEOGRAPHS),
+  }
+
+  local function add_glyph(codepoint)
+    lines[#lines + 1] = "STARTCHAR U+" .. string.format("%04X", codepoint)
+    lines[#lines + 1] = "ENCODING " .. codepoint
+    lines[#lines + 1] = "DWIDTH 8 0"
+    lines[#lines + 1] = "BBX 8 16 0 -4"
+    lines[#lines + 1] = "BITMAP"
+    -- Any pattern will do, as long as glyphs differ
+    for row = 1, 16 do
+      lines[#lines + 1] = string.format("%02X",
+                                        (codepoint * 37 + row * 11) % 256)
+    end
+    lines[#lines + 1] = "ENDCHAR"
+  end
+
+  for codepoint = 32, 126 do
+    add_glyph(codepoint)
+  end
+  for i = 0, IDEOGRAPHS - 1 do
+    add_glyph(FIRST_IDEOGRAPH + i)
+  end
+  lines[#lines + 1] = "ENDFONT"
+
+  local file = assert(io.open(file_name, "w"))
+  file:write(table.concat(lines, "\n"), "\n")
+  file:close()
+end
+
+-- UTF-8 for the ideograph, which always takes three bytes
+local function ideograph(i)
+  local codepoint = FIRST_IDEOGRAPH + i
+  return string.char(0xe0 + math.floor(codepoint / 4096),
+                     0x80 + math.floor(codepoint / 64) % 64,
+                     0x80 + codepoint % 64)
+end
+
+-- Counter changes between two stats tables
+local function changes(before, after)
+  local result = {}
+  for name, value in pairs(after) do
+    result[name] = value - before[name]
+  end
+  return result
+end
+
+local function run()
+  bench.header("text")
+
+  local font_file = os.tmpname()
+  write_font(font_file)
+
+  local renderer = text.create_renderer(1024)
+  local font = text.load_font(renderer.context, font_file)
+
+  local labels = {}
+  for i = 1, LABELS do
+    labels[i] = string.format("Label %d: the quick brown fox", i)
+  end
+
+  text.begin(renderer, WIDTH, HEIGHT)
+
+  -- Static text, which after the first frame is all run cache hits
+  local before = text.stats(renderer.context)
+  local static_ms = bench.time("draw " .. LABELS .. " unchanged labels", 100,
+    function()
+      for i = 1, LABELS do
+        text.draw(renderer.context, font, SIZE, labels[i], 0, i * 3)
+      end
+    end)
+  local static = changes(before, text.stats(renderer.context))
+  bench.report("per unchanged label", static_ms / LABELS * 1000, "us")
+  bench.report("run hit rate", static.run_hits /
+               (static.run_hits + static.run_misses) * 100, "%")
+
+  -- Numbers that change every frame are laid out again, from glyphs already
+  -- in the atlas
+  local frame = 0
+  before = text.stats(renderer.context)
+  local counter_ms = bench.time("draw " .. COUNTERS .. " changing counters",
+                                100, function()
+    frame = frame + 1
+    for i = 1, COUNTERS do
+      text.draw(renderer.context, font, SIZE,
+                "Score " .. frame * COUNTERS + i, 0, i * 20)
+    end
+  end)
+  local counter = changes(before, text.stats(renderer.context))
+  bench.report("per changing counter", counter_ms / COUNTERS * 1000, "us")
+  bench.report("run misses", counter.run_misses)
+  bench.report("glyph hit rate", counter.glyph_hits /
+               (counter.glyph_hits + counter.glyph_misses) * 100, "%")
+
+  text.finish()
+  text.delete_renderer(renderer)
+
+  -- First use of a glyph draws it into the atlas, and distance fields cost
+  -- more to make than bitmaps
+  for _, sdf in ipairs({false, true}) do
+    local renderer = text.create_renderer(1024, sdf)
+    local font = text.load_font(renderer.context, font_file)
+    text.begin(renderer, WIDTH, HEIGHT)
+
+    local start = bench.now()
+    for i = 0, IDEOGRAPHS - 1 do
+      text.draw(renderer.context, font, SIZE, ideograph(i), 0, 0)
+    end
+    local ms = bench.now() - start
+    local misses = text.stats(renderer.context).glyph_misses
+    bench.report((sdf and "sdf" or "bitmap") .. " glyph miss",
+                 ms / misses * 1000, "us")
+
+    text.finish()
+    text.delete_renderer(renderer)
+  end
+
+  -- More ideographs than a 512 atlas holds, drawn a few new names a frame,
+  -- so old glyphs are evicted once the runs using them are
+  renderer = text.create_renderer(512)
+  font = text.load_font(renderer.context, font_file)
+  text.begin(renderer, WIDTH, HEIGHT)
+
+  math.randomseed(1)
+  before = text.stats(renderer.context)
+  local names_ms = bench.time("draw " .. NAMES .. " names, small atlas", 600,
+                              function()
+    for i = 1, NAMES do
+      text.draw(renderer.context, font, SIZE,
+                ideograph(math.random(0, IDEOGRAPHS - 1)) ..
+                ideograph(math.random(0, IDEOGRAPHS - 1)), 0, i * 20)
+    end
+  end)
+  local names = changes(before, text.stats(renderer.context))
+  bench.report("per new name", names_ms / NAMES * 1000, "us")
+  bench.report("glyph hit rate", names.glyph_hits /
+               (names.glyph_hits + names.glyph_misses) * 100, "%")
+  bench.report("glyph evictions", names.glyph_evictions)
+  bench.report("glyphs left out, atlas pinned full", names.glyph_failures)
+
+  text.finish()
+  text.delete_renderer(renderer)
+
+  os.remove(font_file)
+end
+
+bench.main(run)
@@ -0,0 +1,116 @@
+-- Meshing a hilly world, then how long single block edits and a blast take
+-- from the edit to the new mesh being uploaded, with the main thread doing
+-- nothing but waiting for it. Real frames only upload once per frame, which
+-- adds up to a frame to each of these.
+local bench = require 'bench'
+local voxel = require 'voxel'
+
+-- In chunks of 32^3
+local SIZE_X, SIZE_Y, SIZE_Z = 8, 4, 8
+local STONE, GRASS = 1, 2
+local EDITS = 100
+-- Half the side of the box a blast clears
+local BLAST = 6
+
+local function height(x, z)
+  return 48 + math.floor(16 * math.sin(x / 23) + 12 * math.cos(z / 17))
+end
+
+-- Uploads until nothing is waiting to be meshed. Returns the chunks
+-- uploaded.
+local function finish(world)
+  local uploaded = 0
+  repeat
+    voxel.update(world)
+    uploaded = uploaded + voxel.upload_meshes(world)
+    local stats = voxel.stats(world)
+  until stats.dirty == 0 and stats.in_flight == 0
+  return uploaded
+end
+
+local function run()
+  bench.header("voxel")
+
+  local width, depth = SIZE_X * 32, SIZE_Z * 32
+  local world = voxel.create_world(SIZE_X, SIZE_Y, SIZE_Z)
+
+  -- Heights are in blocks, each column filled from y = 0 up
+  local heights = {}
+  local start = bench.now()
+  for x = 0, width - 1 do
+    heights[x] = {}
+    for z = 0, depth - 1 do
+      local h = height(x, z)
+      heights[x][z] = h
+      voxel.fill(world, x, 0, z, x, h - 2, z, STONE)
+      voxel.set_block(world, x, h - 1, z, GRASS)
+    end
+  end
+  bench.report("fill " .. width .. "x" .. depth .. " columns",
+               bench.now() - start, "ms")
+
+  start = bench.now()
+  local uploaded = finish(world)
+  local stats = voxel.stats(world)
+  bench.report("mesh and upload " .. uploaded .. " chunks",
+               bench.now() - start, "ms")
+  bench.report("workers", stats.workers)
+  bench.report("meshing per chunk", stats.mesh_ms, "ms")
+  bench.report("worst chunk", stats.max_mesh_ms, "ms")
+
+  -- Every exposed block face on its own, to compare with the merged mesh.
+  -- Outside the world is air, so the bottom and the edges count.
+  local faces = 0
+  for x = 0, width - 1 do
+    for z = 0, depth - 1 do
+      local h = heights[x][z]
+      faces = faces + 2
+      for _, n in ipairs({{x - 1, z}, {x + 1, z}, {x, z - 1}, {x, z + 1}}) do
+        local column = heights[n[1]]
+        local neighbour = column and column[n[2]] or 0
+        faces = faces + math.max(0, h - neighbour)
+      end
+    end
+  end
+  bench.report("triangles", stats.triangles)
+  bench.report("triangles per meshed chunk",
+               stats.triangles / stats.meshed_chunks)
+  bench.report("triangles with no faces merged", faces * 2)
+  bench.report("pool used", stats.pool_used_bytes / 1024, "KB")
+
+  -- Digging out the top block of a random column, or putting one on top
+  math.randomseed(1)
+  local total_ms, worst_ms, remeshed = 0, 0, 0
+  for i = 1, EDITS do
+    local x, z = math.random(0, width - 1), math.random(0, depth - 1)
+    local dig = i % 2 == 1
+    local y = dig and heights[x][z] - 1 or heights[x][z]
+
+    start = bench.now()
+    voxel.set_block(world, x, y, z, dig and 0 or GRASS)
+    remeshed = remeshed + finish(world)
+    local ms = bench.now() - start
+
+    total_ms = total_ms + ms
+    worst_ms = math.max(worst_ms, ms)
+    heights[x][z] = dig and y or y + 1
+  end
+  bench.report("block edit to upload", total_ms / EDITS, "ms")
+  bench.report("worst block edit", worst_ms, "ms")
+  bench.report("chunks remeshed per edit", remeshed / EDITS)
+
+  -- Clearing a box at the surface, where four chunks meet
+  local x, z = 4 * 32, 4 * 32
+  local y = heights[x][z]
+  start = bench.now()
+  voxel.fill(world, x - BLAST, y - BLAST, z - BLAST,
+             x + BLAST - 1, y + BLAST - 1, z + BLAST - 1, 0)
+  remeshed = finish(world)
+  bench.report("blast to upload, " .. remeshed .. " chunks",
+               bench.now() - start, "ms")
+  bench.report("triangles after", voxel.stats(world).triangles)
+
+  voxel.delete_world(world)
+end
+
+bench.main(run)
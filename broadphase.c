@@ -0,0 +1,1017 @@
+#include "broadphase.h"
+
+#include "log.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// The insertion sort gives up and sorts from scratch after moving this many
+// elements per body, e.g. when the sweep axis changes or bodies teleport
+#define MAX_SHIFTS_PER_BODY 8
+
+// Worlds are split into slabs with at least this many bodies on average,
+#define SLAB_BODIES 64
+// at least this many times as wide as the widest body, so most bodies stay
+// inside one
+#define SLAB_WIDEST 4
+
+// Lets slab tests divide by axis-aligned ray directions without producing
+// NaNs
+#define MIN_DIRECTION 1e-30f
+
+static int grow_array(void **array, size_t size, size_t capacity) {
+    void *grown = realloc(*array, size * capacity);
+    if (!grown) {
+        return 1;
+    }
+
+    *array = grown;
+    return 0;
+}
+
+static int reserve(struct broadphase *world, size_t capacity) {
+    if (capacity <= world->capacity) {
+        return 0;
+    }
+
+    void **arrays[] = {
+        (void **)&world->min[0], (void **)&world->min[1],
+        (void **)&world->min[2], (void **)&world->max[0],
+        (void **)&world->max[1], (void **)&world->max[2],
+    };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++) {
+        if (grow_array(arrays[i], sizeof(float), capacity)) {
+            return 1;
+        }
+    }
+
+    if (grow_array((void **)&world->alive, 1, capacity) ||
+        grow_array((void **)&world->in_order, 1, capacity) ||
+        grow_array((void **)&world->free_ids, sizeof(uint32_t), capacity) ||
+        grow_array((void **)&world->order, sizeof(uint32_t), capacity) ||
+        grow_array((void **)&world->keys, sizeof(struct sort_entry),
+                   capacity) ||
+        grow_array((void **)&world->keys_tmp, sizeof(struct sort_entry),
+                   capacity)) {
+        return 1;
+    }
+
+    world->capacity = capacity;
+
+    return 0;
+}
+
+struct broadphase *broadphase_create(size_t capacity) {
+    struct broadphase *world = calloc(1, sizeof(*world));
+    if (!world) {
+        return NULL;
+    }
+
+    // One empty slab until there are enough bodies to split them
+    world->slab_axis = 1;
+    world->slab_width = FLT_MAX;
+    world->slabs = 1;
+    world->slab_starts = calloc(2, sizeof(size_t));
+    world->slab_starts_capacity = 2;
+
+    if (!world->slab_starts || reserve(world, capacity > 0 ? capacity : 1)) {
+        broadphase_destroy(world);
+        return NULL;
+    }
+
+    return world;
+}
+
+void broadphase_destroy(struct broadphase *world) {
+    for (int i = 0; i < 3; i++) {
+        free(world->min[i]);
+        free(world->max[i]);
+    }
+    for (int i = 0; i < 6; i++) {
+        free(world->sorted[i]);
+    }
+
+    free(world->alive);
+    free(world->in_order);
+    free(world->free_ids);
+    free(world->order);
+    free(world->keys);
+    free(world->keys_tmp);
+    free(world->slab_starts);
+    free(world->pairs.data);
+    free(world->results.data);
+    free(world);
+}
+
+int32_t broadphase_add(struct broadphase *world, const float *min,
+                       const float *max) {
+    uint32_t id;
+    if (world->free_count > 0) {
+        id = world->free_ids[--world->free_count];
+    } else {
+        if (world->count == world->capacity &&
+            reserve(world, world->capacity * 2)) {
+            return -1;
+        }
+        id = world->count++;
+        world->in_order[id] = 0;
+    }
+
+    world->alive[id] = 1;
+    world->live++;
+    broadphase_set(world, id, min, max);
+
+    // A reused id may still be in the order from before it was removed
+    if (!world->in_order[id]) {
+        world->order[world->order_count++] = id;
+        world->in_order[id] = 1;
+    }
+
+    return id;
+}
+
+void broadphase_set(struct broadphase *world, int32_t id, const float *min,
+                    const float *max) {
+    for (int i = 0; i < 3; i++) {
+        world->min[i][id] = min[i];
+        world->max[i][id] = max[i];
+    }
+}
+
+void broadphase_remove(struct broadphase *world, int32_t id) {
+    world->alive[id] = 0;
+    world->live--;
+    world->free_ids[world->free_count++] = id;
+}
+
+static int append_pair(struct broadphase_pairs *pairs, uint32_t a,
+                       uint32_t b) {
+    if (pairs->count == pairs->capacity) {
+        size_t capacity = pairs->capacity ? pairs->capacity * 2 : 256;
+        if (grow_array((void **)&pairs->data, 2 * sizeof(uint32_t),
+                       capacity)) {
+            return 1;
+        }
+        pairs->capacity = capacity;
+    }
+
+    pairs->data[pairs->count * 2] = a;
+    pairs->data[pairs->count * 2 + 1] = b;
+    pairs->count++;
+
+    return 0;
+}
+
+// Sweeping along the axis the bodies are most spread out on keeps the
+// number of bodies each sweep step has to look at down. Slabs go along the
+// next most spread out axis.
+static void choose_axes(struct broadphase *world) {
+    double sum[3] = {0};
+    double sum_squares[3] = {0};
+    float lowest[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float highest[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    float widest[3] = {0};
+
+    // In id order rather than sweep order, so the bounds are read
+    // sequentially
+    for (size_t id = 0; id < world->count; id++) {
+        if (!world->alive[id]) {
+            continue;
+        }
+
+        for (int axis = 0; axis < 3; axis++) {
+            float min = world->min[axis][id];
+            float max = world->max[axis][id];
+            double center = 0.5 * ((double)min + max);
+            sum[axis] += center;
+            sum_squares[axis] += center * center;
+
+            lowest[axis] = min < lowest[axis] ? min : lowest[axis];
+            highest[axis] = max > highest[axis] ? max : highest[axis];
+            widest[axis] = max - min > widest[axis] ? max - min : widest[axis];
+        }
+    }
+
+    int axes[3] = {0, 1, 2};
+    double variance[3];
+    for (int axis = 0; axis < 3; axis++) {
+        variance[axis] = sum_squares[axis] -
+                         sum[axis] * sum[axis] / world->live;
+    }
+    for (int i = 1; i < 3; i++) {
+        for (int j = i; j > 0 && variance[axes[j]] > variance[axes[j - 1]];
+             j--) {
+            int swap = axes[j];
+            axes[j] = axes[j - 1];
+            axes[j - 1] = swap;
+        }
+    }
+
+    if (axes[0] != world->axis) {
+        log_debug("Broadphase sweep axis changed from %d to %d",
+                  world->axis, axes[0]);
+        world->axis = axes[0];
+    }
+    world->widest = widest[axes[0]];
+
+    int axis = axes[1];
+    double range = (double)highest[axis] - lowest[axis];
+    double width = range / (world->live / SLAB_BODIES);
+    if (width < SLAB_WIDEST * widest[axis]) {
+        width = SLAB_WIDEST * widest[axis];
+    }
+
+    // Also catches infinite and NaN bounds
+    size_t slabs = 1;
+    if (world->live >= SLAB_BODIES * 2 && width > 0 && range / width >= 1) {
+        slabs = (size_t)(range / width) + 1;
+    }
+
+    // Moving the slabs moves every body in the order, so they're kept
+    // while bodies still fit and the slabs aren't far off the right size
+    if (slabs > 1 && world->slabs > 1 && axis == world->slab_axis &&
+        widest[axis] <= world->slab_width &&
+        world->slab_width <= width * 2 && width <= world->slab_width * 2 &&
+        lowest[axis] >= world->slab_low - world->slab_width &&
+        highest[axis] <= world->slab_low +
+                         (world->slabs + 1) * world->slab_width) {
+        return;
+    }
+    if (slabs == 1 && world->slabs == 1) {
+        return;
+    }
+
+    log_debug("Broadphase split into %zu slabs along axis %d", slabs, axis);
+    world->slab_axis = axis;
+    world->slab_low = lowest[axis];
+    world->slab_width = width;
+    world->slabs = slabs;
+}
+
+static size_t slab_of(const struct broadphase *world, float value) {
+    float slab = (value - world->slab_low) / world->slab_width;
+    if (!(slab > 0)) {
+        return 0;
+    }
+
+    return slab < world->slabs - 1 ? (size_t)slab : world->slabs - 1;
+}
+
+// Maps a float to an unsigned integer with the same ordering
+static uint32_t radix_key(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+static int sort_order(struct broadphase *world) {
+    struct sort_entry *keys = world->keys;
+    size_t count = world->order_count;
+    const float *min = world->min[world->axis];
+    const float *slab_min = world->min[world->slab_axis];
+
+    if (world->slabs + 1 > world->slab_starts_capacity) {
+        if (grow_array((void **)&world->slab_starts, sizeof(size_t),
+                       world->slabs + 1)) {
+            return 1;
+        }
+        world->slab_starts_capacity = world->slabs + 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t id = world->order[i];
+        keys[i].index = id;
+        keys[i].key = (uint64_t)slab_of(world, slab_min[id]) << 32 |
+                      radix_key(min[id]);
+    }
+
+    size_t max_shifts = count * MAX_SHIFTS_PER_BODY;
+    size_t shifts = 0;
+    size_t i;
+    for (i = 1; i < count && shifts <= max_shifts; i++) {
+        struct sort_entry key = keys[i];
+        size_t j = i;
+        while (j > 0 && keys[j - 1].key > key.key) {
+            keys[j] = keys[j - 1];
+            j--;
+        }
+        keys[j] = key;
+        shifts += i - j;
+    }
+
+    world->last_shifts = shifts;
+    world->last_full_sort = i < count;
+    if (world->last_full_sort) {
+        int key_bits = 32;
+        while ((size_t)1 << (key_bits - 32) < world->slabs) {
+            key_bits++;
+        }
+        // Stable, so ties keep last frame's order
+        radix_sort(&world->keys, &world->keys_tmp, count, key_bits);
+        keys = world->keys;
+    }
+
+    size_t slab = 0;
+    world->slab_starts[0] = 0;
+    for (size_t i = 0; i < count; i++) {
+        world->order[i] = keys[i].index;
+        while (slab < keys[i].key >> 32) {
+            world->slab_starts[++slab] = i;
+        }
+    }
+    while (slab < world->slabs) {
+        world->slab_starts[++slab] = count;
+    }
+
+    return 0;
+}
+
+// Drops bodies removed since the last update, keeping the rest in order
+static void compact_order(struct broadphase *world) {
+    size_t count = 0;
+    for (size_t i = 0; i < world->order_count; i++) {
+        uint32_t id = world->order[i];
+        if (world->alive[id]) {
+            world->order[count++] = id;
+        } else {
+            world->in_order[id] = 0;
+        }
+    }
+
+    world->order_count = count;
+}
+
+static int copy_sorted(struct broadphase *world) {
+    size_t count = world->order_count;
+
+    // Room for the padding the four-wide loops read past the end
+    if (count + 4 > world->sorted_capacity) {
+        size_t capacity = ((world->capacity + 3) & ~(size_t)3) + 4;
+        for (int i = 0; i < 6; i++) {
+            free(world->sorted[i]);
+            world->sorted[i] = aligned_alloc(16, capacity * sizeof(float));
+            if (!world->sorted[i]) {
+                world->sorted_capacity = 0;
+                world->sorted_count = 0;
+                return 1;
+            }
+        }
+        world->sorted_capacity = capacity;
+    }
+
+    const int axes[3] = {
+        world->axis, (world->axis + 1) % 3, (world->axis + 2) % 3,
+    };
+    for (int i = 0; i < 3; i++) {
+        float *min = world->sorted[i * 2];
+        float *max = world->sorted[i * 2 + 1];
+        for (size_t j = 0; j < count; j++) {
+            uint32_t id = world->order[j];
+            min[j] = world->min[axes[i]][id];
+            max[j] = world->max[axes[i]][id];
+        }
+        // Nothing overlaps the padding
+        for (size_t j = count; j < count + 4; j++) {
+            min[j] = FLT_MAX;
+            max[j] = -FLT_MAX;
+        }
+    }
+
+    world->sorted_count = count;
+
+    return 0;
+}
+
+// Appends a pair for each set bit of the mask, the bit standing for the
+// body at start plus its position
+static int append_mask(struct broadphase_pairs *pairs, uint32_t first,
+                       const uint32_t *ids, size_t start, int mask,
+                       int lower_first) {
+    while (mask) {
+        int bit = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        uint32_t second = ids[start + bit];
+        if (lower_first && second < first) {
+            if (append_pair(pairs, second, first)) {
+                return 1;
+            }
+        } else if (append_pair(pairs, first, second)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Compares body i against the bodies from j up to end in sweep order until
+// their minimum on the sweep axis passes its maximum. Bodies from the next
+// slab can start before it, so their maximum is checked too.
+static int sweep_body(struct broadphase *world, size_t i, size_t j,
+                      size_t end) {
+    const float *a_min = world->sorted[0], *a_max = world->sorted[1];
+    const float *b_min = world->sorted[2], *b_max = world->sorted[3];
+    const float *c_min = world->sorted[4], *c_max = world->sorted[5];
+
+#if defined(__SSE__)
+    __m128 body_a_min = _mm_set1_ps(a_min[i]);
+    __m128 body_a_max = _mm_set1_ps(a_max[i]);
+    __m128 body_b_min = _mm_set1_ps(b_min[i]);
+    __m128 body_b_max = _mm_set1_ps(b_max[i]);
+    __m128 body_c_min = _mm_set1_ps(c_min[i]);
+    __m128 body_c_max = _mm_set1_ps(c_max[i]);
+
+    for (; j < end; j += 4) {
+        // Past the end is the next slab or the padding, which are left out
+        int inside = end - j < 4 ? (1 << (end - j)) - 1 : 0xf;
+        __m128 in_range = _mm_cmple_ps(_mm_loadu_ps(&a_min[j]), body_a_max);
+        __m128 overlap = _mm_and_ps(
+            _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&b_min[j]), body_b_max),
+                       _mm_cmpge_ps(_mm_loadu_ps(&b_max[j]), body_b_min)),
+            _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&c_min[j]), body_c_max),
+                       _mm_cmpge_ps(_mm_loadu_ps(&c_max[j]), body_c_min)));
+        overlap = _mm_and_ps(
+            overlap, _mm_cmpge_ps(_mm_loadu_ps(&a_max[j]), body_a_min));
+
+        int mask = _mm_movemask_ps(_mm_and_ps(in_range, overlap)) & inside;
+        if (mask && append_mask(&world->pairs, world->order[i], world->order,
+                                j, mask, 1)) {
+            return 1;
+        }
+
+        if ((_mm_movemask_ps(in_range) & inside) != 0xf) {
+            break;
+        }
+    }
+#else
+    for (; j < end && a_min[j] <= a_max[i]; j++) {
+        if (a_max[j] >= a_min[i] &&
+            b_min[j] <= b_max[i] && b_max[j] >= b_min[i] &&
+            c_min[j] <= c_max[i] && c_max[j] >= c_min[i] &&
+            append_mask(&world->pairs, world->order[i], world->order, j, 1,
+                        1)) {
+            return 1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+// Sweeps the slab, then sweeps the bodies reaching into the next slab
+// against it, from the first body there that could reach back to them
+static int sweep_slab(struct broadphase *world, size_t slab) {
+    const float *min = world->sorted[0];
+    // The sorted arrays after the sweep axis hold the other two in order
+    const float *slab_max = world->sorted[
+        world->slab_axis == (world->axis + 1) % 3 ? 3 : 5];
+    size_t start = world->slab_starts[slab];
+    size_t end = world->slab_starts[slab + 1];
+
+    for (size_t i = start; i < end; i++) {
+        if (sweep_body(world, i, i + 1, end)) {
+            return 1;
+        }
+    }
+
+    if (slab + 1 == world->slabs) {
+        return 0;
+    }
+
+    size_t next_end = world->slab_starts[slab + 2];
+    size_t j = end;
+    for (size_t i = start; i < end; i++) {
+        if (slab_of(world, slab_max[i]) == slab) {
+            continue;
+        }
+
+        // Both slabs are in sweep order, so this only moves forward
+        while (j < next_end && min[j] < min[i] - world->widest) {
+            j++;
+        }
+        if (sweep_body(world, i, j, next_end)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int broadphase_update(struct broadphase *world) {
+    world->pairs.count = 0;
+
+    compact_order(world);
+    if (world->order_count > 0) {
+        choose_axes(world);
+    }
+
+    if (sort_order(world) || copy_sorted(world)) {
+        return 1;
+    }
+
+    for (size_t slab = 0; slab < world->slabs; slab++) {
+        if (sweep_slab(world, slab)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Number of bodies from start up to end in sweep order whose minimum on the
+// sweep axis is at or below value. Only those can reach it.
+static size_t count_below(const struct broadphase *world, size_t start,
+                          size_t end, float value) {
+    const float *min = world->sorted[0];
+    size_t low = start;
+    size_t high = end;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (min[middle] <= value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// The slabs holding bodies that can reach from low to high on the slab axis
+static void slab_range(const struct broadphase *world, float low, float high,
+                       size_t *first, size_t *last) {
+    *first = slab_of(world, low);
+    // Bodies are no wider than a slab, so they reach one slab up at most
+    if (*first > 0) {
+        (*first)--;
+    }
+    *last = slab_of(world, high);
+}
+
+// Checks the query against the bodies from start up to end in sweep order
+static int query_range(struct broadphase *world, uint32_t query,
+                       const float *bounds, size_t start, size_t end) {
+    float *const *sorted = world->sorted;
+    size_t j = start;
+
+#if defined(__SSE__)
+    __m128 query_min[3], query_max[3];
+    for (int i = 0; i < 3; i++) {
+        query_min[i] = _mm_set1_ps(bounds[i * 2]);
+        query_max[i] = _mm_set1_ps(bounds[i * 2 + 1]);
+    }
+
+    for (; j + 4 <= end; j += 4) {
+        __m128 overlap = _mm_cmpge_ps(_mm_loadu_ps(&sorted[1][j]),
+                                      query_min[0]);
+        for (int i = 1; i < 3; i++) {
+            overlap = _mm_and_ps(overlap, _mm_and_ps(
+                _mm_cmple_ps(_mm_loadu_ps(&sorted[i * 2][j]), query_max[i]),
+                _mm_cmpge_ps(_mm_loadu_ps(&sorted[i * 2 + 1][j]),
+                             query_min[i])));
+        }
+
+        int mask = _mm_movemask_ps(overlap);
+        if (append_mask(&world->results, query, world->order, j, mask, 0)) {
+            return 1;
+        }
+    }
+#endif
+
+    for (; j < end; j++) {
+        if (sorted[1][j] >= bounds[0] &&
+            sorted[2][j] <= bounds[3] && sorted[3][j] >= bounds[2] &&
+            sorted[4][j] <= bounds[5] && sorted[5][j] >= bounds[4] &&
+            append_pair(&world->results, query, world->order[j])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int query_box(struct broadphase *world, uint32_t query,
+                     const float *box) {
+    const int axes[3] = {
+        world->axis, (world->axis + 1) % 3, (world->axis + 2) % 3,
+    };
+    // Query bounds in the same order as the sorted arrays
+    float bounds[6];
+    for (int i = 0; i < 3; i++) {
+        bounds[i * 2] = box[axes[i]];
+        bounds[i * 2 + 1] = box[axes[i] + 3];
+    }
+
+    size_t first, last;
+    slab_range(world, box[world->slab_axis], box[world->slab_axis + 3],
+               &first, &last);
+    for (size_t slab = first; slab <= last; slab++) {
+        size_t start = world->slab_starts[slab];
+        size_t end = count_below(world, start, world->slab_starts[slab + 1],
+                                 bounds[1]);
+        if (query_range(world, query, bounds, start, end)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int broadphase_query_boxes(struct broadphase *world, const float *boxes,
+                           size_t count) {
+    world->results.count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (query_box(world, i, &boxes[i * 6])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static float inverse_direction(float d) {
+    if (d >= 0 && d < MIN_DIRECTION) {
+        d = MIN_DIRECTION;
+    } else if (d < 0 && d > -MIN_DIRECTION) {
+        d = -MIN_DIRECTION;
+    }
+
+    return 1 / d;
+}
+
+// Checks the ray, its origin and inverse direction in the same order as
+// the sorted arrays, against the bodies from start up to end in sweep
+// order. Keeps the nearest hit in best and best_t.
+static void raycast_range(const struct broadphase *world,
+                          const float *origin, const float *inverse,
+                          size_t start, size_t end, int32_t *best,
+                          float *best_t) {
+    float *const *sorted = world->sorted;
+    size_t j = start;
+
+#if defined(__SSE__)
+    __m128 o[3], inv[3];
+    for (int i = 0; i < 3; i++) {
+        o[i] = _mm_set1_ps(origin[i]);
+        inv[i] = _mm_set1_ps(inverse[i]);
+    }
+
+    for (; j + 4 <= end; j += 4) {
+        __m128 enter = _mm_setzero_ps();
+        __m128 leave = _mm_set1_ps(*best_t);
+        for (int i = 0; i < 3; i++) {
+            __m128 t0 = _mm_mul_ps(
+                _mm_sub_ps(_mm_loadu_ps(&sorted[i * 2][j]), o[i]), inv[i]);
+            __m128 t1 = _mm_mul_ps(
+                _mm_sub_ps(_mm_loadu_ps(&sorted[i * 2 + 1][j]), o[i]),
+                inv[i]);
+            enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+            leave = _mm_min_ps(leave, _mm_max_ps(t0, t1));
+        }
+
+        int mask = _mm_movemask_ps(_mm_cmple_ps(enter, leave));
+        if (mask) {
+            float t[4];
+            _mm_storeu_ps(t, enter);
+            while (mask) {
+                int bit = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (t[bit] < *best_t || *best < 0) {
+                    *best = world->order[j + bit];
+                    *best_t = t[bit];
+                }
+            }
+        }
+    }
+#endif
+
+    for (; j < end; j++) {
+        float enter = 0;
+        float leave = *best_t;
+        for (int i = 0; i < 3; i++) {
+            float t0 = (sorted[i * 2][j] - origin[i]) * inverse[i];
+            float t1 = (sorted[i * 2 + 1][j] - origin[i]) * inverse[i];
+            enter = fmaxf(enter, fminf(t0, t1));
+            leave = fminf(leave, fmaxf(t0, t1));
+        }
+
+        if (enter <= leave && (enter < *best_t || *best < 0)) {
+            *best = world->order[j];
+            *best_t = enter;
+        }
+    }
+}
+
+static void raycast(const struct broadphase *world, const float *ray,
+                    float max_t, int32_t *hit, float *hit_t) {
+    const int axes[3] = {
+        world->axis, (world->axis + 1) % 3, (world->axis + 2) % 3,
+    };
+    float origin[3], inverse[3];
+    for (int i = 0; i < 3; i++) {
+        origin[i] = ray[axes[i]];
+        inverse[i] = inverse_direction(ray[axes[i] + 3]);
+    }
+
+    // Bodies starting past the far end of the ray on the sweep axis can't
+    // be hit
+    float end = origin[0] + ray[axes[0] + 3] * max_t;
+    end = origin[0] > end ? origin[0] : end;
+
+    float slab_start = ray[world->slab_axis];
+    float slab_end = slab_start + ray[world->slab_axis + 3] * max_t;
+    size_t first, last;
+    slab_range(world, fminf(slab_start, slab_end),
+               fmaxf(slab_start, slab_end), &first, &last);
+
+    int32_t best = -1;
+    float best_t = max_t;
+    for (size_t slab = first; slab <= last; slab++) {
+        size_t start = world->slab_starts[slab];
+        raycast_range(world, origin, inverse, start,
+                      count_below(world, start, world->slab_starts[slab + 1],
+                                  end),
+                      &best, &best_t);
+    }
+
+    *hit = best;
+    *hit_t = best < 0 ? max_t : best_t;
+}
+
+void broadphase_raycast(const struct broadphase *world, const float *rays,
+                        size_t count, float max_t, int32_t *hits,
+                        float *t) {
+    for (size_t i = 0; i < count; i++) {
+        raycast(world, &rays[i * 6], max_t, &hits[i], &t[i]);
+    }
+}
+
+static struct broadphase *check_world(lua_State *L, int index) {
+    struct broadphase *world = lua_touserdata(L, index);
+    if (!world) {
+        luaL_error(L, "Expected a broadphase world");
+    }
+
+    return world;
+}
+
+static int32_t check_body(lua_State *L, struct broadphase *world, int index) {
+    lua_Integer id = luaL_checkinteger(L, index);
+    if (id < 0 || (size_t)id >= world->count || !world->alive[id]) {
+        return luaL_error(L, "Bad broadphase body %d", (int)id);
+    }
+
+    return id;
+}
+
+// Reads min x, y, z, max x, y, z starting at the index
+static void check_bounds(lua_State *L, int index, float *min, float *max) {
+    for (int i = 0; i < 3; i++) {
+        min[i] = luaL_checknumber(L, index + i);
+        max[i] = luaL_checknumber(L, index + i + 3);
+    }
+}
+
+// Reads a flat list of numbers whose length is a multiple of stride. The
+// numbers go in a userdata left on the stack, so nothing leaks if a value
+// turns out not to be a number.
+static float *read_floats(lua_State *L, int index, size_t stride,
+                          size_t *count) {
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    size_t length = lua_rawlen(L, index);
+    if (length % stride != 0) {
+        luaL_error(L, "Expected a multiple of %d numbers, got %d",
+                   (int)stride, (int)length);
+    }
+
+    float *values = lua_newuserdata(L, (length > 0 ? length : 1) *
+                                       sizeof(float));
+    for (size_t i = 0; i < length; i++) {
+        lua_rawgeti(L, index, i + 1);
+        if (!lua_isnumber(L, -1)) {
+            luaL_error(L, "Expected a number at position %d", (int)i + 1);
+        }
+        values[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    *count = length / stride;
+
+    return values;
+}
+
+// The table at the index if there is one, to be refilled, or a new one
+static int result_table(lua_State *L, int index, size_t size) {
+    if (lua_isnoneornil(L, index)) {
+        lua_createtable(L, size, 0);
+    } else {
+        luaL_checktype(L, index, LUA_TTABLE);
+        lua_pushvalue(L, index);
+    }
+
+    return lua_gettop(L);
+}
+
+// Pushes the pairs as a flat list, adding offset to the first of each
+static void push_pairs(lua_State *L, int index,
+                       const struct broadphase_pairs *pairs,
+                       lua_Integer offset) {
+    int table = result_table(L, index, pairs->count * 2);
+    for (size_t i = 0; i < pairs->count; i++) {
+        lua_pushinteger(L, pairs->data[i * 2] + offset);
+        lua_rawseti(L, table, i * 2 + 1);
+        lua_pushinteger(L, pairs->data[i * 2 + 1]);
+        lua_rawseti(L, table, i * 2 + 2);
+    }
+
+    lua_pushinteger(L, pairs->count);
+}
+
+int broadphase_lua_CreateWorld(lua_State *L) {
+    lua_Integer capacity = luaL_optinteger(L, 1, 1024);
+    if (capacity < 0) {
+        return luaL_error(L, "Bad broadphase capacity %d", (int)capacity);
+    }
+
+    struct broadphase *world = broadphase_create(capacity);
+    if (!world) {
+        return luaL_error(L, "Error creating broadphase world");
+    }
+
+    lua_pushlightuserdata(L, world);
+
+    return 1;
+}
+
+int broadphase_lua_DeleteWorld(lua_State *L) {
+    broadphase_destroy(check_world(L, 1));
+
+    return 0;
+}
+
+// world, min x, y, z, max x, y, z. Returns the body.
+int broadphase_lua_Add(lua_State *L) {
+    struct broadphase *world = check_world(L, 1);
+    float min[3], max[3];
+    check_bounds(L, 2, min, max);
+
+    int32_t id = broadphase_add(world, min, max);
+    if (id < 0) {
+        return luaL_error(L, "Error adding broadphase body");
+    }
+
+    lua_pushinteger(L, id);
+
+    return 1;
+}
+
+// world, body, min x, y, z, max x, y, z
+int broadphase_lua_Set(lua_State *L) {
+    struct broadphase *world = check_world(L, 1);
+    int32_t id = check_body(L, world, 2);
+    float min[3], max[3];
+    check_bounds(L, 3, min, max);
+
+    broadphase_set(world, id, min, max);
+
+    return 0;
+}
+
+// world, first body, {min x, y, z, max x, y, z, ...}. Sets the bounds of
+// consecutive bodies, which saves a call per body when moving many of them.
+// Removed bodies in the range are skipped.
+int broadphase_lua_SetMany(lua_State *L) {
+    struct broadphase *world = check_world(L, 1);
+    lua_Integer first = luaL_checkinteger(L, 2);
+    size_t count;
+    const float *bounds = read_floats(L, 3, 6, &count);
+
+    if (first < 0 || (size_t)first + count > world->count) {
+        return luaL_error(L, "Broadphase bodies out of bounds");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (world->alive[first + i]) {
+            broadphase_set(world, first + i, &bounds[i * 6],
+                           &bounds[i * 6 + 3]);
+        }
+    }
+
+    return 0;
+}
+
+int broadphase_lua_Remove(lua_State *L) {
+    struct broadphase *world = check_world(L, 1);
+
+    broadphase_remove(world, check_body(L, world, 2));
+
+    return 0;
+}
+
+// Returns the number of overlapping pairs
+int broadphase_lua_Update(lua_State *L) {
+    struct broadphase *world = check_world(L, 1);
+
+    if (broadphase_update(world) != 0) {
+        return luaL_error(L, "Error updating broadphase");
+    }
+
+    lua_pushinteger(L, world->pairs.count);
+
+    return 1;
+}
+
+// world, table to reuse or nil. Returns {a1, b1, a2, b2, ...} with the pairs
+// found by the last update, and the number of pairs. A reused table isn't
+// cleared past the last pair.
+int broadphase_lua_Pairs(lua_State *L) {
+    struct broadphase *world = check_world(L, 1);
+
+    push_pairs(L, 2, &world->pairs, 0);
+
+    return 2;
+}
+
+// world, {min x, y, z, max x, y, z, ...}, table to reuse or nil. Returns
+// {box, body, box, body, ...}, boxes numbered from 1, and the number of hits.
+int broadphase_lua_QueryBoxes(lua_State *L) {
+    // Keeps the numbers read_floats pushes from standing in for a missing
+    // table to reuse
+    lua_settop(L, 3);
+    struct broadphase *world = check_world(L, 1);
+    size_t count;
+    const float *boxes = read_floats(L, 2, 6, &count);
+
+    if (broadphase_query_boxes(world, boxes, count) != 0) {
+        return luaL_error(L, "Error querying broadphase");
+    }
+
+    // Box indices are zero based in C
+    push_pairs(L, 3, &world->results, 1);
+
+    return 2;
+}
+
+// world, {origin x, y, z, direction x, y, z, ...}, max t, table to reuse or
+// nil. Returns {body, t, body, t, ...} with the nearest hit along each ray,
+// body -1 and t max t for a miss.
+int broadphase_lua_RayCast(lua_State *L) {
+    lua_settop(L, 4);
+    struct broadphase *world = check_world(L, 1);
+    size_t count;
+    const float *rays = read_floats(L, 2, 6, &count);
+    float max_t = luaL_checknumber(L, 3);
+
+    int32_t *hits = lua_newuserdata(L, (count > 0 ? count : 1) *
+                                       (sizeof(int32_t) + sizeof(float)));
+    float *t = (float *)(hits + count);
+    broadphase_raycast(world, rays, count, max_t, hits, t);
+
+    int table = result_table(L, 4, count * 2);
+    for (size_t i = 0; i < count; i++) {
+        lua_pushinteger(L, hits[i]);
+        lua_rawseti(L, table, i * 2 + 1);
+        lua_pushnumber(L, t[i]);
+        lua_rawseti(L, table, i * 2 + 2);
+    }
+
+    return 1;
+}
+
+// Live bodies, pairs from the last update, elements the last update's sort
+// moved, whether it fell back to a full sort, and the number of slabs
+int broadphase_lua_Count(lua_State *L) {
+    struct broadphase *world = check_world(L, 1);
+
+    lua_pushinteger(L, world->live);
+    lua_pushinteger(L, world->pairs.count);
+    lua_pushinteger(L, world->last_shifts);
+    lua_pushboolean(L, world->last_full_sort);
+    lua_pushinteger(L, world->slabs);
+
+    return 5;
+}
+
+void broadphase_register(lua_State *L) {
+    lua_register(L, "broadphase_CreateWorld", broadphase_lua_CreateWorld);
+    lua_register(L, "broadphase_DeleteWorld", broadphase_lua_DeleteWorld);
+    lua_register(L, "broadphase_Add", broadphase_lua_Add);
+    lua_register(L, "broadphase_Set", broadphase_lua_Set);
+    lua_register(L, "broadphase_SetMany", broadphase_lua_SetMany);
+    lua_register(L, "broadphase_Remove", broadphase_lua_Remove);
+    lua_register(L, "broadphase_Update", broadphase_lua_Update);
+    lua_register(L, "broadphase_Pairs", broadphase_lua_Pairs);
+    lua_register(L, "broadphase_QueryBoxes", broadphase_lua_QueryBoxes);
+    lua_register(L, "broadphase_RayCast", broadphase_lua_RayCast);
+    lua_register(L, "broadphase_Count", broadphase_lua_Count);
+}
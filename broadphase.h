@@ -0,0 +1,114 @@
+#ifndef BROADPHASE_H
+#define BROADPHASE_H
+
+#include "lua.h"
+#include "radix_sort.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A growable list of pairs of 32 bit values, e.g. two bodies that overlap,
+// or a query and a body it hit
+struct broadphase_pairs {
+    uint32_t *data;
+    size_t count;
+    size_t capacity;
+};
+
+// Collision broadphase over axis aligned boxes using sweep and prune. Each
+// update sorts the bodies by their minimum along the axis they're most
+// spread out on, then sweeps that list: a body can only overlap the bodies
+// after it whose minimum is below its maximum. Bodies move a little each
+// frame, so last frame's order is nearly sorted and an insertion sort
+// finishes in close to linear time.
+//
+// In large worlds a body would pass many others on the sweep axis that are
+// far away on the rest. So the order is split into slabs along a second
+// axis first, each sorted along the sweep axis. Slabs are at least as wide
+// as any body, so a body only reaches bodies in its own slab and the next.
+//
+// Bounds are indexed by body id. Removed ids are reused by the next add.
+struct broadphase {
+    size_t count;
+    size_t capacity;
+    size_t live;
+
+    float *min[3];
+    float *max[3];
+    uint8_t *alive;
+    // Set while the id is somewhere in order
+    uint8_t *in_order;
+
+    uint32_t *free_ids;
+    size_t free_count;
+
+    // Bodies in sweep order. Removed bodies stay until the next update, new
+    // ones are appended to it.
+    uint32_t *order;
+    size_t order_count;
+    int axis;
+    // Widest body on the sweep axis
+    float widest;
+    int slab_axis;
+    // Slabs start at slab_low. Bodies below it are in the first slab and
+    // bodies past the last one are in the last.
+    float slab_low;
+    float slab_width;
+    size_t slabs;
+    // Where each slab starts in sweep order, with the end of the last one
+    // after them
+    size_t *slab_starts;
+    size_t slab_starts_capacity;
+
+    // Bounds copied out in sweep order so the sweep and the queries read
+    // them sequentially, four at a time. Index 0 and 1 are the sweep axis
+    // minimum and maximum, then the other two axes. Padded by four entries
+    // whose minimums are FLT_MAX.
+    float *sorted[6];
+    size_t sorted_count;
+    size_t sorted_capacity;
+    // Scratch space for sorting, swapped by the radix sort. Keys are the
+    // slab, then the minimum on the sweep axis.
+    struct sort_entry *keys;
+    struct sort_entry *keys_tmp;
+
+    // Pairs of overlapping ids found by the last update, lower id first
+    struct broadphase_pairs pairs;
+    // Results of the last query
+    struct broadphase_pairs results;
+
+    // Stats from the last update: elements moved by the insertion sort, and
+    // whether it gave up and did a full sort instead, e.g. when the slabs
+    // changed
+    size_t last_shifts;
+    int last_full_sort;
+};
+
+struct broadphase *broadphase_create(size_t);
+void broadphase_destroy(struct broadphase *);
+
+// Returns the new body, or -1 on allocation failure
+int32_t broadphase_add(struct broadphase *, const float *, const float *);
+void broadphase_set(struct broadphase *, int32_t, const float *,
+                    const float *);
+void broadphase_remove(struct broadphase *, int32_t);
+
+// Sorts the bodies and finds every overlapping pair. Returns 1 on
+// allocation failure.
+int broadphase_update(struct broadphase *);
+
+// Queries see the bodies as they were at the last update.
+//
+// Finds the bodies overlapping each of count boxes, given as min x, y, z,
+// max x, y, z. Results are pairs of box index and body. Returns 1 on
+// allocation failure.
+int broadphase_query_boxes(struct broadphase *, const float *, size_t);
+// Finds the nearest body hit by each of count rays, given as origin x, y, z,
+// direction x, y, z, no further than max_t times the direction. hits gets
+// the body, or -1, and t the distance along the ray in directions.
+void broadphase_raycast(const struct broadphase *, const float *, size_t,
+                        float, int32_t *, float *);
+
+void broadphase_register(lua_State *);
+
+#endif
@@ -0,0 +1,37 @@
+-- Collision broadphase. Bodies are axis aligned boxes, numbered from 0, and
+-- each update finds every pair of them that overlap.
+local M = {}
+
+-- Broadphase functions exposed from C
+local copy_funcs = {
+  CreateWorld="create_world",
+  DeleteWorld="delete_world",
+  Add="add",
+  Set="set",
+  SetMany="set_many",
+  Remove="remove",
+  Update="update",
+  Pairs="pairs",
+  QueryBoxes="query_boxes",
+  RayCast="ray_cast",
+  Count="count",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["broadphase_" .. c_name]
+end
+
+-- Iterates over the pairs found by the last update. Pass the same table
+-- every frame to avoid making a new one.
+function M.each_pair(world, t)
+  local list, count = M.pairs(world, t)
+  local i = 0
+  return function()
+    i = i + 1
+    if i <= count then
+      return list[i * 2 - 1], list[i * 2]
+    end
+  end
+end
+
+return M
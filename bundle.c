@@ -0,0 +1,198 @@
+#include "bundle.h"
+
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Longest module name require can find in a bundle
+#define BUNDLE_MAX_NAME 256
+
+static int check_range(const struct bundle *bundle, uint32_t offset,
+                       uint32_t length) {
+    return (size_t)offset + length <= bundle->size;
+}
+
+static int check_bundle(const struct bundle *bundle, const char *file_name) {
+    const struct bundle_header *header = bundle->header;
+
+    if (bundle->size < sizeof(*header) ||
+        memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "%s isn't a Lua bundle\n", file_name);
+        return 1;
+    }
+    if (header->version != BUNDLE_VERSION) {
+        fprintf(stderr, "%s is bundle version %u, expected %u\n", file_name,
+                header->version, BUNDLE_VERSION);
+        return 1;
+    }
+    if (header->flavor != BUNDLE_FLAVOR) {
+        fprintf(stderr, "%s was built for %s\n", file_name,
+                header->flavor == BUNDLE_FLAVOR_LUAJIT ? "LuaJIT" : "Lua");
+        return 1;
+    }
+
+    size_t entries_size = (size_t)header->entry_count * sizeof(struct bundle_entry);
+    if (sizeof(*header) + entries_size > bundle->size ||
+        header->main_entry >= header->entry_count) {
+        fprintf(stderr, "%s is truncated\n", file_name);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        const struct bundle_entry *entry = &bundle->entries[i];
+        // Names are stored with a terminator so they can be used in place
+        if (!check_range(bundle, entry->name_offset, entry->name_length + 1) ||
+            !check_range(bundle, entry->data_offset, entry->data_length) ||
+            ((const char *)bundle->data)[entry->name_offset +
+                                         entry->name_length] != '\0') {
+            fprintf(stderr, "%s has a bad entry %u\n", file_name, i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int bundle_open(struct bundle *bundle, const char *file_name) {
+    memset(bundle, 0x0, sizeof(*bundle));
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        perror(file_name);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(file_name);
+        close(fd);
+        return 1;
+    }
+
+    void *data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping stays valid after the file is closed
+    close(fd);
+
+    if (!data || data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s\n", file_name);
+        return 1;
+    }
+
+    bundle->data = data;
+    bundle->size = st.st_size;
+    bundle->header = data;
+    bundle->entries = (const struct bundle_entry *)(bundle->header + 1);
+
+    if (check_bundle(bundle, file_name) != 0) {
+        bundle_close(bundle);
+        return 1;
+    }
+
+    log_info("Opened bundle %s with %u modules", file_name,
+           bundle->header->entry_count);
+
+    return 0;
+}
+
+void bundle_close(struct bundle *bundle) {
+    if (bundle->data) {
+        munmap(bundle->data, bundle->size);
+    }
+
+    memset(bundle, 0x0, sizeof(*bundle));
+}
+
+static const char *entry_name(const struct bundle *bundle,
+                              const struct bundle_entry *entry) {
+    return (const char *)bundle->data + entry->name_offset;
+}
+
+const struct bundle_entry *bundle_find(const struct bundle *bundle,
+                                       const char *name) {
+    char key[BUNDLE_MAX_NAME];
+    size_t length = strlen(name);
+    if (length >= sizeof(key)) {
+        return NULL;
+    }
+    for (size_t i = 0; i <= length; i++) {
+        key[i] = name[i] == '.' ? '/' : name[i];
+    }
+
+    // Entries are sorted by name
+    size_t low = 0;
+    size_t high = bundle->header->entry_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = strcmp(entry_name(bundle, &bundle->entries[middle]), key);
+        if (order == 0) {
+            return &bundle->entries[middle];
+        } else if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+static int load_entry(lua_State *L, const struct bundle *bundle,
+                      const struct bundle_entry *entry) {
+    return luaL_loadbuffer(L, (const char *)bundle->data + entry->data_offset,
+                           entry->data_length, entry_name(bundle, entry));
+}
+
+int bundle_load_main(lua_State *L, struct bundle *bundle) {
+    return load_entry(L, bundle,
+                      &bundle->entries[bundle->header->main_entry]);
+}
+
+static int bundle_searcher(lua_State *L) {
+    struct bundle *bundle = lua_touserdata(L, lua_upvalueindex(1));
+    const char *name = luaL_checkstring(L, 1);
+
+    const struct bundle_entry *entry = bundle_find(bundle, name);
+    if (!entry) {
+        lua_pushfstring(L, "\n\tno module '%s' in bundle", name);
+        return 1;
+    }
+
+    if (load_entry(L, bundle, entry) != LUA_OK) {
+        return luaL_error(L, "error loading module '%s' from bundle:\n\t%s",
+                          name, lua_tostring(L, -1));
+    }
+    // Passed to the loader the way the path searchers pass the file name
+    lua_pushstring(L, entry_name(bundle, entry));
+
+    return 2;
+}
+
+void bundle_register(lua_State *L, struct bundle *bundle) {
+    lua_getglobal(L, "package");
+#ifdef USE_LUAJIT
+    lua_getfield(L, -1, "loaders");
+#else
+    lua_getfield(L, -1, "searchers");
+#endif
+
+    // Shift everything after the preload searcher up one
+    int count = lua_rawlen(L, -1);
+    for (int i = count; i >= 2; i--) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_pushlightuserdata(L, bundle);
+    lua_pushcclosure(L, bundle_searcher, 1);
+    lua_rawseti(L, -2, 2);
+
+    lua_pop(L, 2);
+}
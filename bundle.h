@@ -0,0 +1,69 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "lua.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Precompiled Lua chunks for a whole script tree in one file, written by
+// lua-bundle. The file is mapped as is, so require loads straight from
+// memory without touching the filesystem.
+//
+// Layout: header, entries sorted by module name, then the names and
+// bytecode the entries point at. Offsets are from the start of the file.
+#define BUNDLE_MAGIC "LUABNDL"
+#define BUNDLE_VERSION 1
+
+// Bytecode isn't portable between Lua and LuaJIT
+enum bundle_flavor {
+    BUNDLE_FLAVOR_LUA,
+    BUNDLE_FLAVOR_LUAJIT,
+};
+
+#ifdef USE_LUAJIT
+#define BUNDLE_FLAVOR BUNDLE_FLAVOR_LUAJIT
+#else
+#define BUNDLE_FLAVOR BUNDLE_FLAVOR_LUA
+#endif
+
+struct bundle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flavor;
+    uint32_t entry_count;
+    // Entry run by lua_setup in place of the main file
+    uint32_t main_entry;
+};
+
+struct bundle_entry {
+    // Module name as passed to require, e.g. "glm/matrix"
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t data_offset;
+    uint32_t data_length;
+};
+
+struct bundle {
+    void *data;
+    size_t size;
+
+    const struct bundle_header *header;
+    const struct bundle_entry *entries;
+};
+
+// Maps and checks the bundle. Returns 1 on error, having printed why.
+int bundle_open(struct bundle *, const char *);
+void bundle_close(struct bundle *);
+
+// Returns the entry for the module, or NULL. Dots in the name are treated as
+// slashes, so "glm.matrix" finds "glm/matrix".
+const struct bundle_entry *bundle_find(const struct bundle *, const char *);
+
+// Pushes the main chunk. Returns the lua_load status.
+int bundle_load_main(lua_State *, struct bundle *);
+// Adds a package searcher for the bundle, after the preload searcher and
+// before the path searchers. The bundle has to outlive the state.
+void bundle_register(lua_State *, struct bundle *);
+
+#endif
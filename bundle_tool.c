@@ -0,0 +1,179 @@
+// lua-bundle: precompiles Lua files into a bundle for lua_setup to load
+// in place of a main file. See bundle.h for the format.
+//
+//   lua-bundle <output> <main file> [module files...]
+//
+// Each file's module name is its path without ".lua", so glm/matrix.lua is
+// found by require 'glm/matrix'.
+
+#include "bundle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct chunk {
+    char *name;
+    char *data;
+    size_t size;
+    size_t capacity;
+    int main;
+};
+
+static int write_chunk(lua_State *L, const void *p, size_t size, void *ud) {
+    (void)L;
+    struct chunk *chunk = ud;
+
+    if (chunk->size + size > chunk->capacity) {
+        size_t capacity = chunk->capacity ? chunk->capacity * 2 : 4096;
+        while (capacity < chunk->size + size) {
+            capacity *= 2;
+        }
+
+        char *data = realloc(chunk->data, capacity);
+        if (!data) {
+            return 1;
+        }
+        chunk->data = data;
+        chunk->capacity = capacity;
+    }
+
+    memcpy(chunk->data + chunk->size, p, size);
+    chunk->size += size;
+
+    return 0;
+}
+
+static char *module_name(const char *file_name) {
+    if (strncmp(file_name, "./", 2) == 0) {
+        file_name += 2;
+    }
+
+    size_t length = strlen(file_name);
+    if (length > 4 && strcmp(file_name + length - 4, ".lua") == 0) {
+        length -= 4;
+    }
+
+    char *name = malloc(length + 1);
+    if (name) {
+        memcpy(name, file_name, length);
+        name[length] = '\0';
+    }
+
+    return name;
+}
+
+static int compare_chunks(const void *a, const void *b) {
+    return strcmp(((const struct chunk *)a)->name,
+                  ((const struct chunk *)b)->name);
+}
+
+static int write_bundle(const char *file_name, struct chunk *chunks,
+                        uint32_t count) {
+    qsort(chunks, count, sizeof(*chunks), compare_chunks);
+
+    struct bundle_header header;
+    memset(&header, 0x0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.flavor = BUNDLE_FLAVOR;
+    header.entry_count = count;
+
+    // Names and bytecode follow the entries, in entry order
+    size_t offset = sizeof(header) + count * sizeof(struct bundle_entry);
+    struct bundle_entry *entries = calloc(count, sizeof(*entries));
+    if (!entries) {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (chunks[i].main) {
+            header.main_entry = i;
+        }
+
+        entries[i].name_offset = offset;
+        entries[i].name_length = strlen(chunks[i].name);
+        offset += entries[i].name_length + 1;
+
+        entries[i].data_offset = offset;
+        entries[i].data_length = chunks[i].size;
+        offset += chunks[i].size;
+
+        if (offset > UINT32_MAX) {
+            fprintf(stderr, "Bundle too big\n");
+            free(entries);
+            return 1;
+        }
+    }
+
+    FILE *f = fopen(file_name, "wb");
+    if (!f) {
+        perror(file_name);
+        free(entries);
+        return 1;
+    }
+
+    int error = fwrite(&header, sizeof(header), 1, f) != 1 ||
+                fwrite(entries, sizeof(*entries), count, f) != count;
+    for (uint32_t i = 0; i < count && !error; i++) {
+        error = fwrite(chunks[i].name, entries[i].name_length + 1, 1, f) != 1 ||
+                fwrite(chunks[i].data, 1, chunks[i].size, f) != chunks[i].size;
+    }
+
+    free(entries);
+
+    if (fclose(f) != 0 || error) {
+        fprintf(stderr, "Error writing %s\n", file_name);
+        remove(file_name);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <output> <main file> [module files...]\n",
+                argv[0]);
+        return 1;
+    }
+
+    uint32_t count = argc - 2;
+    struct chunk *chunks = calloc(count, sizeof(*chunks));
+    lua_State *L = luaL_newstate();
+    if (!chunks || !L) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    int error = 0;
+    for (uint32_t i = 0; i < count && !error; i++) {
+        const char *file_name = argv[i + 2];
+        struct chunk *chunk = &chunks[i];
+
+        chunk->main = i == 0;
+        chunk->name = module_name(file_name);
+
+        if (luaL_loadfile(L, file_name) != LUA_OK) {
+            fprintf(stderr, "%s\n", lua_tostring(L, -1));
+            error = 1;
+        } else if (!chunk->name || lua_dump(L, write_chunk, chunk, 0) != 0) {
+            fprintf(stderr, "Error compiling %s\n", file_name);
+            error = 1;
+        }
+        lua_settop(L, 0);
+    }
+
+    if (!error) {
+        error = write_bundle(argv[1], chunks, count);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(chunks[i].name);
+        free(chunks[i].data);
+    }
+    free(chunks);
+    lua_close(L);
+
+    return error;
+}
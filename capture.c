@@ -0,0 +1,1316 @@
+// The wrappers here call the real GL functions
+#define CAPTURE_NO_WRAP
+#include "capture.h"
+
+#include "draw.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mappings open at once
+#define MAX_MAPPINGS 8
+
+enum capture_mode {
+    CAPTURE_OFF,
+    // Recording state for a window to come
+    CAPTURE_ARMED,
+    // Recording everything
+    CAPTURE_WINDOW,
+};
+
+struct capture_buffer {
+    GLuint name;
+    GLsizeiptr size;
+};
+
+struct capture_texture {
+    GLuint name;
+    GLsizei width;
+    GLsizei height;
+    GLenum internal_format;
+};
+
+// Latest call setting one piece of context state, kept while armed instead
+// of writing every one. Calls setting the same thing share a slot: its op
+// is the first of them, and a and b the arguments saying what's set, e.g.
+// the target and index of an indexed buffer bind.
+struct capture_slot {
+    enum capture_op op;
+    uint64_t a;
+    uint64_t b;
+    // State the call depended on, written back before it: the texture unit
+    // of a texture bind, vertex array of an element buffer bind, or target
+    // of buffer data. Uniforms depend on the program, which is a.
+    uint64_t context;
+    // When it was last set, so slots are written in the order they were
+    uint64_t sequence;
+    int dirty;
+
+    // The encoded call
+    uint8_t *bytes;
+    size_t size;
+    size_t capacity;
+};
+
+struct capture_mapping {
+    GLenum target;
+    GLintptr offset;
+    GLsizeiptr length;
+    GLbitfield access;
+    void *pointer;
+};
+
+struct capture_state {
+    enum capture_mode mode;
+    FILE *file;
+    char *file_name;
+
+    long frame;
+    // Frame after which the window opens, -1 for none pending
+    long window_start;
+    int window_frames;
+    int frames_left;
+    Uint64 last_frame_end;
+
+    // Live objects whose contents are snapshotted when the window opens
+    struct capture_buffer *buffers;
+    size_t buffer_count;
+    size_t buffer_capacity;
+    struct capture_texture *textures;
+    size_t texture_count;
+    size_t texture_capacity;
+
+    struct capture_mapping mappings[MAX_MAPPINGS];
+    int mapping_count;
+
+    // Context state while armed, by slot. The table holds slot indices + 1
+    // and is kept at most half full.
+    struct capture_slot *slots;
+    size_t slot_count;
+    size_t slot_capacity;
+    uint32_t *slot_table;
+    size_t slot_table_size;
+    size_t *dirty;
+    size_t dirty_count;
+    size_t dirty_capacity;
+    uint64_t sequence;
+    // Slot being written instead of the file, if any
+    struct capture_slot *slot;
+    int slot_failed;
+
+    // What slots' calls depend on, as the captured process set it
+    GLuint program;
+    GLenum active_texture;
+    GLuint vertex_array;
+
+    // Marker names, by id. Names are compared by pointer, since they come
+    // from the draw function table.
+    const char **strings;
+    size_t string_count;
+    size_t string_capacity;
+};
+
+static struct capture_state capture;
+
+static void put_slot_bytes(const void *bytes, size_t size);
+
+static void put_byte(uint8_t byte) {
+    if (capture.slot) {
+        put_slot_bytes(&byte, 1);
+    } else {
+        putc(byte, capture.file);
+    }
+}
+
+static void put_bytes(const void *bytes, size_t size) {
+    if (capture.slot) {
+        put_slot_bytes(bytes, size);
+    } else {
+        fwrite(bytes, 1, size, capture.file);
+    }
+}
+
+static void put_unsigned(uint64_t value) {
+    while (value >= 0x80) {
+        put_byte((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    put_byte(value);
+}
+
+static void put_signed(int64_t value) {
+    put_unsigned(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void put_data(const void *data, size_t size) {
+    put_unsigned(size);
+    put_bytes(data, size);
+}
+
+static void put_op(enum capture_op op) {
+    put_byte(op);
+}
+
+// Argument kinds, see capture_format.h
+static void put_ENUM(GLenum value) { put_unsigned(value); }
+static void put_UINT(GLuint value) { put_unsigned(value); }
+static void put_BOOL(GLboolean value) { put_unsigned(value); }
+static void put_BITS(GLbitfield value) { put_unsigned(value); }
+static void put_INT(GLint value) { put_signed(value); }
+static void put_SIZEI(GLsizei value) { put_signed(value); }
+static void put_INTPTR(GLintptr value) { put_signed(value); }
+static void put_OFFSET(const void *value) { put_signed((intptr_t)value); }
+static void put_FLOAT(GLfloat value) { put_bytes(&value, 4); }
+static void put_DOUBLE(GLdouble value) { put_bytes(&value, 8); }
+static void put_BUFFER(GLuint name) { put_unsigned(name); }
+static void put_TEXTURE(GLuint name) { put_unsigned(name); }
+static void put_VERTEX_ARRAY(GLuint name) { put_unsigned(name); }
+static void put_FRAMEBUFFER(GLuint name) { put_unsigned(name); }
+static void put_RENDERBUFFER(GLuint name) { put_unsigned(name); }
+static void put_QUERY(GLuint name) { put_unsigned(name); }
+static void put_PROGRAM(GLuint name) { put_unsigned(name); }
+static void put_LOCATION(GLint location) { put_signed(location); }
+static void put_BLOCK(GLuint index) { put_unsigned(index); }
+
+static int armed(void) {
+    return capture.mode != CAPTURE_OFF;
+}
+
+static int in_window(void) {
+    return capture.mode == CAPTURE_WINDOW;
+}
+
+static int grow(void **array, size_t size, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+
+    void *grown = realloc(*array, new_capacity * size);
+    if (!grown) {
+        return 1;
+    }
+
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static void put_slot_bytes(const void *bytes, size_t size) {
+    struct capture_slot *slot = capture.slot;
+    if (capture.slot_failed) {
+        return;
+    }
+
+    if (grow((void **)&slot->bytes, 1, &slot->capacity,
+             slot->size + size) != 0) {
+        capture.slot_failed = 1;
+        return;
+    }
+
+    memcpy(slot->bytes + slot->size, bytes, size);
+    slot->size += size;
+}
+
+static size_t slot_hash(enum capture_op op, uint64_t a, uint64_t b) {
+    uint64_t hash = (op * 0x9e3779b97f4a7c15ull ^ a) * 0x9e3779b97f4a7c15ull;
+    hash = (hash ^ b) * 0x9e3779b97f4a7c15ull;
+    return hash >> 32;
+}
+
+static int rehash_slots(size_t size) {
+    uint32_t *table = calloc(size, sizeof(*table));
+    if (!table) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < capture.slot_count; i++) {
+        struct capture_slot *slot = &capture.slots[i];
+        size_t index = slot_hash(slot->op, slot->a, slot->b) & (size - 1);
+        while (table[index]) {
+            index = (index + 1) & (size - 1);
+        }
+        table[index] = i + 1;
+    }
+
+    free(capture.slot_table);
+    capture.slot_table = table;
+    capture.slot_table_size = size;
+    return 0;
+}
+
+static struct capture_slot *find_slot(enum capture_op op, uint64_t a,
+                                      uint64_t b) {
+    size_t mask = capture.slot_table_size - 1;
+    size_t index = slot_hash(op, a, b) & mask;
+
+    while (capture.slot_table_size && capture.slot_table[index]) {
+        struct capture_slot *slot =
+            &capture.slots[capture.slot_table[index] - 1];
+        if (slot->op == op && slot->a == a && slot->b == b) {
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+
+    if ((capture.slot_count + 1) * 2 > capture.slot_table_size) {
+        size_t size = capture.slot_table_size ? capture.slot_table_size * 2 :
+                      256;
+        if (rehash_slots(size) != 0) {
+            return NULL;
+        }
+        return find_slot(op, a, b);
+    }
+
+    if (grow((void **)&capture.slots, sizeof(*capture.slots),
+             &capture.slot_capacity, capture.slot_count + 1) != 0) {
+        return NULL;
+    }
+
+    capture.slot_table[index] = capture.slot_count + 1;
+    struct capture_slot *slot = &capture.slots[capture.slot_count++];
+    memset(slot, 0x0, sizeof(*slot));
+    slot->op = op;
+    slot->a = a;
+    slot->b = b;
+
+    return slot;
+}
+
+// Points the put_ functions at the slot for a call, replacing what it held.
+// Returns 0 if out of memory, when the call isn't recorded.
+static int begin_slot(enum capture_op op, uint64_t a, uint64_t b,
+                      uint64_t context) {
+    struct capture_slot *slot = find_slot(op, a, b);
+    if (!slot || (!slot->dirty &&
+                  grow((void **)&capture.dirty, sizeof(*capture.dirty),
+                       &capture.dirty_capacity,
+                       capture.dirty_count + 1) != 0)) {
+        fprintf(stderr, "Out of memory capturing GL state\n");
+        return 0;
+    }
+
+    if (!slot->dirty) {
+        capture.dirty[capture.dirty_count++] = slot - capture.slots;
+        slot->dirty = 1;
+    }
+    slot->context = context;
+    slot->sequence = capture.sequence++;
+    slot->size = 0;
+
+    capture.slot = slot;
+    capture.slot_failed = 0;
+
+    return 1;
+}
+
+// Ends a record, put either to the file or a slot
+static void end_record(void) {
+    if (capture.slot && capture.slot_failed) {
+        fprintf(stderr, "Out of memory capturing GL state\n");
+        capture.slot->size = 0;
+    }
+    capture.slot = NULL;
+}
+
+static int compare_sequence(const void *a, const void *b) {
+    uint64_t x = capture.slots[*(const size_t *)a].sequence;
+    uint64_t y = capture.slots[*(const size_t *)b].sequence;
+    return (x > y) - (x < y);
+}
+
+// Writes the slots set since the last time, in the order they were set,
+// each after the state it depended on. That state is put back after.
+static void flush_slots(void) {
+    if (capture.dirty_count == 0) {
+        return;
+    }
+
+    qsort(capture.dirty, capture.dirty_count, sizeof(*capture.dirty),
+          compare_sequence);
+
+    int restore_program = 0;
+    int restore_texture_unit = 0;
+    int restore_vertex_array = 0;
+
+    for (size_t i = 0; i < capture.dirty_count; i++) {
+        struct capture_slot *slot = &capture.slots[capture.dirty[i]];
+        slot->dirty = 0;
+        if (slot->size == 0) {
+            continue;
+        }
+
+        switch (slot->op) {
+        case CAPTURE_OP_glUniform1fv:
+            put_op(CAPTURE_OP_glUseProgram);
+            put_PROGRAM(slot->a);
+            restore_program = 1;
+            break;
+        case CAPTURE_OP_glBindTexture:
+            put_op(CAPTURE_OP_glActiveTexture);
+            put_ENUM(slot->context);
+            restore_texture_unit = 1;
+            break;
+        case CAPTURE_OP_glBindBuffer:
+            if (slot->a == GL_ELEMENT_ARRAY_BUFFER) {
+                put_op(CAPTURE_OP_glBindVertexArray);
+                put_VERTEX_ARRAY(slot->context);
+                restore_vertex_array = 1;
+            }
+            break;
+        // Binding the buffer back is right even when it's no longer bound,
+        // since the bind that replaced it comes later
+        case CAPTURE_OP_glBufferData:
+            put_op(CAPTURE_OP_glBindBuffer);
+            put_ENUM(slot->context);
+            put_BUFFER(slot->a);
+            break;
+        default:
+            break;
+        }
+
+        put_bytes(slot->bytes, slot->size);
+    }
+    capture.dirty_count = 0;
+
+    if (restore_program) {
+        put_op(CAPTURE_OP_glUseProgram);
+        put_PROGRAM(capture.program);
+    }
+    if (restore_texture_unit) {
+        put_op(CAPTURE_OP_glActiveTexture);
+        put_ENUM(capture.active_texture);
+    }
+    if (restore_vertex_array) {
+        put_op(CAPTURE_OP_glBindVertexArray);
+        put_VERTEX_ARRAY(capture.vertex_array);
+    }
+}
+
+// Whether to record a call setting up objects. While armed, the context
+// state kept so far is written first, since the call may depend on it.
+static int record_state(void) {
+    if (capture.mode == CAPTURE_ARMED) {
+        flush_slots();
+    }
+
+    return armed();
+}
+
+static int record_STATE(enum capture_op op, uint64_t a0, uint64_t a1) {
+    (void)op;
+    (void)a0;
+    (void)a1;
+
+    return record_state();
+}
+
+static int record_WORK(enum capture_op op, uint64_t a0, uint64_t a1) {
+    (void)op;
+    (void)a0;
+    (void)a1;
+
+    return 0;
+}
+
+// Picks the slot for a context state call from its first two arguments
+static int record_BIND(enum capture_op op, uint64_t a0, uint64_t a1) {
+    uint64_t a = 0;
+    uint64_t b = 0;
+    uint64_t context = 0;
+
+    switch (op) {
+    case CAPTURE_OP_glActiveTexture:
+        capture.active_texture = a0;
+        break;
+    case CAPTURE_OP_glUseProgram:
+        capture.program = a0;
+        break;
+    case CAPTURE_OP_glBindVertexArray:
+        capture.vertex_array = a0;
+        break;
+    case CAPTURE_OP_glDisable:
+        op = CAPTURE_OP_glEnable;
+        a = a0;
+        break;
+    case CAPTURE_OP_glBindBufferRange:
+        op = CAPTURE_OP_glBindBufferBase;
+        a = a0;
+        b = a1;
+        break;
+    case CAPTURE_OP_glBindBufferBase:
+        a = a0;
+        b = a1;
+        break;
+    case CAPTURE_OP_glBindBuffer:
+        // Element array buffers are bound per vertex array
+        a = a0;
+        if (a0 == GL_ELEMENT_ARRAY_BUFFER) {
+            b = context = capture.vertex_array;
+        }
+        break;
+    case CAPTURE_OP_glBindTexture:
+        a = a0;
+        b = context = capture.active_texture;
+        break;
+    case CAPTURE_OP_glBindFramebuffer:
+    case CAPTURE_OP_glBindRenderbuffer:
+    case CAPTURE_OP_glEnable:
+    case CAPTURE_OP_glPixelStorei:
+        a = a0;
+        break;
+#define CAPTURE_UNIFORM(name, kind, type, components) \
+    case CAPTURE_OP_ ## name:
+#define CAPTURE_MATRIX(name, components) \
+    case CAPTURE_OP_ ## name:
+    CAPTURE_UNIFORMS
+    CAPTURE_MATRICES
+#undef CAPTURE_UNIFORM
+#undef CAPTURE_MATRIX
+    case CAPTURE_OP_glUniform2f:
+    case CAPTURE_OP_glUniform4f:
+        // By program and location, whichever setter set it
+        op = CAPTURE_OP_glUniform1fv;
+        a = capture.program;
+        b = a0;
+        break;
+    default:
+        break;
+    }
+
+    return begin_slot(op, a, b, context);
+}
+
+// Arguments as slot keys, see record_BIND
+static uint64_t key_ENUM(GLenum value) { return value; }
+static uint64_t key_UINT(GLuint value) { return value; }
+static uint64_t key_BOOL(GLboolean value) { return value; }
+static uint64_t key_BITS(GLbitfield value) { return value; }
+static uint64_t key_INT(GLint value) { return (uint64_t)value; }
+static uint64_t key_SIZEI(GLsizei value) { return (uint64_t)value; }
+static uint64_t key_INTPTR(GLintptr value) { return (uint64_t)value; }
+static uint64_t key_FLOAT(GLfloat value) { (void)value; return 0; }
+static uint64_t key_DOUBLE(GLdouble value) { (void)value; return 0; }
+static uint64_t key_BUFFER(GLuint name) { return name; }
+static uint64_t key_TEXTURE(GLuint name) { return name; }
+static uint64_t key_VERTEX_ARRAY(GLuint name) { return name; }
+static uint64_t key_FRAMEBUFFER(GLuint name) { return name; }
+static uint64_t key_RENDERBUFFER(GLuint name) { return name; }
+static uint64_t key_QUERY(GLuint name) { return name; }
+static uint64_t key_PROGRAM(GLuint name) { return name; }
+static uint64_t key_LOCATION(GLint location) { return (uint64_t)location; }
+static uint64_t key_BLOCK(GLuint index) { return index; }
+
+// Whether to record a call, and where: the file, or the slot for it while
+// armed. end_record follows what's put.
+#define RECORDING(name, category, key0, key1) \
+    (capture.mode == CAPTURE_WINDOW || \
+     (capture.mode == CAPTURE_ARMED && \
+      record_ ## category(CAPTURE_OP_ ## name, key0, key1)))
+
+#define CAPTURE_CALL1(name, category, k0, t0) \
+    void capture_ ## name(t0 a0) { \
+        if (RECORDING(name, category, key_ ## k0(a0), 0)) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_ ## k0(a0); \
+            end_record(); \
+        } \
+        name(a0); \
+    }
+#define CAPTURE_CALL2(name, category, k0, t0, k1, t1) \
+    void capture_ ## name(t0 a0, t1 a1) { \
+        if (RECORDING(name, category, key_ ## k0(a0), key_ ## k1(a1))) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_ ## k0(a0); put_ ## k1(a1); \
+            end_record(); \
+        } \
+        name(a0, a1); \
+    }
+#define CAPTURE_CALL3(name, category, k0, t0, k1, t1, k2, t2) \
+    void capture_ ## name(t0 a0, t1 a1, t2 a2) { \
+        if (RECORDING(name, category, key_ ## k0(a0), key_ ## k1(a1))) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_ ## k0(a0); put_ ## k1(a1); put_ ## k2(a2); \
+            end_record(); \
+        } \
+        name(a0, a1, a2); \
+    }
+#define CAPTURE_CALL4(name, category, k0, t0, k1, t1, k2, t2, k3, t3) \
+    void capture_ ## name(t0 a0, t1 a1, t2 a2, t3 a3) { \
+        if (RECORDING(name, category, key_ ## k0(a0), key_ ## k1(a1))) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_ ## k0(a0); put_ ## k1(a1); put_ ## k2(a2); put_ ## k3(a3); \
+            end_record(); \
+        } \
+        name(a0, a1, a2, a3); \
+    }
+#define CAPTURE_CALL5(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                      k4, t4) \
+    void capture_ ## name(t0 a0, t1 a1, t2 a2, t3 a3, t4 a4) { \
+        if (RECORDING(name, category, key_ ## k0(a0), key_ ## k1(a1))) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_ ## k0(a0); put_ ## k1(a1); put_ ## k2(a2); put_ ## k3(a3); \
+            put_ ## k4(a4); \
+            end_record(); \
+        } \
+        name(a0, a1, a2, a3, a4); \
+    }
+#define CAPTURE_CALL6(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                      k4, t4, k5, t5) \
+    void capture_ ## name(t0 a0, t1 a1, t2 a2, t3 a3, t4 a4, t5 a5) { \
+        if (RECORDING(name, category, key_ ## k0(a0), key_ ## k1(a1))) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_ ## k0(a0); put_ ## k1(a1); put_ ## k2(a2); put_ ## k3(a3); \
+            put_ ## k4(a4); put_ ## k5(a5); \
+            end_record(); \
+        } \
+        name(a0, a1, a2, a3, a4, a5); \
+    }
+#define CAPTURE_CALL10(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                       k4, t4, k5, t5, k6, t6, k7, t7, k8, t8, k9, t9) \
+    void capture_ ## name(t0 a0, t1 a1, t2 a2, t3 a3, t4 a4, t5 a5, \
+                          t6 a6, t7 a7, t8 a8, t9 a9) { \
+        if (RECORDING(name, category, key_ ## k0(a0), key_ ## k1(a1))) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_ ## k0(a0); put_ ## k1(a1); put_ ## k2(a2); put_ ## k3(a3); \
+            put_ ## k4(a4); put_ ## k5(a5); put_ ## k6(a6); put_ ## k7(a7); \
+            put_ ## k8(a8); put_ ## k9(a9); \
+            end_record(); \
+        } \
+        name(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9); \
+    }
+#define CAPTURE_UNIFORM(name, kind, type, components) \
+    void capture_ ## name(GLint location, GLsizei count, \
+                          const type *values) { \
+        if (RECORDING(name, BIND, key_LOCATION(location), 0)) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_LOCATION(location); \
+            put_SIZEI(count); \
+            for (GLsizei i = 0; i < count * components; i++) { \
+                put_ ## kind(values[i]); \
+            } \
+            end_record(); \
+        } \
+        name(location, count, values); \
+    }
+#define CAPTURE_MATRIX(name, components) \
+    void capture_ ## name(GLint location, GLsizei count, \
+                          GLboolean transpose, const GLfloat *values) { \
+        if (RECORDING(name, BIND, key_LOCATION(location), 0)) { \
+            put_op(CAPTURE_OP_ ## name); \
+            put_LOCATION(location); \
+            put_SIZEI(count); \
+            put_BOOL(transpose); \
+            for (GLsizei i = 0; i < count * components; i++) { \
+                put_FLOAT(values[i]); \
+            } \
+            end_record(); \
+        } \
+        name(location, count, transpose, values); \
+    }
+#define CAPTURE_NAMES(generate, delete, kind) \
+    void capture_ ## generate(GLsizei count, GLuint *names) { \
+        generate(count, names); \
+        if (armed()) { \
+            put_op(CAPTURE_OP_ ## generate); \
+            put_SIZEI(count); \
+            for (GLsizei i = 0; i < count; i++) { \
+                put_ ## kind(names[i]); \
+            } \
+        } \
+    } \
+    void capture_ ## delete(GLsizei count, const GLuint *names) { \
+        if (record_state()) { \
+            put_op(CAPTURE_OP_ ## delete); \
+            put_SIZEI(count); \
+            for (GLsizei i = 0; i < count; i++) { \
+                put_ ## kind(names[i]); \
+            } \
+            forget_ ## kind(count, names); \
+        } \
+        delete(count, names); \
+    }
+
+static void forget_BUFFER(GLsizei count, const GLuint *names) {
+    for (GLsizei i = 0; i < count; i++) {
+        for (size_t j = 0; j < capture.buffer_count; j++) {
+            if (capture.buffers[j].name == names[i]) {
+                capture.buffers[j] = capture.buffers[--capture.buffer_count];
+                break;
+            }
+        }
+    }
+}
+
+static void forget_TEXTURE(GLsizei count, const GLuint *names) {
+    for (GLsizei i = 0; i < count; i++) {
+        for (size_t j = 0; j < capture.texture_count; j++) {
+            if (capture.textures[j].name == names[i]) {
+                capture.textures[j] = capture.textures[--capture.texture_count];
+                break;
+            }
+        }
+    }
+}
+
+// Deleting the bound vertex array binds 0
+static void forget_VERTEX_ARRAY(GLsizei count, const GLuint *names) {
+    for (GLsizei i = 0; i < count; i++) {
+        if (names[i] == capture.vertex_array) {
+            capture.vertex_array = 0;
+        }
+    }
+}
+
+// Contents of the rest aren't snapshotted
+static void forget_names(GLsizei count, const GLuint *names) {
+    (void)count;
+    (void)names;
+}
+#define forget_FRAMEBUFFER forget_names
+#define forget_RENDERBUFFER forget_names
+#define forget_QUERY forget_names
+
+CAPTURE_CALLS
+CAPTURE_UNIFORMS
+CAPTURE_MATRICES
+CAPTURE_NAME_CALLS
+
+GLuint capture_glCreateShader(GLenum type) {
+    GLuint shader = glCreateShader(type);
+
+    if (armed()) {
+        put_op(CAPTURE_OP_glCreateShader);
+        put_ENUM(type);
+        put_PROGRAM(shader);
+    }
+
+    return shader;
+}
+
+GLuint capture_glCreateProgram(void) {
+    GLuint program = glCreateProgram();
+
+    if (armed()) {
+        put_op(CAPTURE_OP_glCreateProgram);
+        put_PROGRAM(program);
+    }
+
+    return program;
+}
+
+void capture_glShaderSource(GLuint shader, GLsizei count,
+                            const GLchar *const *strings,
+                            const GLint *lengths) {
+    if (armed()) {
+        put_op(CAPTURE_OP_glShaderSource);
+        put_PROGRAM(shader);
+        put_SIZEI(count);
+        for (GLsizei i = 0; i < count; i++) {
+            size_t length = lengths && lengths[i] >= 0 ?
+                (size_t)lengths[i] : strlen(strings[i]);
+            put_data(strings[i], length);
+        }
+    }
+
+    glShaderSource(shader, count, strings, lengths);
+}
+
+// Recorded with the result, so replay can map the location it gets
+GLint capture_glGetUniformLocation(GLuint program, const GLchar *name) {
+    GLint location = glGetUniformLocation(program, name);
+
+    if (armed()) {
+        put_op(CAPTURE_OP_glGetUniformLocation);
+        put_PROGRAM(program);
+        put_data(name, strlen(name));
+        put_LOCATION(location);
+    }
+
+    return location;
+}
+
+GLuint capture_glGetUniformBlockIndex(GLuint program, const GLchar *name) {
+    GLuint index = glGetUniformBlockIndex(program, name);
+
+    if (armed()) {
+        put_op(CAPTURE_OP_glGetUniformBlockIndex);
+        put_PROGRAM(program);
+        put_data(name, strlen(name));
+        put_BLOCK(index);
+    }
+
+    return index;
+}
+
+static GLenum buffer_binding(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER: return GL_ARRAY_BUFFER_BINDING;
+    case GL_ELEMENT_ARRAY_BUFFER: return GL_ELEMENT_ARRAY_BUFFER_BINDING;
+    case GL_UNIFORM_BUFFER: return GL_UNIFORM_BUFFER_BINDING;
+    case GL_SHADER_STORAGE_BUFFER: return GL_SHADER_STORAGE_BUFFER_BINDING;
+    case GL_DRAW_INDIRECT_BUFFER: return GL_DRAW_INDIRECT_BUFFER_BINDING;
+    case GL_DISPATCH_INDIRECT_BUFFER:
+        return GL_DISPATCH_INDIRECT_BUFFER_BINDING;
+    case GL_COPY_READ_BUFFER: return GL_COPY_READ_BUFFER_BINDING;
+    case GL_COPY_WRITE_BUFFER: return GL_COPY_WRITE_BUFFER_BINDING;
+    case GL_PIXEL_PACK_BUFFER: return GL_PIXEL_PACK_BUFFER_BINDING;
+    case GL_PIXEL_UNPACK_BUFFER: return GL_PIXEL_UNPACK_BUFFER_BINDING;
+    case GL_TRANSFORM_FEEDBACK_BUFFER:
+        return GL_TRANSFORM_FEEDBACK_BUFFER_BINDING;
+    default: return 0;
+    }
+}
+
+// Returns the buffer bound to the target, or 0
+static GLuint track_buffer(GLenum target, GLsizeiptr size) {
+    GLenum binding = buffer_binding(target);
+    if (!binding) {
+        return 0;
+    }
+
+    GLint name;
+    glGetIntegerv(binding, &name);
+    if (name == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < capture.buffer_count; i++) {
+        if (capture.buffers[i].name == (GLuint)name) {
+            capture.buffers[i].size = size;
+            return name;
+        }
+    }
+
+    if (grow((void **)&capture.buffers, sizeof(*capture.buffers),
+             &capture.buffer_capacity, capture.buffer_count + 1) == 0) {
+        capture.buffers[capture.buffer_count++] =
+            (struct capture_buffer){name, size};
+    }
+
+    return name;
+}
+
+// Contents are only recorded in the window. Before it, the snapshot taken
+// when the window opens stands in for every upload, and streaming buffers
+// respecified every frame keep only their latest size, like a bind.
+// Element array buffers are left out of that, being bound per vertex array.
+void capture_glBufferData(GLenum target, GLsizeiptr size, const void *data,
+                          GLenum usage) {
+    if (armed()) {
+        GLuint buffer = track_buffer(target, size);
+        int with_data = in_window() && data;
+        int recording = capture.mode == CAPTURE_ARMED && buffer &&
+                        target != GL_ELEMENT_ARRAY_BUFFER ?
+            begin_slot(CAPTURE_OP_glBufferData, buffer, 0, target) :
+            record_state();
+
+        if (recording) {
+            put_op(CAPTURE_OP_glBufferData);
+            put_ENUM(target);
+            put_INTPTR(size);
+            put_ENUM(usage);
+            put_BOOL(with_data);
+            if (with_data) {
+                put_data(data, size);
+            }
+            end_record();
+        }
+    }
+
+    glBufferData(target, size, data, usage);
+}
+
+void capture_glBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size,
+                             const void *data) {
+    if (in_window()) {
+        put_op(CAPTURE_OP_glBufferSubData);
+        put_ENUM(target);
+        put_INTPTR(offset);
+        put_data(data, size);
+    }
+
+    glBufferSubData(target, offset, size, data);
+}
+
+// Bytes per pixel of client data, or 0 for combinations we don't know
+static size_t pixel_size(GLenum format, GLenum type) {
+    switch (type) {
+    case GL_UNSIGNED_INT_24_8:
+        return 4;
+    case GL_FLOAT_32_UNSIGNED_INT_24_8_REV:
+        return 8;
+    }
+
+    size_t components;
+    switch (format) {
+    case GL_RED:
+    case GL_DEPTH_COMPONENT:
+        components = 1;
+        break;
+    case GL_RG:
+        components = 2;
+        break;
+    case GL_RGB:
+        components = 3;
+        break;
+    case GL_RGBA:
+    case GL_BGRA:
+        components = 4;
+        break;
+    default:
+        return 0;
+    }
+
+    switch (type) {
+    case GL_UNSIGNED_BYTE:
+    case GL_BYTE:
+        return components;
+    case GL_UNSIGNED_SHORT:
+    case GL_SHORT:
+    case GL_HALF_FLOAT:
+        return components * 2;
+    case GL_UNSIGNED_INT:
+    case GL_INT:
+    case GL_FLOAT:
+        return components * 4;
+    default:
+        return 0;
+    }
+}
+
+// Size of client image data as GL reads it, rows padded to the unpack
+// alignment except the last
+static size_t image_size(GLsizei width, GLsizei height, GLenum format,
+                         GLenum type) {
+    size_t pixel = pixel_size(format, type);
+    if (pixel == 0 || width <= 0 || height <= 0) {
+        return 0;
+    }
+
+    GLint alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+
+    size_t row = pixel * width;
+    size_t stride = (row + alignment - 1) / alignment * alignment;
+
+    return stride * (height - 1) + row;
+}
+
+static void track_texture(GLenum target, GLint level, GLint internal_format,
+                          GLsizei width, GLsizei height) {
+    if (target != GL_TEXTURE_2D || level != 0) {
+        return;
+    }
+
+    GLint name;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &name);
+    if (name == 0) {
+        return;
+    }
+
+    struct capture_texture texture = {name, width, height, internal_format};
+
+    for (size_t i = 0; i < capture.texture_count; i++) {
+        if (capture.textures[i].name == (GLuint)name) {
+            capture.textures[i] = texture;
+            return;
+        }
+    }
+
+    if (grow((void **)&capture.textures, sizeof(*capture.textures),
+             &capture.texture_capacity, capture.texture_count + 1) == 0) {
+        capture.textures[capture.texture_count++] = texture;
+    }
+}
+
+void capture_glTexImage2D(GLenum target, GLint level, GLint internal_format,
+                          GLsizei width, GLsizei height, GLint border,
+                          GLenum format, GLenum type, const void *pixels) {
+    if (record_state()) {
+        size_t size = in_window() && pixels ?
+            image_size(width, height, format, type) : 0;
+
+        put_op(CAPTURE_OP_glTexImage2D);
+        put_ENUM(target);
+        put_INT(level);
+        put_INT(internal_format);
+        put_SIZEI(width);
+        put_SIZEI(height);
+        put_INT(border);
+        put_ENUM(format);
+        put_ENUM(type);
+        put_BOOL(size > 0);
+        if (size > 0) {
+            put_data(pixels, size);
+        }
+
+        track_texture(target, level, internal_format, width, height);
+    }
+
+    glTexImage2D(target, level, internal_format, width, height, border,
+                 format, type, pixels);
+}
+
+void capture_glTexSubImage2D(GLenum target, GLint level, GLint x, GLint y,
+                             GLsizei width, GLsizei height, GLenum format,
+                             GLenum type, const void *pixels) {
+    size_t size = in_window() ? image_size(width, height, format, type) : 0;
+
+    if (size > 0) {
+        put_op(CAPTURE_OP_glTexSubImage2D);
+        put_ENUM(target);
+        put_INT(level);
+        put_INT(x);
+        put_INT(y);
+        put_SIZEI(width);
+        put_SIZEI(height);
+        put_ENUM(format);
+        put_ENUM(type);
+        put_data(pixels, size);
+    } else if (in_window()) {
+        log_warn("Can't capture texture data of format 0x%x type 0x%x",
+               format, type);
+    }
+
+    glTexSubImage2D(target, level, x, y, width, height, format, type, pixels);
+}
+
+void capture_glDrawBuffers(GLsizei count, const GLenum *buffers) {
+    if (record_state()) {
+        put_op(CAPTURE_OP_glDrawBuffers);
+        put_SIZEI(count);
+        for (GLsizei i = 0; i < count; i++) {
+            put_ENUM(buffers[i]);
+        }
+    }
+
+    glDrawBuffers(count, buffers);
+}
+
+void capture_glInvalidateFramebuffer(GLenum target, GLsizei count,
+                                     const GLenum *attachments) {
+    if (in_window()) {
+        put_op(CAPTURE_OP_glInvalidateFramebuffer);
+        put_ENUM(target);
+        put_SIZEI(count);
+        for (GLsizei i = 0; i < count; i++) {
+            put_ENUM(attachments[i]);
+        }
+    }
+
+    glInvalidateFramebuffer(target, count, attachments);
+}
+
+// Writes through a mapping are recorded when it's unmapped, as the whole
+// mapped range
+void *capture_glMapBufferRange(GLenum target, GLintptr offset,
+                               GLsizeiptr length, GLbitfield access) {
+    void *pointer = glMapBufferRange(target, offset, length, access);
+
+    if (in_window() && pointer && (access & GL_MAP_WRITE_BIT) &&
+        capture.mapping_count < MAX_MAPPINGS) {
+        capture.mappings[capture.mapping_count++] = (struct capture_mapping){
+            target, offset, length, access, pointer,
+        };
+    }
+
+    return pointer;
+}
+
+GLboolean capture_glUnmapBuffer(GLenum target) {
+    for (int i = 0; i < capture.mapping_count; i++) {
+        struct capture_mapping *mapping = &capture.mappings[i];
+        if (mapping->target != target) {
+            continue;
+        }
+
+        if (in_window()) {
+            put_op(CAPTURE_OP_MAP_WRITE);
+            put_ENUM(target);
+            put_INTPTR(mapping->offset);
+            put_INTPTR(mapping->length);
+            put_BITS(mapping->access);
+            put_data(mapping->pointer, mapping->length);
+        }
+
+        capture.mappings[i] = capture.mappings[--capture.mapping_count];
+        break;
+    }
+
+    return glUnmapBuffer(target);
+}
+
+// Client format and type to read a texture back in, or 0
+static void texture_transfer_format(GLenum internal_format, GLenum *format,
+                                    GLenum *type) {
+    *format = 0;
+    *type = 0;
+
+    switch (internal_format) {
+    case GL_R8: *format = GL_RED; *type = GL_UNSIGNED_BYTE; break;
+    case GL_RG8: *format = GL_RG; *type = GL_UNSIGNED_BYTE; break;
+    case GL_RGB8: *format = GL_RGB; *type = GL_UNSIGNED_BYTE; break;
+    case GL_RGBA8: *format = GL_RGBA; *type = GL_UNSIGNED_BYTE; break;
+    case GL_R16F:
+    case GL_R32F: *format = GL_RED; *type = GL_FLOAT; break;
+    case GL_RG16F:
+    case GL_RG32F: *format = GL_RG; *type = GL_FLOAT; break;
+    case GL_R11F_G11F_B10F: *format = GL_RGB; *type = GL_FLOAT; break;
+    case GL_RGBA16F:
+    case GL_RGBA32F: *format = GL_RGBA; *type = GL_FLOAT; break;
+    case GL_DEPTH_COMPONENT16:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+        *format = GL_DEPTH_COMPONENT;
+        *type = GL_FLOAT;
+        break;
+    case GL_DEPTH24_STENCIL8:
+        *format = GL_DEPTH_STENCIL;
+        *type = GL_UNSIGNED_INT_24_8;
+        break;
+    case GL_DEPTH32F_STENCIL8:
+        *format = GL_DEPTH_STENCIL;
+        *type = GL_FLOAT_32_UNSIGNED_INT_24_8_REV;
+        break;
+    }
+}
+
+static void snapshot_buffers(void) {
+    GLint previous;
+    glGetIntegerv(GL_COPY_READ_BUFFER_BINDING, &previous);
+
+    for (size_t i = 0; i < capture.buffer_count; i++) {
+        struct capture_buffer *buffer = &capture.buffers[i];
+        if (buffer->size <= 0) {
+            continue;
+        }
+
+        void *data = malloc(buffer->size);
+        if (!data) {
+            fprintf(stderr, "Out of memory capturing buffer %u\n",
+                    buffer->name);
+            continue;
+        }
+
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer->name);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, buffer->size, data);
+
+        put_op(CAPTURE_OP_BUFFER_CONTENTS);
+        put_BUFFER(buffer->name);
+        put_data(data, buffer->size);
+
+        free(data);
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, previous);
+}
+
+static void snapshot_textures(void) {
+    GLint previous, pack_alignment, unpack_alignment;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+    glGetIntegerv(GL_PACK_ALIGNMENT, &pack_alignment);
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    for (size_t i = 0; i < capture.texture_count; i++) {
+        struct capture_texture *texture = &capture.textures[i];
+
+        GLenum format, type;
+        texture_transfer_format(texture->internal_format, &format, &type);
+        size_t size = (size_t)texture->width * texture->height *
+                      pixel_size(format, type);
+        if (size == 0) {
+            log_warn("Can't capture texture %u of format 0x%x", texture->name,
+                   texture->internal_format);
+            continue;
+        }
+
+        void *data = malloc(size);
+        if (!data) {
+            fprintf(stderr, "Out of memory capturing texture %u\n",
+                    texture->name);
+            continue;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, texture->name);
+        glGetTexImage(GL_TEXTURE_2D, 0, format, type, data);
+
+        put_op(CAPTURE_OP_TEXTURE_CONTENTS);
+        put_TEXTURE(texture->name);
+        put_SIZEI(texture->width);
+        put_SIZEI(texture->height);
+        put_ENUM(format);
+        put_ENUM(type);
+        put_TEXTURE(previous);
+        put_INT(unpack_alignment);
+        put_data(data, size);
+
+        free(data);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, previous);
+    glPixelStorei(GL_PACK_ALIGNMENT, pack_alignment);
+}
+
+// The context state kept while armed goes before the window, so replay
+// doesn't count it in the first frame
+static void open_window(void) {
+    flush_slots();
+
+    put_op(CAPTURE_OP_WINDOW);
+    put_unsigned(capture.window_frames);
+
+    snapshot_buffers();
+    snapshot_textures();
+
+    capture.mode = CAPTURE_WINDOW;
+    capture.frames_left = capture.window_frames;
+    capture.window_start = -1;
+    capture.last_frame_end = SDL_GetPerformanceCounter();
+
+    fprintf(stderr, "Capturing %d frames to %s\n", capture.window_frames,
+            capture.file_name);
+}
+
+int capture_open(const char *file_name, int gl_major, int gl_minor,
+                 int width, int height) {
+    if (armed()) {
+        fprintf(stderr, "Already capturing to %s\n", capture.file_name);
+        return 1;
+    }
+
+    FILE *file = fopen(file_name, "wb");
+    if (!file) {
+        fprintf(stderr, "Error opening capture file %s\n", file_name);
+        return 1;
+    }
+
+    struct capture_header header = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .gl_major = gl_major,
+        .gl_minor = gl_minor,
+        .width = width,
+        .height = height,
+    };
+    fwrite(&header, sizeof(header), 1, file);
+
+    memset(&capture, 0x0, sizeof(capture));
+    capture.file = file;
+    capture.file_name = strdup(file_name);
+    capture.window_start = -1;
+    capture.mode = CAPTURE_ARMED;
+
+    log_debug("Armed GL capture to %s", file_name);
+
+    return 0;
+}
+
+int capture_armed(void) {
+    return armed();
+}
+
+// after_frame is counted from capture_open, -1 for the next frame
+int capture_frames(long after_frame, int count) {
+    if (capture.mode != CAPTURE_ARMED || count <= 0) {
+        return 1;
+    }
+
+    capture.window_start = after_frame < 0 ? capture.frame : after_frame;
+    capture.window_frames = count;
+
+    return 0;
+}
+
+void capture_close(void) {
+    if (!armed()) {
+        return;
+    }
+
+    put_op(CAPTURE_OP_END);
+    fclose(capture.file);
+
+    if (in_window()) {
+        fprintf(stderr, "Captured %d frames to %s\n",
+                capture.window_frames - capture.frames_left,
+                capture.file_name);
+    }
+
+    free(capture.file_name);
+    free(capture.buffers);
+    free(capture.textures);
+    free(capture.strings);
+    for (size_t i = 0; i < capture.slot_count; i++) {
+        free(capture.slots[i].bytes);
+    }
+    free(capture.slots);
+    free(capture.slot_table);
+    free(capture.dirty);
+    memset(&capture, 0x0, sizeof(capture));
+}
+
+void capture_frame_end(void) {
+    if (in_window()) {
+        Uint64 now = SDL_GetPerformanceCounter();
+        put_op(CAPTURE_OP_FRAME);
+        put_unsigned((now - capture.last_frame_end) * 1000000000.0 /
+                     SDL_GetPerformanceFrequency());
+        capture.last_frame_end = now;
+
+        if (--capture.frames_left == 0) {
+            capture_close();
+            return;
+        }
+    }
+
+    if (capture.mode == CAPTURE_ARMED && capture.window_start >= 0 &&
+        capture.frame >= capture.window_start) {
+        open_window();
+    }
+
+    capture.frame++;
+}
+
+void capture_marker_begin(const char *name) {
+    if (!in_window()) {
+        return;
+    }
+
+    size_t id = 0;
+    while (id < capture.string_count && capture.strings[id] != name) {
+        id++;
+    }
+
+    if (id == capture.string_count) {
+        if (grow((void **)&capture.strings, sizeof(*capture.strings),
+                 &capture.string_capacity, capture.string_count + 1) != 0) {
+            return;
+        }
+        capture.strings[capture.string_count++] = name;
+
+        put_op(CAPTURE_OP_STRING);
+        put_unsigned(id);
+        put_data(name, strlen(name));
+    }
+
+    put_op(CAPTURE_OP_MARKER_BEGIN);
+    put_unsigned(id);
+}
+
+void capture_marker_end(void) {
+    if (in_window()) {
+        put_op(CAPTURE_OP_MARKER_END);
+    }
+}
+
+int capture_in_window(void) {
+    return in_window();
+}
@@ -0,0 +1,196 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "capture_format.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <stddef.h>
+
+// Records the GL call stream into a trace for gl-replay.
+//
+// Once armed with capture_open, object creation is recorded from then on,
+// and the latest binds, enables and uniforms are kept in memory and written
+// when the window opens, so a window opened later can be replayed from the
+// state it started in without the trace growing every frame before it.
+// Inside the window every call is recorded along with the data it uploads,
+// and the draw functions Lua called are marked around the GL calls they
+// made. The trace is closed when the window ends.
+//
+// Every GL function the engine calls goes through the capture_ wrappers
+// below. Unarmed, each costs one predictable branch.
+
+// Starts recording state into the file. Returns 1 on error, having printed
+// why.
+int capture_open(const char *, int, int, int, int);
+// Opens the window after the given frame counted from capture_open, or -1
+// for the next frame, for the given number of frames. Returns 1 if the
+// capture isn't armed or a window already opened.
+int capture_frames(long, int);
+// Called once per frame, after the swap
+void capture_frame_end(void);
+// Whether calls are being recorded. Only the render thread's are, so work
+// that would go to other threads' contexts stays on it while this is set.
+int capture_armed(void);
+// Closes the trace early, e.g. at exit
+void capture_close(void);
+
+// Around each draw function called from Lua. The name must outlive the
+// capture.
+void capture_marker_begin(const char *);
+void capture_marker_end(void);
+// Whether markers are being written, i.e. the frame window is open
+int capture_in_window(void);
+
+#define CAPTURE_CALL1(name, category, k0, t0) void capture_ ## name(t0);
+#define CAPTURE_CALL2(name, category, k0, t0, k1, t1) \
+    void capture_ ## name(t0, t1);
+#define CAPTURE_CALL3(name, category, k0, t0, k1, t1, k2, t2) \
+    void capture_ ## name(t0, t1, t2);
+#define CAPTURE_CALL4(name, category, k0, t0, k1, t1, k2, t2, k3, t3) \
+    void capture_ ## name(t0, t1, t2, t3);
+#define CAPTURE_CALL5(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                      k4, t4) \
+    void capture_ ## name(t0, t1, t2, t3, t4);
+#define CAPTURE_CALL6(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                      k4, t4, k5, t5) \
+    void capture_ ## name(t0, t1, t2, t3, t4, t5);
+#define CAPTURE_CALL10(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                       k4, t4, k5, t5, k6, t6, k7, t7, k8, t8, k9, t9) \
+    void capture_ ## name(t0, t1, t2, t3, t4, t5, t6, t7, t8, t9);
+#define CAPTURE_UNIFORM(name, kind, type, components) \
+    void capture_ ## name(GLint, GLsizei, const type *);
+#define CAPTURE_MATRIX(name, components) \
+    void capture_ ## name(GLint, GLsizei, GLboolean, const GLfloat *);
+#define CAPTURE_NAMES(generate, delete, kind) \
+    void capture_ ## generate(GLsizei, GLuint *); \
+    void capture_ ## delete(GLsizei, const GLuint *);
+CAPTURE_CALLS
+CAPTURE_UNIFORMS
+CAPTURE_MATRICES
+CAPTURE_NAME_CALLS
+#undef CAPTURE_CALL1
+#undef CAPTURE_CALL2
+#undef CAPTURE_CALL3
+#undef CAPTURE_CALL4
+#undef CAPTURE_CALL5
+#undef CAPTURE_CALL6
+#undef CAPTURE_CALL10
+#undef CAPTURE_UNIFORM
+#undef CAPTURE_MATRIX
+#undef CAPTURE_NAMES
+
+GLuint capture_glCreateShader(GLenum);
+GLuint capture_glCreateProgram(void);
+void capture_glShaderSource(GLuint, GLsizei, const GLchar *const *,
+                            const GLint *);
+GLint capture_glGetUniformLocation(GLuint, const GLchar *);
+GLuint capture_glGetUniformBlockIndex(GLuint, const GLchar *);
+void capture_glBufferData(GLenum, GLsizeiptr, const void *, GLenum);
+void capture_glBufferSubData(GLenum, GLintptr, GLsizeiptr, const void *);
+void capture_glTexImage2D(GLenum, GLint, GLint, GLsizei, GLsizei, GLint,
+                          GLenum, GLenum, const void *);
+void capture_glTexSubImage2D(GLenum, GLint, GLint, GLint, GLsizei, GLsizei,
+                             GLenum, GLenum, const void *);
+void capture_glDrawBuffers(GLsizei, const GLenum *);
+void capture_glInvalidateFramebuffer(GLenum, GLsizei, const GLenum *);
+void *capture_glMapBufferRange(GLenum, GLintptr, GLsizeiptr, GLbitfield);
+GLboolean capture_glUnmapBuffer(GLenum);
+
+// capture.c itself calls the real functions
+#ifndef CAPTURE_NO_WRAP
+#define glActiveTexture capture_glActiveTexture
+#define glAttachShader capture_glAttachShader
+#define glBeginQuery capture_glBeginQuery
+#define glBindBuffer capture_glBindBuffer
+#define glBindBufferBase capture_glBindBufferBase
+#define glBindBufferRange capture_glBindBufferRange
+#define glBindFramebuffer capture_glBindFramebuffer
+#define glBindRenderbuffer capture_glBindRenderbuffer
+#define glBindTexture capture_glBindTexture
+#define glBindVertexArray capture_glBindVertexArray
+#define glBlendFunc capture_glBlendFunc
+#define glBlitFramebuffer capture_glBlitFramebuffer
+#define glBufferData capture_glBufferData
+#define glBufferSubData capture_glBufferSubData
+#define glClear capture_glClear
+#define glClearColor capture_glClearColor
+#define glClearDepth capture_glClearDepth
+#define glCompileShader capture_glCompileShader
+#define glCreateProgram capture_glCreateProgram
+#define glCreateShader capture_glCreateShader
+#define glCullFace capture_glCullFace
+#define glDeleteBuffers capture_glDeleteBuffers
+#define glDeleteFramebuffers capture_glDeleteFramebuffers
+#define glDeleteProgram capture_glDeleteProgram
+#define glDeleteQueries capture_glDeleteQueries
+#define glDeleteRenderbuffers capture_glDeleteRenderbuffers
+#define glDeleteShader capture_glDeleteShader
+#define glDeleteTextures capture_glDeleteTextures
+#define glDeleteVertexArrays capture_glDeleteVertexArrays
+#define glDepthFunc capture_glDepthFunc
+#define glDepthMask capture_glDepthMask
+#define glDepthRange capture_glDepthRange
+#define glDetachShader capture_glDetachShader
+#define glDisable capture_glDisable
+#define glDisableVertexAttribArray capture_glDisableVertexAttribArray
+#define glDispatchCompute capture_glDispatchCompute
+#define glDispatchComputeIndirect capture_glDispatchComputeIndirect
+#define glDrawArrays capture_glDrawArrays
+#define glDrawBuffers capture_glDrawBuffers
+#define glDrawElements capture_glDrawElements
+#define glDrawElementsBaseVertex capture_glDrawElementsBaseVertex
+#define glEnable capture_glEnable
+#define glEnableVertexAttribArray capture_glEnableVertexAttribArray
+#define glEndQuery capture_glEndQuery
+#define glFramebufferRenderbuffer capture_glFramebufferRenderbuffer
+#define glFramebufferTexture2D capture_glFramebufferTexture2D
+#define glFrontFace capture_glFrontFace
+#define glGenBuffers capture_glGenBuffers
+#define glGenFramebuffers capture_glGenFramebuffers
+#define glGenQueries capture_glGenQueries
+#define glGenRenderbuffers capture_glGenRenderbuffers
+#define glGenTextures capture_glGenTextures
+#define glGenVertexArrays capture_glGenVertexArrays
+#define glGetUniformBlockIndex capture_glGetUniformBlockIndex
+#define glGetUniformLocation capture_glGetUniformLocation
+#define glInvalidateFramebuffer capture_glInvalidateFramebuffer
+#define glInvalidateTexImage capture_glInvalidateTexImage
+#define glLinkProgram capture_glLinkProgram
+#define glMapBufferRange capture_glMapBufferRange
+#define glMemoryBarrier capture_glMemoryBarrier
+#define glPixelStorei capture_glPixelStorei
+#define glQueryCounter capture_glQueryCounter
+#define glRenderbufferStorage capture_glRenderbufferStorage
+#define glShaderSource capture_glShaderSource
+#define glTexImage2D capture_glTexImage2D
+#define glTexParameteri capture_glTexParameteri
+#define glTexSubImage2D capture_glTexSubImage2D
+#define glUniform1fv capture_glUniform1fv
+#define glUniform1iv capture_glUniform1iv
+#define glUniform2f capture_glUniform2f
+#define glUniform2fv capture_glUniform2fv
+#define glUniform2iv capture_glUniform2iv
+#define glUniform3fv capture_glUniform3fv
+#define glUniform3iv capture_glUniform3iv
+#define glUniform4f capture_glUniform4f
+#define glUniform4fv capture_glUniform4fv
+#define glUniform4iv capture_glUniform4iv
+#define glUniformBlockBinding capture_glUniformBlockBinding
+#define glUniformMatrix2fv capture_glUniformMatrix2fv
+#define glUniformMatrix2x3fv capture_glUniformMatrix2x3fv
+#define glUniformMatrix2x4fv capture_glUniformMatrix2x4fv
+#define glUniformMatrix3fv capture_glUniformMatrix3fv
+#define glUniformMatrix3x2fv capture_glUniformMatrix3x2fv
+#define glUniformMatrix3x4fv capture_glUniformMatrix3x4fv
+#define glUniformMatrix4fv capture_glUniformMatrix4fv
+#define glUniformMatrix4x2fv capture_glUniformMatrix4x2fv
+#define glUniformMatrix4x3fv capture_glUniformMatrix4x3fv
+#define glUnmapBuffer capture_glUnmapBuffer
+#define glUseProgram capture_glUseProgram
+#define glVertexAttribPointer capture_glVertexAttribPointer
+#define glViewport capture_glViewport
+#endif
+
+#endif
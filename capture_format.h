@@ -0,0 +1,219 @@
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+#include <stdint.h>
+
+// Trace file written by capture.c and read by gl-replay.
+//
+// Layout: a capture_header, then records until CAPTURE_OP_END. A record is
+// a one byte opcode followed by its arguments:
+//   - integers, enums and GL names as LEB128 varints, signed ones zigzagged
+//   - floats and doubles as their little endian bytes
+//   - data as a varint length, then the bytes
+// GL names are the ones the captured process saw. gl-replay maps them to
+// the names it gets from its own glGen and glCreate calls.
+#define CAPTURE_MAGIC "GLTRACE"
+#define CAPTURE_VERSION 1
+
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t gl_major;
+    uint32_t gl_minor;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Argument kinds. Names of each kind are mapped separately on replay.
+//   ENUM UINT BOOL BITS: unsigned varint
+//   INT SIZEI INTPTR OFFSET: signed varint, OFFSET being a byte offset
+//       passed as a pointer, e.g. into the bound element array buffer
+//   FLOAT DOUBLE: raw
+//   BUFFER TEXTURE VERTEX_ARRAY FRAMEBUFFER RENDERBUFFER QUERY PROGRAM:
+//       names, programs and shaders sharing one space as in GL
+//   LOCATION: uniform location in the program in use
+//   BLOCK: uniform block index in the program passed before it
+//
+// Categories say what to keep before the capture window opens. STATE calls
+// set up objects and are always recorded. BIND calls set context state that
+// later calls replace, such as binds, enables and the viewport, and so do
+// the uniform setters. Before the window only the latest of each is kept,
+// and written out when a STATE call might depend on it or the window opens.
+// WORK calls only matter inside the window.
+//
+// CAPTURE_CALLn(name, category, kind, type, ...) for calls whose arguments
+// are all plain values
+#define CAPTURE_CALLS \
+    CAPTURE_CALL1(glActiveTexture, BIND, ENUM, GLenum) \
+    CAPTURE_CALL2(glAttachShader, STATE, PROGRAM, GLuint, PROGRAM, GLuint) \
+    CAPTURE_CALL2(glBeginQuery, WORK, ENUM, GLenum, QUERY, GLuint) \
+    CAPTURE_CALL2(glBindBuffer, BIND, ENUM, GLenum, BUFFER, GLuint) \
+    CAPTURE_CALL3(glBindBufferBase, BIND, ENUM, GLenum, UINT, GLuint, \
+                  BUFFER, GLuint) \
+    CAPTURE_CALL5(glBindBufferRange, BIND, ENUM, GLenum, UINT, GLuint, \
+                  BUFFER, GLuint, INTPTR, GLintptr, INTPTR, GLsizeiptr) \
+    CAPTURE_CALL2(glBindFramebuffer, BIND, ENUM, GLenum, FRAMEBUFFER, GLuint) \
+    CAPTURE_CALL2(glBindRenderbuffer, BIND, ENUM, GLenum, \
+                  RENDERBUFFER, GLuint) \
+    CAPTURE_CALL2(glBindTexture, BIND, ENUM, GLenum, TEXTURE, GLuint) \
+    CAPTURE_CALL1(glBindVertexArray, BIND, VERTEX_ARRAY, GLuint) \
+    CAPTURE_CALL2(glBlendFunc, BIND, ENUM, GLenum, ENUM, GLenum) \
+    CAPTURE_CALL10(glBlitFramebuffer, WORK, INT, GLint, INT, GLint, \
+                   INT, GLint, INT, GLint, INT, GLint, INT, GLint, \
+                   INT, GLint, INT, GLint, BITS, GLbitfield, ENUM, GLenum) \
+    CAPTURE_CALL1(glClear, WORK, BITS, GLbitfield) \
+    CAPTURE_CALL4(glClearColor, BIND, FLOAT, GLfloat, FLOAT, GLfloat, \
+                  FLOAT, GLfloat, FLOAT, GLfloat) \
+    CAPTURE_CALL1(glClearDepth, BIND, DOUBLE, GLdouble) \
+    CAPTURE_CALL1(glCompileShader, STATE, PROGRAM, GLuint) \
+    CAPTURE_CALL1(glCullFace, BIND, ENUM, GLenum) \
+    CAPTURE_CALL1(glDeleteProgram, STATE, PROGRAM, GLuint) \
+    CAPTURE_CALL1(glDeleteShader, STATE, PROGRAM, GLuint) \
+    CAPTURE_CALL1(glDepthFunc, BIND, ENUM, GLenum) \
+    CAPTURE_CALL1(glDepthMask, BIND, BOOL, GLboolean) \
+    CAPTURE_CALL2(glDepthRange, BIND, DOUBLE, GLdouble, DOUBLE, GLdouble) \
+    CAPTURE_CALL2(glDetachShader, STATE, PROGRAM, GLuint, PROGRAM, GLuint) \
+    CAPTURE_CALL1(glDisable, BIND, ENUM, GLenum) \
+    CAPTURE_CALL1(glDisableVertexAttribArray, STATE, UINT, GLuint) \
+    CAPTURE_CALL3(glDispatchCompute, WORK, UINT, GLuint, UINT, GLuint, \
+                  UINT, GLuint) \
+    CAPTURE_CALL1(glDispatchComputeIndirect, WORK, INTPTR, GLintptr) \
+    CAPTURE_CALL3(glDrawArrays, WORK, ENUM, GLenum, INT, GLint, \
+                  SIZEI, GLsizei) \
+    CAPTURE_CALL4(glDrawElements, WORK, ENUM, GLenum, SIZEI, GLsizei, \
+                  ENUM, GLenum, OFFSET, const GLvoid *) \
+    CAPTURE_CALL5(glDrawElementsBaseVertex, WORK, ENUM, GLenum, \
+                  SIZEI, GLsizei, ENUM, GLenum, OFFSET, const GLvoid *, \
+                  INT, GLint) \
+    CAPTURE_CALL1(glEnable, BIND, ENUM, GLenum) \
+    CAPTURE_CALL1(glEnableVertexAttribArray, STATE, UINT, GLuint) \
+    CAPTURE_CALL1(glEndQuery, WORK, ENUM, GLenum) \
+    CAPTURE_CALL4(glFramebufferRenderbuffer, STATE, ENUM, GLenum, \
+                  ENUM, GLenum, ENUM, GLenum, RENDERBUFFER, GLuint) \
+    CAPTURE_CALL5(glFramebufferTexture2D, STATE, ENUM, GLenum, ENUM, GLenum, \
+                  ENUM, GLenum, TEXTURE, GLuint, INT, GLint) \
+    CAPTURE_CALL1(glFrontFace, BIND, ENUM, GLenum) \
+    CAPTURE_CALL2(glInvalidateTexImage, WORK, TEXTURE, GLuint, INT, GLint) \
+    CAPTURE_CALL1(glLinkProgram, STATE, PROGRAM, GLuint) \
+    CAPTURE_CALL1(glMemoryBarrier, WORK, BITS, GLbitfield) \
+    CAPTURE_CALL2(glPixelStorei, BIND, ENUM, GLenum, INT, GLint) \
+    CAPTURE_CALL2(glQueryCounter, WORK, QUERY, GLuint, ENUM, GLenum) \
+    CAPTURE_CALL4(glRenderbufferStorage, STATE, ENUM, GLenum, ENUM, GLenum, \
+                  SIZEI, GLsizei, SIZEI, GLsizei) \
+    CAPTURE_CALL3(glTexParameteri, STATE, ENUM, GLenum, ENUM, GLenum, \
+                  INT, GLint) \
+    CAPTURE_CALL3(glUniform2f, BIND, LOCATION, GLint, FLOAT, GLfloat, \
+                  FLOAT, GLfloat) \
+    CAPTURE_CALL5(glUniform4f, BIND, LOCATION, GLint, FLOAT, GLfloat, \
+                  FLOAT, GLfloat, FLOAT, GLfloat, FLOAT, GLfloat) \
+    CAPTURE_CALL3(glUniformBlockBinding, STATE, PROGRAM, GLuint, \
+                  BLOCK, GLuint, UINT, GLuint) \
+    CAPTURE_CALL1(glUseProgram, BIND, PROGRAM, GLuint) \
+    CAPTURE_CALL6(glVertexAttribPointer, STATE, UINT, GLuint, INT, GLint, \
+                  ENUM, GLenum, BOOL, GLboolean, SIZEI, GLsizei, \
+                  OFFSET, const GLvoid *) \
+    CAPTURE_CALL4(glViewport, BIND, INT, GLint, INT, GLint, \
+                  SIZEI, GLsizei, SIZEI, GLsizei)
+
+// Uniform array setters, CAPTURE_UNIFORM(name, kind, type, components)
+#define CAPTURE_UNIFORMS \
+    CAPTURE_UNIFORM(glUniform1fv, FLOAT, GLfloat, 1) \
+    CAPTURE_UNIFORM(glUniform2fv, FLOAT, GLfloat, 2) \
+    CAPTURE_UNIFORM(glUniform3fv, FLOAT, GLfloat, 3) \
+    CAPTURE_UNIFORM(glUniform4fv, FLOAT, GLfloat, 4) \
+    CAPTURE_UNIFORM(glUniform1iv, INT, GLint, 1) \
+    CAPTURE_UNIFORM(glUniform2iv, INT, GLint, 2) \
+    CAPTURE_UNIFORM(glUniform3iv, INT, GLint, 3) \
+    CAPTURE_UNIFORM(glUniform4iv, INT, GLint, 4)
+
+// Matrix setters, CAPTURE_MATRIX(name, components)
+#define CAPTURE_MATRICES \
+    CAPTURE_MATRIX(glUniformMatrix2fv, 4) \
+    CAPTURE_MATRIX(glUniformMatrix2x3fv, 6) \
+    CAPTURE_MATRIX(glUniformMatrix2x4fv, 8) \
+    CAPTURE_MATRIX(glUniformMatrix3x2fv, 6) \
+    CAPTURE_MATRIX(glUniformMatrix3fv, 9) \
+    CAPTURE_MATRIX(glUniformMatrix3x4fv, 12) \
+    CAPTURE_MATRIX(glUniformMatrix4x2fv, 8) \
+    CAPTURE_MATRIX(glUniformMatrix4x3fv, 12) \
+    CAPTURE_MATRIX(glUniformMatrix4fv, 16)
+
+// Object creation and deletion, CAPTURE_NAMES(generate, delete, kind)
+#define CAPTURE_NAME_CALLS \
+    CAPTURE_NAMES(glGenBuffers, glDeleteBuffers, BUFFER) \
+    CAPTURE_NAMES(glGenTextures, glDeleteTextures, TEXTURE) \
+    CAPTURE_NAMES(glGenVertexArrays, glDeleteVertexArrays, VERTEX_ARRAY) \
+    CAPTURE_NAMES(glGenFramebuffers, glDeleteFramebuffers, FRAMEBUFFER) \
+    CAPTURE_NAMES(glGenRenderbuffers, glDeleteRenderbuffers, RENDERBUFFER) \
+    CAPTURE_NAMES(glGenQueries, glDeleteQueries, QUERY)
+
+// Calls with pointer arguments or results, written out by hand
+#define CAPTURE_SPECIALS \
+    CAPTURE_SPECIAL(glCreateShader) \
+    CAPTURE_SPECIAL(glCreateProgram) \
+    CAPTURE_SPECIAL(glShaderSource) \
+    CAPTURE_SPECIAL(glGetUniformLocation) \
+    CAPTURE_SPECIAL(glGetUniformBlockIndex) \
+    CAPTURE_SPECIAL(glBufferData) \
+    CAPTURE_SPECIAL(glBufferSubData) \
+    CAPTURE_SPECIAL(glTexImage2D) \
+    CAPTURE_SPECIAL(glTexSubImage2D) \
+    CAPTURE_SPECIAL(glDrawBuffers) \
+    CAPTURE_SPECIAL(glInvalidateFramebuffer)
+
+enum capture_op {
+    // Varint nanoseconds since the previous frame ended
+    CAPTURE_OP_FRAME,
+    // The capture window opens: varint frame count. Content snapshots of
+    // every live buffer and texture follow.
+    CAPTURE_OP_WINDOW,
+    // Varint id, then the string as data
+    CAPTURE_OP_STRING,
+    // Draw function called from Lua, by string id, and its return
+    CAPTURE_OP_MARKER_BEGIN,
+    CAPTURE_OP_MARKER_END,
+    // BUFFER, data
+    CAPTURE_OP_BUFFER_CONTENTS,
+    // TEXTURE, width, height, format, type, TEXTURE bound to restore, unpack
+    // alignment to restore, data. Level 0 of a 2D texture.
+    CAPTURE_OP_TEXTURE_CONTENTS,
+    // glMapBufferRange then glUnmapBuffer: target, offset, length, access,
+    // then the bytes written while mapped
+    CAPTURE_OP_MAP_WRITE,
+    CAPTURE_OP_END,
+
+#define CAPTURE_CALL(name, ...) CAPTURE_OP_ ## name,
+#define CAPTURE_CALL1 CAPTURE_CALL
+#define CAPTURE_CALL2 CAPTURE_CALL
+#define CAPTURE_CALL3 CAPTURE_CALL
+#define CAPTURE_CALL4 CAPTURE_CALL
+#define CAPTURE_CALL5 CAPTURE_CALL
+#define CAPTURE_CALL6 CAPTURE_CALL
+#define CAPTURE_CALL10 CAPTURE_CALL
+#define CAPTURE_UNIFORM CAPTURE_CALL
+#define CAPTURE_MATRIX CAPTURE_CALL
+#define CAPTURE_SPECIAL CAPTURE_CALL
+#define CAPTURE_NAMES(generate, delete, kind) \
+    CAPTURE_OP_ ## generate, CAPTURE_OP_ ## delete,
+    CAPTURE_CALLS
+    CAPTURE_UNIFORMS
+    CAPTURE_MATRICES
+    CAPTURE_NAME_CALLS
+    CAPTURE_SPECIALS
+#undef CAPTURE_CALL
+#undef CAPTURE_CALL1
+#undef CAPTURE_CALL2
+#undef CAPTURE_CALL3
+#undef CAPTURE_CALL4
+#undef CAPTURE_CALL5
+#undef CAPTURE_CALL6
+#undef CAPTURE_CALL10
+#undef CAPTURE_UNIFORM
+#undef CAPTURE_MATRIX
+#undef CAPTURE_SPECIAL
+#undef CAPTURE_NAMES
+
+    CAPTURE_OP_COUNT,
+};
+
+#endif
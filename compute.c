@@ -0,0 +1,142 @@
+#include "compute.h"
+
+#include "draw_interface.h"
+
+#include <stdlib.h>
+
+static void check_compute(struct draw_data *data, lua_State *L) {
+    if (!data->compute) {
+        luaL_error(L, "Compute shaders need an OpenGL 4.3 context");
+    }
+}
+
+int draw_lua_ComputeSupported(struct draw_data *data, lua_State *L) {
+    lua_pushboolean(L, data->compute);
+
+    return 1;
+}
+
+int draw_lua_glDispatchCompute(struct draw_data *data, lua_State *L) {
+    check_compute(data, L);
+
+    GLuint x = get_integer_arg(L);
+    GLuint y = luaL_optinteger(L, 1, 1);
+    GLuint z = luaL_optinteger(L, 2, 1);
+
+    glDispatchCompute(x, y, z);
+
+    return 0;
+}
+
+// Reads the group counts from the bound GL_DISPATCH_INDIRECT_BUFFER at the
+// given offset, so a previous pass can size the dispatch on the GPU
+int draw_lua_glDispatchComputeIndirect(struct draw_data *data, lua_State *L) {
+    check_compute(data, L);
+
+    GLintptr offset = get_integer_arg(L);
+
+    glDispatchComputeIndirect(offset);
+
+    return 0;
+}
+
+// target, index, buffer
+int draw_lua_glBindBufferBase(struct draw_data *data, lua_State *L) {
+    GLenum target = get_integer_arg(L);
+    GLuint index = get_integer_arg(L);
+    GLuint buffer = handle_check(L, &data->handles, 1, HANDLE_BUFFER);
+
+    if (target == GL_SHADER_STORAGE_BUFFER) {
+        check_compute(data, L);
+    }
+
+    // Also binds the generic target
+    glBindBufferBase(target, index, buffer);
+    handle_bind_buffer(&data->handles, target, lua_touserdata(L, 1));
+
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+// target, index, buffer, offset, size
+int draw_lua_glBindBufferRange(struct draw_data *data, lua_State *L) {
+    GLenum target = get_integer_arg(L);
+    GLuint index = get_integer_arg(L);
+    GLuint buffer = handle_check(L, &data->handles, 1, HANDLE_BUFFER);
+    const struct handle *handle = lua_touserdata(L, 1);
+    lua_remove(L, 1);
+    GLintptr offset = get_integer_arg(L);
+    GLsizeiptr size = get_integer_arg(L);
+
+    if (target == GL_SHADER_STORAGE_BUFFER) {
+        check_compute(data, L);
+    }
+
+    glBindBufferRange(target, index, buffer, offset, size);
+    handle_bind_buffer(&data->handles, target, handle);
+
+    return 0;
+}
+
+int draw_lua_glMemoryBarrier(struct draw_data *data, lua_State *L) {
+    check_compute(data, L);
+
+    GLbitfield barriers = get_integer_arg(L);
+
+    glMemoryBarrier(barriers);
+
+    return 0;
+}
+
+// target, offset, count. Reads count floats back from the bound buffer into
+// a table. This waits for the GPU, so it's for tests and debugging.
+int draw_lua_GetBufferSubFloatData(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    GLenum target = get_integer_arg(L);
+    GLintptr offset = get_integer_arg(L);
+    lua_Integer count = get_integer_arg(L);
+
+    float *values = malloc(count * sizeof(*values));
+    if (!values) {
+        return luaL_error(L, "Error allocating %d floats", (int)count);
+    }
+
+    glGetBufferSubData(target, offset, count * sizeof(*values), values);
+
+    lua_createtable(L, count, 0);
+    for (lua_Integer i = 0; i < count; i++) {
+        lua_pushnumber(L, values[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    free(values);
+
+    return 1;
+}
+
+void compute_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(ComputeSupported);
+    REGISTER_FUNC(glDispatchCompute);
+    REGISTER_FUNC(glDispatchComputeIndirect);
+    REGISTER_FUNC(glBindBufferBase);
+    REGISTER_FUNC(glBindBufferRange);
+    REGISTER_FUNC(glMemoryBarrier);
+    REGISTER_FUNC(GetBufferSubFloatData);
+
+    REGISTER_CONST(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    REGISTER_CONST(GL_ELEMENT_ARRAY_BARRIER_BIT);
+    REGISTER_CONST(GL_UNIFORM_BARRIER_BIT);
+    REGISTER_CONST(GL_TEXTURE_FETCH_BARRIER_BIT);
+    REGISTER_CONST(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    REGISTER_CONST(GL_COMMAND_BARRIER_BIT);
+    REGISTER_CONST(GL_PIXEL_BUFFER_BARRIER_BIT);
+    REGISTER_CONST(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    REGISTER_CONST(GL_BUFFER_UPDATE_BARRIER_BIT);
+    REGISTER_CONST(GL_FRAMEBUFFER_BARRIER_BIT);
+    REGISTER_CONST(GL_TRANSFORM_FEEDBACK_BARRIER_BIT);
+    REGISTER_CONST(GL_ATOMIC_COUNTER_BARRIER_BIT);
+    REGISTER_CONST(GL_SHADER_STORAGE_BARRIER_BIT);
+    REGISTER_CONST(GL_ALL_BARRIER_BITS);
+}
@@ -0,0 +1,12 @@
+#ifndef COMPUTE_H
+#define COMPUTE_H
+
+#include "lua.h"
+#include "draw.h"
+
+// Compute dispatch, indexed buffer binding and memory barriers. These need
+// a 4.3 context, which the main file asks for with
+// opengl_version = {4, 3}. Without one they raise a Lua error.
+void compute_register(lua_State *, struct draw_data *);
+
+#endif
@@ -1,6 +1,5 @@
 #include "draw.h"
 
-#include "debug.h"
 #include "util.h"
 
 #include <stdlib.h>
@@ -12,6 +11,52 @@ void print_sdl_error(const char *prefix) {
     fprintf(stderr, "%s: %s", prefix, error);
 }
 
+static int set_context_version(int major, int minor) {
+    int err;
+    if ((err = SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, major)) < 0) {
+        print_sdl_error("Error setting SDL context major version");
+        return 1;
+    }
+    if ((err = SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, minor)) < 0) {
+        print_sdl_error("Error setting SDL context minor version");
+        return 1;
+    }
+
+    // 3.3 keeps whatever profile the driver defaults to, as it always has
+    int profile = major > 3 || minor > 3 ? SDL_GL_CONTEXT_PROFILE_CORE : 0;
+    if ((err = SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, profile)) < 0) {
+        print_sdl_error("Error setting SDL context profile");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Makes a context sharing objects with the current one for the loader
+// thread. Without it, loads run on the render thread.
+static void start_loader(struct draw_data *data) {
+    if (SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1) < 0) {
+        print_sdl_error("Error sharing OpenGL contexts");
+        fprintf(stderr, "\nLoading on the render thread\n");
+        return;
+    }
+
+    // Made current on this thread, so switch back straight away
+    SDL_GLContext context = SDL_GL_CreateContext(data->window);
+    SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+    SDL_GL_MakeCurrent(data->window, data->context);
+
+    if (!context) {
+        print_sdl_error("Error getting loader OpenGL context");
+        fprintf(stderr, "\nLoading on the render thread\n");
+        return;
+    }
+
+    if (loader_start(&data->loader, data->window, context) != 0) {
+        SDL_GL_DeleteContext(context);
+    }
+}
+
 int draw_setup(struct draw_data *data) {
     int err;
     if ((err = SDL_Init(SDL_INIT_VIDEO)) < 0) {
@@ -19,18 +64,23 @@ int draw_setup(struct draw_data *data) {
         return 1;
     }
 
-    if ((err = SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3)) < 0) {
-        print_sdl_error("Error setting SDL context major version");
-        SDL_Quit();
-        return 1;
+    if (data->gl_major == 0) {
+        data->gl_major = 3;
+        data->gl_minor = 3;
     }
-    if ((err = SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3)) < 0) {
-        print_sdl_error("Error setting SDL context minor version");
+    if ((err = set_context_version(data->gl_major, data->gl_minor)) != 0) {
         SDL_Quit();
         return 1;
     }
 
-    SDL_Window *window = SDL_CreateWindow("Test window", 0, 0, 800, 600,
+    if (data->window_width <= 0 || data->window_height <= 0) {
+        data->window_width = 800;
+        data->window_height = 600;
+    }
+
+    SDL_Window *window = SDL_CreateWindow("Test window", 0, 0,
+                                          data->window_width,
+                                          data->window_height,
                                           SDL_WINDOW_OPENGL);
 
     if (!window) {
@@ -41,6 +91,17 @@ int draw_setup(struct draw_data *data) {
 
     SDL_GLContext context = SDL_GL_CreateContext(window);
 
+    if (!context && (data->gl_major > 3 || data->gl_minor > 3)) {
+        print_sdl_error("Error getting requested OpenGL context");
+        fprintf(stderr, "\nFalling back to OpenGL 3.3\n");
+
+        data->gl_major = 3;
+        data->gl_minor = 3;
+        if ((err = set_context_version(3, 3)) == 0) {
+            context = SDL_GL_CreateContext(window);
+        }
+    }
+
     if (!context) {
         print_sdl_error("Error getting SDL OpenGL context");
         SDL_DestroyWindow(window);
@@ -63,13 +124,45 @@ int draw_setup(struct draw_data *data) {
     }
     fprintf(stderr, "Got OpenGL Version: %d.%d\n", major, minor);
 
+    // The attributes only say what was asked for
+    GLint gl_major, gl_minor;
+    glGetIntegerv(GL_MAJOR_VERSION, &gl_major);
+    glGetIntegerv(GL_MINOR_VERSION, &gl_minor);
+    data->compute = gl_major > 4 || (gl_major == 4 && gl_minor >= 3);
+
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT,
+                  &data->uniform_buffer_alignment);
+    if (data->uniform_buffer_alignment < 1) {
+        data->uniform_buffer_alignment = 1;
+    }
+
     data->window = window;
     data->context = context;
 
+    data->capabilities = 0;
+    data->depth_mask = GL_TRUE;
+    data->frame_scaler = NULL;
+
+    gpu_timer_init(&data->gpu_timers);
+    shader_cache_init(&data->shaders);
+    handle_table_init(&data->handles, data->memory);
+
+    loader_init(&data->loader, data->memory);
+    if (data->background_loads) {
+        start_loader(data);
+    }
+
     return 0;
 }
 
 void draw_cleanup(struct draw_data *data) {
+    // Before the handles, since finished programs are handed out as handles
+    loader_cleanup(&data->loader);
+
+    gpu_timer_cleanup(&data->gpu_timers);
+    shader_cache_cleanup(&data->shaders);
+    handle_table_cleanup(&data->handles);
+
     SDL_GL_DeleteContext(data->context);
 
     SDL_DestroyWindow(data->window);
@@ -78,6 +171,25 @@ void draw_cleanup(struct draw_data *data) {
     memset(data, 0x0, sizeof(*data));
 }
 
+static unsigned capability_bit(GLenum cap) {
+    switch (cap) {
+    case GL_BLEND: return DRAW_BLEND;
+    case GL_CULL_FACE: return DRAW_CULL_FACE;
+    case GL_DEPTH_TEST: return DRAW_DEPTH_TEST;
+    case GL_SCISSOR_TEST: return DRAW_SCISSOR_TEST;
+    case GL_STENCIL_TEST: return DRAW_STENCIL_TEST;
+    default: return 0;
+    }
+}
+
+void draw_set_capability(struct draw_data *data, GLenum cap, int enabled) {
+    if (enabled) {
+        data->capabilities |= capability_bit(cap);
+    } else {
+        data->capabilities &= ~capability_bit(cap);
+    }
+}
+
 void draw_cleanup_wrapper(void *d) {
     struct draw_data *data = (struct draw_data *)d;
     draw_cleanup(data);
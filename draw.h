@@ -8,13 +8,73 @@
 #include <SDL2/SDL_opengl.h>
 #include <SDL2/SDL_video.h>
 
+// After every GL header, so the wrappers stand in for the GL calls below
+#include "capture.h"
+
+#include "gpu_timer.h"
+#include "handle.h"
+#include "loader.h"
+#include "memory_stats.h"
+#include "shader.h"
+
+struct resolution_scaler;
+
+// Capabilities whose state draw_data keeps, for C code that changes them
+// for a draw and has to put them back
+enum draw_capability {
+    DRAW_BLEND = 1 << 0,
+    DRAW_CULL_FACE = 1 << 1,
+    DRAW_DEPTH_TEST = 1 << 2,
+    DRAW_SCISSOR_TEST = 1 << 3,
+    DRAW_STENCIL_TEST = 1 << 4,
+};
+
 struct draw_data {
     SDL_Window *window;
     SDL_GLContext context;
+
+    // OpenGL version to ask for, set before draw_setup. Versions past 3.3
+    // get a core profile, and fall back to 3.3 if the driver says no.
+    int gl_major;
+    int gl_minor;
+    // Window size to ask for, set before draw_setup
+    int window_width;
+    int window_height;
+    // Whether the context we got has compute shaders (4.3+)
+    int compute;
+    // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, at least 1
+    GLint uniform_buffer_alignment;
+    // Whether to ask for a second context for the loader thread, set
+    // before draw_setup
+    int background_loads;
+
+    // Set by main before lua_setup, since the Lua heap is counted too
+    struct memory_stats *memory;
+
+    struct gpu_timers gpu_timers;
+
+    struct shader_cache shaders;
+
+    // GL objects owned by Lua
+    struct handle_table handles;
+
+    // DRAW_* capabilities enabled through gl.enable, all off to begin with
+    // as in GL. C code changing them directly has to put them back.
+    unsigned capabilities;
+    // Last gl.depth_mask, GL_TRUE to begin with
+    GLboolean depth_mask;
+    // Scaler between resolution_begin and resolution_end, whose target
+    // render graphs draw their backbuffer passes into
+    struct resolution_scaler *frame_scaler;
+
+    struct loader loader;
 };
 
 int draw_setup(struct draw_data *);
 void draw_cleanup(struct draw_data *);
 void draw_cleanup_wrapper(void *);
 
+// Records a glEnable or glDisable of the capability
+void draw_set_capability(struct draw_data *, GLenum, int);
+
 #endif
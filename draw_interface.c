@@ -1,7 +1,6 @@
 #include "draw_interface.h"
 
-#include "debug.h"
-#include "util.h"
+#include "log.h"
 
 // Helper functions
 lua_Integer get_integer_arg(lua_State *L) {
@@ -87,7 +86,15 @@ const char *gl_strerror(GLenum err) {
     return "Invalid error";
 }
 
-typedef int (*draw_luafunction)(struct draw_data *data, lua_State *L);
+// Calls the draw function in upvalues 1 and 2, for drawfunction_wrapper to
+// run protected
+static int drawfunction_call(lua_State *L) {
+    struct draw_data *data = lua_touserdata(L, lua_upvalueindex(1));
+    draw_luafunction func =
+        (draw_luafunction)lua_touserdata(L, lua_upvalueindex(2));
+
+    return func(data, L);
+}
 
 int drawfunction_wrapper(lua_State *L) {
     void *d = lua_touserdata(L, lua_upvalueindex(1));
@@ -104,7 +111,27 @@ int drawfunction_wrapper(lua_State *L) {
                err, gl_strerror(err), func_name);
     }
 
-    int ret = func(data, L);
+    int ret;
+    if (capture_in_window()) {
+        // An error thrown past the end marker would leave it open for the
+        // rest of the trace, so catch it, close the marker and rethrow
+        int nargs = lua_gettop(L);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_pushcclosure(L, drawfunction_call, 2);
+        lua_insert(L, 1);
+
+        capture_marker_begin(func_name);
+        int status = lua_pcall(L, nargs, LUA_MULTRET, 0);
+        capture_marker_end();
+
+        if (status != LUA_OK) {
+            return lua_error(L);
+        }
+        ret = lua_gettop(L);
+    } else {
+        ret = func(data, L);
+    }
 
     while ((err = glGetError()) != GL_NO_ERROR) {
         fprintf(stderr, "Got error: %d (%s) during function '%s'\n",
@@ -128,7 +155,7 @@ void register_drawfunction(lua_State *L, draw_luafunction func,
 void register_drawconst(lua_State *L, lua_Integer val, const char *name) {
     lua_pushinteger(L, val);
     lua_setglobal(L, name);
-    debugp("Setting %s to %ld", name, val);
+    log_trace("Setting %s to %lld", name, (long long)val);
 }
 
 int draw_lua_glClearColor(struct draw_data *data, lua_State *L) {
@@ -165,15 +192,9 @@ int draw_lua_glClear(struct draw_data *data, lua_State *L) {
 }
 
 int draw_lua_glUseProgram(struct draw_data *data, lua_State *L) {
-    (void)data;
-
-    if (lua_isnil(L, 1)) {
-        glUseProgram(0);
-    } else {
-        GLuint program = (GLuint)lua_touserdata(L, 1);
+    GLuint program = handle_check(L, &data->handles, 1, HANDLE_PROGRAM);
 
-        glUseProgram(program);
-    }
+    glUseProgram(program);
 
     lua_pop(L, 1);
 
@@ -254,58 +275,25 @@ int draw_lua_glVertexAttribPointer(struct draw_data *data, lua_State *L) {
     return 0;
 }
 
-int draw_lua_CreateShaderFromFile(struct draw_data *data, lua_State *L) {
-    (void)data;
-
-    GLenum shader_type = get_integer_arg(L);
-    const char *file_name = get_string_arg(L);
-
-    GLchar *file_data = read_whole_file(file_name);
-
-    GLuint shader = glCreateShader(shader_type);
-
-    glShaderSource(shader, 1, (const GLchar * const *)&file_data, NULL);
-    glCompileShader(shader);
-
-    GLint status;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if (status == GL_FALSE) {
-        GLchar log[512];
-        glGetShaderInfoLog(shader, 512, NULL, log);
-
-        fprintf(stderr, "Error compiling shader %s:\n%s\n", file_name, log);
-    }
-
-    free(file_data);
-
-    // TODO(emily): Offset this so it doesn't test equal to other OpenGL types.
-    lua_pushlightuserdata(L, (void*)(intptr_t)shader);
-
-    return 1;
-}
-
 int draw_lua_glDeleteShader(struct draw_data *data, lua_State *L) {
-    (void)data;
-
-    GLuint shader = get_integer_arg(L);
-
-    glDeleteShader(shader);
+    handle_delete(L, &data->handles, 1, HANDLE_SHADER);
+    lua_settop(L, 0);
 
     return 0;
 }
 
 int draw_lua_CreateProgramFromShaders(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLuint program = glCreateProgram();
 
     lua_pushnil(L);
     while (lua_next(L, 1) != 0) {
         // TODO(emily): check if the indices are integers?
-        GLuint shader = (GLuint)lua_touserdata(L, -1);
-        debugp("Attaching shader %d", shader);
+        GLuint shader = handle_check(L, &data->handles, -1, HANDLE_SHADER);
+        log_trace("Attaching shader %d", shader);
 
         glAttachShader(program, shader);
+        // Shaders from CompileShaders may still be compiling
+        shader_cache_finish(&data->shaders, shader);
 
         lua_pop(L, 1);
     }
@@ -321,8 +309,8 @@ int draw_lua_CreateProgramFromShaders(struct draw_data *data, lua_State *L) {
 
     lua_pushnil(L);
     while (lua_next(L, 1) != 0) {
-        GLuint shader = (GLuint)lua_touserdata(L, -1);
-        debugp("Detaching shader %d", shader);
+        GLuint shader = handle_check(L, &data->handles, -1, HANDLE_SHADER);
+        log_trace("Detaching shader %d", shader);
 
         glDetachShader(program, shader);
 
@@ -332,57 +320,43 @@ int draw_lua_CreateProgramFromShaders(struct draw_data *data, lua_State *L) {
     // Pop table
     lua_pop(L, 1);
 
-    lua_pushlightuserdata(L, (void*)(intptr_t)program);
+    handle_push(L, &data->handles, HANDLE_PROGRAM, program);
 
     return 1;
 }
 
 int draw_lua_glDeleteProgram(struct draw_data *data, lua_State *L) {
-    (void)data;
-
-    GLuint program = get_integer_arg(L);
-
-    glDeleteProgram(program);
+    handle_delete(L, &data->handles, 1, HANDLE_PROGRAM);
+    lua_settop(L, 0);
 
     return 0;
 }
 
 int draw_lua_CreateBufferObject(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLuint buffer_object;
 
     glGenBuffers(1, &buffer_object);
 
-    lua_pushlightuserdata(L, (void*)(intptr_t)buffer_object);
+    handle_push(L, &data->handles, HANDLE_BUFFER, buffer_object);
 
     return 1;
 }
 
 int draw_lua_DeleteBufferObject(struct draw_data *data, lua_State *L) {
-    (void)data;
-
-    GLuint buffer = get_userdata_arg(L);
-
-    glDeleteBuffers(1, &buffer);
+    handle_delete(L, &data->handles, 1, HANDLE_BUFFER);
+    lua_settop(L, 0);
 
-    return 1;
+    return 0;
 }
 
 int draw_lua_glBindBuffer(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLenum target = get_integer_arg(L);
 
-    if (lua_isnil(L, 1)) {
-        debugp("Unbinding buffer");
-        glBindBuffer(target, 0);
-    } else {
-        GLuint buffer = (GLuint)lua_touserdata(L, 1);
-        debugp("Binding buffer %d", buffer);
+    GLuint buffer = handle_check(L, &data->handles, 1, HANDLE_BUFFER);
+    log_trace("Binding buffer %d", buffer);
 
-        glBindBuffer(target, buffer);
-    }
+    glBindBuffer(target, buffer);
+    handle_bind_buffer(&data->handles, target, lua_touserdata(L, 1));
 
     lua_pop(L, 1);
 
@@ -390,13 +364,14 @@ int draw_lua_glBindBuffer(struct draw_data *data, lua_State *L) {
 }
 
 int draw_lua_glBufferData(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLenum target = get_integer_arg(L);
     GLsizeiptr size = get_integer_arg(L);
     GLenum usage = get_integer_arg(L);
 
     glBufferData(target, size, NULL, usage);
+    memory_gpu_alloc_lua(data->memory, MEMORY_GPU_BUFFER,
+                         handle_bound_buffer(&data->handles, target), size,
+                         usage, L);
 
     return 0;
 }
@@ -440,37 +415,28 @@ int draw_lua_BufferSubUnsignedIntData(struct draw_data *data, lua_State *L) {
 }
 
 int draw_lua_CreateVertexArray(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLuint vertex_array;
 
     glGenVertexArrays(1, &vertex_array);
 
-    lua_pushlightuserdata(L, (void*)(intptr_t)vertex_array);
+    handle_push(L, &data->handles, HANDLE_VERTEX_ARRAY, vertex_array);
 
     return 1;
 }
 
 int draw_lua_DeleteVertexArray(struct draw_data *data, lua_State *L) {
-    (void)data;
-
-    GLuint vertex_array = get_userdata_arg(L);
-
-    glDeleteVertexArrays(1, &vertex_array);
+    handle_delete(L, &data->handles, 1, HANDLE_VERTEX_ARRAY);
+    lua_settop(L, 0);
 
     return 0;
 }
 
 int draw_lua_glBindVertexArray(struct draw_data *data, lua_State *L) {
-    (void)data;
+    GLuint vertex_array = handle_check(L, &data->handles, 1,
+                                       HANDLE_VERTEX_ARRAY);
 
-    if (lua_isnil(L, 1)) {
-        glBindVertexArray(0);
-    } else {
-        GLuint vertex_array = (GLuint)lua_touserdata(L, 1);
-
-        glBindVertexArray(vertex_array);
-    }
+    glBindVertexArray(vertex_array);
+    handle_bind_vertex_array(&data->handles, lua_touserdata(L, 1));
 
     lua_pop(L, 1);
 
@@ -478,9 +444,8 @@ int draw_lua_glBindVertexArray(struct draw_data *data, lua_State *L) {
 }
 
 int draw_lua_glGetUniformLocation(struct draw_data *data, lua_State *L) {
-    (void)data;
-
-    GLuint program = get_userdata_arg(L);
+    GLuint program = handle_check(L, &data->handles, 1, HANDLE_PROGRAM);
+    lua_remove(L, 1);
     const char *name = get_string_arg(L);
 
     GLint uniform = glGetUniformLocation(program, name);
@@ -490,6 +455,25 @@ int draw_lua_glGetUniformLocation(struct draw_data *data, lua_State *L) {
     return 1;
 }
 
+// program, block name, binding. Points a uniform block at a binding index
+// for glBindBufferBase/Range. Returns false if the program has no such
+// block.
+int draw_lua_UniformBlockBinding(struct draw_data *data, lua_State *L) {
+    GLuint program = handle_check(L, &data->handles, 1, HANDLE_PROGRAM);
+    lua_remove(L, 1);
+    const char *name = get_string_arg(L);
+    GLuint binding = get_integer_arg(L);
+
+    GLuint block = glGetUniformBlockIndex(program, name);
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block, binding);
+    }
+
+    lua_pushboolean(L, block != GL_INVALID_INDEX);
+
+    return 1;
+}
+
 void (*floatUniformFunctions[4])(GLint, GLsizei, const GLfloat *) = {
     glUniform1fv,
     glUniform2fv,
@@ -514,6 +498,35 @@ int draw_lua_glUniformFloat(struct draw_data *data, lua_State *L) {
     return 0;
 }
 
+void (*intUniformFunctions[4])(GLint, GLsizei, const GLint *) = {
+    glUniform1iv,
+    glUniform2iv,
+    glUniform3iv,
+    glUniform4iv
+};
+
+// Also how samplers are pointed at texture units
+int draw_lua_glUniformInt(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    GLint location = get_userdata_arg(L);
+    lua_Integer len = get_lua_len(L, 1);
+
+    GLint values[4];
+
+    for (int i = 0; i < len; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        values[i] = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    intUniformFunctions[len - 1](location, 1, values);
+
+    return 0;
+}
+
 void (*floatMatrixUniformFunctions[3][3])(GLint, GLsizei, GLboolean, const GLfloat *) = {
     {glUniformMatrix2fv,   glUniformMatrix2x3fv, glUniformMatrix2x4fv},
     {glUniformMatrix3x2fv, glUniformMatrix3fv,   glUniformMatrix3x4fv},
@@ -539,21 +552,19 @@ int draw_lua_glUniformMatrixFloat(struct draw_data *data, lua_State *L) {
 }
 
 int draw_lua_glEnable(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLenum cap = get_integer_arg(L);
 
     glEnable(cap);
+    draw_set_capability(data, cap, 1);
 
     return 0;
 }
 
 int draw_lua_glDisable(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLenum cap = get_integer_arg(L);
 
     glDisable(cap);
+    draw_set_capability(data, cap, 0);
 
     return 0;
 }
@@ -600,11 +611,21 @@ int draw_lua_glDepthRange(struct draw_data *data, lua_State *L) {
 }
 
 int draw_lua_glDepthMask(struct draw_data *data, lua_State *L) {
-    (void)data;
-
     GLboolean flag = get_integer_arg(L);
 
     glDepthMask(flag);
+    data->depth_mask = flag;
+
+    return 0;
+}
+
+int draw_lua_glBlendFunc(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    GLenum source = get_integer_arg(L);
+    GLenum destination = get_integer_arg(L);
+
+    glBlendFunc(source, destination);
 
     return 0;
 }
@@ -617,13 +638,19 @@ int draw_lua_SDL_GL_SwapWindow(struct draw_data *data, lua_State *L) {
     return 0;
 }
 
-#define REGISTER_FUNC(func) \
-    register_drawfunction(L, draw_lua_ ## func, draw, "draw_" #func)
-// E.g. register_drawfunction(L, draw_lua_glClear, draw, "draw_glClear")
+// Captures the given number of frames from the next one, into the trace
+// armed by the gl_capture global
+int draw_lua_CaptureFrames(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    int count = get_integer_arg(L);
 
-#define REGISTER_CONST(val) \
-    register_drawconst(L, val, "draw_" #val)
-// E.g. register_drawconst(L, GL_TRUE, "draw_GL_TRUE")
+    if (capture_frames(-1, count) != 0) {
+        return luaL_error(L, "No capture armed, or one already running");
+    }
+
+    return 0;
+}
 
 void draw_interface_register(lua_State *L, struct draw_data *draw) {
     /***** FUNCTIONS *****/
@@ -643,7 +670,6 @@ void draw_interface_register(lua_State *L, struct draw_data *draw) {
     REGISTER_FUNC(glVertexAttribPointer);
 
     // Shader and Program functions
-    REGISTER_FUNC(CreateShaderFromFile);
     REGISTER_FUNC(glDeleteShader);
     REGISTER_FUNC(CreateProgramFromShaders);
     REGISTER_FUNC(glDeleteProgram);
@@ -665,7 +691,9 @@ void draw_interface_register(lua_State *L, struct draw_data *draw) {
     // Uniform functions
     REGISTER_FUNC(glGetUniformLocation);
     REGISTER_FUNC(glUniformFloat);
+    REGISTER_FUNC(glUniformInt);
     REGISTER_FUNC(glUniformMatrixFloat);
+    REGISTER_FUNC(UniformBlockBinding);
 
     // Enable/Disable functions
     REGISTER_FUNC(glEnable);
@@ -680,9 +708,15 @@ void draw_interface_register(lua_State *L, struct draw_data *draw) {
     REGISTER_FUNC(glDepthRange);
     REGISTER_FUNC(glDepthMask);
 
+    // Blending functions
+    REGISTER_FUNC(glBlendFunc);
+
     // SDL functions
     REGISTER_FUNC(SDL_GL_SwapWindow);
 
+    // Tracing
+    REGISTER_FUNC(CaptureFrames);
+
     /***** CONSTANTS *****/
     // Flags for glClear
     REGISTER_CONST(GL_COLOR_BUFFER_BIT);
@@ -812,4 +846,16 @@ void draw_interface_register(lua_State *L, struct draw_data *draw) {
     REGISTER_CONST(GL_NOTEQUAL);
     REGISTER_CONST(GL_GEQUAL);
     REGISTER_CONST(GL_ALWAYS);
+
+    // Blend factors
+    REGISTER_CONST(GL_ZERO);
+    REGISTER_CONST(GL_ONE);
+    REGISTER_CONST(GL_SRC_COLOR);
+    REGISTER_CONST(GL_ONE_MINUS_SRC_COLOR);
+    REGISTER_CONST(GL_DST_COLOR);
+    REGISTER_CONST(GL_ONE_MINUS_DST_COLOR);
+    REGISTER_CONST(GL_SRC_ALPHA);
+    REGISTER_CONST(GL_ONE_MINUS_SRC_ALPHA);
+    REGISTER_CONST(GL_DST_ALPHA);
+    REGISTER_CONST(GL_ONE_MINUS_DST_ALPHA);
 }
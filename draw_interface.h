@@ -4,6 +4,31 @@
 #include "lua.h"
 #include "draw.h"
 
+typedef int (*draw_luafunction)(struct draw_data *data, lua_State *L);
+
+// Helpers for draw functions, which take their arguments off the front of
+// the stack one at a time
+lua_Integer get_integer_arg(lua_State *);
+lua_Number get_float_arg(lua_State *);
+const char *get_string_arg(lua_State *);
+lua_Integer get_userdata_arg(lua_State *);
+lua_Integer get_lua_len(lua_State *, int);
+
+void read_into_float_array(lua_State *, int, int, float *);
+void read_into_double_array(lua_State *, int, int, double *);
+
+void register_drawfunction(lua_State *, draw_luafunction,
+                           struct draw_data *, const char *);
+void register_drawconst(lua_State *, lua_Integer, const char *);
+
+#define REGISTER_FUNC(func) \
+    register_drawfunction(L, draw_lua_ ## func, draw, "draw_" #func)
+// E.g. register_drawfunction(L, draw_lua_glClear, draw, "draw_glClear")
+
+#define REGISTER_CONST(val) \
+    register_drawconst(L, val, "draw_" #val)
+// E.g. register_drawconst(L, GL_TRUE, "draw_GL_TRUE")
+
 void draw_interface_register(lua_State *, struct draw_data *);
 
 #endif
@@ -0,0 +1,103 @@
+#include "flat_api.h"
+
+// These skip the glGetError checks done by drawfunction_wrapper. Scripts
+// that want them can still call the lua_CFunction versions.
+
+static struct draw_data *flat_draw_data;
+
+void flat_api_init(struct draw_data *data) {
+    flat_draw_data = data;
+}
+
+void ffi_glClearColor(float r, float g, float b, float a) {
+    glClearColor(r, g, b, a);
+}
+
+void ffi_glClearDepth(double depth) {
+    glClearDepth(depth);
+}
+
+void ffi_glClear(unsigned int mask) {
+    glClear(mask);
+}
+
+void ffi_glDrawArrays(unsigned int mode, int first, int count) {
+    glDrawArrays(mode, first, count);
+}
+
+void ffi_glDrawElements(unsigned int mode, int count, unsigned int type,
+                        intptr_t indices) {
+    glDrawElements(mode, count, type, (const GLvoid *)indices);
+}
+
+void ffi_glDrawElementsBaseVertex(unsigned int mode, int count,
+                                  unsigned int type, intptr_t indices,
+                                  int basevertex) {
+    glDrawElementsBaseVertex(mode, count, type, (GLvoid *)indices, basevertex);
+}
+
+void ffi_glUseProgram(void *program) {
+    glUseProgram(handle_resolve(&flat_draw_data->handles, program,
+                                HANDLE_PROGRAM));
+}
+
+void ffi_glBindVertexArray(void *vertex_array) {
+    glBindVertexArray(handle_resolve(&flat_draw_data->handles, vertex_array,
+                                     HANDLE_VERTEX_ARRAY));
+    handle_bind_vertex_array(&flat_draw_data->handles, vertex_array);
+}
+
+void ffi_glBindBuffer(unsigned int target, void *buffer) {
+    glBindBuffer(target, handle_resolve(&flat_draw_data->handles, buffer,
+                                        HANDLE_BUFFER));
+    handle_bind_buffer(&flat_draw_data->handles, target, buffer);
+}
+
+void ffi_glBufferData(unsigned int target, intptr_t size, unsigned int usage) {
+    glBufferData(target, size, NULL, usage);
+    memory_gpu_alloc(flat_draw_data->memory, MEMORY_GPU_BUFFER,
+                     handle_bound_buffer(&flat_draw_data->handles, target),
+                     size, usage, "ffi");
+}
+
+void ffi_glBufferSubData(unsigned int target, intptr_t offset, intptr_t size,
+                         const void *data) {
+    glBufferSubData(target, offset, size, data);
+}
+
+static void (*flatFloatUniformFunctions[4])(GLint, GLsizei, const GLfloat *) = {
+    glUniform1fv,
+    glUniform2fv,
+    glUniform3fv,
+    glUniform4fv
+};
+
+void ffi_glUniformFloat(void *location, int count, const float *values) {
+    flatFloatUniformFunctions[count - 1]((GLint)(intptr_t)location, 1, values);
+}
+
+static void (*flatFloatMatrixUniformFunctions[3][3])(GLint, GLsizei, GLboolean, const GLfloat *) = {
+    {glUniformMatrix2fv,   glUniformMatrix2x3fv, glUniformMatrix2x4fv},
+    {glUniformMatrix3x2fv, glUniformMatrix3fv,   glUniformMatrix3x4fv},
+    {glUniformMatrix4x2fv, glUniformMatrix4x3fv, glUniformMatrix4fv  }
+};
+
+void ffi_glUniformMatrixFloat(void *location, int width, int height,
+                              const float *values) {
+    flatFloatMatrixUniformFunctions[width - 2][height - 2](
+        (GLint)(intptr_t)location, 1, GL_FALSE, values);
+}
+
+void ffi_glEnable(unsigned int cap) {
+    glEnable(cap);
+    draw_set_capability(flat_draw_data, cap, 1);
+}
+
+void ffi_glDisable(unsigned int cap) {
+    glDisable(cap);
+    draw_set_capability(flat_draw_data, cap, 0);
+}
+
+void ffi_SDL_GL_SwapWindow(void) {
+    SDL_GL_SwapWindow(flat_draw_data->window);
+}
@@ -0,0 +1,17 @@
+#ifndef FLAT_API_H
+#define FLAT_API_H
+
+#include "draw.h"
+
+#include <stdint.h>
+
+// The functions themselves are declared in flat_api.cdef, which is shared
+// with gl_ffi.lua
+#include "flat_api.cdef"
+
+#include "mat4.h"
+
+// Gives the flat API the window to swap
+void flat_api_init(struct draw_data *);
+
+#endif
@@ -1,5 +1,10 @@
 local M = {}
 
+-- LuaJIT has the bit library instead of bit32
+if not bit32 then
+  bit32 = require 'bit'
+end
+
 -- OpenGL, misc. functions exposed from C
 copy_funcs = {
   glClearColor="clear_color",
@@ -15,6 +20,10 @@ copy_funcs = {
   glVertexAttribPointer="vertex_attrib_pointer",
 
   CreateShaderFromFile="create_shader_from_file",
+  CompileShader="compile_shader",
+  CompileShaders="compile_shaders",
+  ShadersReady="shaders_ready",
+  ShaderCacheStats="shader_cache_stats",
   glDeleteShader="delete_shader",
   CreateProgramFromShaders="create_program_from_shaders",
   glDeleteProgram="delete_program",
@@ -26,14 +35,46 @@ copy_funcs = {
   glBufferData="buffer_data",
   BufferSubDoubleData="buffer_sub_double_data",
   BufferSubUnsignedIntData="buffer_sub_unsigned_int_data",
+  BufferIndexData="buffer_index_data",
+  DrawIndexed="draw_indexed",
+
+  LiveHandles="live_handles",
+
+  LoadBufferData="load_buffer_data",
+  LoadBufferSubData="load_buffer_sub_data",
+  LoadTexture="load_texture",
+  LoadProgram="load_program",
+  LoadStatus="load_status",
+  DeleteTexture="delete_texture",
+  LoaderStats="loader_stats",
+
+  ComputeSupported="compute_supported",
+  glDispatchCompute="dispatch_compute",
+  glDispatchComputeIndirect="dispatch_compute_indirect",
+  glBindBufferBase="bind_buffer_base",
+  glBindBufferRange="bind_buffer_range",
+  glMemoryBarrier="memory_barrier",
+  GetBufferSubFloatData="get_buffer_sub_float_data",
 
   CreateVertexArray="create_vertex_array",
   DeleteVertexArray="delete_vertex_array",
   glBindVertexArray="bind_vertex_array",
 
+  CreateVertexLayout="create_vertex_layout",
+  DeleteVertexLayout="delete_vertex_layout",
+  VertexLayoutStride="vertex_layout_stride",
+  SetupVertexLayout="setup_vertex_layout",
+  BufferVertexData="buffer_vertex_data",
+
   glGetUniformLocation="get_uniform_location",
   glUniformFloat="uniform_float",
+  glUniformInt="uniform_int",
   glUniformMatrixFloat="uniform_matrix_float",
+  UniformBlockBinding="uniform_block_binding",
+  TransformUniform="transform_uniform",
+  BufferTransforms="buffer_transforms",
+  StreamParticles="stream_particles",
+  StreamPalettes="stream_palettes",
 
   glEnable="enable",
   glDisable="disable",
@@ -45,7 +86,33 @@ copy_funcs = {
   glDepthRange="depth_range",
   glDepthMask="depth_mask",
 
+  glBlendFunc="blend_func",
+
+  CreateRenderGraph="create_render_graph",
+  DeleteRenderGraph="delete_render_graph",
+  RenderGraphAttachment="render_graph_attachment",
+  RenderGraphPass="render_graph_pass",
+  CompileRenderGraph="compile_render_graph",
+  ExecuteRenderGraph="execute_render_graph",
+  RenderGraphTexture="render_graph_texture",
+
+  CreateResolutionScaler="create_resolution_scaler",
+  DeleteResolutionScaler="delete_resolution_scaler",
+  SetResolutionLimits="set_resolution_limits",
+  ResolutionBegin="resolution_begin",
+  ResolutionEnd="resolution_end",
+  ResolutionScale="resolution_scale",
+
+  GpuScopeBegin="gpu_scope_begin",
+  GpuScopeEnd="gpu_scope_end",
+  GpuScopeResults="gpu_scope_results",
+
+  MemoryStats="memory_stats",
+  MemoryReport="memory_report",
+
   SDL_GL_SwapWindow="swap_window",
+
+  CaptureFrames="capture_frames",
 }
 
 for gl_name, lua_name in pairs(copy_funcs) do
@@ -110,6 +177,37 @@ consts = {
   "TRANSFORM_FEEDBACK_BUFFER",
   "UNIFORM_BUFFER",
 
+  "R8",
+  "RG8",
+  "RGBA8",
+  "R16F",
+  "RG16F",
+  "RGBA16F",
+  "R32F",
+  "RG32F",
+  "RGBA32F",
+  "R11F_G11F_B10F",
+  "DEPTH_COMPONENT16",
+  "DEPTH_COMPONENT24",
+  "DEPTH_COMPONENT32F",
+  "DEPTH24_STENCIL8",
+  "DEPTH32F_STENCIL8",
+
+  "VERTEX_ATTRIB_ARRAY_BARRIER_BIT",
+  "ELEMENT_ARRAY_BARRIER_BIT",
+  "UNIFORM_BARRIER_BIT",
+  "TEXTURE_FETCH_BARRIER_BIT",
+  "SHADER_IMAGE_ACCESS_BARRIER_BIT",
+  "COMMAND_BARRIER_BIT",
+  "PIXEL_BUFFER_BARRIER_BIT",
+  "TEXTURE_UPDATE_BARRIER_BIT",
+  "BUFFER_UPDATE_BARRIER_BIT",
+  "FRAMEBUFFER_BARRIER_BIT",
+  "TRANSFORM_FEEDBACK_BARRIER_BIT",
+  "ATOMIC_COUNTER_BARRIER_BIT",
+  "SHADER_STORAGE_BARRIER_BIT",
+  "ALL_BARRIER_BITS",
+
   "STREAM_DRAW",
   "STREAM_READ",
   "STREAM_COPY",
@@ -171,6 +269,17 @@ consts = {
   "NOTEQUAL",
   "GEQUAL",
   "ALWAYS",
+
+  "ZERO",
+  "ONE",
+  "SRC_COLOR",
+  "ONE_MINUS_SRC_COLOR",
+  "DST_COLOR",
+  "ONE_MINUS_DST_COLOR",
+  "SRC_ALPHA",
+  "ONE_MINUS_SRC_ALPHA",
+  "DST_ALPHA",
+  "ONE_MINUS_DST_ALPHA",
 }
 
 for _, name in ipairs(consts) do
@@ -186,6 +295,16 @@ function M.with_vertex_array(vao, func)
   M.bind_vertex_array(nil)
 end
 
+-- Times func on the GPU. Results show up in gpu_scope_results() a few
+-- frames later.
+function M.with_gpu_scope(name, func)
+  M.gpu_scope_begin(name)
+
+  func()
+
+  M.gpu_scope_end()
+end
+
 function M.with_program(program, func)
   M.use_program(program)
 
@@ -194,6 +313,60 @@ function M.with_program(program, func)
   M.use_program(nil)
 end
 
+-- Budgets in bytes, any of {lua = ..., gpu = ..., buffer = ..., texture = ...}.
+-- Errors naming the first one exceeded, so a budget can't be ignored.
+function M.check_memory_budget(budget)
+  local stats = M.memory_stats()
+
+  local lua_bytes = 0
+  for _, heap in pairs(stats.lua) do
+    lua_bytes = lua_bytes + heap.bytes
+  end
+
+  local used = {
+    lua = lua_bytes,
+    gpu = stats.gpu.bytes,
+    buffer = stats.gpu.buffer.bytes,
+    texture = stats.gpu.texture.bytes,
+    renderbuffer = stats.gpu.renderbuffer.bytes,
+  }
+
+  for name, limit in pairs(budget) do
+    if used[name] and used[name] > limit then
+      error(string.format("%s memory over budget: %d bytes of %d",
+                          name, used[name], limit), 2)
+    end
+  end
+end
+
+-- Links a program from a list of {type, file name, defines}. The shaders
+-- come from the cache, and compile in parallel where the driver can.
+function M.create_program(shaders)
+  local handles = M.compile_shaders(shaders)
+
+  local program = M.create_program_from_shaders(handles)
+
+  for _, handle in ipairs(handles) do
+    M.delete_shader(handle)
+  end
+
+  return program
+end
+
+-- Inside a scheduler task, waits for a load from one of the load_
+-- functions and returns what it made. Outside one, poll load_status once a
+-- frame instead.
+function M.finish_load(ticket)
+  local done, result = M.load_status(ticket)
+  if not done then
+    coroutine.yield(function()
+      done, result = M.load_status(ticket)
+      return done
+    end)
+  end
+  return result
+end
+
 function M.with_attribs(attribs, func)
   for _, attrib in ipairs(attribs) do
     M.enable_vertex_attrib_array(attrib)
@@ -214,6 +387,13 @@ function M.with_buffer(target, buffer, func)
   M.bind_buffer(target, nil)
 end
 
+-- Under LuaJIT the hot functions are swapped for FFI calls. Everything
+-- else, and all of PUC Lua, stays on the lua_CFunction path.
+M.backend = "lua"
+if jit then
+  require('gl_ffi')(M)
+end
+
 setmetatable(
   M,
   {
@@ -0,0 +1,85 @@
+-- LuaJIT back end for gl.lua. Replaces the per-frame functions with direct
+-- FFI calls into the flat C API, which the JIT can compile through instead
+-- of going through the lua_CFunction stack protocol.
+local ffi = require 'ffi'
+
+-- flat_api.cdef, wrapped in a module by the Makefile so it's found on
+-- package.path and bundled like the scripts
+ffi.cdef(require 'flat_api_cdef')
+
+local C = ffi.C
+
+-- Scratch space for converting lua tables to C arrays
+local uniform_values = ffi.new("float[16]")
+
+local function fill_floats(dest, values, count)
+  for i = 1, count do
+    dest[i - 1] = values[i]
+  end
+end
+
+return function(M)
+  M.clear_color = C.ffi_glClearColor
+  M.clear_depth = C.ffi_glClearDepth
+  M.clear = C.ffi_glClear
+
+  M.draw_arrays = C.ffi_glDrawArrays
+  M.draw_elements = C.ffi_glDrawElements
+  M.draw_elements_base_vertex = C.ffi_glDrawElementsBaseVertex
+
+  M.use_program = C.ffi_glUseProgram
+  M.bind_vertex_array = C.ffi_glBindVertexArray
+  M.bind_buffer = C.ffi_glBindBuffer
+
+  M.buffer_data = C.ffi_glBufferData
+
+  function M.buffer_sub_double_data(target, offset, values)
+    local count = #values
+    local data = ffi.new("double[?]", count)
+    for i = 1, count do
+      data[i - 1] = values[i]
+    end
+    C.ffi_glBufferSubData(target, offset, count * 8, data)
+  end
+
+  function M.buffer_sub_unsigned_int_data(target, offset, values)
+    local count = #values
+    local data = ffi.new("unsigned int[?]", count)
+    for i = 1, count do
+      data[i - 1] = values[i]
+    end
+    C.ffi_glBufferSubData(target, offset, count * 4, data)
+  end
+
+  function M.uniform_float(location, values)
+    local count = #values
+    fill_floats(uniform_values, values, count)
+    C.ffi_glUniformFloat(location, count, uniform_values)
+  end
+
+  function M.uniform_matrix_float(location, width, height, values)
+    fill_floats(uniform_values, values, width * height)
+    C.ffi_glUniformMatrixFloat(location, width, height, uniform_values)
+  end
+
+  M.enable = C.ffi_glEnable
+  M.disable = C.ffi_glDisable
+
+  M.swap_window = C.ffi_SDL_GL_SwapWindow
+
+  -- Matrix routines working on float[16] cdata
+  M.mat4 = {
+    new = function() return ffi.new("float[16]") end,
+    identity = C.mat4_identity,
+    multiply = C.mat4_multiply,
+    translation = C.mat4_translation,
+    scaling = C.mat4_scaling,
+    rotation = C.mat4_rotation,
+    translate = C.mat4_translate,
+    scale = C.mat4_scale,
+    rotate = C.mat4_rotate,
+    from_trs = C.mat4_from_trs,
+  }
+
+  M.backend = "ffi"
+end
@@ -0,0 +1,113 @@
+-- Particles simulated by a compute shader. Positions live in a shader
+-- storage buffer that's also bound as the vertex buffer for drawing, so
+-- nothing goes back through the CPU. Needs a 4.3 context.
+local gl = require 'gl'
+
+local M = {}
+
+local GROUP_SIZE = 256
+-- vec4 position, vec4 velocity
+local PARTICLE_SIZE = 32
+
+function M.create(count, perspective_matrix, model_matrix)
+  local particles = {
+    count = count,
+    frame = 0,
+    compute_program = gl.create_program({
+      {gl.COMPUTE_SHADER, "particles.compute.glsl"},
+    }),
+    draw_program = gl.create_program({
+      {gl.VERTEX_SHADER, "particles.vertex.glsl"},
+      {gl.FRAGMENT_SHADER, "particles.fragment.glsl"},
+    }),
+    buffer = gl.create_buffer_object(),
+    vertex_array = gl.create_vertex_array(),
+  }
+
+  gl.with_buffer(
+    gl.SHADER_STORAGE_BUFFER, particles.buffer,
+    function()
+      gl.buffer_data(
+        gl.SHADER_STORAGE_BUFFER, count * PARTICLE_SIZE, gl.DYNAMIC_COPY)
+    end
+  )
+
+  gl.with_vertex_array(
+    particles.vertex_array,
+    function()
+      gl.bind_buffer(gl.ARRAY_BUFFER, particles.buffer)
+      gl.enable_vertex_attrib_array(0)
+      gl.vertex_attrib_pointer(0, 4, gl.FLOAT, gl.FALSE, PARTICLE_SIZE, 0)
+    end
+  )
+  gl.bind_buffer(gl.ARRAY_BUFFER, nil)
+
+  local program = particles.compute_program
+  particles.uniforms = {
+    count = gl.get_uniform_location(program, "count"),
+    frame = gl.get_uniform_location(program, "frame"),
+    reset = gl.get_uniform_location(program, "reset"),
+    dt = gl.get_uniform_location(program, "dt"),
+  }
+
+  gl.with_program(
+    particles.draw_program,
+    function()
+      local draw_program = particles.draw_program
+      gl.uniform_matrix_float(
+        gl.get_uniform_location(draw_program, "perspective_matrix"), 4, 4,
+        perspective_matrix)
+      gl.uniform_matrix_float(
+        gl.get_uniform_location(draw_program, "model_matrix"), 4, 4,
+        model_matrix)
+    end
+  )
+
+  return particles
+end
+
+function M.update(particles, dt)
+  local uniforms = particles.uniforms
+
+  gl.with_program(
+    particles.compute_program,
+    function()
+      gl.uniform_int(uniforms.count, {particles.count})
+      gl.uniform_int(uniforms.frame, {particles.frame})
+      gl.uniform_int(uniforms.reset, {particles.frame == 0 and 1 or 0})
+      gl.uniform_float(uniforms.dt, {dt})
+
+      gl.bind_buffer_base(gl.SHADER_STORAGE_BUFFER, 0, particles.buffer)
+      gl.dispatch_compute(math.ceil(particles.count / GROUP_SIZE), 1, 1)
+      gl.bind_buffer_base(gl.SHADER_STORAGE_BUFFER, 0, nil)
+    end
+  )
+
+  -- The draw reads what the dispatch wrote as vertex attributes
+  gl.memory_barrier(gl.VERTEX_ATTRIB_ARRAY_BARRIER_BIT)
+
+  particles.frame = particles.frame + 1
+end
+
+function M.draw(particles)
+  gl.with_program(
+    particles.draw_program,
+    function()
+      gl.with_vertex_array(
+        particles.vertex_array,
+        function()
+          gl.draw_arrays(gl.POINTS, 0, particles.count)
+        end
+      )
+    end
+  )
+end
+
+function M.delete(particles)
+  gl.delete_vertex_array(particles.vertex_array)
+  gl.delete_buffer_object(particles.buffer)
+  gl.delete_program(particles.compute_program)
+  gl.delete_program(particles.draw_program)
+end
+
+return M
@@ -0,0 +1,234 @@
+#include "gpu_timer.h"
+
+#include "draw.h"
+#include "draw_interface.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void gpu_timer_init(struct gpu_timers *timers) {
+    memset(timers, 0x0, sizeof(*timers));
+    timers->primitives_scope = -1;
+}
+
+void gpu_timer_cleanup(struct gpu_timers *timers) {
+    for (int i = 0; i < timers->scope_count; i++) {
+        struct gpu_timer_scope *scope = &timers->scopes[i];
+
+        for (int f = 0; f < GPU_TIMER_FRAMES; f++) {
+            GLuint queries[3] = {
+                scope->frames[f].begin,
+                scope->frames[f].end,
+                scope->frames[f].primitives,
+            };
+            glDeleteQueries(3, queries);
+        }
+
+        free(scope->name);
+    }
+
+    memset(timers, 0x0, sizeof(*timers));
+}
+
+static int find_scope(struct gpu_timers *timers, const char *name) {
+    for (int i = 0; i < timers->scope_count; i++) {
+        if (strcmp(timers->scopes[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    if (timers->scope_count == GPU_TIMER_MAX_SCOPES) {
+        return -1;
+    }
+
+    struct gpu_timer_scope *scope = &timers->scopes[timers->scope_count];
+    memset(scope, 0x0, sizeof(*scope));
+
+    scope->name = strdup(name);
+    scope->result_frame = -1;
+
+    for (int f = 0; f < GPU_TIMER_FRAMES; f++) {
+        GLuint queries[3];
+        glGenQueries(3, queries);
+
+        scope->frames[f].begin = queries[0];
+        scope->frames[f].end = queries[1];
+        scope->frames[f].primitives = queries[2];
+    }
+
+    log_debug("Made GPU timer scope '%s'", name);
+
+    return timers->scope_count++;
+}
+
+void gpu_timer_begin(struct gpu_timers *timers, const char *name) {
+    if (timers->depth == GPU_TIMER_MAX_DEPTH) {
+        fprintf(stderr, "GPU timer scopes nested too deeply at '%s'\n", name);
+        return;
+    }
+
+    int index = find_scope(timers, name);
+
+    // Push even for scopes we skip, so the matching end pops the right one
+    timers->stack[timers->depth++] = index;
+
+    if (index < 0) {
+        fprintf(stderr, "Too many GPU timer scopes, ignoring '%s'\n", name);
+        return;
+    }
+
+    struct gpu_timer_queries *queries =
+        &timers->scopes[index].frames[timers->frame % GPU_TIMER_FRAMES];
+
+    // Each scope gets one measurement per frame
+    if (queries->issued) {
+        timers->stack[timers->depth - 1] = -1;
+        return;
+    }
+
+    glQueryCounter(queries->begin, GL_TIMESTAMP);
+    queries->issued = 1;
+
+    if (timers->primitives_scope < 0) {
+        glBeginQuery(GL_PRIMITIVES_GENERATED, queries->primitives);
+        queries->primitives_issued = 1;
+        timers->primitives_scope = index;
+    }
+}
+
+void gpu_timer_end(struct gpu_timers *timers) {
+    if (timers->depth == 0) {
+        fprintf(stderr, "GPU timer scope ended without being started\n");
+        return;
+    }
+
+    int index = timers->stack[--timers->depth];
+    if (index < 0) {
+        return;
+    }
+
+    struct gpu_timer_queries *queries =
+        &timers->scopes[index].frames[timers->frame % GPU_TIMER_FRAMES];
+
+    glQueryCounter(queries->end, GL_TIMESTAMP);
+
+    if (timers->primitives_scope == index) {
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        timers->primitives_scope = -1;
+    }
+}
+
+const struct gpu_timer_scope *gpu_timer_find(const struct gpu_timers *timers,
+                                             const char *name) {
+    for (int i = 0; i < timers->scope_count; i++) {
+        if (strcmp(timers->scopes[i].name, name) == 0) {
+            return &timers->scopes[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Reads back a frame's queries if the GPU has finished them. Ones that
+// aren't ready are dropped rather than waited on.
+static void collect_results(struct gpu_timers *timers, long frame) {
+    int slot = frame % GPU_TIMER_FRAMES;
+
+    for (int i = 0; i < timers->scope_count; i++) {
+        struct gpu_timer_scope *scope = &timers->scopes[i];
+        struct gpu_timer_queries *queries = &scope->frames[slot];
+
+        if (!queries->issued) {
+            continue;
+        }
+
+        GLuint available = 0;
+        glGetQueryObjectuiv(queries->end, GL_QUERY_RESULT_AVAILABLE, &available);
+
+        if (available) {
+            GLuint64 begin, end;
+            glGetQueryObjectui64v(queries->begin, GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(queries->end, GL_QUERY_RESULT, &end);
+
+            scope->ms = (end - begin) / 1000000.0;
+            scope->result_frame = frame;
+
+            if (queries->primitives_issued) {
+                glGetQueryObjectuiv(queries->primitives, GL_QUERY_RESULT,
+                                    &scope->primitives);
+            }
+        }
+
+        queries->issued = 0;
+        queries->primitives_issued = 0;
+    }
+}
+
+void gpu_timer_frame_end(struct gpu_timers *timers) {
+    if (timers->depth != 0) {
+        fprintf(stderr, "%d GPU timer scopes still open at end of frame\n",
+                timers->depth);
+        while (timers->depth > 0) {
+            gpu_timer_end(timers);
+        }
+    }
+
+    timers->frame++;
+
+    // The slot we're about to reuse is the oldest one in flight
+    if (timers->frame >= GPU_TIMER_FRAMES) {
+        collect_results(timers, timers->frame - GPU_TIMER_FRAMES);
+    }
+}
+
+int draw_lua_GpuScopeBegin(struct draw_data *data, lua_State *L) {
+    const char *name = get_string_arg(L);
+
+    gpu_timer_begin(&data->gpu_timers, name);
+
+    return 0;
+}
+
+int draw_lua_GpuScopeEnd(struct draw_data *data, lua_State *L) {
+    (void)L;
+
+    gpu_timer_end(&data->gpu_timers);
+
+    return 0;
+}
+
+// Returns {name = {ms = ..., primitives = ..., frame = ...}} for every scope
+// that has a result yet
+int draw_lua_GpuScopeResults(struct draw_data *data, lua_State *L) {
+    struct gpu_timers *timers = &data->gpu_timers;
+
+    lua_newtable(L);
+
+    for (int i = 0; i < timers->scope_count; i++) {
+        struct gpu_timer_scope *scope = &timers->scopes[i];
+        if (scope->result_frame < 0) {
+            continue;
+        }
+
+        lua_createtable(L, 0, 3);
+
+        lua_pushnumber(L, scope->ms);
+        lua_setfield(L, -2, "ms");
+        lua_pushinteger(L, scope->primitives);
+        lua_setfield(L, -2, "primitives");
+        lua_pushinteger(L, scope->result_frame);
+        lua_setfield(L, -2, "frame");
+
+        lua_setfield(L, -2, scope->name);
+    }
+
+    return 1;
+}
+
+void gpu_timer_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(GpuScopeBegin);
+    REGISTER_FUNC(GpuScopeEnd);
+    REGISTER_FUNC(GpuScopeResults);
+}
@@ -0,0 +1,64 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include "lua.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+struct draw_data;
+
+// Results are read GPU_TIMER_FRAMES frames after they're issued, by which
+// point the GPU is done with them and reading doesn't stall
+#define GPU_TIMER_FRAMES 4
+#define GPU_TIMER_MAX_SCOPES 32
+#define GPU_TIMER_MAX_DEPTH 16
+
+struct gpu_timer_queries {
+    // GL_TIMESTAMP queries at the start and end of the scope. Timestamps
+    // rather than GL_TIME_ELAPSED so that scopes can nest.
+    GLuint begin;
+    GLuint end;
+    GLuint primitives;
+    int issued;
+    int primitives_issued;
+};
+
+struct gpu_timer_scope {
+    char *name;
+    struct gpu_timer_queries frames[GPU_TIMER_FRAMES];
+
+    // Latest results, in milliseconds and primitives
+    double ms;
+    GLuint primitives;
+    // Frame the latest results come from, or -1 for none yet
+    long result_frame;
+};
+
+struct gpu_timers {
+    struct gpu_timer_scope scopes[GPU_TIMER_MAX_SCOPES];
+    int scope_count;
+
+    int stack[GPU_TIMER_MAX_DEPTH];
+    int depth;
+    // Only one GL_PRIMITIVES_GENERATED query can be active, so it goes to
+    // the outermost scope
+    int primitives_scope;
+
+    long frame;
+};
+
+void gpu_timer_init(struct gpu_timers *);
+void gpu_timer_cleanup(struct gpu_timers *);
+void gpu_timer_begin(struct gpu_timers *, const char *);
+void gpu_timer_end(struct gpu_timers *);
+// The scope with the name, or NULL if it hasn't been begun yet
+const struct gpu_timer_scope *gpu_timer_find(const struct gpu_timers *,
+                                             const char *);
+// Collects whatever results are ready and moves on to the next frame's
+// queries. Called once per frame, after the swap.
+void gpu_timer_frame_end(struct gpu_timers *);
+
+void gpu_timer_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,464 @@
+#include "handle.h"
+
+#include "draw.h"
+#include "draw_interface.h"
+#include "memory_stats.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *handle_type_names[HANDLE_TYPE_COUNT] = {
+    "buffer",
+    "vertex_array",
+    "shader",
+    "program",
+};
+
+// Metatable names, kept apart from anything else in the registry
+static const char *handle_metatables[HANDLE_TYPE_COUNT] = {
+    "handle.buffer",
+    "handle.vertex_array",
+    "handle.shader",
+    "handle.program",
+};
+
+void handle_table_init(struct handle_table *table,
+                       struct memory_stats *memory) {
+    memset(table, 0x0, sizeof(*table));
+
+    table->free_list = -1;
+    table->open = 1;
+    table->memory = memory;
+}
+
+static struct handle_slot *get_slot(struct handle_table *table,
+                                    uint32_t index) {
+    if (index / HANDLE_SLAB_SIZE >= table->slab_count) {
+        return NULL;
+    }
+
+    return &table->slabs[index / HANDLE_SLAB_SIZE][index % HANDLE_SLAB_SIZE];
+}
+
+static void delete_names(struct handle_table *table, enum handle_type type,
+                         GLsizei count, const GLuint *names) {
+    switch (type) {
+    case HANDLE_BUFFER:
+        for (GLsizei i = 0; i < count; i++) {
+            memory_gpu_free(table->memory, MEMORY_GPU_BUFFER, names[i]);
+        }
+        glDeleteBuffers(count, names);
+        break;
+    case HANDLE_VERTEX_ARRAY:
+        glDeleteVertexArrays(count, names);
+        break;
+    case HANDLE_SHADER:
+        for (GLsizei i = 0; i < count; i++) {
+            glDeleteShader(names[i]);
+        }
+        break;
+    case HANDLE_PROGRAM:
+        for (GLsizei i = 0; i < count; i++) {
+            glDeleteProgram(names[i]);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void handle_flush(struct handle_table *table) {
+    for (int type = 0; type < HANDLE_TYPE_COUNT; type++) {
+        struct handle_queue *queue = &table->pending[type];
+        if (queue->count == 0) {
+            continue;
+        }
+
+        log_trace("Deleting %zu %s handles", queue->count,
+               handle_type_names[type]);
+
+        delete_names(table, type, queue->count, queue->names);
+        queue->count = 0;
+    }
+}
+
+static void queue_delete(struct handle_table *table, enum handle_type type,
+                         GLuint name) {
+    struct handle_queue *queue = &table->pending[type];
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        GLuint *names = realloc(queue->names, capacity * sizeof(*names));
+        if (!names) {
+            // Better to stall than to leak
+            delete_names(table, type, 1, &name);
+            return;
+        }
+        queue->names = names;
+        queue->capacity = capacity;
+    }
+
+    queue->names[queue->count++] = name;
+}
+
+void handle_table_cleanup(struct handle_table *table) {
+    for (int type = 0; type < HANDLE_TYPE_COUNT; type++) {
+        if (table->live[type] > 0) {
+            fprintf(stderr, "Leaked %zu %s handles\n", table->live[type],
+                    handle_type_names[type]);
+        }
+    }
+
+    for (size_t i = 0; i < table->slab_count; i++) {
+        for (size_t j = 0; j < HANDLE_SLAB_SIZE; j++) {
+            struct handle_slot *slot = &table->slabs[i][j];
+            if (slot->live && slot->owned) {
+                queue_delete(table, slot->type, slot->name);
+            }
+        }
+        free(table->slabs[i]);
+    }
+    free(table->slabs);
+
+    handle_flush(table);
+
+    for (int type = 0; type < HANDLE_TYPE_COUNT; type++) {
+        free(table->pending[type].names);
+    }
+
+    memset(table, 0x0, sizeof(*table));
+}
+
+static int32_t allocate_slot(struct handle_table *table) {
+    if (table->free_list < 0) {
+        struct handle_slot **slabs =
+            realloc(table->slabs, (table->slab_count + 1) * sizeof(*slabs));
+        if (!slabs) {
+            return -1;
+        }
+        table->slabs = slabs;
+
+        struct handle_slot *slab = calloc(HANDLE_SLAB_SIZE, sizeof(*slab));
+        if (!slab) {
+            return -1;
+        }
+        table->slabs[table->slab_count] = slab;
+
+        // Thread the new slots onto the free list in order
+        int32_t base = table->slab_count * HANDLE_SLAB_SIZE;
+        for (int32_t i = 0; i < HANDLE_SLAB_SIZE; i++) {
+            slab[i].generation = 1;
+            slab[i].next_free = i + 1 < HANDLE_SLAB_SIZE ? base + i + 1 : -1;
+        }
+        table->free_list = base;
+        table->slab_count++;
+    }
+
+    int32_t index = table->free_list;
+    table->free_list = get_slot(table, index)->next_free;
+
+    return index;
+}
+
+static void push_handle(lua_State *L, struct handle_table *table,
+                        enum handle_type type, GLuint name, int owned) {
+    int32_t index = allocate_slot(table);
+    if (index < 0) {
+        if (owned) {
+            delete_names(table, type, 1, &name);
+        }
+        luaL_error(L, "Error allocating %s handle", handle_type_names[type]);
+        return;
+    }
+
+    struct handle_slot *slot = get_slot(table, index);
+    slot->name = name;
+    slot->type = type;
+    slot->live = 1;
+    slot->owned = owned;
+    table->live[type]++;
+
+    struct handle *handle = lua_newuserdata(L, sizeof(*handle));
+    handle->index = index;
+    handle->generation = slot->generation;
+    handle->type = type;
+    handle->copy = 0;
+
+    luaL_setmetatable(L, handle_metatables[type]);
+}
+
+void handle_push(lua_State *L, struct handle_table *table,
+                 enum handle_type type, GLuint name) {
+    push_handle(L, table, type, name, 1);
+}
+
+void handle_push_borrowed(lua_State *L, struct handle_table *table,
+                          enum handle_type type, GLuint name) {
+    push_handle(L, table, type, name, 0);
+}
+
+const struct handle *handle_test(lua_State *L, int index) {
+    if (lua_type(L, index) != LUA_TUSERDATA) {
+        return NULL;
+    }
+
+    for (int type = 0; type < HANDLE_TYPE_COUNT; type++) {
+        struct handle *handle =
+            luaL_testudata(L, index, handle_metatables[type]);
+        if (handle) {
+            return handle;
+        }
+    }
+
+    return NULL;
+}
+
+void handle_push_copy(lua_State *L, const struct handle *source) {
+    struct handle *handle = lua_newuserdata(L, sizeof(*handle));
+    *handle = *source;
+    handle->copy = 1;
+
+    luaL_setmetatable(L, handle_metatables[source->type]);
+}
+
+static struct handle_slot *find_live_slot(struct handle_table *table,
+                                          const struct handle *handle) {
+    struct handle_slot *slot = get_slot(table, handle->index);
+    if (!slot || !slot->live || slot->generation != handle->generation) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+GLuint handle_resolve(struct handle_table *table, const struct handle *handle,
+                      enum handle_type type) {
+    if (!handle) {
+        return 0;
+    }
+
+    struct handle_slot *slot = find_live_slot(table, handle);
+    if (!slot || slot->type != type) {
+        fprintf(stderr, "Bad %s handle\n", handle_type_names[type]);
+        return 0;
+    }
+
+    return slot->name;
+}
+
+GLuint handle_check(lua_State *L, struct handle_table *table, int index,
+                    enum handle_type type) {
+    if (lua_isnoneornil(L, index)) {
+        return 0;
+    }
+
+    struct handle *handle = luaL_checkudata(L, index, handle_metatables[type]);
+
+    struct handle_slot *slot = find_live_slot(table, handle);
+    if (!slot) {
+        return luaL_error(L, "Use of deleted %s handle",
+                          handle_type_names[type]);
+    }
+
+    return slot->name;
+}
+
+int handle_release(struct handle_table *table, const struct handle *handle) {
+    struct handle_slot *slot = find_live_slot(table, handle);
+    if (!slot) {
+        return 1;
+    }
+
+    if (slot->owned) {
+        queue_delete(table, slot->type, slot->name);
+    }
+
+    table->live[slot->type]--;
+
+    slot->live = 0;
+    slot->name = 0;
+    slot->index_type = 0;
+    slot->element_buffer.slot = NULL;
+    slot->generation++;
+    slot->next_free = table->free_list;
+    table->free_list = handle->index;
+
+    return 0;
+}
+
+void handle_delete(lua_State *L, struct handle_table *table, int index,
+                   enum handle_type type) {
+    struct handle *handle = luaL_checkudata(L, index, handle_metatables[type]);
+
+    if (handle_release(table, handle) != 0) {
+        luaL_error(L, "%s handle deleted twice", handle_type_names[type]);
+    }
+}
+
+static int buffer_target_index(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER: return 0;
+    case GL_ATOMIC_COUNTER_BUFFER: return 1;
+    case GL_COPY_READ_BUFFER: return 2;
+    case GL_COPY_WRITE_BUFFER: return 3;
+    case GL_DISPATCH_INDIRECT_BUFFER: return 4;
+    case GL_DRAW_INDIRECT_BUFFER: return 5;
+    case GL_PIXEL_PACK_BUFFER: return 6;
+    case GL_PIXEL_UNPACK_BUFFER: return 7;
+    case GL_QUERY_BUFFER: return 8;
+    case GL_SHADER_STORAGE_BUFFER: return 9;
+    case GL_TEXTURE_BUFFER: return 10;
+    case GL_TRANSFORM_FEEDBACK_BUFFER: return 11;
+    case GL_UNIFORM_BUFFER: return 12;
+    default: return -1;
+    }
+}
+
+static void set_ref(struct handle_ref *ref, struct handle_slot *slot) {
+    ref->slot = slot;
+    ref->generation = slot ? slot->generation : 0;
+}
+
+// The slot, if it's still the object that was bound
+static struct handle_slot *ref_slot(const struct handle_ref *ref,
+                                    enum handle_type type) {
+    struct handle_slot *slot = ref->slot;
+    if (!slot || !slot->live || slot->generation != ref->generation ||
+        slot->type != type) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+// As in GL, the element array buffer binding is part of the vertex array
+static struct handle_ref *element_binding(struct handle_table *table) {
+    struct handle_slot *vertex_array =
+        ref_slot(&table->bound_vertex_array, HANDLE_VERTEX_ARRAY);
+
+    return vertex_array ? &vertex_array->element_buffer :
+                          &table->element_buffer;
+}
+
+static struct handle_ref *buffer_binding(struct handle_table *table,
+                                         GLenum target) {
+    if (target == GL_ELEMENT_ARRAY_BUFFER) {
+        return element_binding(table);
+    }
+
+    int index = buffer_target_index(target);
+    return index < 0 ? NULL : &table->bound_buffers[index];
+}
+
+void handle_bind_buffer(struct handle_table *table, GLenum target,
+                        const struct handle *handle) {
+    struct handle_ref *ref = buffer_binding(table, target);
+    if (ref) {
+        set_ref(ref, handle ? find_live_slot(table, handle) : NULL);
+    }
+}
+
+void handle_bind_vertex_array(struct handle_table *table,
+                              const struct handle *handle) {
+    set_ref(&table->bound_vertex_array,
+            handle ? find_live_slot(table, handle) : NULL);
+}
+
+GLuint handle_bound_buffer(struct handle_table *table, GLenum target) {
+    struct handle_ref *ref = buffer_binding(table, target);
+    struct handle_slot *slot = ref ? ref_slot(ref, HANDLE_BUFFER) : NULL;
+
+    return slot ? slot->name : 0;
+}
+
+void handle_set_index_type(struct handle_table *table, GLenum target,
+                           GLenum type) {
+    struct handle_ref *ref = buffer_binding(table, target);
+    struct handle_slot *slot = ref ? ref_slot(ref, HANDLE_BUFFER) : NULL;
+
+    if (slot) {
+        slot->index_type = type;
+    }
+}
+
+GLenum handle_index_type(struct handle_table *table) {
+    struct handle_slot *slot =
+        ref_slot(element_binding(table), HANDLE_BUFFER);
+
+    return slot && slot->index_type ? slot->index_type : GL_UNSIGNED_INT;
+}
+
+void handle_bind_texture(struct handle_table *table, GLuint texture) {
+    table->texture = texture;
+}
+
+void handle_restore_bindings(struct handle_table *table) {
+    struct handle_slot *vertex_array =
+        ref_slot(&table->bound_vertex_array, HANDLE_VERTEX_ARRAY);
+
+    glBindVertexArray(vertex_array ? vertex_array->name : 0);
+    glBindBuffer(GL_ARRAY_BUFFER,
+                 handle_bound_buffer(table, GL_ARRAY_BUFFER));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, table->texture);
+}
+
+static int handle_gc(lua_State *L) {
+    struct handle_table *table = lua_touserdata(L, lua_upvalueindex(1));
+    struct handle *handle = lua_touserdata(L, 1);
+
+    // After cleanup the context is gone, and everything was deleted already.
+    // Copies leave the object to the handle that made it.
+    if (table->open && !handle->copy) {
+        handle_release(table, handle);
+    }
+
+    return 0;
+}
+
+static int handle_tostring(lua_State *L) {
+    struct handle_table *table = lua_touserdata(L, lua_upvalueindex(1));
+    struct handle *handle = lua_touserdata(L, 1);
+
+    struct handle_slot *slot = table->open ? find_live_slot(table, handle) :
+                                             NULL;
+    if (slot) {
+        lua_pushfstring(L, "%s: %d", handle_type_names[handle->type],
+                        (int)slot->name);
+    } else {
+        lua_pushfstring(L, "%s: deleted", handle_type_names[handle->type]);
+    }
+
+    return 1;
+}
+
+// Number of live handles of each type, e.g. to spot leaks while running
+int draw_lua_LiveHandles(struct draw_data *data, lua_State *L) {
+    lua_createtable(L, 0, HANDLE_TYPE_COUNT);
+
+    for (int type = 0; type < HANDLE_TYPE_COUNT; type++) {
+        lua_pushinteger(L, data->handles.live[type]);
+        lua_setfield(L, -2, handle_type_names[type]);
+    }
+
+    return 1;
+}
+
+void handle_register(lua_State *L, struct draw_data *draw) {
+    for (int type = 0; type < HANDLE_TYPE_COUNT; type++) {
+        luaL_newmetatable(L, handle_metatables[type]);
+
+        lua_pushlightuserdata(L, &draw->handles);
+        lua_pushcclosure(L, handle_gc, 1);
+        lua_setfield(L, -2, "__gc");
+
+        lua_pushlightuserdata(L, &draw->handles);
+        lua_pushcclosure(L, handle_tostring, 1);
+        lua_setfield(L, -2, "__tostring");
+
+        lua_pop(L, 1);
+    }
+
+    REGISTER_FUNC(LiveHandles);
+}
@@ -0,0 +1,153 @@
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include "lua.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct draw_data;
+struct memory_stats;
+
+// GL objects handed to Lua are full userdata holding a slot index and the
+// slot's generation when the object was made. Deleting bumps the
+// generation, so a handle that outlives its object is caught instead of
+// silently naming whatever reuses the GL name.
+enum handle_type {
+    HANDLE_BUFFER,
+    HANDLE_VERTEX_ARRAY,
+    HANDLE_SHADER,
+    HANDLE_PROGRAM,
+    HANDLE_TYPE_COUNT,
+};
+
+// Userdata payload
+struct handle {
+    uint32_t index;
+    uint32_t generation;
+    uint32_t type;
+    // Set on copies decoded by the serializer. They name the object without
+    // owning it, so collecting one leaves the object alone.
+    uint32_t copy;
+};
+
+// Slots come in fixed-size slabs so they never move once handed out
+#define HANDLE_SLAB_SIZE 256
+
+// Buffer targets whose bindings are shadowed, besides the element array
+// buffer, which belongs to the bound vertex array
+#define HANDLE_BUFFER_TARGETS 13
+
+struct handle_slot;
+
+// A slot as it was when bound. Stale once the generation moves on.
+struct handle_ref {
+    struct handle_slot *slot;
+    uint32_t generation;
+};
+
+struct handle_slot {
+    GLuint name;
+    uint32_t generation;
+    uint32_t type;
+    int live;
+    // Borrowed names belong to something else, e.g. the shader cache, and
+    // aren't deleted with the handle
+    int owned;
+    // Next slot on the free list, or -1
+    int32_t next_free;
+
+    // Buffers: the index type BufferIndexData last filled it with, or 0
+    GLenum index_type;
+    // Vertex arrays: the element array buffer bound in it
+    struct handle_ref element_buffer;
+};
+
+// GL names waiting for the end of the frame to be deleted
+struct handle_queue {
+    GLuint *names;
+    size_t count;
+    size_t capacity;
+};
+
+struct handle_table {
+    struct handle_slot **slabs;
+    size_t slab_count;
+    int32_t free_list;
+
+    struct handle_queue pending[HANDLE_TYPE_COUNT];
+    size_t live[HANDLE_TYPE_COUNT];
+
+    // Cleared at cleanup, after which finalizers leave GL alone
+    int open;
+
+    // Deleted buffers are uncounted here
+    struct memory_stats *memory;
+
+    // Bindings made through handles, so draws can find the bound buffer's
+    // index type, and uploads the buffer to count, without asking GL.
+    // Code binding raw names, e.g. C subsystems drawing their own buffers,
+    // isn't seen, and puts back what Lua had with handle_restore_bindings.
+    struct handle_ref bound_buffers[HANDLE_BUFFER_TARGETS];
+    struct handle_ref bound_vertex_array;
+    // Element array buffer bound while no vertex array is
+    struct handle_ref element_buffer;
+    // GL_TEXTURE_2D on unit 0. Lua doesn't bind textures itself, but the
+    // render graph binds a pass's first input there for its draws.
+    GLuint texture;
+};
+
+extern const char *handle_type_names[HANDLE_TYPE_COUNT];
+
+void handle_table_init(struct handle_table *, struct memory_stats *);
+// Flushes pending deletions, then reports and deletes anything still live.
+// Needs the GL context.
+void handle_table_cleanup(struct handle_table *);
+
+// Pushes a new handle owning the GL object
+void handle_push(lua_State *, struct handle_table *, enum handle_type, GLuint);
+// Pushes a new handle to a GL object owned elsewhere
+void handle_push_borrowed(lua_State *, struct handle_table *,
+                          enum handle_type, GLuint);
+// The handle at the index, or NULL if it isn't one
+const struct handle *handle_test(lua_State *, int);
+// Pushes a copy of the handle that doesn't own the object, for values
+// rebuilt from a serialized snapshot
+void handle_push_copy(lua_State *, const struct handle *);
+// GL name of the handle at the index, or 0 for nil. Errors if it's the
+// wrong type or already deleted.
+GLuint handle_check(lua_State *, struct handle_table *, int, enum handle_type);
+// Same, for callers without a lua_State. Returns 0 for bad handles.
+GLuint handle_resolve(struct handle_table *, const struct handle *,
+                      enum handle_type);
+// Queues the object for deletion. Returns 1 if the handle was already dead.
+int handle_release(struct handle_table *, const struct handle *);
+// Same for the handle at the index, erroring if it's the wrong type or
+// already deleted
+void handle_delete(lua_State *, struct handle_table *, int, enum handle_type);
+
+// Record a glBindBuffer or glBindVertexArray made with a handle, NULL for
+// unbinding
+void handle_bind_buffer(struct handle_table *, GLenum, const struct handle *);
+void handle_bind_vertex_array(struct handle_table *, const struct handle *);
+// GL name of the buffer last bound to the target through a handle, or 0
+GLuint handle_bound_buffer(struct handle_table *, GLenum);
+// Index type of the buffer bound to the target, set when it's filled
+void handle_set_index_type(struct handle_table *, GLenum, GLenum);
+// Index type of the bound element array buffer, GL_UNSIGNED_INT if unknown
+GLenum handle_index_type(struct handle_table *);
+// Record the texture the render graph bound to unit 0, or 0
+void handle_bind_texture(struct handle_table *, GLuint);
+// Rebinds the vertex array, array buffer and unit 0 texture Lua had, for C
+// code that binds raw names of its own around a draw or upload
+void handle_restore_bindings(struct handle_table *);
+// Deletes everything queued, one glDelete* per type. Called once a frame
+// after the swap.
+void handle_flush(struct handle_table *);
+
+void handle_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,202 @@
+#include "input.h"
+
+#include "log.h"
+
+#include <string.h>
+
+#define INPUT_QUEUE_MASK (INPUT_QUEUE_SIZE - 1)
+
+#define INPUT_BATCH_META "input_batch"
+
+void input_init(struct input_data *data) {
+    memset(data, 0x0, sizeof(*data));
+
+    atomic_init(&data->queue.head, 0);
+    atomic_init(&data->queue.tail, 0);
+
+    data->start = SDL_GetPerformanceCounter();
+}
+
+int input_queue_push(struct input_queue *queue, const struct input_event *event) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head - tail == INPUT_QUEUE_SIZE) {
+        return 1;
+    }
+
+    queue->events[head & INPUT_QUEUE_MASK] = *event;
+
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    return 0;
+}
+
+int input_queue_pop(struct input_queue *queue, struct input_event *event) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail == head) {
+        return 1;
+    }
+
+    *event = queue->events[tail & INPUT_QUEUE_MASK];
+
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+// Returns 0 if the event isn't one we pass on
+static int translate_event(const SDL_Event *sdl_event, struct input_event *event) {
+    switch (sdl_event->type) {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            event->type = sdl_event->type == SDL_KEYDOWN ? INPUT_KEYDOWN : INPUT_KEYUP;
+            event->data[0] = sdl_event->key.keysym.sym;
+            event->data[1] = sdl_event->key.keysym.scancode;
+            event->data[2] = sdl_event->key.keysym.mod;
+            event->data[3] = sdl_event->key.repeat;
+            return 1;
+
+        case SDL_MOUSEMOTION:
+            event->type = INPUT_MOUSEMOTION;
+            event->data[0] = sdl_event->motion.x;
+            event->data[1] = sdl_event->motion.y;
+            event->data[2] = sdl_event->motion.xrel;
+            event->data[3] = sdl_event->motion.yrel;
+            return 1;
+
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+            event->type = sdl_event->type == SDL_MOUSEBUTTONDOWN ?
+                INPUT_MOUSEBUTTONDOWN : INPUT_MOUSEBUTTONUP;
+            event->data[0] = sdl_event->button.button;
+            event->data[1] = sdl_event->button.x;
+            event->data[2] = sdl_event->button.y;
+            event->data[3] = sdl_event->button.clicks;
+            return 1;
+
+        case SDL_MOUSEWHEEL:
+            event->type = INPUT_MOUSEWHEEL;
+            event->data[0] = sdl_event->wheel.x;
+            event->data[1] = sdl_event->wheel.y;
+            event->data[2] = 0;
+            event->data[3] = 0;
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+void input_pump(struct input_data *data) {
+    // SDL stamps events in SDL_GetTicks milliseconds when it receives them,
+    // which is earlier than the pump. Carry that over to the counter.
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint32 now_ticks = SDL_GetTicks();
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+
+    SDL_Event sdl_event;
+    while (SDL_PollEvent(&sdl_event) == 1) {
+        if (sdl_event.type == SDL_QUIT) {
+            log_debug("Got quit event");
+            data->quit = 1;
+            continue;
+        }
+
+        struct input_event event;
+        if (!translate_event(&sdl_event, &event)) {
+            continue;
+        }
+
+        Uint32 age = now_ticks - sdl_event.common.timestamp;
+        if (age > now_ticks) {
+            // Stamped after now_ticks was read
+            age = 0;
+        }
+        event.timestamp = now - age * frequency / 1000;
+
+        if (input_queue_push(&data->queue, &event)) {
+            data->dropped++;
+            log_warn("Input queue full, dropped event");
+        }
+    }
+}
+
+void input_push_batch(lua_State *L, struct input_data *data) {
+    struct input_batch *batch = data->batch;
+
+    batch->count = 0;
+    while (batch->count < INPUT_QUEUE_SIZE &&
+           input_queue_pop(&data->queue, &batch->events[batch->count]) == 0) {
+        batch->count++;
+    }
+
+    data->oldest = batch->count > 0 ? batch->events[0].timestamp : 0;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, data);
+}
+
+int input_lua_batch_len(lua_State *L) {
+    struct input_batch *batch = luaL_checkudata(L, 1, INPUT_BATCH_META);
+
+    lua_pushinteger(L, batch->count);
+
+    return 1;
+}
+
+// events:get(i) returns type, time, and the four data fields of the i-th
+// event, so scripts can walk the batch without making a table per event.
+int input_lua_batch_get(lua_State *L) {
+    struct input_batch *batch = luaL_checkudata(L, 1, INPUT_BATCH_META);
+    lua_Integer i = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, i >= 1 && i <= batch->count, 2, "event index out of range");
+
+    struct input_data *data = lua_touserdata(L, lua_upvalueindex(1));
+    struct input_event *event = &batch->events[i - 1];
+
+    lua_pushinteger(L, event->type);
+    lua_pushnumber(L, (double)(event->timestamp - data->start) /
+                      SDL_GetPerformanceFrequency());
+    for (int j = 0; j < 4; j++) {
+        lua_pushinteger(L, event->data[j]);
+    }
+
+    return 6;
+}
+
+#define REGISTER_INPUT_CONST(val) \
+    lua_pushinteger(L, val); \
+    lua_setglobal(L, #val)
+
+void input_register(lua_State *L, struct input_data *data) {
+    // The batch lives in lua so that scripts can hold on to it safely. It's
+    // made once and refilled every frame.
+    struct input_batch *batch = lua_newuserdata(L, sizeof(*batch));
+    memset(batch, 0x0, sizeof(*batch));
+    data->batch = batch;
+
+    luaL_newmetatable(L, INPUT_BATCH_META);
+
+    lua_pushcfunction(L, input_lua_batch_len);
+    lua_setfield(L, -2, "__len");
+
+    lua_newtable(L);
+    lua_pushlightuserdata(L, data);
+    lua_pushcclosure(L, input_lua_batch_get, 1);
+    lua_setfield(L, -2, "get");
+    lua_setfield(L, -2, "__index");
+
+    lua_setmetatable(L, -2);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, data);
+
+    REGISTER_INPUT_CONST(INPUT_KEYDOWN);
+    REGISTER_INPUT_CONST(INPUT_KEYUP);
+    REGISTER_INPUT_CONST(INPUT_MOUSEMOTION);
+    REGISTER_INPUT_CONST(INPUT_MOUSEBUTTONDOWN);
+    REGISTER_INPUT_CONST(INPUT_MOUSEBUTTONUP);
+    REGISTER_INPUT_CONST(INPUT_MOUSEWHEEL);
+}
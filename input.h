@@ -0,0 +1,74 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "lua.h"
+
+#include <SDL2/SDL.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Must be a power of two
+#define INPUT_QUEUE_SIZE 256
+
+enum input_event_type {
+    INPUT_KEYDOWN = 1,
+    INPUT_KEYUP,
+    INPUT_MOUSEMOTION,
+    INPUT_MOUSEBUTTONDOWN,
+    INPUT_MOUSEBUTTONUP,
+    INPUT_MOUSEWHEEL,
+};
+
+// A flattened SDL event. What the fields mean depends on the type:
+//   key events:          keycode, scancode, modifiers, repeat
+//   mouse motion:        x, y, x relative, y relative
+//   mouse button events: button, x, y, clicks
+//   mouse wheel:         x, y
+struct input_event {
+    // Performance counter value at the time SDL received the event, to the
+    // millisecond
+    Uint64 timestamp;
+    uint32_t type;
+    int32_t data[4];
+};
+
+// Single producer/single consumer ring of events. The producer only writes
+// head and the consumer only writes tail, so neither side needs a lock.
+struct input_queue {
+    struct input_event events[INPUT_QUEUE_SIZE];
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+};
+
+// The events handed to one call of update()
+struct input_batch {
+    struct input_event events[INPUT_QUEUE_SIZE];
+    int count;
+};
+
+struct input_data {
+    struct input_queue queue;
+    // Performance counter value at startup, which lua timestamps are
+    // relative to
+    Uint64 start;
+    // Oldest event in the last drained batch, or 0 if it was empty
+    Uint64 oldest;
+    int quit;
+    int dropped;
+    struct input_batch *batch;
+};
+
+void input_init(struct input_data *);
+// Pulls all pending SDL events into the queue. Called once at the very
+// start of every frame.
+void input_pump(struct input_data *);
+int input_queue_push(struct input_queue *, const struct input_event *);
+int input_queue_pop(struct input_queue *, struct input_event *);
+// Moves queued events into the batch that is passed to update() and pushes
+// it onto the stack.
+void input_push_batch(lua_State *, struct input_data *);
+
+void input_register(lua_State *, struct input_data *);
+
+#endif
@@ -0,0 +1,31 @@
+local M = {}
+
+-- Input event types exposed from C
+local types = {
+  "KEYDOWN",
+  "KEYUP",
+  "MOUSEMOTION",
+  "MOUSEBUTTONDOWN",
+  "MOUSEBUTTONUP",
+  "MOUSEWHEEL",
+}
+
+for _, name in ipairs(types) do
+  M[name] = _G["INPUT_" .. name]
+end
+
+-- Iterates over the event batch passed to update(), e.g.
+--   for type, time, a, b, c, d in input.events(events) do ... end
+function M.events(batch)
+  local i = 0
+  local count = #batch
+
+  return function()
+    i = i + 1
+    if i <= count then
+      return batch:get(i)
+    end
+  end
+end
+
+return M
@@ -0,0 +1,630 @@
+#include "loader.h"
+
+#include "draw.h"
+#include "draw_interface.h"
+#include "log.h"
+#include "memory_stats.h"
+#include "shader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void free_job(struct loader_job *job) {
+    free(job->data);
+
+    for (size_t i = 0; i < job->shader_count; i++) {
+        struct loader_shader *shader = &job->shaders[i];
+
+        free(shader->file_name);
+        for (size_t j = 0; j < shader->define_count; j++) {
+            free(shader->defines[j]);
+        }
+        free(shader->defines);
+    }
+    free(job->shaders);
+
+    free(job);
+}
+
+static void print_program_log(GLuint program) {
+    GLint log_length = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_length);
+
+    GLchar *log = malloc(log_length > 0 ? log_length : 1);
+    if (!log) {
+        fprintf(stderr, "Error linking program\n");
+        return;
+    }
+    log[0] = '\0';
+    glGetProgramInfoLog(program, log_length, NULL, log);
+
+    fprintf(stderr, "Error linking program:\n%s\n", log);
+
+    free(log);
+}
+
+// Compiles the job's shaders and links them. Returns 0 if any shader
+// couldn't be read, or linking failed.
+static GLuint link_program(struct loader_job *job) {
+    GLuint *shaders = calloc(job->shader_count ? job->shader_count : 1,
+                             sizeof(*shaders));
+    if (!shaders) {
+        return 0;
+    }
+
+    GLuint program = 0;
+    size_t compiled = 0;
+    for (; compiled < job->shader_count; compiled++) {
+        struct loader_shader *shader = &job->shaders[compiled];
+
+        shaders[compiled] = shader_compile(shader->type, shader->file_name,
+                                           (const char **)shader->defines,
+                                           shader->define_count);
+        if (!shaders[compiled]) {
+            fprintf(stderr, "Error preprocessing shader %s\n",
+                    shader->file_name);
+            goto done;
+        }
+    }
+
+    program = glCreateProgram();
+    for (size_t i = 0; i < compiled; i++) {
+        glAttachShader(program, shaders[i]);
+    }
+
+    glLinkProgram(program);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE) {
+        print_program_log(program);
+    }
+
+    for (size_t i = 0; i < compiled; i++) {
+        glDetachShader(program, shaders[i]);
+    }
+
+    if (status == GL_FALSE) {
+        glDeleteProgram(program);
+        program = 0;
+    }
+
+done:
+    for (size_t i = 0; i < compiled; i++) {
+        glDeleteShader(shaders[i]);
+    }
+    free(shaders);
+
+    return program;
+}
+
+// Does the GL work in whichever context is current
+static void run_job(struct loader_job *job) {
+    switch (job->type) {
+    case LOADER_BUFFER_DATA:
+        glBindBuffer(GL_COPY_WRITE_BUFFER, job->name);
+        glBufferData(GL_COPY_WRITE_BUFFER, job->size, job->data, job->usage);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        break;
+    case LOADER_BUFFER_SUB_DATA:
+        glBindBuffer(GL_COPY_WRITE_BUFFER, job->name);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, job->offset, job->size,
+                        job->data);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        break;
+    case LOADER_TEXTURE:
+        glGenTextures(1, &job->name);
+        glBindTexture(GL_TEXTURE_2D, job->name);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, job->width, job->height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, job->data);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        break;
+    case LOADER_PROGRAM:
+        job->name = link_program(job);
+        job->failed = job->name == 0;
+        break;
+    }
+
+    free(job->data);
+    job->data = NULL;
+}
+
+static void *loader_main(void *arg) {
+    struct loader *loader = (struct loader *)arg;
+
+    int current = SDL_GL_MakeCurrent(loader->window, loader->context) == 0;
+    if (!current) {
+        fprintf(stderr, "Error making loader context current: %s\n",
+                SDL_GetError());
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    loader->started = current ? 1 : -1;
+    pthread_cond_broadcast(&loader->work);
+
+    while (current) {
+        while (!loader->pending && !loader->quit) {
+            pthread_cond_wait(&loader->work, &loader->lock);
+        }
+        if (loader->quit) {
+            break;
+        }
+
+        struct loader_job *job = loader->pending;
+        loader->pending = job->next_pending;
+        if (!loader->pending) {
+            loader->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&loader->lock);
+
+        run_job(job);
+        GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        // The fence has to reach the GPU before another context can see it
+        // pass
+        glFlush();
+
+        pthread_mutex_lock(&loader->lock);
+        job->fence = fence;
+        job->uploaded = 1;
+    }
+
+    pthread_mutex_unlock(&loader->lock);
+
+    if (current) {
+        SDL_GL_MakeCurrent(loader->window, NULL);
+    }
+
+    return NULL;
+}
+
+void loader_init(struct loader *loader, struct memory_stats *memory) {
+    memset(loader, 0x0, sizeof(*loader));
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->work, NULL);
+    loader->memory = memory;
+}
+
+int loader_start(struct loader *loader, SDL_Window *window,
+                 SDL_GLContext context) {
+    loader->window = window;
+    loader->context = context;
+
+    if (pthread_create(&loader->thread, NULL, loader_main, loader) != 0) {
+        fprintf(stderr, "Error starting loader thread\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    while (!loader->started) {
+        pthread_cond_wait(&loader->work, &loader->lock);
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    if (loader->started < 0) {
+        pthread_join(loader->thread, NULL);
+        return 1;
+    }
+
+    loader->running = 1;
+    log_debug("Started loader thread");
+
+    return 0;
+}
+
+// Deletes what the job made, if Lua never got it
+static void delete_result(struct loader *loader, struct loader_job *job) {
+    if (!job->name) {
+        return;
+    }
+
+    if (job->type == LOADER_TEXTURE) {
+        if (job->finished) {
+            memory_gpu_free(loader->memory, MEMORY_GPU_TEXTURE, job->name);
+        }
+        glDeleteTextures(1, &job->name);
+    } else if (job->type == LOADER_PROGRAM) {
+        glDeleteProgram(job->name);
+    }
+}
+
+void loader_cleanup(struct loader *loader) {
+    if (loader->running) {
+        pthread_mutex_lock(&loader->lock);
+        loader->quit = 1;
+        pthread_cond_broadcast(&loader->work);
+        pthread_mutex_unlock(&loader->lock);
+
+        pthread_join(loader->thread, NULL);
+        SDL_GL_DeleteContext(loader->context);
+    }
+
+    struct loader_job *job = loader->jobs;
+    while (job) {
+        struct loader_job *next = job->next;
+
+        if (job->fence) {
+            glDeleteSync(job->fence);
+        }
+        delete_result(loader, job);
+        free_job(job);
+
+        job = next;
+    }
+
+    pthread_cond_destroy(&loader->work);
+    pthread_mutex_destroy(&loader->lock);
+
+    memset(loader, 0x0, sizeof(*loader));
+}
+
+// Hands the job to the thread, or runs it now without one. Captures only
+// record the render thread, so jobs stay on it while one is armed.
+static uint32_t submit(struct loader *loader, struct loader_job *job) {
+    job->id = ++loader->next_id;
+    job->submit_ns = now_ns();
+
+    job->next = loader->jobs;
+    loader->jobs = job;
+    loader->job_count++;
+
+    loader->stats.submitted++;
+    loader->stats.bytes += job->size;
+
+    if (!loader->running || capture_armed()) {
+        run_job(job);
+        job->uploaded = 1;
+        loader->stats.synchronous++;
+
+        return job->id;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->pending_tail) {
+        loader->pending_tail->next_pending = job;
+    } else {
+        loader->pending = job;
+    }
+    loader->pending_tail = job;
+    pthread_cond_signal(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+
+    return job->id;
+}
+
+static void finish_job(struct loader *loader, struct loader_job *job) {
+    job->finished = 1;
+
+    uint64_t latency = now_ns() - job->submit_ns;
+    loader->stats.finished++;
+    loader->stats.failed += job->failed;
+    loader->stats.latency_ns += latency;
+    if (latency > loader->stats.max_latency_ns) {
+        loader->stats.max_latency_ns = latency;
+    }
+
+    if (job->type == LOADER_BUFFER_DATA) {
+        memory_gpu_alloc(loader->memory, MEMORY_GPU_BUFFER, job->name,
+                         job->size, job->usage, job->site);
+    } else if (job->type == LOADER_TEXTURE) {
+        memory_gpu_alloc(loader->memory, MEMORY_GPU_TEXTURE, job->name,
+                         job->size, GL_RGBA8, job->site);
+    }
+}
+
+void loader_poll(struct loader *loader) {
+    struct loader_job **link = &loader->jobs;
+
+    while (*link) {
+        struct loader_job *job = *link;
+
+        if (!job->finished) {
+            pthread_mutex_lock(&loader->lock);
+            int uploaded = job->uploaded;
+            pthread_mutex_unlock(&loader->lock);
+
+            if (uploaded && job->fence) {
+                GLenum status = glClientWaitSync(job->fence, 0, 0);
+                if (status == GL_TIMEOUT_EXPIRED) {
+                    uploaded = 0;
+                } else {
+                    glDeleteSync(job->fence);
+                    job->fence = NULL;
+                }
+            }
+
+            if (uploaded) {
+                finish_job(loader, job);
+            }
+        }
+
+        // Buffer uploads have nothing to hand back, so they're done with
+        // once finished
+        if (job->finished && (job->type == LOADER_BUFFER_DATA ||
+                              job->type == LOADER_BUFFER_SUB_DATA)) {
+            *link = job->next;
+            loader->job_count--;
+            free_job(job);
+        } else {
+            link = &job->next;
+        }
+    }
+}
+
+static struct loader_job *new_job(struct draw_data *data, lua_State *L,
+                                  enum loader_job_type type) {
+    struct loader_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        luaL_error(L, "Error allocating load");
+        return NULL;
+    }
+
+    job->type = type;
+    job->site = memory_lua_site(data->memory, L);
+
+    return job;
+}
+
+// Copies the string at the index into the job
+static void copy_data(lua_State *L, int index, struct loader_job *job) {
+    size_t size;
+    const char *data = lua_tolstring(L, index, &size);
+
+    job->data = malloc(size ? size : 1);
+    if (!job->data) {
+        free_job(job);
+        luaL_error(L, "Error allocating %d bytes to load", (int)size);
+        return;
+    }
+
+    memcpy(job->data, data, size);
+    job->size = size;
+}
+
+// buffer, data string, usage. Replaces the buffer's storage with the bytes
+// in the string. Returns a ticket for LoadStatus.
+int draw_lua_LoadBufferData(struct draw_data *data, lua_State *L) {
+    GLuint buffer = handle_check(L, &data->handles, 1, HANDLE_BUFFER);
+    luaL_checkstring(L, 2);
+    GLenum usage = luaL_checkinteger(L, 3);
+
+    struct loader_job *job = new_job(data, L, LOADER_BUFFER_DATA);
+    job->name = buffer;
+    job->usage = usage;
+    copy_data(L, 2, job);
+
+    lua_pushinteger(L, submit(&data->loader, job));
+
+    return 1;
+}
+
+// buffer, offset in bytes, data string
+int draw_lua_LoadBufferSubData(struct draw_data *data, lua_State *L) {
+    GLuint buffer = handle_check(L, &data->handles, 1, HANDLE_BUFFER);
+    GLintptr offset = luaL_checkinteger(L, 2);
+    luaL_checkstring(L, 3);
+
+    struct loader_job *job = new_job(data, L, LOADER_BUFFER_SUB_DATA);
+    job->name = buffer;
+    job->offset = offset;
+    copy_data(L, 3, job);
+
+    lua_pushinteger(L, submit(&data->loader, job));
+
+    return 1;
+}
+
+// width, height, string of width * height RGBA8 pixels, bottom row first.
+// The texture can be used wherever a texture is taken, e.g. by sprites.
+int draw_lua_LoadTexture(struct draw_data *data, lua_State *L) {
+    lua_Integer width = luaL_checkinteger(L, 1);
+    lua_Integer height = luaL_checkinteger(L, 2);
+    size_t size;
+    luaL_checklstring(L, 3, &size);
+
+    if (width <= 0 || height <= 0 || (size_t)(width * height * 4) != size) {
+        return luaL_error(L, "Texture data for %dx%d should be %d bytes",
+                          (int)width, (int)height, (int)(width * height * 4));
+    }
+
+    struct loader_job *job = new_job(data, L, LOADER_TEXTURE);
+    job->width = width;
+    job->height = height;
+    copy_data(L, 3, job);
+
+    lua_pushinteger(L, submit(&data->loader, job));
+
+    return 1;
+}
+
+// Errors unless the entry at the top of the stack is {type, file name,
+// defines}
+static void check_shader(lua_State *L, lua_Integer entry) {
+    int top = lua_gettop(L);
+    if (lua_istable(L, top)) {
+        lua_rawgeti(L, top, 1);
+        lua_rawgeti(L, top, 2);
+        lua_rawgeti(L, top, 3);
+    }
+    if (!lua_istable(L, top) || !lua_isnumber(L, top + 1) ||
+        !lua_isstring(L, top + 2)) {
+        luaL_error(L, "Shader %d to load should be {type, file name, defines}",
+                   (int)entry);
+        return;
+    }
+
+    size_t count;
+    free(shader_read_defines(L, top + 3, &count));
+
+    lua_settop(L, top);
+}
+
+// Copies the checked entry at the top of the stack. Returns 1 out of memory.
+static int copy_shader(lua_State *L, struct loader_shader *shader) {
+    int variant = lua_gettop(L);
+    lua_rawgeti(L, variant, 1);
+    lua_rawgeti(L, variant, 2);
+    lua_rawgeti(L, variant, 3);
+    shader->type = lua_tointeger(L, variant + 1);
+    shader->file_name = strdup(lua_tostring(L, variant + 2));
+
+    size_t count;
+    const char **defines = shader_read_defines(L, variant + 3, &count);
+    shader->defines = calloc(count ? count : 1, sizeof(*shader->defines));
+
+    int failed = !shader->file_name || !shader->defines;
+    for (size_t i = 0; i < count && !failed; i++) {
+        shader->defines[i] = strdup(defines[i]);
+        failed = !shader->defines[i];
+        shader->define_count += !failed;
+    }
+    free(defines);
+
+    lua_settop(L, variant - 1);
+
+    return failed;
+}
+
+// List of {type, file name, defines}, as for CompileShaders. The shaders
+// are read, compiled and linked on the loader thread, and skip the shader
+// cache. LoadStatus hands back a program handle.
+int draw_lua_LoadProgram(struct draw_data *data, lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer count = get_lua_len(L, 1);
+
+    // Every entry is checked before anything is allocated, so the errors
+    // can't leak the job
+    for (lua_Integer i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        check_shader(L, i + 1);
+        lua_pop(L, 1);
+    }
+
+    struct loader_job *job = new_job(data, L, LOADER_PROGRAM);
+    job->shaders = calloc(count > 0 ? count : 1, sizeof(*job->shaders));
+    int failed = !job->shaders;
+
+    for (lua_Integer i = 0; i < count && !failed; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        job->shader_count++;
+        failed = copy_shader(L, &job->shaders[i]);
+    }
+
+    if (failed) {
+        free_job(job);
+        return luaL_error(L, "Error allocating load");
+    }
+
+    lua_pushinteger(L, submit(&data->loader, job));
+
+    return 1;
+}
+
+// ticket. Returns whether the load is done, and then for textures the
+// texture and for programs a program handle. Each result is handed out
+// once, after which the ticket reads as done with nothing.
+int draw_lua_LoadStatus(struct draw_data *data, lua_State *L) {
+    struct loader *loader = &data->loader;
+    lua_Integer id = luaL_checkinteger(L, 1);
+    if (id <= 0 || id > loader->next_id) {
+        return luaL_error(L, "Unknown load %d", (int)id);
+    }
+
+    loader_poll(loader);
+
+    struct loader_job **link = &loader->jobs;
+    while (*link && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+
+    struct loader_job *job = *link;
+    if (!job) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (!job->finished) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    *link = job->next;
+    loader->job_count--;
+
+    if (job->failed) {
+        free_job(job);
+        return luaL_error(L, "Error loading program (load %d)", (int)id);
+    }
+
+    lua_pushboolean(L, 1);
+    if (job->type == LOADER_TEXTURE) {
+        lua_pushlightuserdata(L, (void *)(intptr_t)job->name);
+    } else {
+        handle_push(L, &data->handles, HANDLE_PROGRAM, job->name);
+    }
+    free_job(job);
+
+    return 2;
+}
+
+// texture from LoadTexture
+int draw_lua_DeleteTexture(struct draw_data *data, lua_State *L) {
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    GLuint texture = (GLuint)(intptr_t)lua_touserdata(L, 1);
+
+    memory_gpu_free(data->memory, MEMORY_GPU_TEXTURE, texture);
+    glDeleteTextures(1, &texture);
+
+    return 0;
+}
+
+static void set_number(lua_State *L, const char *name, lua_Number value) {
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+}
+
+// Counts since startup, with latency from submission until the result can
+// be used
+int draw_lua_LoaderStats(struct draw_data *data, lua_State *L) {
+    struct loader *loader = &data->loader;
+    struct loader_stats *stats = &loader->stats;
+
+    loader_poll(loader);
+
+    lua_createtable(L, 0, 9);
+    lua_pushboolean(L, loader->running);
+    lua_setfield(L, -2, "threaded");
+    set_number(L, "submitted", stats->submitted);
+    set_number(L, "finished", stats->finished);
+    set_number(L, "failed", stats->failed);
+    set_number(L, "synchronous", stats->synchronous);
+    set_number(L, "in_flight", stats->submitted - stats->finished);
+    set_number(L, "bytes", stats->bytes);
+    set_number(L, "average_ms", stats->finished ?
+               stats->latency_ns / 1e6 / stats->finished : 0);
+    set_number(L, "max_ms", stats->max_latency_ns / 1e6);
+
+    return 1;
+}
+
+void loader_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(LoadBufferData);
+    REGISTER_FUNC(LoadBufferSubData);
+    REGISTER_FUNC(LoadTexture);
+    REGISTER_FUNC(LoadProgram);
+    REGISTER_FUNC(LoadStatus);
+    REGISTER_FUNC(DeleteTexture);
+    REGISTER_FUNC(LoaderStats);
+}
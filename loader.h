@@ -0,0 +1,127 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "lua.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <SDL2/SDL.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct draw_data;
+struct memory_stats;
+
+enum loader_job_type {
+    LOADER_BUFFER_DATA,
+    LOADER_BUFFER_SUB_DATA,
+    LOADER_TEXTURE,
+    LOADER_PROGRAM,
+};
+
+struct loader_shader {
+    GLenum type;
+    char *file_name;
+    char **defines;
+    size_t define_count;
+};
+
+// One upload or compile. The render thread owns the job from submission to
+// when Lua collects it; the loader thread only takes it off pending, does
+// the GL work, and sets uploaded.
+struct loader_job {
+    // All jobs Lua hasn't collected, on the render thread
+    struct loader_job *next;
+    // Waiting for the loader thread
+    struct loader_job *next_pending;
+
+    uint32_t id;
+    enum loader_job_type type;
+
+    // Buffer being filled. Textures and programs are made by the job, and
+    // put here when it's done.
+    GLuint name;
+    GLintptr offset;
+    GLenum usage;
+    GLsizei width, height;
+    // Copied from Lua, and freed once uploaded
+    void *data;
+    size_t size;
+
+    struct loader_shader *shaders;
+    size_t shader_count;
+
+    // Set under the lock by whichever thread ran the job, along with the
+    // fence the render thread waits on before using what it made
+    int uploaded;
+    int failed;
+    GLsync fence;
+    // Fence passed and counted, so Lua can have the result
+    int finished;
+
+    // Where in Lua the job was submitted, for memory stats
+    const char *site;
+    uint64_t submit_ns;
+};
+
+struct loader_stats {
+    uint64_t submitted;
+    uint64_t finished;
+    uint64_t failed;
+    uint64_t bytes;
+    // From submission to the fence passing
+    uint64_t latency_ns;
+    uint64_t max_latency_ns;
+    // Jobs run on the render thread, without the loader thread or while a
+    // capture is armed
+    uint64_t synchronous;
+};
+
+// Runs buffer and texture uploads and shader compiles on a thread with a
+// second GL context sharing objects with the main one. Each job ends with a
+// fence, and a job's result is only handed to Lua once the render thread
+// sees the fence pass, so nothing is used before the upload reaches it.
+//
+// Without the shared context, jobs run when they're submitted and are ready
+// straight away, so scripts work the same either way.
+struct loader {
+    // Set once the thread has the shared context
+    int running;
+    SDL_Window *window;
+    SDL_GLContext context;
+    pthread_t thread;
+    // Set by the thread once it's tried to make its context current: 1 if
+    // it could, -1 if not
+    int started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct loader_job *pending, *pending_tail;
+    int quit;
+
+    struct loader_job *jobs;
+    size_t job_count;
+    uint32_t next_id;
+
+    struct memory_stats *memory;
+    struct loader_stats stats;
+};
+
+void loader_init(struct loader *, struct memory_stats *);
+// Starts the thread on the context, which shares objects with the main one
+// and is the loader's from then on. Returns 1 on error, having printed why,
+// and the loader runs jobs synchronously.
+int loader_start(struct loader *, SDL_Window *, SDL_GLContext);
+// Stops the thread and deletes its context and whatever Lua didn't collect.
+// Needs the main context.
+void loader_cleanup(struct loader *);
+
+// Checks the fences of jobs the thread has finished. Render thread only.
+void loader_poll(struct loader *);
+
+void loader_register(lua_State *, struct draw_data *);
+
+#endif
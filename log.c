@@ -0,0 +1,683 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_QUEUE_MASK (LOG_QUEUE_SIZE - 1)
+// Longest line written, including the time, level and location
+#define LOG_LINE_SIZE 1024
+// How long the writer sleeps when there's nothing queued
+#define LOG_IDLE_NS 2000000
+
+static const char *level_names[LOG_OFF + 1] = {
+    "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF",
+};
+
+struct log_module log_modules[LOG_MAX_MODULES] = {
+    {.name = "other", .level = LOG_DEFAULT_LEVEL},
+};
+static atomic_int module_count = 1;
+static atomic_int default_level = LOG_DEFAULT_LEVEL;
+static pthread_mutex_t module_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct log_slot slots[LOG_QUEUE_SIZE];
+static _Alignas(64) atomic_size_t head;
+// Only the writer moves tail. log_flush reads it.
+static _Alignas(64) atomic_size_t tail;
+
+static pthread_t writer;
+static atomic_int running;
+static atomic_int quit;
+static uint64_t start_ns;
+
+static atomic_uint_fast64_t written;
+static atomic_uint_fast64_t dropped;
+// Drops not reported by the writer yet
+static atomic_uint_fast64_t unreported;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int find_module(const char *name, size_t length) {
+    int count = atomic_load_explicit(&module_count, memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        if (strncmp(log_modules[i].name, name, length) == 0 &&
+            log_modules[i].name[length] == '\0') {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int add_module(const char *name, size_t length) {
+    if (length >= LOG_MODULE_NAME_SIZE) {
+        length = LOG_MODULE_NAME_SIZE - 1;
+    }
+
+    pthread_mutex_lock(&module_lock);
+
+    int module = find_module(name, length);
+    if (module < 0) {
+        int count = atomic_load_explicit(&module_count, memory_order_relaxed);
+        if (count == LOG_MAX_MODULES) {
+            module = 0;
+        } else {
+            module = count;
+            memcpy(log_modules[module].name, name, length);
+            log_modules[module].name[length] = '\0';
+            atomic_store_explicit(&log_modules[module].level,
+                                  atomic_load(&default_level),
+                                  memory_order_relaxed);
+            // The name is written before anyone can find the module
+            atomic_store_explicit(&module_count, count + 1,
+                                  memory_order_release);
+        }
+    }
+
+    pthread_mutex_unlock(&module_lock);
+
+    return module;
+}
+
+int log_module(const char *name) {
+    return add_module(name, strlen(name));
+}
+
+// "path/render_graph.c" is the module render_graph
+int log_module_for_file(const char *file) {
+    const char *name = strrchr(file, '/');
+    name = name ? name + 1 : file;
+
+    const char *extension = strrchr(name, '.');
+    size_t length = extension ? (size_t)(extension - name) : strlen(name);
+
+    return add_module(name, length);
+}
+
+void log_set_level(int module, enum log_level level) {
+    if (module >= 0) {
+        atomic_store_explicit(&log_modules[module].level, level,
+                              memory_order_relaxed);
+        return;
+    }
+
+    pthread_mutex_lock(&module_lock);
+    atomic_store(&default_level, level);
+    int count = atomic_load_explicit(&module_count, memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        atomic_store_explicit(&log_modules[i].level, level,
+                              memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&module_lock);
+}
+
+static void fill_record(struct log_record *record, enum log_level level,
+                        int module, const char *file, int line,
+                        const char *format, const struct log_arg *args,
+                        int count) {
+    record->time_ns = now_ns();
+    record->format = format;
+    record->file = file;
+    record->line = line;
+    record->level = level;
+    record->module = module;
+    record->arg_count = count < LOG_MAX_ARGS ? count : LOG_MAX_ARGS;
+
+    // Strings are copied now, since they may not outlive the call.
+    // Whatever doesn't fit is cut short.
+    size_t used = 0;
+    for (int i = 0; i < record->arg_count; i++) {
+        record->args[i] = args[i];
+        if (args[i].type != LOG_ARG_STRING) {
+            continue;
+        }
+
+        const char *string = args[i].s ? args[i].s : "(null)";
+        size_t length = strlen(string);
+        if (length > LOG_TEXT_SIZE - 1 - used) {
+            length = LOG_TEXT_SIZE - 1 - used;
+        }
+
+        memcpy(&record->text[used], string, length);
+        record->text[used + length] = '\0';
+        record->args[i].offset = used;
+        used += length < LOG_TEXT_SIZE - 1 - used ? length + 1 : length;
+    }
+}
+
+enum length_modifier {
+    LENGTH_NONE,
+    LENGTH_HH,
+    LENGTH_H,
+    LENGTH_L,
+    LENGTH_LL,
+    LENGTH_J,
+    LENGTH_Z,
+    LENGTH_T,
+};
+
+// Integers are stored widened to 64 bits, so cut them back down to the type
+// the conversion names before printing
+static long long signed_value(uint64_t bits, enum length_modifier length) {
+    switch (length) {
+    case LENGTH_HH:
+        return (signed char)bits;
+    case LENGTH_H:
+        return (short)bits;
+    case LENGTH_NONE:
+        return (int)bits;
+    case LENGTH_L:
+    case LENGTH_Z:
+    case LENGTH_T:
+        return (long)bits;
+    default:
+        return (long long)bits;
+    }
+}
+
+static unsigned long long unsigned_value(uint64_t bits,
+                                         enum length_modifier length) {
+    switch (length) {
+    case LENGTH_HH:
+        return (unsigned char)bits;
+    case LENGTH_H:
+        return (unsigned short)bits;
+    case LENGTH_NONE:
+        return (unsigned int)bits;
+    case LENGTH_L:
+    case LENGTH_Z:
+    case LENGTH_T:
+        return (unsigned long)bits;
+    default:
+        return (unsigned long long)bits;
+    }
+}
+
+static const char *parse_length(const char *f, enum length_modifier *length) {
+    switch (*f) {
+    case 'h':
+        *length = f[1] == 'h' ? LENGTH_HH : LENGTH_H;
+        return f + (f[1] == 'h' ? 2 : 1);
+    case 'l':
+        *length = f[1] == 'l' ? LENGTH_LL : LENGTH_L;
+        return f + (f[1] == 'l' ? 2 : 1);
+    case 'j':
+        *length = LENGTH_J;
+        return f + 1;
+    case 'z':
+        *length = LENGTH_Z;
+        return f + 1;
+    case 't':
+        *length = LENGTH_T;
+        return f + 1;
+    case 'L':
+        // long double isn't stored, so %Lf prints the double it was
+        // converted to
+        *length = LENGTH_NONE;
+        return f + 1;
+    default:
+        *length = LENGTH_NONE;
+        return f;
+    }
+}
+
+// Copies digits or a * taken from the arguments into the spec
+static const char *parse_number(const char *f, char *spec, size_t *s,
+                                const struct log_record *record, int *next) {
+    if (*f == '*') {
+        int value = *next < record->arg_count ?
+                    (int)record->args[(*next)++].i : 0;
+        *s += snprintf(&spec[*s], 12, "%d", value);
+        return f + 1;
+    }
+
+    while (*f >= '0' && *f <= '9' && *s < 24) {
+        spec[(*s)++] = *f++;
+    }
+
+    return f;
+}
+
+// Does the printf conversions the log site asked for, with the argument
+// values it copied
+static size_t format_message(const struct log_record *record, char *out,
+                             size_t size) {
+    const char *f = record->format;
+    size_t used = 0;
+    int next = 0;
+
+    while (*f && used + 1 < size) {
+        if (*f != '%') {
+            out[used++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[used++] = '%';
+            f += 2;
+            continue;
+        }
+
+        // %, flags, width, precision, then the length and conversion below
+        char spec[64];
+        size_t s = 0;
+        spec[s++] = *f++;
+        while (*f && strchr("-+ #0", *f) && s < 8) {
+            spec[s++] = *f++;
+        }
+        f = parse_number(f, spec, &s, record, &next);
+        if (*f == '.') {
+            spec[s++] = *f++;
+            f = parse_number(f, spec, &s, record, &next);
+        }
+
+        enum length_modifier length;
+        f = parse_length(f, &length);
+        char conversion = *f;
+        if (!conversion) {
+            break;
+        }
+        f++;
+
+        if (next >= record->arg_count) {
+            continue;
+        }
+        const struct log_arg *arg = &record->args[next++];
+
+        int n = 0;
+        switch (conversion) {
+        case 'd':
+        case 'i':
+            memcpy(&spec[s], "lld", 4);
+            n = snprintf(&out[used], size - used, spec,
+                         signed_value(arg->u, length));
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec[s++] = 'l';
+            spec[s++] = 'l';
+            spec[s++] = conversion;
+            spec[s] = '\0';
+            n = snprintf(&out[used], size - used, spec,
+                         unsigned_value(arg->u, length));
+            break;
+        case 'c':
+            memcpy(&spec[s], "c", 2);
+            n = snprintf(&out[used], size - used, spec, (int)arg->i);
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec[s++] = conversion;
+            spec[s] = '\0';
+            n = snprintf(&out[used], size - used, spec, arg->d);
+            break;
+        case 's':
+            memcpy(&spec[s], "s", 2);
+            n = snprintf(&out[used], size - used, spec,
+                         arg->type == LOG_ARG_STRING ?
+                         &record->text[arg->offset] : "(?)");
+            break;
+        case 'p':
+            memcpy(&spec[s], "p", 2);
+            n = snprintf(&out[used], size - used, spec, arg->p);
+            break;
+        default:
+            break;
+        }
+
+        if (n > 0) {
+            used += (size_t)n < size - used ? (size_t)n : size - used - 1;
+        }
+    }
+
+    out[used] = '\0';
+
+    return used;
+}
+
+// [seconds] LEVEL file:line message, or module: message for Lua
+static size_t format_record(const struct log_record *record, char *out,
+                            size_t size) {
+    // Records from before log_init count from 0
+    double seconds = start_ns && record->time_ns > start_ns ?
+                     (record->time_ns - start_ns) / 1e9 : 0;
+
+    int n;
+    if (record->file) {
+        n = snprintf(out, size, "[%11.6f] %-5s %s:%d ",
+                     seconds, level_names[record->level], record->file,
+                     record->line);
+    } else {
+        n = snprintf(out, size, "[%11.6f] %-5s %s: ",
+                     seconds, level_names[record->level],
+                     log_modules[record->module].name);
+    }
+
+    // Leave room for the newline
+    size_t used = (size_t)n < size - 1 ? (size_t)n : size - 2;
+    if (record->format) {
+        used += format_message(record, &out[used], size - 1 - used);
+    } else {
+        size_t length = strlen(record->text);
+        if (length > size - 2 - used) {
+            length = size - 2 - used;
+        }
+        memcpy(&out[used], record->text, length);
+        used += length;
+    }
+
+    out[used++] = '\n';
+    out[used] = '\0';
+
+    return used;
+}
+
+static void write_record(const struct log_record *record) {
+    char line[LOG_LINE_SIZE];
+    size_t length = format_record(record, line, sizeof(line));
+
+    fwrite(line, 1, length, stderr);
+    atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+}
+
+// Returns the slot for the next record, or NULL if the queue is full
+static struct log_slot *claim_slot(size_t *position) {
+    size_t at = atomic_load_explicit(&head, memory_order_relaxed);
+
+    for (;;) {
+        struct log_slot *slot = &slots[at & LOG_QUEUE_MASK];
+        size_t sequence = atomic_load_explicit(&slot->sequence,
+                                               memory_order_acquire);
+        intptr_t lap = (intptr_t)sequence - (intptr_t)at;
+
+        if (lap == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &head, &at, at + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *position = at;
+                return slot;
+            }
+        } else if (lap < 0) {
+            // The writer hasn't freed this slot from the last lap
+            return NULL;
+        } else {
+            at = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+}
+
+static void publish_slot(struct log_slot *slot, size_t position) {
+    atomic_store_explicit(&slot->sequence, position + 1,
+                          memory_order_release);
+}
+
+static void count_drop(void) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&unreported, 1, memory_order_relaxed);
+}
+
+void log_write(enum log_level level, int module, const char *file, int line,
+               const char *format, const struct log_arg *args, int count) {
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        struct log_record record;
+        fill_record(&record, level, module, file, line, format, args, count);
+        write_record(&record);
+        return;
+    }
+
+    size_t position;
+    struct log_slot *slot = claim_slot(&position);
+    if (!slot) {
+        count_drop();
+        return;
+    }
+
+    fill_record(&slot->record, level, module, file, line, format, args,
+                count);
+    publish_slot(slot, position);
+}
+
+void log_write_message(enum log_level level, int module, const char *message,
+                       size_t length) {
+    struct log_record local;
+    struct log_record *record = &local;
+    struct log_slot *slot = NULL;
+    size_t position = 0;
+
+    if (atomic_load_explicit(&running, memory_order_acquire)) {
+        slot = claim_slot(&position);
+        if (!slot) {
+            count_drop();
+            return;
+        }
+        record = &slot->record;
+    }
+
+    fill_record(record, level, module, NULL, 0, NULL, NULL, 0);
+    if (length > LOG_TEXT_SIZE - 1) {
+        length = LOG_TEXT_SIZE - 1;
+    }
+    memcpy(record->text, message, length);
+    record->text[length] = '\0';
+
+    if (slot) {
+        publish_slot(slot, position);
+    } else {
+        write_record(record);
+    }
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        // Checked before draining, so everything queued before the quit
+        // gets written
+        int quitting = atomic_load_explicit(&quit, memory_order_acquire);
+        int wrote = 0;
+
+        size_t at = atomic_load_explicit(&tail, memory_order_relaxed);
+        for (;;) {
+            struct log_slot *slot = &slots[at & LOG_QUEUE_MASK];
+            if (atomic_load_explicit(&slot->sequence, memory_order_acquire) !=
+                at + 1) {
+                break;
+            }
+
+            write_record(&slot->record);
+            atomic_store_explicit(&slot->sequence, at + LOG_QUEUE_SIZE,
+                                  memory_order_release);
+            at++;
+            atomic_store_explicit(&tail, at, memory_order_release);
+            wrote = 1;
+        }
+
+        uint64_t lost = atomic_exchange_explicit(&unreported, 0,
+                                                 memory_order_relaxed);
+        if (lost) {
+            fprintf(stderr, "Log queue full, dropped %llu records\n",
+                    (unsigned long long)lost);
+            wrote = 1;
+        }
+
+        if (wrote) {
+            fflush(stderr);
+        } else if (quitting) {
+            break;
+        } else {
+            nanosleep(&(struct timespec){0, LOG_IDLE_NS}, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int log_init(void) {
+    for (size_t i = 0; i < LOG_QUEUE_SIZE; i++) {
+        atomic_init(&slots[i].sequence, i);
+    }
+    atomic_store(&head, 0);
+    atomic_store(&tail, 0);
+    atomic_store(&quit, 0);
+    start_ns = now_ns();
+
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "Error starting log writer, logging synchronously\n");
+        return 1;
+    }
+
+    atomic_store_explicit(&running, 1, memory_order_release);
+
+    return 0;
+}
+
+void log_shutdown(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+
+    atomic_store_explicit(&quit, 1, memory_order_release);
+    pthread_join(writer, NULL);
+    atomic_store(&running, 0);
+}
+
+void log_cleanup_wrapper(void *d) {
+    (void)d;
+
+    log_shutdown();
+}
+
+void log_flush(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+
+    size_t target = atomic_load(&head);
+    while (atomic_load_explicit(&tail, memory_order_acquire) < target) {
+        nanosleep(&(struct timespec){0, LOG_IDLE_NS / 4}, NULL);
+    }
+}
+
+static int check_module(lua_State *L, int index) {
+    lua_Integer module = luaL_checkinteger(L, index);
+    if (module < 0 || module >= atomic_load(&module_count)) {
+        luaL_error(L, "Bad log module %d", (int)module);
+    }
+
+    return module;
+}
+
+static enum log_level check_level(lua_State *L, int index) {
+    lua_Integer level = luaL_checkinteger(L, index);
+    if (level < LOG_TRACE || level > LOG_OFF) {
+        luaL_error(L, "Bad log level %d", (int)level);
+    }
+
+    return level;
+}
+
+// name. Returns the module's id, making it if needed.
+int log_lua_Module(lua_State *L) {
+    lua_pushinteger(L, log_module(luaL_checkstring(L, 1)));
+
+    return 1;
+}
+
+// module, level
+int log_lua_Enabled(lua_State *L) {
+    enum log_level level = check_level(L, 2);
+
+    lua_pushboolean(L, level >= LOG_MIN_LEVEL &&
+                       log_enabled(check_module(L, 1), level));
+
+    return 1;
+}
+
+// module, level, message. Levels compiled out of C are dropped here too.
+int log_lua_Write(lua_State *L) {
+    int module = check_module(L, 1);
+    enum log_level level = check_level(L, 2);
+    size_t length;
+    const char *message = luaL_checklstring(L, 3, &length);
+
+    if (level >= LOG_MIN_LEVEL && log_enabled(module, level)) {
+        log_write_message(level, module, message, length);
+    }
+
+    return 0;
+}
+
+// module name or nil for every module, level
+int log_lua_SetLevel(lua_State *L) {
+    enum log_level level = check_level(L, 2);
+
+    if (lua_isnil(L, 1)) {
+        log_set_level(-1, level);
+    } else {
+        log_set_level(log_module(luaL_checkstring(L, 1)), level);
+    }
+
+    return 0;
+}
+
+// module name
+int log_lua_GetLevel(lua_State *L) {
+    int module = log_module(luaL_checkstring(L, 1));
+
+    lua_pushinteger(L, atomic_load_explicit(&log_modules[module].level,
+                                            memory_order_relaxed));
+
+    return 1;
+}
+
+int log_lua_Flush(lua_State *L) {
+    (void)L;
+
+    log_flush();
+
+    return 0;
+}
+
+static void set_number(lua_State *L, const char *name, lua_Number value) {
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+}
+
+// Records written and dropped since the start, what's queued now, and the
+// compile time minimum level
+int log_lua_Stats(lua_State *L) {
+    size_t queued = atomic_load(&head) - atomic_load(&tail);
+
+    lua_createtable(L, 0, 5);
+    set_number(L, "written", atomic_load(&written));
+    set_number(L, "dropped", atomic_load(&dropped));
+    set_number(L, "queued", atomic_load(&running) ? queued : 0);
+    set_number(L, "modules", atomic_load(&module_count));
+    set_number(L, "min_level", LOG_MIN_LEVEL);
+
+    return 1;
+}
+
+void log_register(lua_State *L) {
+    lua_register(L, "log_Module", log_lua_Module);
+    lua_register(L, "log_Enabled", log_lua_Enabled);
+    lua_register(L, "log_Write", log_lua_Write);
+    lua_register(L, "log_SetLevel", log_lua_SetLevel);
+    lua_register(L, "log_GetLevel", log_lua_GetLevel);
+    lua_register(L, "log_Flush", log_lua_Flush);
+    lua_register(L, "log_Stats", log_lua_Stats);
+}
@@ -0,0 +1,226 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "lua.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum log_level {
+    LOG_TRACE,
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF,
+};
+
+// Sites below this level compile to nothing. The release build sets it to
+// LOG_INFO.
+#ifndef LOG_MIN_LEVEL
+#ifdef DEBUG
+#define LOG_MIN_LEVEL LOG_TRACE
+#else
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+#endif
+
+// Level modules start at, until changed with log_set_level. Trace is for
+// per-frame messages, so it's off unless asked for.
+#ifdef DEBUG
+#define LOG_DEFAULT_LEVEL LOG_DEBUG
+#else
+#define LOG_DEFAULT_LEVEL LOG_INFO
+#endif
+
+// Records waiting for the writer thread. Must be a power of two.
+#define LOG_QUEUE_SIZE 4096
+#define LOG_MAX_ARGS 8
+// Room in a record for its string arguments, or a message from Lua
+#define LOG_TEXT_SIZE 256
+#define LOG_MAX_MODULES 64
+#define LOG_MODULE_NAME_SIZE 32
+
+enum log_arg_type {
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING,
+};
+
+// An argument as passed at the log site. Strings are copied into the record,
+// and offset then holds where.
+struct log_arg {
+    enum log_arg_type type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void *p;
+        const char *s;
+        size_t offset;
+    };
+};
+
+// A log call as it was made: formatting waits for the writer thread. Records
+// from Lua are already formatted, and have no format.
+struct log_record {
+    uint64_t time_ns;
+    const char *format;
+    const char *file;
+    int line;
+    uint8_t level;
+    uint8_t module;
+    uint8_t arg_count;
+    struct log_arg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_SIZE];
+};
+
+// A producer claims a slot by moving head, fills it, then publishes it by
+// setting sequence to its position + 1. The writer frees it for the next
+// lap by setting sequence to position + LOG_QUEUE_SIZE.
+struct log_slot {
+    atomic_size_t sequence;
+    struct log_record record;
+};
+
+// C modules are named after their file, and made the first time the file
+// logs. Lua makes its own with log.module.
+struct log_module {
+    char name[LOG_MODULE_NAME_SIZE];
+    atomic_int level;
+};
+
+extern struct log_module log_modules[LOG_MAX_MODULES];
+
+// Starts the writer thread. Until then, and after log_shutdown, records are
+// written as they're made. Returns 1 on error, having printed why.
+int log_init(void);
+// Writes what's queued and stops the writer
+void log_shutdown(void);
+void log_cleanup_wrapper(void *);
+// Waits for the writer to catch up with everything logged so far
+void log_flush(void);
+
+// Returns the module with the name, making it if needed. Module 0 takes
+// every module past LOG_MAX_MODULES.
+int log_module(const char *);
+int log_module_for_file(const char *);
+// Level of one module, or with -1 of every module and the ones made later
+void log_set_level(int, enum log_level);
+
+// Queues a record, or drops it and counts the drop if the queue is full.
+// Called through the macros below.
+void log_write(enum log_level, int, const char *, int, const char *,
+               const struct log_arg *, int);
+void log_write_message(enum log_level, int, const char *, size_t);
+
+static inline int log_enabled(int module, enum log_level level) {
+    return (int)level >= atomic_load_explicit(&log_modules[module].level,
+                                              memory_order_relaxed);
+}
+
+// Each site looks its file's module up once
+static inline int log_site_module(atomic_int *site, const char *file) {
+    int module = atomic_load_explicit(site, memory_order_relaxed);
+    if (module < 0) {
+        module = log_module_for_file(file);
+        atomic_store_explicit(site, module, memory_order_relaxed);
+    }
+
+    return module;
+}
+
+static inline struct log_arg log_arg_int(int64_t value) {
+    return (struct log_arg){.type = LOG_ARG_INT, .i = value};
+}
+
+static inline struct log_arg log_arg_uint(uint64_t value) {
+    return (struct log_arg){.type = LOG_ARG_UINT, .u = value};
+}
+
+static inline struct log_arg log_arg_double(double value) {
+    return (struct log_arg){.type = LOG_ARG_DOUBLE, .d = value};
+}
+
+static inline struct log_arg log_arg_pointer(const void *value) {
+    return (struct log_arg){.type = LOG_ARG_POINTER, .p = value};
+}
+
+static inline struct log_arg log_arg_string(const char *value) {
+    return (struct log_arg){.type = LOG_ARG_STRING, .s = value};
+}
+
+#define LOG_ARG(x) _Generic((x), \
+    _Bool: log_arg_uint, \
+    char: log_arg_int, \
+    signed char: log_arg_int, \
+    unsigned char: log_arg_uint, \
+    short: log_arg_int, \
+    unsigned short: log_arg_uint, \
+    int: log_arg_int, \
+    unsigned int: log_arg_uint, \
+    long: log_arg_int, \
+    unsigned long: log_arg_uint, \
+    long long: log_arg_int, \
+    unsigned long long: log_arg_uint, \
+    float: log_arg_double, \
+    double: log_arg_double, \
+    char *: log_arg_string, \
+    const char *: log_arg_string, \
+    default: log_arg_pointer)(x)
+
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a ## b
+
+#define LOG_NARGS(...) \
+    LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+
+// , LOG_ARG(a), LOG_ARG(b), ... for up to LOG_MAX_ARGS arguments
+#define LOG_ARGS(...) LOG_CAT(LOG_ARGS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_ARGS_0()
+#define LOG_ARGS_1(a) , LOG_ARG(a)
+#define LOG_ARGS_2(a, ...) , LOG_ARG(a) LOG_ARGS_1(__VA_ARGS__)
+#define LOG_ARGS_3(a, ...) , LOG_ARG(a) LOG_ARGS_2(__VA_ARGS__)
+#define LOG_ARGS_4(a, ...) , LOG_ARG(a) LOG_ARGS_3(__VA_ARGS__)
+#define LOG_ARGS_5(a, ...) , LOG_ARG(a) LOG_ARGS_4(__VA_ARGS__)
+#define LOG_ARGS_6(a, ...) , LOG_ARG(a) LOG_ARGS_5(__VA_ARGS__)
+#define LOG_ARGS_7(a, ...) , LOG_ARG(a) LOG_ARGS_6(__VA_ARGS__)
+#define LOG_ARGS_8(a, ...) , LOG_ARG(a) LOG_ARGS_7(__VA_ARGS__)
+
+// Below LOG_MIN_LEVEL the whole site is dead code, kept only so the format
+// is still checked against its arguments. Above it, a disabled site costs a
+// load and a branch, and an enabled one copies its arguments without
+// formatting them.
+#define LOG_AT(level, format, ...) \
+    do { \
+        if ((level) >= LOG_MIN_LEVEL) { \
+            static atomic_int log_site_module_ = -1; \
+            int log_module_ = log_site_module(&log_site_module_, __FILE__); \
+            if (log_enabled(log_module_, (level))) { \
+                const struct log_arg log_args_[] = { \
+                    {0} LOG_ARGS(__VA_ARGS__) \
+                }; \
+                log_write((level), log_module_, __FILE__, __LINE__, \
+                          "" format, log_args_ + 1, \
+                          LOG_NARGS(__VA_ARGS__)); \
+            } \
+        } \
+        if (0) { \
+            printf(format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_trace(format, ...) LOG_AT(LOG_TRACE, format, ##__VA_ARGS__)
+#define log_debug(format, ...) LOG_AT(LOG_DEBUG, format, ##__VA_ARGS__)
+#define log_info(format, ...) LOG_AT(LOG_INFO, format, ##__VA_ARGS__)
+#define log_warn(format, ...) LOG_AT(LOG_WARN, format, ##__VA_ARGS__)
+#define log_error(format, ...) LOG_AT(LOG_ERROR, format, ##__VA_ARGS__)
+
+void log_register(lua_State *);
+
+#endif
@@ -0,0 +1,78 @@
+-- Leveled logging through the same queue and writer thread as C. Messages
+-- are only formatted when their module's level lets them through, so
+-- leaving trace calls in per-frame code costs a C call and a comparison.
+local M = {}
+
+M.TRACE = 0
+M.DEBUG = 1
+M.INFO = 2
+M.WARN = 3
+M.ERROR = 4
+M.OFF = 5
+
+M.names = {"trace", "debug", "info", "warn", "error", "off"}
+
+-- Log functions exposed from C
+local copy_funcs = {
+  Module="module",
+  Enabled="enabled",
+  Write="write",
+  GetLevel="get_level",
+  Flush="flush",
+  Stats="stats",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["log_" .. c_name]
+end
+
+local function level_number(level)
+  if type(level) == "string" then
+    for i, name in ipairs(M.names) do
+      if name == level then
+        return i - 1
+      end
+    end
+    error("Unknown log level " .. level)
+  end
+  return level
+end
+
+-- Sets the level of the named module, C or Lua, or of every module if name
+-- is nil. Levels are numbers or names, e.g. "warn".
+function M.set_level(name, level)
+  log_SetLevel(name, level_number(level))
+end
+
+local Logger = {}
+Logger.__index = Logger
+
+function Logger:log(level, format, ...)
+  if not log_Enabled(self.module, level) then
+    return
+  end
+
+  local info = debug.getinfo(3, "Sl")
+  local message = string.format(format, ...)
+  if info then
+    message = string.format("%s:%d %s", info.short_src, info.currentline,
+                            message)
+  end
+  log_Write(self.module, level, message)
+end
+
+for level, name in ipairs(M.names) do
+  if name ~= "off" then
+    Logger[name] = function(self, format, ...)
+      self:log(level - 1, format, ...)
+    end
+  end
+end
+
+-- A logger for the named module, e.g. local log = require("log").get("ai"),
+-- then log:debug("%d agents", count)
+function M.get(name)
+  return setmetatable({name = name, module = M.module(name)}, Logger)
+end
+
+return M
@@ -1,6 +1,35 @@
 #include "lua.h"
 
+#include "bundle.h"
 #include "draw_interface.h"
+#include "gpu_timer.h"
+#include "memory_stats.h"
+#include "handle.h"
+#include "shader.h"
+#include "input.h"
+#include "sprite.h"
+#include "vertex_format.h"
+#include "mesh.h"
+#include "compute.h"
+#include "transform.h"
+#include "particle_system.h"
+#include "broadphase.h"
+#include "animation.h"
+#include "text.h"
+#include "resolution.h"
+#include "voxel.h"
+#include "loader.h"
+#include "render_queue.h"
+#include "render_graph.h"
+#include "serialize.h"
+#include "stats.h"
+#include "scheduler.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 void print_lua_error(const char *prefix, lua_State *L) {
     size_t err_len;
@@ -9,30 +38,102 @@ void print_lua_error(const char *prefix, lua_State *L) {
     fprintf(stderr, "%s: %s\n", prefix, err);
 }
 
-int lua_setup(struct lua_data *data, struct draw_data *draw, const char *main_file) {
-    lua_State *L = luaL_newstate();
+static int is_bundle(const char *file_name) {
+    size_t length = strlen(file_name);
+
+    return length > 7 && strcmp(file_name + length - 7, ".bundle") == 0;
+}
+
+// The bundle is closed after the state, which may still load from it
+static void close_state(struct lua_data *data, lua_State *L) {
+    memory_close_state(data->memory, L);
+    lua_close(L);
+
+    if (data->bundle) {
+        bundle_close(data->bundle);
+        free(data->bundle);
+        data->bundle = NULL;
+    }
+}
+
+int lua_setup(struct lua_data *data, struct draw_data *draw,
+              struct input_data *input, const char *main_file) {
+    lua_State *L = memory_new_state(draw->memory, "main");
     if (!L) {
         fprintf(stderr, "Error making lua state");
         return 1;
     }
     luaL_openlibs(L);
 
+    data->memory = draw->memory;
+
+    handle_register(L, draw);
+    memory_register(L, draw);
     draw_interface_register(L, draw);
+    shader_register(L, draw);
+    sprite_interface_register(L, draw);
+    vertex_format_register(L, draw);
+    mesh_register(L, draw);
+    compute_register(L, draw);
+    gpu_timer_register(L, draw);
+    render_graph_register(L, draw);
+    transform_register(L, draw);
+    particle_system_register(L, draw);
+    animation_register(L, draw);
+    text_register(L, draw);
+    resolution_register(L, draw);
+    voxel_register(L, draw);
+    loader_register(L, draw);
+    render_queue_register(L, draw);
+    broadphase_register(L);
+    serialize_register(L);
+    stats_register(L);
+    scheduler_register(L);
+    log_register(L);
+    input_register(L, input);
+
+    data->bundle = NULL;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int load_error;
+    if (is_bundle(main_file)) {
+        data->bundle = malloc(sizeof(*data->bundle));
+        if (!data->bundle || bundle_open(data->bundle, main_file) != 0) {
+            free(data->bundle);
+            data->bundle = NULL;
+            close_state(data, L);
+            return 1;
+        }
+
+        bundle_register(L, data->bundle);
+        load_error = bundle_load_main(L, data->bundle);
+    } else {
+        load_error = luaL_loadfile(L, main_file);
+    }
 
-    int load_error = luaL_loadfile(L, main_file);
     if (load_error != LUA_OK) {
         print_lua_error("Error loading", L);
-        lua_close(L);
+        close_state(data, L);
         return 1;
     }
 
     int run_error = lua_pcall(L, 0, 0, 0);
     if (run_error != LUA_OK) {
         print_lua_error("Error running", L);
-        lua_close(L);
+        close_state(data, L);
         return 1;
     }
 
+    // Running the main file is where its requires happen, so this covers
+    // loading the whole script tree
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_info("Loaded %s in %.2f ms", main_file,
+           (end.tv_sec - start.tv_sec) * 1e3 +
+               (end.tv_nsec - start.tv_nsec) / 1e6);
+
     lua_State *L2 = lua_newthread(L);
 
     data->renderL = L;
@@ -41,8 +142,69 @@ int lua_setup(struct lua_data *data, struct draw_data *draw, const char *main_fi
     return 0;
 }
 
+void lua_opengl_version(struct lua_data *data, int *major, int *minor) {
+    lua_State *L = data->renderL;
+
+    lua_getglobal(L, "opengl_version");
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        *major = lua_tointeger(L, -2);
+        *minor = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+}
+
+void lua_window_size(struct lua_data *data, int *width, int *height) {
+    lua_State *L = data->renderL;
+
+    lua_getglobal(L, "window_size");
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        *width = lua_tointeger(L, -2);
+        *height = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+}
+
+int lua_capture_settings(struct lua_data *data, char *file, size_t size,
+                         long *start, int *frames) {
+    lua_State *L = data->renderL;
+    int found = 0;
+
+    lua_getglobal(L, "gl_capture");
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "file");
+        lua_getfield(L, -2, "start");
+        lua_getfield(L, -3, "frames");
+        if (lua_isstring(L, -3)) {
+            snprintf(file, size, "%s", lua_tostring(L, -3));
+            *start = lua_isnumber(L, -2) ? lua_tointeger(L, -2) : -1;
+            *frames = lua_tointeger(L, -1);
+            found = 1;
+        }
+        lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+
+    return found;
+}
+
+int lua_background_loads(struct lua_data *data) {
+    lua_State *L = data->renderL;
+
+    lua_getglobal(L, "background_loads");
+    int enabled = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    return enabled;
+}
+
 void lua_cleanup(struct lua_data *data) {
-    lua_close(data->renderL);
+    close_state(data, data->renderL);
 }
 
 void lua_cleanup_wrapper(void *d) {
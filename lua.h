@@ -5,14 +5,89 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#ifdef USE_LUAJIT
+// LuaJIT implements the 5.1 API plus a few 5.2 additions. Fill in the rest
+// of what we use.
+#define LUA_OK 0
+
+#define lua_rawlen lua_objlen
+
+static inline int lua_absindex(lua_State *L, int index) {
+    return (index > 0 || index <= LUA_REGISTRYINDEX) ?
+        index : lua_gettop(L) + index + 1;
+}
+
+// Only used on tables, which don't have __len in 5.1
+static inline void lua_len(lua_State *L, int index) {
+    lua_pushinteger(L, lua_objlen(L, index));
+}
+
+static inline void lua_rawgetp(lua_State *L, int index, const void *p) {
+    index = lua_absindex(L, index);
+    lua_pushlightuserdata(L, (void *)p);
+    lua_rawget(L, index);
+}
+
+static inline void lua_rawsetp(lua_State *L, int index, const void *p) {
+    index = lua_absindex(L, index);
+    lua_pushlightuserdata(L, (void *)p);
+    lua_insert(L, -2);
+    lua_rawset(L, index);
+}
+#endif
+
+#if LUA_VERSION_NUM < 504
+// 5.4 counts the values the thread yielded or returned, which before that
+// are everything left on its stack. 5.1 has no from argument either.
+static inline int lua_resume_count(lua_State *L, lua_State *from, int nargs,
+                                   int *nres) {
+#ifdef USE_LUAJIT
+    (void)from;
+    int status = lua_resume(L, nargs);
+#else
+    int status = lua_resume(L, from, nargs);
+#endif
+    *nres = lua_gettop(L);
+    return status;
+}
+#define lua_resume lua_resume_count
+#endif
+
+#if LUA_VERSION_NUM < 503
+// 5.3 added whether to strip debug information
+#define lua_dump(L, writer, data, strip) lua_dump(L, writer, data)
+#endif
+
+struct bundle;
+struct memory_stats;
+
 struct lua_data {
     lua_State *renderL;
     lua_State *updateL;
+
+    // Set when the main file is a bundle, which require then loads from
+    struct bundle *bundle;
+
+    // Where the state's heap is counted
+    struct memory_stats *memory;
 };
 
 struct draw_data;
+struct input_data;
 
-int lua_setup(struct lua_data *, struct draw_data *, const char *);
+int lua_setup(struct lua_data *, struct draw_data *, struct input_data *,
+              const char *);
+// Reads the optional opengl_version = {major, minor} global set by the main
+// file. Leaves the arguments alone if it isn't set.
+void lua_opengl_version(struct lua_data *, int *, int *);
+// Same for window_size = {width, height}
+void lua_window_size(struct lua_data *, int *, int *);
+// Reads the optional gl_capture = {file=, start=, frames=} global into the
+// file buffer, start frame (-1 when left to capture_frames from Lua) and
+// frame count. Returns whether it's set.
+int lua_capture_settings(struct lua_data *, char *, size_t, long *, int *);
+// Whether the optional background_loads global is true
+int lua_background_loads(struct lua_data *);
 void lua_cleanup(struct lua_data *);
 void lua_cleanup_wrapper(void *);
 
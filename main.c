@@ -3,7 +3,13 @@
 
 #include "lua.h"
 #include "draw.h"
-#include "debug.h"
+#include "input.h"
+#include "memory_stats.h"
+#include "stats.h"
+#ifdef USE_LUAJIT
+#include "flat_api.h"
+#endif
+#include "log.h"
 
 // pthreads
 #include <pthread.h>
@@ -89,6 +95,7 @@ void startup_lua(lua_State **LL) {
 struct thread_data {
     struct lua_data *lua_data;
     struct draw_data *draw_data;
+    struct input_data *input_data;
 };
 
 void register_cfunction(lua_State *L, lua_CFunction func,
@@ -98,8 +105,8 @@ void register_cfunction(lua_State *L, lua_CFunction func,
     lua_setglobal(L, name);
 }
 
-int update(lua_State *L) {
-    debugp("Updating...");
+int update(lua_State *L, struct input_data *input) {
+    log_trace("Updating...");
 
     lua_getglobal(L, "update");
     if (!lua_isfunction(L, -1)) {
@@ -108,7 +115,8 @@ int update(lua_State *L) {
     }
 
     lua_insert(L, -2);
-    if (handle_lua_error(lua_pcall(L, 1, 2, 0),
+    input_push_batch(L, input);
+    if (handle_lua_error(lua_pcall(L, 2, 2, 0),
                          "Error calling update", L, 0)) {
         return 1;
     }
@@ -116,13 +124,13 @@ int update(lua_State *L) {
     int done = lua_toboolean(L, -1);
     lua_pop(L, 1);
 
-    debugp("Updated. Done: %d", done);
+    log_trace("Updated. Done: %d", done);
 
     return done;
 }
 
 void render(lua_State *L) {
-    debugp("Rendering...");
+    log_trace("Rendering...");
 
     lua_getglobal(L, "render");
     if (!lua_isfunction(L, -1)) {
@@ -143,40 +151,37 @@ void transfer(struct lua_data *lua_data) {
 void update_thread(struct thread_data *d) {
     int done = 0;
 
-    unsigned int ticks = SDL_GetTicks();
-    int frame_count = 0;
+    struct frame_stats stats;
+    stats_init(&stats);
 
     while (!done) {
-        done = update(d->lua_data->updateL);
+        // Grab input before anything else so update sees it this frame
+        input_pump(d->input_data);
+
+        done = update(d->lua_data->updateL, d->input_data);
+        done = done || d->input_data->quit;
 
         transfer(d->lua_data);
 
         render(d->lua_data->renderL);
 
-        SDL_Event event;
-        while (SDL_PollEvent(&event) == 1) {
-            switch (event.type) {
-                case SDL_QUIT:
-                    debugp("Got quit event");
-                    done = 1;
-                    break;
-
-                default:
-                    break;
-            }
-        }
+        gpu_timer_frame_end(&d->draw_data->gpu_timers);
+        handle_flush(&d->draw_data->handles);
+        loader_poll(&d->draw_data->loader);
+        capture_frame_end();
+        stats_gpu_timers(&stats, &d->draw_data->gpu_timers);
 
-        frame_count++;
-        if (SDL_GetTicks() > ticks + 1000) {
-            ticks = SDL_GetTicks();
-            debugp("%d frames per second", frame_count);
-            frame_count = 0;
+        if (d->input_data->oldest != 0) {
+            stats_input_latency(&stats, SDL_GetPerformanceCounter() -
+                                        d->input_data->oldest);
         }
+
+        stats_frame_end(&stats);
     }
 }
 
 void cleanup(lua_State *L) {
-    debugp("Cleaning up...");
+    log_debug("Cleaning up...");
 
     lua_getglobal(L, "cleanup");
     if (!lua_isfunction(L, -1)) {
@@ -191,24 +196,66 @@ void cleanup(lua_State *L) {
 
 int main(int argc, const char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <main lua file>", argv[0]);
+        fprintf(stderr, "Usage: %s <main lua file or bundle>", argv[0]);
     }
 
     int err;
 
+    // Writes queued records if the main thread exits on an error too, since
+    // the writer thread would otherwise keep the process alive
+    log_init();
+    pthread_cleanup_push(log_cleanup_wrapper, NULL);
+
     struct lua_data lua_data;
     struct draw_data draw_data;
+    struct input_data input_data;
+    struct memory_stats memory;
 
-    if ((err = lua_setup(&lua_data, &draw_data, argv[1])) != 0) {
+    input_init(&input_data);
+    memory_init(&memory);
+    draw_data.memory = &memory;
+
+    if ((err = lua_setup(&lua_data, &draw_data, &input_data, argv[1])) != 0) {
         pthread_exit(NULL);
     }
     pthread_cleanup_push(lua_cleanup_wrapper, &lua_data);
 
+    draw_data.gl_major = 3;
+    draw_data.gl_minor = 3;
+    lua_opengl_version(&lua_data, &draw_data.gl_major, &draw_data.gl_minor);
+
+    draw_data.window_width = 800;
+    draw_data.window_height = 600;
+    lua_window_size(&lua_data, &draw_data.window_width,
+                    &draw_data.window_height);
+
+    draw_data.background_loads = lua_background_loads(&lua_data);
+
     if ((err = draw_setup(&draw_data)) != 0) {
         pthread_exit(NULL);
     }
     pthread_cleanup_push(draw_cleanup_wrapper, &draw_data);
 
+#ifdef USE_LUAJIT
+    flat_api_init(&draw_data);
+#endif
+
+    char capture_file[256];
+    long capture_start;
+    int capture_count;
+    if (lua_capture_settings(&lua_data, capture_file, sizeof(capture_file),
+                             &capture_start, &capture_count)) {
+        int drawable_width, drawable_height;
+        SDL_GL_GetDrawableSize(draw_data.window, &drawable_width,
+                               &drawable_height);
+
+        if (capture_open(capture_file, draw_data.gl_major, draw_data.gl_minor,
+                         drawable_width, drawable_height) == 0 &&
+            capture_start >= 0) {
+            capture_frames(capture_start, capture_count);
+        }
+    }
+
     lua_getglobal(lua_data.renderL, "startup");
     if (!lua_isfunction(lua_data.renderL, -1)) {
         fprintf(stderr, "startup function not defined\n");
@@ -223,11 +270,27 @@ int main(int argc, const char *argv[]) {
 
     data.lua_data = &lua_data;
     data.draw_data = &draw_data;
+    data.input_data = &input_data;
 
     update_thread(&data);
 
     cleanup(lua_data.renderL);
 
+    // Finalize handles nothing refers to anymore while there's still a
+    // context, so the leak report only counts ones the script held onto
+    lua_gc(lua_data.renderL, LUA_GCCOLLECT, 0);
+
+    capture_close();
+
     pthread_cleanup_pop(1); // cleanup draw
     pthread_cleanup_pop(1); // cleanup lua
+
+    // Anything still counted now was leaked
+#ifdef DEBUG
+    log_flush();
+    memory_report(&memory, stderr);
+#endif
+    memory_cleanup(&memory);
+
+    pthread_cleanup_pop(1); // cleanup log
 }
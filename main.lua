@@ -1,6 +1,21 @@
 local gl = require 'gl'
 local util = require 'util'
-local glm = require 'glm'
+local mesh = require 'mesh'
+local transform = require 'transform'
+local gpu_particles = require 'gpu_particles'
+local particle_system = require 'particle_system'
+local resolution = require 'resolution'
+
+-- Ask for compute shaders. Falls back to 3.3 without them.
+opengl_version = {4, 3}
+
+-- Upload buffers and textures and compile programs given to the gl.load_*
+-- functions on a thread with its own GL context
+background_loads = true
+
+-- Uncomment to trace frames 120 to 179 for gl-replay. Leave start out to
+-- arm the trace and pick the frames with gl.capture_frames(count).
+-- gl_capture = {file = "frames.trace", start = 120, frames = 60}
 
 local vertex_data = {
   1.0,  1.0,  1.0, 1.0,
@@ -52,55 +67,37 @@ local index_data = {
   5, 6, 2,
 }
 
-local gl_type_data = {
-  [gl.DOUBLE] = {
-    size = 8,
-    data_func = gl.buffer_sub_double_data,
-  },
-
-  [gl.UNSIGNED_INT] = {
-    size = 4,
-    data_func = gl.buffer_sub_unsigned_int_data,
-  },
+-- Positions go up as floats and colors as normalized bytes, 20 bytes per
+-- vertex instead of 64 as doubles
+local vertex_attributes = {
+  {0, 4, gl.FLOAT, gl.FALSE},
+  {1, 4, gl.UNSIGNED_BYTE, gl.TRUE},
 }
 
-function write_arrays_to_buffer(buffer, data_type, ...)
-  local size = 0
-  local type_data = gl_type_data[data_type]
-
-  for i, array in ipairs({...}) do
-    size = size + (#array * type_data.size)
-  end
-
-  print(size)
-
-  gl.buffer_data(buffer, size, gl.STATIC_DRAW)
-
-  local position = 0
+function setup_data(vertex_layout, vertex_buffer, index_buffer)
+  local vertex_count = #vertex_data / 4
 
-  for i, array in ipairs({...}) do
-    print(i, position)
-    type_data.data_func(buffer, position, array)
-    position = position + (#array * type_data.size)
-  end
-end
+  -- The ACMR before and after is logged at debug level
+  index_data, vertex_data, color_data =
+    mesh.optimize(index_data, vertex_count, {vertex_data, 4}, {color_data, 4})
 
-function setup_data(vertex_buffer, index_buffer)
   gl.with_buffer(
     gl.ARRAY_BUFFER, vertex_buffer,
     function()
-      write_arrays_to_buffer(
+      gl.buffer_data(
         gl.ARRAY_BUFFER,
-        gl.DOUBLE,
-        vertex_data, color_data
+        vertex_count * gl.vertex_layout_stride(vertex_layout),
+        gl.STATIC_DRAW
       )
+      gl.buffer_vertex_data(
+        gl.ARRAY_BUFFER, 0, vertex_layout, vertex_data, color_data)
     end
   )
 
   gl.with_buffer(
     gl.ELEMENT_ARRAY_BUFFER, index_buffer,
     function()
-      write_arrays_to_buffer(gl.ELEMENT_ARRAY_BUFFER, gl.UNSIGNED_INT, index_data)
+      gl.buffer_index_data(gl.ELEMENT_ARRAY_BUFFER, index_data, vertex_count)
     end
   )
 end
@@ -115,17 +112,15 @@ function make_perspective_matrix(frustum_scale, z_near, z_far)
 end
 
 function startup()
-  local vertex_shader = gl.create_shader_from_file(gl.VERTEX_SHADER, "main.vertex.glsl")
-  local fragment_shader = gl.create_shader_from_file(gl.FRAGMENT_SHADER, "main.fragment.glsl")
-
-  local program = gl.create_program_from_shaders({vertex_shader, fragment_shader})
-
-  gl.delete_shader(vertex_shader)
-  gl.delete_shader(fragment_shader)
+  local program = gl.create_program({
+    {gl.VERTEX_SHADER, "main.vertex.glsl"},
+    {gl.FRAGMENT_SHADER, "main.fragment.glsl"},
+  })
 
+  local vertex_layout = gl.create_vertex_layout(vertex_attributes)
   local vertex_buffer = gl.create_buffer_object()
   local index_buffer = gl.create_buffer_object()
-  setup_data(vertex_buffer, index_buffer)
+  setup_data(vertex_layout, vertex_buffer, index_buffer)
 
   local vertex_array = gl.create_vertex_array()
   gl.with_vertex_array(
@@ -133,12 +128,7 @@ function startup()
     function()
       gl.bind_buffer(gl.ARRAY_BUFFER, vertex_buffer)
 
-      gl.enable_vertex_attrib_array(0)
-      gl.vertex_attrib_pointer(0, 4, gl.DOUBLE, gl.FALSE, 0, 0)
-
-      gl.enable_vertex_attrib_array(1)
-      gl.vertex_attrib_pointer(
-        1, 4, gl.DOUBLE, gl.FALSE, 0, #vertex_data * 8)
+      gl.setup_vertex_layout(vertex_layout, 0)
 
       gl.bind_buffer(gl.ELEMENT_ARRAY_BUFFER, index_buffer)
     end
@@ -166,10 +156,58 @@ function startup()
     end
   )
 
+  -- The model orbits a pivot in front of the camera
+  local transforms = transform.create_store()
+  local pivot = transform.create_node(transforms)
+  transform.set_translation(transforms, pivot, 0, 0, -4)
+  local model = transform.create_node(transforms, pivot)
+  transform.set_translation(transforms, model, 0, 2, 0)
+
+  -- Without compute shaders the particles are simulated on the CPU instead
+  local particle_model = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, -1, -5, 1}
+  local particles = nil
+  local cpu_particles = nil
+  if gl.compute_supported() then
+    particles = gpu_particles.create(
+      65536, make_perspective_matrix(1, 0.5, 10.0), particle_model)
+  else
+    local system = particle_system.create_system(65536)
+    particle_system.add_emitter(
+      system, {vy = 4, spread = 1.5, rate = 20000, life_min = 1, life_max = 3})
+    cpu_particles = {
+      system = system,
+      renderer = particle_system.create_renderer(
+        make_perspective_matrix(1, 0.5, 10.0), particle_model),
+    }
+  end
+
+  local render_graph = gl.create_render_graph()
+  gl.render_graph_pass(
+    render_graph, "scene", {colors = {"backbuffer"}}, draw_scene
+  )
+  if particles or cpu_particles then
+    gl.render_graph_pass(
+      render_graph, "particles", {colors = {"backbuffer"}}, draw_particles
+    )
+  end
+  gl.compile_render_graph(render_graph)
+
+  -- The scene drops below full resolution when it takes over 12 ms
+  local dynamic_resolution = resolution.create(
+    {min_scale = 0.5, max_scale = 1, target_ms = 12, sharpness = 0.5})
+
   local data = {
     counter = 1,
+    render_graph = render_graph,
+    resolution = dynamic_resolution,
+    particles = particles,
+    cpu_particles = cpu_particles,
+    transforms = transforms,
+    pivot = pivot,
+    model = model,
     program = program,
     vertex_array = vertex_array,
+    vertex_layout = vertex_layout,
     vertex_buffer = vertex_buffer,
     index_buffer = index_buffer,
     uniforms = {
@@ -180,10 +218,22 @@ function startup()
 end
 
 function cleanup(data)
+  gl.delete_render_graph(data.render_graph)
+  resolution.delete(data.resolution)
+  transform.delete_store(data.transforms)
+  if data.particles then
+    gpu_particles.delete(data.particles)
+  end
+  if data.cpu_particles then
+    particle_system.delete_renderer(data.cpu_particles.renderer)
+    particle_system.delete_system(data.cpu_particles.system)
+  end
   gl.delete_program(data.program)
 
   gl.delete_vertex_array(data.vertex_array)
+  gl.delete_vertex_layout(data.vertex_layout)
   gl.delete_buffer_object(data.vertex_buffer)
+  gl.delete_buffer_object(data.index_buffer)
 end
 
 function update(data)
@@ -196,30 +246,61 @@ function update(data)
   return new_data, (data.counter >= 1000)
 end
 
-function render(data)
+function draw_scene(pass, data)
   gl.clear_color(0.0, 0.0, 0.0, 1.0)
   gl.clear_depth(1.0);
   gl.clear(bit32.bor(gl.COLOR_BUFFER_BIT, gl.DEPTH_BUFFER_BIT))
 
-  gl.with_program(
-    data.program,
+  gl.with_gpu_scope(
+    pass,
     function()
-      gl.with_vertex_array(
-        data.vertex_array,
+      gl.with_program(
+        data.program,
         function()
-          local mat = glm.mat4(1.0)
-          mat = mat:translate(0, 0, -4)
-          mat = mat:rotate(0, 0, 1, data.counter / 100)
-          mat = mat:translate(0, 2, 0)
-          mat = mat:rotate(0, 1, 0, data.counter / 100)
-          mat:to_uniform(data.uniforms.model_matrix)
-
-          gl.draw_elements_base_vertex(
-            gl.TRIANGLES, #index_data, gl.UNSIGNED_INT, 0, 0)
+          gl.with_vertex_array(
+            data.vertex_array,
+            function()
+              local angle = data.counter / 100
+              transform.set_rotation(data.transforms, data.pivot, 0, 0, 1, angle)
+              transform.set_rotation(data.transforms, data.model, 0, 1, 0, angle)
+              transform.update(data.transforms)
+
+              gl.transform_uniform(
+                data.uniforms.model_matrix, data.transforms, data.model
+              )
+
+              gl.draw_indexed(gl.TRIANGLES, #index_data, 0, 0)
+            end
+          )
         end
       )
     end
   )
+end
+
+function draw_particles(pass, data)
+  gl.with_gpu_scope(
+    pass,
+    function()
+      if data.particles then
+        gpu_particles.update(data.particles, 1 / 60)
+        gpu_particles.draw(data.particles)
+      else
+        local cpu_particles = data.cpu_particles
+        particle_system.update(cpu_particles.system, 1 / 60)
+        particle_system.draw(cpu_particles.renderer, cpu_particles.system)
+      end
+    end
+  )
+end
+
+function render(data)
+  resolution.frame(
+    data.resolution,
+    function()
+      gl.execute_render_graph(data.render_graph, data)
+    end
+  )
 
   gl.swap_window()
 end
@@ -0,0 +1,131 @@
+#include "mat4.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+void mat4_identity(float *out) {
+    memset(out, 0x0, 16 * sizeof(*out));
+    out[0] = out[5] = out[10] = out[15] = 1.0f;
+}
+
+void mat4_multiply(float *out, const float *a, const float *b) {
+#if defined(__SSE__)
+    // Each result column is a's columns weighted by one column of b
+    __m128 a0 = _mm_loadu_ps(a + 0);
+    __m128 a1 = _mm_loadu_ps(a + 4);
+    __m128 a2 = _mm_loadu_ps(a + 8);
+    __m128 a3 = _mm_loadu_ps(a + 12);
+
+    __m128 result[4];
+    for (int col = 0; col < 4; col++) {
+        const float *b_col = b + col * 4;
+        result[col] = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(b_col[0])),
+                       _mm_mul_ps(a1, _mm_set1_ps(b_col[1]))),
+            _mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(b_col[2])),
+                       _mm_mul_ps(a3, _mm_set1_ps(b_col[3]))));
+    }
+
+    for (int col = 0; col < 4; col++) {
+        _mm_storeu_ps(out + col * 4, result[col]);
+    }
+#else
+    float result[16];
+
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 4; row++) {
+            result[col * 4 + row] =
+                a[0 * 4 + row] * b[col * 4 + 0] +
+                a[1 * 4 + row] * b[col * 4 + 1] +
+                a[2 * 4 + row] * b[col * 4 + 2] +
+                a[3 * 4 + row] * b[col * 4 + 3];
+        }
+    }
+
+    memcpy(out, result, sizeof(result));
+#endif
+}
+
+void mat4_translation(float *out, float x, float y, float z) {
+    mat4_identity(out);
+    out[12] = x;
+    out[13] = y;
+    out[14] = z;
+}
+
+void mat4_scaling(float *out, float x, float y, float z) {
+    mat4_identity(out);
+    out[0] = x;
+    out[5] = y;
+    out[10] = z;
+}
+
+void mat4_rotation(float *out, float x, float y, float z, float angle) {
+    float c = cosf(angle);
+    float s = sinf(angle);
+    float ic = 1.0f - c;
+
+    mat4_identity(out);
+
+    out[0] = x * x * ic + c;
+    out[1] = x * y * ic + z * s;
+    out[2] = x * z * ic - y * s;
+
+    out[4] = x * y * ic - z * s;
+    out[5] = y * y * ic + c;
+    out[6] = y * z * ic + x * s;
+
+    out[8] = x * z * ic + y * s;
+    out[9] = y * z * ic - x * s;
+    out[10] = z * z * ic + c;
+}
+
+void mat4_translate(float *m, float x, float y, float z) {
+    // Only the last column changes when multiplying by a translation
+    for (int row = 0; row < 4; row++) {
+        m[12 + row] += m[0 + row] * x + m[4 + row] * y + m[8 + row] * z;
+    }
+}
+
+void mat4_scale(float *m, float x, float y, float z) {
+    for (int row = 0; row < 4; row++) {
+        m[0 + row] *= x;
+        m[4 + row] *= y;
+        m[8 + row] *= z;
+    }
+}
+
+void mat4_rotate(float *m, float x, float y, float z, float angle) {
+    float rotation[16];
+    mat4_rotation(rotation, x, y, z, angle);
+    mat4_multiply(m, m, rotation);
+}
+
+void mat4_from_trs(float *out, const float *t, const float *q,
+                   const float *s) {
+    float x = q[0], y = q[1], z = q[2], w = q[3];
+
+    out[0] = (1.0f - 2.0f * (y * y + z * z)) * s[0];
+    out[1] = (2.0f * (x * y + z * w)) * s[0];
+    out[2] = (2.0f * (x * z - y * w)) * s[0];
+    out[3] = 0.0f;
+
+    out[4] = (2.0f * (x * y - z * w)) * s[1];
+    out[5] = (1.0f - 2.0f * (x * x + z * z)) * s[1];
+    out[6] = (2.0f * (y * z + x * w)) * s[1];
+    out[7] = 0.0f;
+
+    out[8] = (2.0f * (x * z + y * w)) * s[2];
+    out[9] = (2.0f * (y * z - x * w)) * s[2];
+    out[10] = (1.0f - 2.0f * (x * x + y * y)) * s[2];
+    out[11] = 0.0f;
+
+    out[12] = t[0];
+    out[13] = t[1];
+    out[14] = t[2];
+    out[15] = 1.0f;
+}
@@ -0,0 +1,24 @@
+#ifndef MAT4_H
+#define MAT4_H
+
+// 4x4 float matrices stored column-major, the same layout glm/matrix.lua
+// uses and glUniformMatrix4fv expects. Outputs may alias inputs.
+
+void mat4_identity(float *out);
+void mat4_multiply(float *out, const float *a, const float *b);
+
+void mat4_translation(float *out, float x, float y, float z);
+void mat4_scaling(float *out, float x, float y, float z);
+// Rotation around the (normalized) axis x, y, z by angle radians
+void mat4_rotation(float *out, float x, float y, float z, float angle);
+
+// m = m * translation/scale/rotation, like Matrix:translate and friends
+void mat4_translate(float *m, float x, float y, float z);
+void mat4_scale(float *m, float x, float y, float z);
+void mat4_rotate(float *m, float x, float y, float z, float angle);
+
+// translation * rotation * scale, with the rotation a unit quaternion
+// (x, y, z, w)
+void mat4_from_trs(float *out, const float *t, const float *q, const float *s);
+
+#endif
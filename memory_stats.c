@@ -0,0 +1,488 @@
+#include "memory_stats.h"
+
+#include "draw.h"
+#include "draw_interface.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const char *memory_gpu_kind_names[MEMORY_GPU_KIND_COUNT] = {
+    "buffer",
+    "texture",
+    "renderbuffer",
+};
+
+void memory_init(struct memory_stats *stats) {
+    memset(stats, 0x0, sizeof(*stats));
+}
+
+void memory_cleanup(struct memory_stats *stats) {
+    for (int kind = 0; kind < MEMORY_GPU_KIND_COUNT; kind++) {
+        free(stats->gpu[kind].objects);
+    }
+
+    for (size_t i = 0; i < stats->site_count; i++) {
+        free(stats->sites[i]);
+    }
+    free(stats->sites);
+
+    memset(stats, 0x0, sizeof(*stats));
+}
+
+static int size_class(size_t size) {
+    int size_class = 0;
+    size_t limit = 16;
+    while (size > limit && size_class < MEMORY_SIZE_CLASSES - 1) {
+        limit *= 2;
+        size_class++;
+    }
+
+    return size_class;
+}
+
+static void count_alloc(struct memory_lua_heap *heap, size_t size) {
+    int c = size_class(size);
+    heap->class_bytes[c] += size;
+    heap->class_blocks[c]++;
+
+    heap->bytes += size;
+    heap->blocks++;
+    if (heap->bytes > heap->peak) {
+        heap->peak = heap->bytes;
+    }
+}
+
+static void count_free(struct memory_lua_heap *heap, size_t size) {
+    int c = size_class(size);
+    heap->class_bytes[c] -= size;
+    heap->class_blocks[c]--;
+
+    heap->bytes -= size;
+    heap->blocks--;
+}
+
+// When ptr is NULL, osize is the type of object being made rather than a
+// size, so only blocks that exist are uncounted
+static void *lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    struct memory_lua_heap *heap = ud;
+
+    if (nsize == 0) {
+        if (ptr) {
+            count_free(heap, osize);
+        }
+        free(ptr);
+        return NULL;
+    }
+
+    void *block = realloc(ptr, nsize);
+    if (!block) {
+        return NULL;
+    }
+
+    if (ptr) {
+        count_free(heap, osize);
+    }
+    count_alloc(heap, nsize);
+
+    return block;
+}
+
+static int state_panic(lua_State *L) {
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+            lua_tostring(L, -1));
+
+    return 0;
+}
+
+lua_State *memory_new_state(struct memory_stats *stats, const char *name) {
+    if (stats->heap_count == MEMORY_MAX_HEAPS) {
+        return luaL_newstate();
+    }
+
+    struct memory_lua_heap *heap = &stats->heaps[stats->heap_count++];
+    memset(heap, 0x0, sizeof(*heap));
+    heap->name = name;
+    heap->tracked = 1;
+
+    lua_State *L = lua_newstate(lua_alloc, heap);
+    if (!L) {
+        // x64 LuaJIT without GC64 insists on its own allocator
+        L = luaL_newstate();
+        memset(heap, 0x0, sizeof(*heap));
+        heap->name = name;
+    }
+    if (!L) {
+        stats->heap_count--;
+        return NULL;
+    }
+
+    heap->state = L;
+    lua_atpanic(L, state_panic);
+
+    return L;
+}
+
+static void update_untracked(struct memory_lua_heap *heap) {
+    if (heap->tracked || !heap->state) {
+        return;
+    }
+
+    heap->bytes = (size_t)lua_gc(heap->state, LUA_GCCOUNT, 0) * 1024 +
+                  lua_gc(heap->state, LUA_GCCOUNTB, 0);
+    if (heap->bytes > heap->peak) {
+        heap->peak = heap->bytes;
+    }
+}
+
+void memory_close_state(struct memory_stats *stats, lua_State *L) {
+    for (int i = 0; i < stats->heap_count; i++) {
+        if (stats->heaps[i].state == L) {
+            update_untracked(&stats->heaps[i]);
+            stats->heaps[i].state = NULL;
+        }
+    }
+}
+
+static struct memory_gpu_object *get_object(struct memory_gpu_table *table,
+                                            GLuint name) {
+    if (name >= table->size) {
+        size_t size = table->size ? table->size : 64;
+        while (size <= name) {
+            size *= 2;
+        }
+
+        struct memory_gpu_object *objects =
+            realloc(table->objects, size * sizeof(*objects));
+        if (!objects) {
+            return NULL;
+        }
+        memset(objects + table->size, 0x0,
+               (size - table->size) * sizeof(*objects));
+
+        table->objects = objects;
+        table->size = size;
+    }
+
+    return &table->objects[name];
+}
+
+void memory_gpu_alloc(struct memory_stats *stats, enum memory_gpu_kind kind,
+                      GLuint name, size_t bytes, GLenum usage,
+                      const char *site) {
+    if (name == 0) {
+        return;
+    }
+
+    struct memory_gpu_table *table = &stats->gpu[kind];
+    struct memory_gpu_object *object = get_object(table, name);
+    if (!object) {
+        return;
+    }
+
+    if (object->site) {
+        table->bytes -= object->bytes;
+        stats->gpu_bytes -= object->bytes;
+    } else {
+        table->count++;
+    }
+
+    object->bytes = bytes;
+    object->usage = usage;
+    object->site = site ? site : "unknown";
+
+    table->bytes += bytes;
+    if (table->bytes > table->peak) {
+        table->peak = table->bytes;
+    }
+
+    stats->gpu_bytes += bytes;
+    if (stats->gpu_bytes > stats->gpu_peak) {
+        stats->gpu_peak = stats->gpu_bytes;
+    }
+}
+
+void memory_gpu_free(struct memory_stats *stats, enum memory_gpu_kind kind,
+                     GLuint name) {
+    struct memory_gpu_table *table = &stats->gpu[kind];
+    if (name >= table->size || !table->objects[name].site) {
+        return;
+    }
+
+    struct memory_gpu_object *object = &table->objects[name];
+    table->bytes -= object->bytes;
+    table->count--;
+    stats->gpu_bytes -= object->bytes;
+
+    memset(object, 0x0, sizeof(*object));
+}
+
+// Interns the string, so objects can point at it for good
+static const char *intern_site(struct memory_stats *stats, const char *site) {
+    for (size_t i = 0; i < stats->site_count; i++) {
+        if (strcmp(stats->sites[i], site) == 0) {
+            return stats->sites[i];
+        }
+    }
+
+    char **sites = realloc(stats->sites,
+                           (stats->site_count + 1) * sizeof(*sites));
+    if (!sites) {
+        return "unknown";
+    }
+    stats->sites = sites;
+
+    char *interned = strdup(site);
+    if (!interned) {
+        return "unknown";
+    }
+    stats->sites[stats->site_count++] = interned;
+
+    return interned;
+}
+
+const char *memory_lua_site(struct memory_stats *stats, lua_State *L) {
+    luaL_where(L, 1);
+
+    // "file:line:", or empty when called from C
+    size_t length;
+    const char *where = lua_tolstring(L, -1, &length);
+    char site[256];
+    if (length > 1 && length < sizeof(site)) {
+        memcpy(site, where, length - 1);
+        site[length - 1] = '\0';
+    } else {
+        strcpy(site, "C");
+    }
+
+    lua_pop(L, 1);
+
+    return intern_site(stats, site);
+}
+
+void memory_gpu_alloc_lua(struct memory_stats *stats,
+                          enum memory_gpu_kind kind, GLuint name,
+                          size_t bytes, GLenum usage, lua_State *L) {
+    if (name == 0) {
+        return;
+    }
+
+    struct memory_gpu_table *table = &stats->gpu[kind];
+    const char *site = name < table->size ? table->objects[name].site : NULL;
+
+    memory_gpu_alloc(stats, kind, name, bytes, usage,
+                     site ? site : memory_lua_site(stats, L));
+}
+
+static const char *usage_name(enum memory_gpu_kind kind, GLenum usage,
+                              char *buffer, size_t size) {
+    if (kind == MEMORY_GPU_BUFFER) {
+        switch (usage) {
+        case GL_STREAM_DRAW: return "STREAM_DRAW";
+        case GL_STREAM_READ: return "STREAM_READ";
+        case GL_STREAM_COPY: return "STREAM_COPY";
+        case GL_STATIC_DRAW: return "STATIC_DRAW";
+        case GL_STATIC_READ: return "STATIC_READ";
+        case GL_STATIC_COPY: return "STATIC_COPY";
+        case GL_DYNAMIC_DRAW: return "DYNAMIC_DRAW";
+        case GL_DYNAMIC_READ: return "DYNAMIC_READ";
+        case GL_DYNAMIC_COPY: return "DYNAMIC_COPY";
+        default: break;
+        }
+    }
+
+    snprintf(buffer, size, "0x%x", usage);
+    return buffer;
+}
+
+struct site_total {
+    const char *site;
+    GLenum usage;
+    size_t bytes;
+    size_t count;
+};
+
+// Totals objects of the kind by creating site and usage. Returns how many
+// there are, and the caller frees them.
+static size_t total_sites(const struct memory_gpu_table *table,
+                          struct site_total **totals) {
+    size_t count = 0;
+    *totals = NULL;
+
+    for (size_t name = 0; name < table->size; name++) {
+        const struct memory_gpu_object *object = &table->objects[name];
+        if (!object->site) {
+            continue;
+        }
+
+        size_t i = 0;
+        while (i < count && ((*totals)[i].site != object->site ||
+                             (*totals)[i].usage != object->usage)) {
+            i++;
+        }
+
+        if (i == count) {
+            struct site_total *grown =
+                realloc(*totals, (count + 1) * sizeof(*grown));
+            if (!grown) {
+                break;
+            }
+            *totals = grown;
+            (*totals)[count++] = (struct site_total){object->site,
+                                                     object->usage, 0, 0};
+        }
+
+        (*totals)[i].bytes += object->bytes;
+        (*totals)[i].count++;
+    }
+
+    return count;
+}
+
+void memory_report(struct memory_stats *stats, FILE *f) {
+    fprintf(f, "Memory report\n");
+
+    for (int h = 0; h < stats->heap_count; h++) {
+        struct memory_lua_heap *heap = &stats->heaps[h];
+        update_untracked(heap);
+
+        fprintf(f, "  Lua %s: %zu bytes, peak %zu", heap->name, heap->bytes,
+                heap->peak);
+        if (!heap->tracked) {
+            fprintf(f, " (from lua_gc, no size classes)\n");
+            continue;
+        }
+        fprintf(f, ", in %zu blocks\n", heap->blocks);
+
+        for (int c = 0; c < MEMORY_SIZE_CLASSES; c++) {
+            if (heap->class_blocks[c] == 0) {
+                continue;
+            }
+
+            if (c < MEMORY_SIZE_CLASSES - 1) {
+                fprintf(f, "    <= %6zu: ", (size_t)16 << c);
+            } else {
+                fprintf(f, "    larger:    ");
+            }
+            fprintf(f, "%zu bytes in %zu blocks\n", heap->class_bytes[c],
+                    heap->class_blocks[c]);
+        }
+    }
+
+    fprintf(f, "  GPU: %zu bytes, peak %zu\n", stats->gpu_bytes,
+            stats->gpu_peak);
+
+    for (int kind = 0; kind < MEMORY_GPU_KIND_COUNT; kind++) {
+        struct memory_gpu_table *table = &stats->gpu[kind];
+        if (table->peak == 0) {
+            continue;
+        }
+
+        fprintf(f, "    %s: %zu bytes in %zu objects, peak %zu\n",
+                memory_gpu_kind_names[kind], table->bytes, table->count,
+                table->peak);
+
+        struct site_total *totals;
+        size_t count = total_sites(table, &totals);
+        for (size_t i = 0; i < count; i++) {
+            char usage[16];
+            fprintf(f, "      %s %s: %zu bytes in %zu objects\n",
+                    totals[i].site,
+                    usage_name(kind, totals[i].usage, usage, sizeof(usage)),
+                    totals[i].bytes, totals[i].count);
+        }
+        free(totals);
+    }
+}
+
+static void set_integer(lua_State *L, const char *key, size_t value) {
+    lua_pushinteger(L, value);
+    lua_setfield(L, -2, key);
+}
+
+// {lua = {name = {bytes=, peak=, blocks=, classes = {{size=, bytes=,
+// blocks=}, ...}}}, gpu = {bytes=, peak=, buffer = {bytes=, peak=,
+// objects=, sites = {{site=, usage=, bytes=, objects=}, ...}}, texture = ...,
+// renderbuffer = ...}}. size is nil for the class of everything over 64k.
+int draw_lua_MemoryStats(struct draw_data *data, lua_State *L) {
+    struct memory_stats *stats = data->memory;
+
+    lua_createtable(L, 0, 2);
+
+    lua_createtable(L, 0, stats->heap_count);
+    for (int h = 0; h < stats->heap_count; h++) {
+        struct memory_lua_heap *heap = &stats->heaps[h];
+        update_untracked(heap);
+
+        lua_createtable(L, 0, 4);
+        set_integer(L, "bytes", heap->bytes);
+        set_integer(L, "peak", heap->peak);
+
+        if (heap->tracked) {
+            set_integer(L, "blocks", heap->blocks);
+
+            lua_createtable(L, MEMORY_SIZE_CLASSES, 0);
+            for (int c = 0; c < MEMORY_SIZE_CLASSES; c++) {
+                lua_createtable(L, 0, 3);
+                if (c < MEMORY_SIZE_CLASSES - 1) {
+                    set_integer(L, "size", (size_t)16 << c);
+                }
+                set_integer(L, "bytes", heap->class_bytes[c]);
+                set_integer(L, "blocks", heap->class_blocks[c]);
+                lua_rawseti(L, -2, c + 1);
+            }
+            lua_setfield(L, -2, "classes");
+        }
+
+        lua_setfield(L, -2, heap->name);
+    }
+    lua_setfield(L, -2, "lua");
+
+    lua_createtable(L, 0, 2 + MEMORY_GPU_KIND_COUNT);
+    set_integer(L, "bytes", stats->gpu_bytes);
+    set_integer(L, "peak", stats->gpu_peak);
+    for (int kind = 0; kind < MEMORY_GPU_KIND_COUNT; kind++) {
+        struct memory_gpu_table *table = &stats->gpu[kind];
+
+        lua_createtable(L, 0, 4);
+        set_integer(L, "bytes", table->bytes);
+        set_integer(L, "peak", table->peak);
+        set_integer(L, "objects", table->count);
+
+        struct site_total *totals;
+        size_t count = total_sites(table, &totals);
+        lua_createtable(L, count, 0);
+        for (size_t i = 0; i < count; i++) {
+            char usage[16];
+
+            lua_createtable(L, 0, 4);
+            lua_pushstring(L, totals[i].site);
+            lua_setfield(L, -2, "site");
+            lua_pushstring(L, usage_name(kind, totals[i].usage, usage,
+                                         sizeof(usage)));
+            lua_setfield(L, -2, "usage");
+            set_integer(L, "bytes", totals[i].bytes);
+            set_integer(L, "objects", totals[i].count);
+            lua_rawseti(L, -2, i + 1);
+        }
+        free(totals);
+        lua_setfield(L, -2, "sites");
+
+        lua_setfield(L, -2, memory_gpu_kind_names[kind]);
+    }
+    lua_setfield(L, -2, "gpu");
+
+    return 1;
+}
+
+int draw_lua_MemoryReport(struct draw_data *data, lua_State *L) {
+    (void)L;
+
+    memory_report(data->memory, stderr);
+
+    return 0;
+}
+
+void memory_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(MemoryStats);
+    REGISTER_FUNC(MemoryReport);
+}
@@ -0,0 +1,103 @@
+#ifndef MEMORY_STATS_H
+#define MEMORY_STATS_H
+
+#include "lua.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct draw_data;
+
+#define MEMORY_MAX_HEAPS 4
+
+// Lua allocations are counted in power of two size classes from 16 bytes
+// up to 64k, with everything bigger in the last class
+#define MEMORY_SIZE_CLASSES 14
+
+struct memory_lua_heap {
+    const char *name;
+    // Set while the heap's state is open. States that couldn't take our
+    // allocator (LuaJIT without GC64) are only counted through lua_gc.
+    lua_State *state;
+    int tracked;
+
+    size_t bytes;
+    size_t peak;
+    size_t blocks;
+
+    size_t class_bytes[MEMORY_SIZE_CLASSES];
+    size_t class_blocks[MEMORY_SIZE_CLASSES];
+};
+
+enum memory_gpu_kind {
+    MEMORY_GPU_BUFFER,
+    MEMORY_GPU_TEXTURE,
+    MEMORY_GPU_RENDERBUFFER,
+    MEMORY_GPU_KIND_COUNT,
+};
+
+struct memory_gpu_object {
+    size_t bytes;
+    // Usage hint for buffers, internal format for textures and
+    // renderbuffers
+    GLenum usage;
+    // Lua "file:line" interned by memory_lua_site, or a string literal
+    // naming the C code that made it
+    const char *site;
+};
+
+// Objects of one kind, indexed by GL name
+struct memory_gpu_table {
+    struct memory_gpu_object *objects;
+    size_t size;
+
+    size_t count;
+    size_t bytes;
+    size_t peak;
+};
+
+// Owned by main, and shared by the Lua state and draw_data, so it outlives
+// both and can report what they leaked
+struct memory_stats {
+    struct memory_lua_heap heaps[MEMORY_MAX_HEAPS];
+    int heap_count;
+
+    struct memory_gpu_table gpu[MEMORY_GPU_KIND_COUNT];
+    size_t gpu_bytes;
+    size_t gpu_peak;
+
+    char **sites;
+    size_t site_count;
+};
+
+extern const char *memory_gpu_kind_names[MEMORY_GPU_KIND_COUNT];
+
+void memory_init(struct memory_stats *);
+void memory_cleanup(struct memory_stats *);
+
+// Makes a Lua state whose allocations are counted under the name
+lua_State *memory_new_state(struct memory_stats *, const char *);
+// Call before lua_close on a state from memory_new_state
+void memory_close_state(struct memory_stats *, lua_State *);
+
+// Records the GL object's storage, replacing what it had before
+void memory_gpu_alloc(struct memory_stats *, enum memory_gpu_kind, GLuint,
+                      size_t, GLenum, const char *);
+void memory_gpu_free(struct memory_stats *, enum memory_gpu_kind, GLuint);
+// Same, with the calling Lua code as the site. Streaming buffers are
+// reallocated every frame, so the site is only looked up for objects that
+// don't have one yet.
+void memory_gpu_alloc_lua(struct memory_stats *, enum memory_gpu_kind, GLuint,
+                          size_t, GLenum, lua_State *);
+
+// Interned "file:line" of the Lua code calling the current C function
+const char *memory_lua_site(struct memory_stats *, lua_State *);
+
+void memory_report(struct memory_stats *, FILE *);
+
+void memory_register(lua_State *, struct draw_data *);
+
+#endif
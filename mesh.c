@@ -0,0 +1,480 @@
+#include "mesh.h"
+
+#include "draw_interface.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/***** ANALYSIS *****/
+
+float mesh_acmr(const unsigned int *indices, size_t index_count,
+                size_t vertex_count, int cache_size) {
+    if (index_count < 3) {
+        return 0.0f;
+    }
+
+    // Position in the FIFO each vertex was loaded at, so a vertex is in the
+    // cache if fewer than cache_size loads have happened since
+    size_t *loaded_at = malloc(vertex_count * sizeof(*loaded_at));
+    for (size_t i = 0; i < vertex_count; i++) {
+        loaded_at[i] = SIZE_MAX;
+    }
+
+    size_t misses = 0;
+    for (size_t i = 0; i < index_count; i++) {
+        unsigned int v = indices[i];
+        if (v >= vertex_count) {
+            continue;
+        }
+
+        if (loaded_at[v] == SIZE_MAX || misses - loaded_at[v] >= (size_t)cache_size) {
+            loaded_at[v] = misses;
+            misses++;
+        }
+    }
+
+    free(loaded_at);
+
+    return (float)misses / (index_count / 3);
+}
+
+/***** VERTEX CACHE OPTIMIZATION *****/
+
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_CACHE_DECAY_POWER 1.5f
+#define FORSYTH_LAST_TRI_SCORE 0.75f
+#define FORSYTH_VALENCE_BOOST_SCALE 2.0f
+#define FORSYTH_VALENCE_BOOST_POWER 0.5f
+
+static float forsyth_vertex_score(int cache_position, unsigned int remaining) {
+    if (remaining == 0) {
+        // Not used by any more triangles
+        return -1.0f;
+    }
+
+    float score = 0.0f;
+    if (cache_position >= 0) {
+        if (cache_position < 3) {
+            // Used by the last triangle. Fixed score so the next triangle
+            // doesn't just reuse the same edge in a strip.
+            score = FORSYTH_LAST_TRI_SCORE;
+        } else {
+            float scale = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+            score = powf(1.0f - (cache_position - 3) * scale,
+                         FORSYTH_CACHE_DECAY_POWER);
+        }
+    }
+
+    // Prefer vertices with few triangles left, so they get finished off
+    // and stop taking up cache space
+    score += FORSYTH_VALENCE_BOOST_SCALE *
+             powf(remaining, -FORSYTH_VALENCE_BOOST_POWER);
+
+    return score;
+}
+
+int mesh_optimize_vertex_cache(unsigned int *out, const unsigned int *indices,
+                               size_t index_count, size_t vertex_count) {
+    size_t triangle_count = index_count / 3;
+
+    // Triangles using each vertex, as offsets into one shared array.
+    // remaining[v] is how many of vertex v's entries are still unemitted;
+    // emitted triangles get swapped past the end of that range.
+    unsigned int *remaining = calloc(vertex_count, sizeof(*remaining));
+    size_t *offsets = malloc((vertex_count + 1) * sizeof(*offsets));
+    unsigned int *adjacency = malloc(index_count * sizeof(*adjacency));
+    int *cache_position = malloc(vertex_count * sizeof(*cache_position));
+    float *vertex_score = malloc(vertex_count * sizeof(*vertex_score));
+    float *triangle_score = malloc(triangle_count * sizeof(*triangle_score));
+    char *emitted = calloc(triangle_count, 1);
+
+    if (!remaining || !offsets || !adjacency || !cache_position ||
+        !vertex_score || !triangle_score || !emitted) {
+        free(remaining);
+        free(offsets);
+        free(adjacency);
+        free(cache_position);
+        free(vertex_score);
+        free(triangle_score);
+        free(emitted);
+        return 1;
+    }
+
+    int err = 0;
+
+    for (size_t i = 0; i < triangle_count * 3; i++) {
+        if (indices[i] >= vertex_count) {
+            fprintf(stderr, "Index %u out of range for %zu vertices\n",
+                    indices[i], vertex_count);
+            err = 1;
+            goto cleanup;
+        }
+        remaining[indices[i]]++;
+    }
+
+    offsets[0] = 0;
+    for (size_t v = 0; v < vertex_count; v++) {
+        offsets[v + 1] = offsets[v] + remaining[v];
+        remaining[v] = 0;
+    }
+    for (size_t t = 0; t < triangle_count; t++) {
+        for (int k = 0; k < 3; k++) {
+            unsigned int v = indices[t * 3 + k];
+            adjacency[offsets[v] + remaining[v]++] = t;
+        }
+    }
+
+    for (size_t v = 0; v < vertex_count; v++) {
+        cache_position[v] = -1;
+        vertex_score[v] = forsyth_vertex_score(-1, remaining[v]);
+    }
+    for (size_t t = 0; t < triangle_count; t++) {
+        triangle_score[t] = vertex_score[indices[t * 3 + 0]] +
+                            vertex_score[indices[t * 3 + 1]] +
+                            vertex_score[indices[t * 3 + 2]];
+    }
+
+    // Room for the cache plus the three vertices that get pushed in front
+    unsigned int cache[FORSYTH_CACHE_SIZE + 3];
+    int cache_count = 0;
+
+    size_t scan = 0;
+    long best = -1;
+
+    for (size_t emit = 0; emit < triangle_count; emit++) {
+        if (best < 0) {
+            // Nothing useful in the cache, so start on the best of the
+            // remaining triangles
+            while (scan < triangle_count && emitted[scan]) {
+                scan++;
+            }
+
+            float best_score = -2.0f;
+            for (size_t t = scan; t < triangle_count; t++) {
+                if (!emitted[t] && triangle_score[t] > best_score) {
+                    best_score = triangle_score[t];
+                    best = t;
+                }
+            }
+        }
+
+        size_t t = best;
+        const unsigned int *tri = &indices[t * 3];
+
+        out[emit * 3 + 0] = tri[0];
+        out[emit * 3 + 1] = tri[1];
+        out[emit * 3 + 2] = tri[2];
+        emitted[t] = 1;
+
+        // Take the triangle out of its vertices' adjacency lists
+        for (int k = 0; k < 3; k++) {
+            unsigned int v = tri[k];
+            unsigned int *list = &adjacency[offsets[v]];
+            for (unsigned int i = 0; i < remaining[v]; i++) {
+                if (list[i] == t) {
+                    list[i] = list[remaining[v] - 1];
+                    list[remaining[v] - 1] = t;
+                    remaining[v]--;
+                    break;
+                }
+            }
+        }
+
+        // Move the triangle's vertices to the front of the cache
+        unsigned int new_cache[FORSYTH_CACHE_SIZE + 3];
+        int new_count = 0;
+        for (int k = 0; k < 3; k++) {
+            new_cache[new_count++] = tri[k];
+        }
+        for (int i = 0; i < cache_count; i++) {
+            unsigned int v = cache[i];
+            if (v != tri[0] && v != tri[1] && v != tri[2]) {
+                new_cache[new_count++] = v;
+            }
+        }
+
+        // Rescore everything that was or is in the cache. Anything past
+        // the cache size just fell out.
+        for (int i = 0; i < new_count; i++) {
+            unsigned int v = new_cache[i];
+            cache_position[v] = i < FORSYTH_CACHE_SIZE ? i : -1;
+            vertex_score[v] = forsyth_vertex_score(cache_position[v], remaining[v]);
+        }
+
+        best = -1;
+        float best_score = -1.0f;
+        for (int i = 0; i < new_count; i++) {
+            unsigned int v = new_cache[i];
+            for (unsigned int j = 0; j < remaining[v]; j++) {
+                unsigned int other = adjacency[offsets[v] + j];
+                const unsigned int *o = &indices[other * 3];
+
+                float score = vertex_score[o[0]] + vertex_score[o[1]] +
+                              vertex_score[o[2]];
+                triangle_score[other] = score;
+
+                if (score > best_score) {
+                    best_score = score;
+                    best = other;
+                }
+            }
+        }
+
+        cache_count = new_count < FORSYTH_CACHE_SIZE ? new_count : FORSYTH_CACHE_SIZE;
+        memcpy(cache, new_cache, cache_count * sizeof(*cache));
+    }
+
+cleanup:
+    free(remaining);
+    free(offsets);
+    free(adjacency);
+    free(cache_position);
+    free(vertex_score);
+    free(triangle_score);
+    free(emitted);
+
+    return err;
+}
+
+/***** VERTEX FETCH OPTIMIZATION *****/
+
+void mesh_optimize_vertex_fetch(unsigned int *remap, unsigned int *indices,
+                                size_t index_count, size_t vertex_count) {
+    for (size_t v = 0; v < vertex_count; v++) {
+        remap[v] = UINT32_MAX;
+    }
+
+    unsigned int next = 0;
+    for (size_t i = 0; i < index_count; i++) {
+        unsigned int v = indices[i];
+        if (v >= vertex_count) {
+            continue;
+        }
+        if (remap[v] == UINT32_MAX) {
+            remap[v] = next++;
+        }
+        indices[i] = remap[v];
+    }
+
+    for (size_t v = 0; v < vertex_count; v++) {
+        if (remap[v] == UINT32_MAX) {
+            remap[v] = next++;
+        }
+    }
+}
+
+/***** INDEX TYPES *****/
+
+GLenum mesh_index_type(size_t vertex_count) {
+    if (vertex_count <= UINT8_MAX + 1) {
+        return GL_UNSIGNED_BYTE;
+    } else if (vertex_count <= UINT16_MAX + 1) {
+        return GL_UNSIGNED_SHORT;
+    } else {
+        return GL_UNSIGNED_INT;
+    }
+}
+
+size_t mesh_index_size(GLenum type) {
+    switch (type) {
+        case GL_UNSIGNED_BYTE:
+            return 1;
+        case GL_UNSIGNED_SHORT:
+            return 2;
+        default:
+            return 4;
+    }
+}
+
+size_t mesh_pack_indices(void *out, const unsigned int *indices, size_t count,
+                         GLenum type) {
+    switch (type) {
+        case GL_UNSIGNED_BYTE:
+            for (size_t i = 0; i < count; i++) {
+                ((uint8_t *)out)[i] = indices[i];
+            }
+            break;
+        case GL_UNSIGNED_SHORT:
+            for (size_t i = 0; i < count; i++) {
+                ((uint16_t *)out)[i] = indices[i];
+            }
+            break;
+        default:
+            memcpy(out, indices, count * sizeof(*indices));
+            break;
+    }
+
+    return count * mesh_index_size(type);
+}
+
+/***** LUA INTERFACE *****/
+
+static unsigned int *read_indices(lua_State *L, int index, size_t *count) {
+    *count = get_lua_len(L, index);
+
+    unsigned int *indices = malloc(*count * sizeof(*indices) + 1);
+    for (size_t i = 0; i < *count; i++) {
+        lua_rawgeti(L, index, i + 1);
+        indices[i] = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return indices;
+}
+
+static void push_array(lua_State *L, const unsigned int *values, size_t count) {
+    lua_createtable(L, count, 0);
+    for (size_t i = 0; i < count; i++) {
+        lua_pushinteger(L, values[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+// indices, vertex_count -> optimized indices, remap, ACMR before, ACMR after.
+// The indices have to be a list of triangles.
+//
+// Vertex attribute arrays have to be put through RemapVertexArray with the
+// returned remap to match the new indices.
+int mesh_lua_OptimizeIndices(lua_State *L) {
+    size_t vertex_count = luaL_checkinteger(L, 2);
+
+    size_t index_count = get_lua_len(L, 1);
+    if (index_count % 3 != 0) {
+        return luaL_error(L, "Index count %d isn't a whole number of triangles",
+                          (int)index_count);
+    }
+
+    unsigned int *indices = read_indices(L, 1, &index_count);
+    unsigned int *optimized = malloc(index_count * sizeof(*optimized) + 1);
+    unsigned int *remap = malloc(vertex_count * sizeof(*remap) + 1);
+
+    float before = mesh_acmr(indices, index_count, vertex_count,
+                             MESH_ACMR_CACHE_SIZE);
+
+    if (mesh_optimize_vertex_cache(optimized, indices, index_count, vertex_count)) {
+        free(indices);
+        free(optimized);
+        free(remap);
+        return luaL_error(L, "Error optimizing mesh");
+    }
+    mesh_optimize_vertex_fetch(remap, optimized, index_count, vertex_count);
+
+    float after = mesh_acmr(optimized, index_count, vertex_count,
+                            MESH_ACMR_CACHE_SIZE);
+
+    log_debug("Optimized %zu triangles: ACMR %.3f -> %.3f",
+           index_count / 3, before, after);
+
+    push_array(L, optimized, index_count);
+    push_array(L, remap, vertex_count);
+    lua_pushnumber(L, before);
+    lua_pushnumber(L, after);
+
+    free(indices);
+    free(optimized);
+    free(remap);
+
+    return 4;
+}
+
+// array, components per vertex, remap -> reordered array
+int mesh_lua_RemapVertexArray(lua_State *L) {
+    int components = luaL_checkinteger(L, 2);
+    lua_Integer len = get_lua_len(L, 1);
+    lua_Integer vertex_count = len / components;
+
+    lua_createtable(L, len, 0);
+    int result = lua_gettop(L);
+
+    for (lua_Integer v = 0; v < vertex_count; v++) {
+        lua_rawgeti(L, 3, v + 1);
+        lua_Integer target = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        for (int c = 0; c < components; c++) {
+            lua_rawgeti(L, 1, v * components + c + 1);
+            lua_rawseti(L, result, target * components + c + 1);
+        }
+    }
+
+    return 1;
+}
+
+// target, indices, vertex_count. Allocates and fills the bound buffer with
+// the narrowest index type that fits. The vertex count defaults to one past
+// the largest index, and erroring if it's too small beats wrapping indices.
+// Returns the type and the byte size.
+int draw_lua_BufferIndexData(struct draw_data *data, lua_State *L) {
+    GLenum target = get_integer_arg(L);
+
+    size_t count;
+    unsigned int *indices = read_indices(L, 1, &count);
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (indices[i] >= used) {
+            used = (size_t)indices[i] + 1;
+        }
+    }
+
+    size_t vertex_count = used;
+    if (!lua_isnoneornil(L, 2)) {
+        vertex_count = lua_tointeger(L, 2);
+        if (vertex_count < used) {
+            free(indices);
+            return luaL_error(L, "Index %d out of range for %d vertices",
+                              (int)(used - 1), (int)vertex_count);
+        }
+    }
+    lua_settop(L, 0);
+
+    GLenum type = mesh_index_type(vertex_count);
+
+    void *packed = malloc(count * mesh_index_size(type) + 1);
+    size_t size = mesh_pack_indices(packed, indices, count, type);
+
+    glBufferData(target, size, packed, GL_STATIC_DRAW);
+
+    // Kept with the buffer's handle, so draws don't have to ask GL
+    handle_set_index_type(&data->handles, target, type);
+    GLuint buffer = handle_bound_buffer(&data->handles, target);
+    memory_gpu_alloc_lua(data->memory, MEMORY_GPU_BUFFER, buffer, size,
+                         GL_STATIC_DRAW, L);
+
+    free(indices);
+    free(packed);
+
+    lua_pushinteger(L, type);
+    lua_pushinteger(L, size);
+
+    return 2;
+}
+
+// mode, count, first index, base vertex. Uses the index type recorded for
+// the bound element array buffer by BufferIndexData, so the buffer has to
+// have been bound through its handle.
+int draw_lua_DrawIndexed(struct draw_data *data, lua_State *L) {
+    GLenum mode = get_integer_arg(L);
+    GLsizei count = get_integer_arg(L);
+    lua_Integer first = luaL_optinteger(L, 1, 0);
+    GLint basevertex = luaL_optinteger(L, 2, 0);
+
+    GLenum type = handle_index_type(&data->handles);
+
+    glDrawElementsBaseVertex(mode, count, type,
+                             (GLvoid *)(first * mesh_index_size(type)),
+                             basevertex);
+
+    return 0;
+}
+
+void mesh_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(BufferIndexData);
+    REGISTER_FUNC(DrawIndexed);
+
+    lua_register(L, "mesh_OptimizeIndices", mesh_lua_OptimizeIndices);
+    lua_register(L, "mesh_RemapVertexArray", mesh_lua_RemapVertexArray);
+}
@@ -0,0 +1,37 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "lua.h"
+#include "draw.h"
+
+#include <stddef.h>
+
+// Size of the FIFO cache used to compute ACMR (average cache miss ratio,
+// the number of vertex shader runs per triangle)
+#define MESH_ACMR_CACHE_SIZE 16
+
+float mesh_acmr(const unsigned int *indices, size_t index_count,
+                size_t vertex_count, int cache_size);
+
+// Reorders triangles for post-transform vertex cache hits, using Tom
+// Forsyth's linear-speed vertex cache optimization. `out` and `indices`
+// must not overlap.
+int mesh_optimize_vertex_cache(unsigned int *out, const unsigned int *indices,
+                               size_t index_count, size_t vertex_count);
+
+// Renumbers vertices in the order the index buffer first uses them, so
+// vertex fetches walk memory forwards. Rewrites the indices in place and
+// fills remap[old vertex] = new vertex. Unused vertices go at the end.
+void mesh_optimize_vertex_fetch(unsigned int *remap, unsigned int *indices,
+                                size_t index_count, size_t vertex_count);
+
+// The narrowest index type that can address vertex_count vertices
+GLenum mesh_index_type(size_t vertex_count);
+size_t mesh_index_size(GLenum);
+// Packs indices into the given type. Returns the number of bytes written.
+size_t mesh_pack_indices(void *out, const unsigned int *indices, size_t count,
+                         GLenum type);
+
+void mesh_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,33 @@
+local M = {}
+
+local unpack = table.unpack or unpack
+
+-- Mesh optimization functions exposed from C
+local copy_funcs = {
+  OptimizeIndices="optimize_indices",
+  RemapVertexArray="remap_vertex_array",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["mesh_" .. c_name]
+end
+
+-- Optimizes indices for the vertex cache and reorders vertices to match.
+-- Each extra argument is {array, components}. Returns the new indices, the
+-- reordered arrays in the same order, then the ACMR before and after.
+function M.optimize(indices, vertex_count, ...)
+  local new_indices, remap, acmr_before, acmr_after =
+    M.optimize_indices(indices, vertex_count)
+
+  local results = {new_indices}
+  for _, attribute in ipairs({...}) do
+    table.insert(
+      results, M.remap_vertex_array(attribute[1], attribute[2], remap))
+  end
+  table.insert(results, acmr_before)
+  table.insert(results, acmr_after)
+
+  return unpack(results)
+end
+
+return M
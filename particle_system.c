@@ -0,0 +1,624 @@
+#include "particle_system.h"
+
+#include "draw_interface.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#define ROUND_UP_4(n) (((n) + 3) & ~(size_t)3)
+
+static float *allocate_component(size_t capacity) {
+    float *component = aligned_alloc(16, capacity * sizeof(float));
+    if (component) {
+        memset(component, 0x0, capacity * sizeof(float));
+    }
+
+    return component;
+}
+
+struct particle_system *particle_system_create(size_t capacity) {
+    struct particle_system *system = calloc(1, sizeof(*system));
+    if (!system) {
+        return NULL;
+    }
+
+    // The kernels run over whole groups of four, so the padding past the
+    // last particle has to exist and hold ordinary floats
+    system->capacity = capacity;
+    size_t padded = ROUND_UP_4(capacity > 0 ? capacity : 1);
+
+    float **components[] = {
+        &system->x, &system->y, &system->z,
+        &system->vx, &system->vy, &system->vz,
+        &system->age, &system->life,
+    };
+    for (size_t i = 0; i < sizeof(components) / sizeof(*components); i++) {
+        *components[i] = allocate_component(padded);
+        if (!*components[i]) {
+            particle_system_destroy(system);
+            return NULL;
+        }
+    }
+
+    system->gravity[1] = -9.8f;
+    system->random = 0x9e3779b9;
+
+    return system;
+}
+
+static void stop_workers(struct particle_workers *workers) {
+    pthread_mutex_lock(&workers->lock);
+    workers->quit = 1;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (int i = 0; i < workers->count; i++) {
+        pthread_join(workers->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&workers->done);
+    pthread_cond_destroy(&workers->start);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers);
+}
+
+void particle_system_destroy(struct particle_system *system) {
+    if (system->workers) {
+        stop_workers(system->workers);
+    }
+
+    free(system->x);
+    free(system->y);
+    free(system->z);
+    free(system->vx);
+    free(system->vy);
+    free(system->vz);
+    free(system->age);
+    free(system->life);
+    free(system);
+}
+
+int particle_system_add_emitter(struct particle_system *system,
+                                const struct particle_emitter *emitter) {
+    for (int i = 0; i < PARTICLE_MAX_EMITTERS; i++) {
+        if (!system->emitters[i].active) {
+            system->emitters[i] = *emitter;
+            system->emitters[i].active = 1;
+            system->emitters[i].accumulator = 0;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// xorshift32, returning [0, 1)
+static float next_random(struct particle_system *system) {
+    uint32_t x = system->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    system->random = x;
+
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+static void spawn_particles(struct particle_system *system, float dt) {
+    system->last_spawned = 0;
+
+    for (int e = 0; e < PARTICLE_MAX_EMITTERS; e++) {
+        struct particle_emitter *emitter = &system->emitters[e];
+        if (!emitter->active) {
+            continue;
+        }
+
+        emitter->accumulator += emitter->rate * dt;
+        size_t spawn_count = (size_t)emitter->accumulator;
+        emitter->accumulator -= spawn_count;
+
+        // Once full, new particles are dropped until old ones die
+        if (spawn_count > system->capacity - system->count) {
+            spawn_count = system->capacity - system->count;
+        }
+
+        float life_range = emitter->life_max - emitter->life_min;
+        for (size_t n = 0; n < spawn_count; n++) {
+            size_t i = system->count++;
+
+            system->x[i] = emitter->position[0];
+            system->y[i] = emitter->position[1];
+            system->z[i] = emitter->position[2];
+
+            float spread = emitter->spread;
+            system->vx[i] = emitter->velocity[0] +
+                            spread * (next_random(system) * 2 - 1);
+            system->vy[i] = emitter->velocity[1] +
+                            spread * (next_random(system) * 2 - 1);
+            system->vz[i] = emitter->velocity[2] +
+                            spread * (next_random(system) * 2 - 1);
+
+            system->age[i] = 0;
+            system->life[i] = emitter->life_min +
+                              life_range * next_random(system);
+        }
+
+        system->last_spawned += spawn_count;
+    }
+}
+
+// Applies gravity and drag, moves, and ages particles [begin, end). begin is
+// a multiple of four and end is rounded up to one, into the padding.
+static void integrate(struct particle_system *system, size_t begin,
+                      size_t end) {
+    float dt = system->dt;
+    float damping = 1.0f - system->drag * dt;
+    if (damping < 0) {
+        damping = 0;
+    }
+
+    end = ROUND_UP_4(end);
+
+#if defined(__SSE__)
+    __m128 dt4 = _mm_set1_ps(dt);
+    __m128 damping4 = _mm_set1_ps(damping);
+    __m128 gx = _mm_set1_ps(system->gravity[0] * dt);
+    __m128 gy = _mm_set1_ps(system->gravity[1] * dt);
+    __m128 gz = _mm_set1_ps(system->gravity[2] * dt);
+
+    for (size_t i = begin; i < end; i += 4) {
+        __m128 vx = _mm_mul_ps(_mm_add_ps(_mm_load_ps(&system->vx[i]), gx),
+                               damping4);
+        __m128 vy = _mm_mul_ps(_mm_add_ps(_mm_load_ps(&system->vy[i]), gy),
+                               damping4);
+        __m128 vz = _mm_mul_ps(_mm_add_ps(_mm_load_ps(&system->vz[i]), gz),
+                               damping4);
+        _mm_store_ps(&system->vx[i], vx);
+        _mm_store_ps(&system->vy[i], vy);
+        _mm_store_ps(&system->vz[i], vz);
+
+        _mm_store_ps(&system->x[i], _mm_add_ps(_mm_load_ps(&system->x[i]),
+                                               _mm_mul_ps(vx, dt4)));
+        _mm_store_ps(&system->y[i], _mm_add_ps(_mm_load_ps(&system->y[i]),
+                                               _mm_mul_ps(vy, dt4)));
+        _mm_store_ps(&system->z[i], _mm_add_ps(_mm_load_ps(&system->z[i]),
+                                               _mm_mul_ps(vz, dt4)));
+
+        _mm_store_ps(&system->age[i],
+                     _mm_add_ps(_mm_load_ps(&system->age[i]), dt4));
+    }
+#else
+    float gx = system->gravity[0] * dt;
+    float gy = system->gravity[1] * dt;
+    float gz = system->gravity[2] * dt;
+
+    for (size_t i = begin; i < end; i++) {
+        system->vx[i] = (system->vx[i] + gx) * damping;
+        system->vy[i] = (system->vy[i] + gy) * damping;
+        system->vz[i] = (system->vz[i] + gz) * damping;
+
+        system->x[i] += system->vx[i] * dt;
+        system->y[i] += system->vy[i] * dt;
+        system->z[i] += system->vz[i] * dt;
+
+        system->age[i] += dt;
+    }
+#endif
+}
+
+static void move_particle(struct particle_system *system, size_t to,
+                          size_t from) {
+    system->x[to] = system->x[from];
+    system->y[to] = system->y[from];
+    system->z[to] = system->z[from];
+    system->vx[to] = system->vx[from];
+    system->vy[to] = system->vy[from];
+    system->vz[to] = system->vz[from];
+    system->age[to] = system->age[from];
+    system->life[to] = system->life[from];
+}
+
+// Swap-remove: each expired particle is overwritten by the last live one,
+// which is checked in turn. Groups of four with nothing expired, the common
+// case, are skipped with one compare.
+static void kill_expired(struct particle_system *system) {
+    size_t count = system->count;
+    size_t i = 0;
+
+    while (i < count) {
+#if defined(__SSE__)
+        if ((i & 3) == 0 && i + 4 <= count) {
+            __m128 expired = _mm_cmpge_ps(_mm_load_ps(&system->age[i]),
+                                          _mm_load_ps(&system->life[i]));
+            if (_mm_movemask_ps(expired) == 0) {
+                i += 4;
+                continue;
+            }
+        }
+#endif
+
+        if (system->age[i] >= system->life[i]) {
+            move_particle(system, i, --count);
+        } else {
+            i++;
+        }
+    }
+
+    system->last_killed = system->count - count;
+    system->count = count;
+}
+
+static void write_vertices(struct particle_system *system, size_t begin,
+                           size_t end) {
+    struct particle_vertex *vertices = system->vertices;
+    size_t i = begin;
+
+#if defined(__SSE__)
+    // Four particles' components are rows of a 4x4 matrix, and transposed
+    // they're four vertices
+    for (; i + 4 <= end; i += 4) {
+        __m128 x = _mm_load_ps(&system->x[i]);
+        __m128 y = _mm_load_ps(&system->y[i]);
+        __m128 z = _mm_load_ps(&system->z[i]);
+        __m128 life = _mm_sub_ps(_mm_load_ps(&system->life[i]),
+                                 _mm_load_ps(&system->age[i]));
+
+        _MM_TRANSPOSE4_PS(x, y, z, life);
+
+        _mm_storeu_ps(&vertices[i].x, x);
+        _mm_storeu_ps(&vertices[i + 1].x, y);
+        _mm_storeu_ps(&vertices[i + 2].x, z);
+        _mm_storeu_ps(&vertices[i + 3].x, life);
+    }
+#endif
+
+    for (; i < end; i++) {
+        vertices[i].x = system->x[i];
+        vertices[i].y = system->y[i];
+        vertices[i].z = system->z[i];
+        vertices[i].life = system->life[i] - system->age[i];
+    }
+}
+
+static void run_slice(struct particle_workers *workers, size_t slice) {
+    size_t slices = workers->count + 1;
+    size_t slice_size = ROUND_UP_4((workers->job_count + slices - 1) / slices);
+
+    size_t begin = slice * slice_size;
+    size_t end = begin + slice_size;
+    if (end > workers->job_count) {
+        end = workers->job_count;
+    }
+
+    if (begin < end) {
+        workers->job(workers->system, begin, end);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct particle_workers *workers = arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&workers->lock);
+    for (;;) {
+        while (workers->generation == seen && !workers->quit) {
+            pthread_cond_wait(&workers->start, &workers->lock);
+        }
+        if (workers->quit) {
+            break;
+        }
+
+        seen = workers->generation;
+        size_t slice = workers->next_slice++;
+        pthread_mutex_unlock(&workers->lock);
+
+        run_slice(workers, slice);
+
+        pthread_mutex_lock(&workers->lock);
+        if (--workers->remaining == 0) {
+            pthread_cond_signal(&workers->done);
+        }
+    }
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+static struct particle_workers *start_workers(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 2) {
+        return NULL;
+    }
+
+    struct particle_workers *workers = calloc(1, sizeof(*workers));
+    if (!workers) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->start, NULL);
+    pthread_cond_init(&workers->done, NULL);
+
+    int wanted = cores - 1 < PARTICLE_MAX_WORKERS ? cores - 1 :
+                                                    PARTICLE_MAX_WORKERS;
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&workers->threads[i], NULL, worker_main,
+                           workers) != 0) {
+            fprintf(stderr, "Error starting particle worker\n");
+            break;
+        }
+        workers->count++;
+    }
+
+    if (workers->count == 0) {
+        stop_workers(workers);
+        return NULL;
+    }
+
+    log_debug("Started %d particle workers", workers->count);
+
+    return workers;
+}
+
+// Runs job over [0, count), split across the workers when count is large
+static void run_job(struct particle_system *system,
+                    void (*job)(struct particle_system *, size_t, size_t),
+                    size_t count) {
+    if (count < PARTICLE_JOB_THRESHOLD) {
+        job(system, 0, count);
+        return;
+    }
+
+    if (!system->workers) {
+        system->workers = start_workers();
+        if (!system->workers) {
+            job(system, 0, count);
+            return;
+        }
+    }
+
+    struct particle_workers *workers = system->workers;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->job = job;
+    workers->system = system;
+    workers->job_count = count;
+    workers->remaining = workers->count;
+    workers->next_slice = 1;
+    workers->generation++;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    run_slice(workers, 0);
+
+    pthread_mutex_lock(&workers->lock);
+    while (workers->remaining > 0) {
+        pthread_cond_wait(&workers->done, &workers->lock);
+    }
+    pthread_mutex_unlock(&workers->lock);
+}
+
+size_t particle_system_update(struct particle_system *system, float dt) {
+    system->dt = dt;
+
+    run_job(system, integrate, system->count);
+    kill_expired(system);
+    // Spawning last means new particles start at the emitter this frame,
+    // and can use the space just freed
+    spawn_particles(system, dt);
+
+    return system->count;
+}
+
+void particle_system_write_vertices(struct particle_system *system,
+                                    struct particle_vertex *vertices) {
+    system->vertices = vertices;
+    run_job(system, write_vertices, system->count);
+    system->vertices = NULL;
+}
+
+static struct particle_system *check_system(lua_State *L, int index) {
+    struct particle_system *system = lua_touserdata(L, index);
+    if (!system) {
+        luaL_error(L, "Expected a particle system");
+    }
+
+    return system;
+}
+
+static struct particle_emitter *check_emitter(lua_State *L,
+                                              struct particle_system *system,
+                                              int index) {
+    lua_Integer emitter = luaL_checkinteger(L, index);
+    if (emitter < 0 || emitter >= PARTICLE_MAX_EMITTERS ||
+        !system->emitters[emitter].active) {
+        luaL_error(L, "Bad particle emitter %d", (int)emitter);
+    }
+
+    return &system->emitters[emitter];
+}
+
+static void read_field(lua_State *L, int index, const char *name,
+                       float *value) {
+    lua_getfield(L, index, name);
+    if (!lua_isnil(L, -1)) {
+        *value = luaL_checknumber(L, -1);
+    }
+    lua_pop(L, 1);
+}
+
+// Fields of the table at the index that are set replace the emitter's
+// values: x, y, z, vx, vy, vz, spread, rate, life_min, life_max
+static void read_emitter(lua_State *L, int index,
+                         struct particle_emitter *emitter) {
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    read_field(L, index, "x", &emitter->position[0]);
+    read_field(L, index, "y", &emitter->position[1]);
+    read_field(L, index, "z", &emitter->position[2]);
+    read_field(L, index, "vx", &emitter->velocity[0]);
+    read_field(L, index, "vy", &emitter->velocity[1]);
+    read_field(L, index, "vz", &emitter->velocity[2]);
+    read_field(L, index, "spread", &emitter->spread);
+    read_field(L, index, "rate", &emitter->rate);
+    read_field(L, index, "life_min", &emitter->life_min);
+    read_field(L, index, "life_max", &emitter->life_max);
+
+    if (emitter->life_max < emitter->life_min) {
+        emitter->life_max = emitter->life_min;
+    }
+}
+
+int particle_lua_CreateSystem(lua_State *L) {
+    lua_Integer capacity = luaL_checkinteger(L, 1);
+    if (capacity < 0) {
+        return luaL_error(L, "Bad particle capacity %d", (int)capacity);
+    }
+
+    struct particle_system *system = particle_system_create(capacity);
+    if (!system) {
+        return luaL_error(L, "Error creating particle system");
+    }
+
+    lua_pushlightuserdata(L, system);
+
+    return 1;
+}
+
+int particle_lua_DeleteSystem(lua_State *L) {
+    particle_system_destroy(check_system(L, 1));
+
+    return 0;
+}
+
+// system, {x=, y=, z=, vx=, vy=, vz=, spread=, rate=, life_min=, life_max=}
+int particle_lua_AddEmitter(lua_State *L) {
+    struct particle_system *system = check_system(L, 1);
+
+    struct particle_emitter emitter = {
+        .spread = 1,
+        .rate = 100,
+        .life_min = 1,
+        .life_max = 2,
+    };
+    read_emitter(L, 2, &emitter);
+
+    int index = particle_system_add_emitter(system, &emitter);
+    if (index < 0) {
+        return luaL_error(L, "Too many particle emitters, the limit is %d",
+                          PARTICLE_MAX_EMITTERS);
+    }
+
+    lua_pushinteger(L, index);
+
+    return 1;
+}
+
+// system, emitter, table of the fields to change
+int particle_lua_SetEmitter(lua_State *L) {
+    struct particle_system *system = check_system(L, 1);
+
+    read_emitter(L, 3, check_emitter(L, system, 2));
+
+    return 0;
+}
+
+// Particles already emitted live out their lives
+int particle_lua_RemoveEmitter(lua_State *L) {
+    struct particle_system *system = check_system(L, 1);
+
+    check_emitter(L, system, 2)->active = 0;
+
+    return 0;
+}
+
+int particle_lua_SetGravity(lua_State *L) {
+    struct particle_system *system = check_system(L, 1);
+
+    system->gravity[0] = luaL_checknumber(L, 2);
+    system->gravity[1] = luaL_checknumber(L, 3);
+    system->gravity[2] = luaL_checknumber(L, 4);
+
+    return 0;
+}
+
+int particle_lua_SetDrag(lua_State *L) {
+    check_system(L, 1)->drag = luaL_checknumber(L, 2);
+
+    return 0;
+}
+
+// system, dt. Returns the number of live particles.
+int particle_lua_Update(lua_State *L) {
+    struct particle_system *system = check_system(L, 1);
+
+    lua_pushinteger(L, particle_system_update(system, luaL_checknumber(L, 2)));
+
+    return 1;
+}
+
+// Live, spawned by the last update, killed by the last update
+int particle_lua_Count(lua_State *L) {
+    struct particle_system *system = check_system(L, 1);
+
+    lua_pushinteger(L, system->count);
+    lua_pushinteger(L, system->last_spawned);
+    lua_pushinteger(L, system->last_killed);
+
+    return 3;
+}
+
+// target, system. Streams the live particles into the bound buffer, laid out
+// as struct particle_vertex, and returns how many there are to draw.
+int draw_lua_StreamParticles(struct draw_data *data, lua_State *L) {
+    GLenum target = get_integer_arg(L);
+    struct particle_system *system = check_system(L, 1);
+
+    // Orphan the old storage, sized for a full system so the driver can
+    // hand back the same block every frame
+    size_t size = system->capacity * sizeof(struct particle_vertex);
+    glBufferData(target, size, NULL, GL_STREAM_DRAW);
+    memory_gpu_alloc_lua(data->memory, MEMORY_GPU_BUFFER,
+                         handle_bound_buffer(&data->handles, target), size,
+                         GL_STREAM_DRAW, L);
+
+    if (system->count == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    struct particle_vertex *vertices = glMapBufferRange(
+        target, 0, system->count * sizeof(struct particle_vertex),
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!vertices) {
+        return luaL_error(L, "Error mapping particle vertex buffer");
+    }
+
+    particle_system_write_vertices(system, vertices);
+
+    glUnmapBuffer(target);
+
+    lua_pushinteger(L, system->count);
+
+    return 1;
+}
+
+void particle_system_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(StreamParticles);
+
+    lua_register(L, "particle_CreateSystem", particle_lua_CreateSystem);
+    lua_register(L, "particle_DeleteSystem", particle_lua_DeleteSystem);
+    lua_register(L, "particle_AddEmitter", particle_lua_AddEmitter);
+    lua_register(L, "particle_SetEmitter", particle_lua_SetEmitter);
+    lua_register(L, "particle_RemoveEmitter", particle_lua_RemoveEmitter);
+    lua_register(L, "particle_SetGravity", particle_lua_SetGravity);
+    lua_register(L, "particle_SetDrag", particle_lua_SetDrag);
+    lua_register(L, "particle_Update", particle_lua_Update);
+    lua_register(L, "particle_Count", particle_lua_Count);
+}
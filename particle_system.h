@@ -0,0 +1,110 @@
+#ifndef PARTICLE_SYSTEM_H
+#define PARTICLE_SYSTEM_H
+
+#include "lua.h"
+#include "draw.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PARTICLE_MAX_EMITTERS 32
+#define PARTICLE_MAX_WORKERS 16
+
+// Counts below this are simulated on the calling thread alone
+#define PARTICLE_JOB_THRESHOLD 65536
+
+// Vertex layout written into the streaming buffer, the same as the compute
+// shader particles use:
+//   location 0: vec4, xyz position and w seconds of life left
+struct particle_vertex {
+    float x, y, z;
+    float life;
+};
+
+struct particle_emitter {
+    int active;
+    float position[3];
+    // Each particle gets velocity plus a random offset up to spread along
+    // each axis
+    float velocity[3];
+    float spread;
+    // Particles per second
+    float rate;
+    float life_min, life_max;
+    // Fraction of a particle carried over between updates
+    float accumulator;
+};
+
+struct particle_system;
+
+// Splits a range of particles across threads. The calling thread takes the
+// first slice, so there's one worker fewer than there are cores.
+struct particle_workers {
+    pthread_t threads[PARTICLE_MAX_WORKERS];
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation;
+    // Each worker takes the next slice of the job when it wakes up
+    size_t next_slice;
+    int remaining;
+    int quit;
+
+    void (*job)(struct particle_system *, size_t, size_t);
+    struct particle_system *system;
+    size_t job_count;
+};
+
+// Particles are stored as one array per component, padded to a multiple of
+// four and 16 byte aligned so the kernels work four at a time. Dead
+// particles are replaced with the last live one, so the live particles are
+// always the first count entries.
+struct particle_system {
+    size_t count;
+    size_t capacity;
+
+    float *x, *y, *z;
+    float *vx, *vy, *vz;
+    float *age;
+    float *life;
+
+    struct particle_emitter emitters[PARTICLE_MAX_EMITTERS];
+
+    float gravity[3];
+    // Fraction of velocity lost per second
+    float drag;
+
+    uint32_t random;
+
+    // Set for the duration of a job
+    float dt;
+    struct particle_vertex *vertices;
+
+    // Started on the first update with enough particles to need them
+    struct particle_workers *workers;
+
+    // Stats from the last update
+    size_t last_spawned;
+    size_t last_killed;
+};
+
+struct particle_system *particle_system_create(size_t);
+void particle_system_destroy(struct particle_system *);
+
+// Returns the emitter, or -1 if they're all in use
+int particle_system_add_emitter(struct particle_system *,
+                                const struct particle_emitter *);
+
+// Integrates, kills expired particles, then spawns from the emitters.
+// Returns the number of live particles.
+size_t particle_system_update(struct particle_system *, float);
+// Writes every live particle to vertices, which needs room for count
+void particle_system_write_vertices(struct particle_system *,
+                                    struct particle_vertex *);
+
+void particle_system_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,88 @@
+-- CPU particle systems. Simulation runs in C, and each frame the live
+-- particles are streamed into a vertex buffer laid out like the compute
+-- shader particles, so both draw with the same shaders.
+local gl = require 'gl'
+
+local M = {}
+
+-- Particle system functions exposed from C
+local copy_funcs = {
+  CreateSystem="create_system",
+  DeleteSystem="delete_system",
+  AddEmitter="add_emitter",
+  SetEmitter="set_emitter",
+  RemoveEmitter="remove_emitter",
+  SetGravity="set_gravity",
+  SetDrag="set_drag",
+  Update="update",
+  Count="count",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["particle_" .. c_name]
+end
+
+-- vec4: xyz position, w seconds of life left
+local VERTEX_SIZE = 16
+
+-- Buffer, vertex array and program to draw a system with
+function M.create_renderer(perspective_matrix, model_matrix)
+  local renderer = {
+    program = gl.create_program({
+      {gl.VERTEX_SHADER, "particles.vertex.glsl"},
+      {gl.FRAGMENT_SHADER, "particles.fragment.glsl"},
+    }),
+    buffer = gl.create_buffer_object(),
+    vertex_array = gl.create_vertex_array(),
+  }
+
+  gl.with_vertex_array(
+    renderer.vertex_array,
+    function()
+      gl.bind_buffer(gl.ARRAY_BUFFER, renderer.buffer)
+      gl.enable_vertex_attrib_array(0)
+      gl.vertex_attrib_pointer(0, 4, gl.FLOAT, gl.FALSE, VERTEX_SIZE, 0)
+    end
+  )
+  gl.bind_buffer(gl.ARRAY_BUFFER, nil)
+
+  gl.with_program(
+    renderer.program,
+    function()
+      gl.uniform_matrix_float(
+        gl.get_uniform_location(renderer.program, "perspective_matrix"), 4, 4,
+        perspective_matrix)
+      gl.uniform_matrix_float(
+        gl.get_uniform_location(renderer.program, "model_matrix"), 4, 4,
+        model_matrix)
+    end
+  )
+
+  return renderer
+end
+
+function M.draw(renderer, system)
+  gl.bind_buffer(gl.ARRAY_BUFFER, renderer.buffer)
+  local count = gl.stream_particles(gl.ARRAY_BUFFER, system)
+  gl.bind_buffer(gl.ARRAY_BUFFER, nil)
+
+  gl.with_program(
+    renderer.program,
+    function()
+      gl.with_vertex_array(
+        renderer.vertex_array,
+        function()
+          gl.draw_arrays(gl.POINTS, 0, count)
+        end
+      )
+    end
+  )
+end
+
+function M.delete_renderer(renderer)
+  gl.delete_vertex_array(renderer.vertex_array)
+  gl.delete_buffer_object(renderer.buffer)
+  gl.delete_program(renderer.program)
+end
+
+return M
@@ -0,0 +1,53 @@
+#version 430
+
+layout(local_size_x = 256) in;
+
+struct particle {
+    // w is the remaining life in seconds
+    vec4 position;
+    vec4 velocity;
+};
+
+layout(std430, binding = 0) buffer particle_buffer {
+    particle particles[];
+};
+
+uniform int count;
+uniform int frame;
+// Respawn everything, for the first frame when the buffer is garbage
+uniform int reset;
+uniform float dt;
+
+float random(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return float(x) / 4294967295.0;
+}
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= uint(count)) {
+        return;
+    }
+
+    particle p = particles[i];
+    p.position.w -= dt;
+
+    if (reset != 0 || !(p.position.w > 0.0)) {
+        uint seed = i * 4u + uint(frame) * 1664525u;
+        float angle = random(seed) * 6.2831853;
+        float spread = random(seed + 1u) * 0.6;
+
+        p.position = vec4(0.0, 0.0, 0.0, 1.0 + random(seed + 2u) * 2.0);
+        p.velocity = vec4(cos(angle) * spread, 2.0 + random(seed + 3u),
+                          sin(angle) * spread, 0.0);
+    } else {
+        p.velocity.y -= 1.5 * dt;
+        p.position.xyz += p.velocity.xyz * dt;
+    }
+
+    particles[i] = p;
+}
@@ -0,0 +1,10 @@
+#version 330
+
+in float life;
+
+out vec4 out_color;
+
+void main() {
+    float t = clamp(life / 3.0, 0.0, 1.0);
+    out_color = vec4(1.0, 0.3 + 0.7 * t, t * t, 1.0);
+}
@@ -0,0 +1,13 @@
+#version 330
+
+layout(location = 0) in vec4 position;
+
+uniform mat4 perspective_matrix;
+uniform mat4 model_matrix;
+
+out float life;
+
+void main() {
+    gl_Position = perspective_matrix * model_matrix * vec4(position.xyz, 1.0);
+    life = position.w;
+}
@@ -0,0 +1,41 @@
+#include "radix_sort.h"
+
+void radix_sort(struct sort_entry **entries, struct sort_entry **tmp,
+                size_t count, int key_bits) {
+    struct sort_entry *src = *entries;
+    struct sort_entry *dst = *tmp;
+
+    if (count == 0) {
+        return;
+    }
+
+    for (int shift = 0; shift < key_bits; shift += 8) {
+        size_t offsets[256] = {0};
+
+        for (size_t i = 0; i < count; i++) {
+            offsets[(src[i].key >> shift) & 0xff]++;
+        }
+
+        if (offsets[(src[0].key >> shift) & 0xff] == count) {
+            continue;
+        }
+
+        size_t total = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t c = offsets[b];
+            offsets[b] = total;
+            total += c;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            dst[offsets[(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+
+        struct sort_entry *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    *entries = src;
+    *tmp = dst;
+}
@@ -0,0 +1,20 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Something to sort by key, with its index in the caller's array
+struct sort_entry {
+    uint64_t key;
+    uint32_t index;
+};
+
+// Stable LSD radix sort on the low key_bits of each key, a byte at a time.
+// Passes where every key has the same byte are skipped, which is most of
+// them when keys only use a few distinct values. Sorts between *entries
+// and *tmp, swapping the two so *entries ends up holding the result.
+void radix_sort(struct sort_entry **entries, struct sort_entry **tmp,
+                size_t count, int key_bits);
+
+#endif
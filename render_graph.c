@@ -0,0 +1,901 @@
+#include "render_graph.h"
+
+#include "draw_interface.h"
+#include "log.h"
+#include "resolution.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct render_graph *render_graph_create(void) {
+    struct render_graph *graph = calloc(1, sizeof(*graph));
+    if (!graph) {
+        return NULL;
+    }
+
+    render_graph_add_attachment(graph, RENDER_GRAPH_BACKBUFFER, 0, 0, GL_RGBA8,
+                                1);
+    graph->attachments[0].imported = 1;
+
+    return graph;
+}
+
+static void release_gl_objects(struct render_graph *graph) {
+    for (int i = 0; i < graph->pass_count; i++) {
+        struct render_graph_pass *pass = &graph->passes[i];
+        if (pass->framebuffer) {
+            glDeleteFramebuffers(1, &pass->framebuffer);
+            pass->framebuffer = 0;
+        }
+    }
+
+    for (int i = 0; i < graph->texture_count; i++) {
+        memory_gpu_free(graph->memory, MEMORY_GPU_TEXTURE,
+                        graph->textures[i].name);
+        glDeleteTextures(1, &graph->textures[i].name);
+    }
+    graph->texture_count = 0;
+
+    graph->compiled = 0;
+}
+
+void render_graph_destroy(struct render_graph *graph, lua_State *L) {
+    release_gl_objects(graph);
+
+    for (int i = 0; i < graph->attachment_count; i++) {
+        free(graph->attachments[i].name);
+    }
+    for (int i = 0; i < graph->pass_count; i++) {
+        free(graph->passes[i].name);
+        luaL_unref(L, LUA_REGISTRYINDEX, graph->passes[i].callback);
+    }
+
+    free(graph);
+}
+
+int render_graph_add_attachment(struct render_graph *graph, const char *name,
+                                GLsizei width, GLsizei height, GLenum format,
+                                int persistent) {
+    if (graph->attachment_count == RENDER_GRAPH_MAX_ATTACHMENTS) {
+        return -1;
+    }
+
+    struct render_graph_attachment *attachment =
+        &graph->attachments[graph->attachment_count];
+    memset(attachment, 0x0, sizeof(*attachment));
+
+    attachment->name = strdup(name);
+    attachment->width = width;
+    attachment->height = height;
+    attachment->format = format;
+    attachment->persistent = persistent;
+
+    graph->compiled = 0;
+
+    return graph->attachment_count++;
+}
+
+int render_graph_find_attachment(struct render_graph *graph,
+                                 const char *name) {
+    for (int i = 0; i < graph->attachment_count; i++) {
+        if (strcmp(graph->attachments[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int render_graph_add_pass(struct render_graph *graph, const char *name,
+                          int callback) {
+    if (graph->pass_count == RENDER_GRAPH_MAX_PASSES) {
+        return -1;
+    }
+
+    struct render_graph_pass *pass = &graph->passes[graph->pass_count];
+    memset(pass, 0x0, sizeof(*pass));
+
+    pass->name = strdup(name);
+    pass->depth = -1;
+    pass->callback = callback;
+
+    graph->compiled = 0;
+
+    return graph->pass_count++;
+}
+
+static int pass_writes(const struct render_graph_pass *pass, int attachment) {
+    for (int i = 0; i < pass->color_count; i++) {
+        if (pass->colors[i] == attachment) {
+            return 1;
+        }
+    }
+
+    return pass->depth == attachment;
+}
+
+static int pass_reads(const struct render_graph_pass *pass, int attachment) {
+    for (int i = 0; i < pass->input_count; i++) {
+        if (pass->inputs[i] == attachment) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Fills deps[p][q] when pass q has to run before pass p. Readers come after
+// every writer of what they read. Passes writing the same attachment run in
+// the order they were added, and later ones keep what earlier ones drew.
+static void find_dependencies(struct render_graph *graph,
+                              char deps[][RENDER_GRAPH_MAX_PASSES]) {
+    for (int p = 0; p < graph->pass_count; p++) {
+        struct render_graph_pass *pass = &graph->passes[p];
+
+        for (int q = 0; q < graph->pass_count; q++) {
+            deps[p][q] = 0;
+            if (p == q) {
+                continue;
+            }
+
+            struct render_graph_pass *other = &graph->passes[q];
+
+            for (int a = 0; a < graph->attachment_count; a++) {
+                if (!pass_writes(other, a)) {
+                    continue;
+                }
+
+                if (pass_writes(pass, a) ? q < p : pass_reads(pass, a)) {
+                    deps[p][q] = 1;
+                }
+            }
+        }
+    }
+}
+
+// Kahn's algorithm over the live passes, taking the earliest added pass
+// whenever there's a choice so the order stays predictable
+static int order_passes(struct render_graph *graph,
+                        char deps[][RENDER_GRAPH_MAX_PASSES],
+                        const char *live) {
+    int done[RENDER_GRAPH_MAX_PASSES] = {0};
+    int live_count = 0;
+    for (int p = 0; p < graph->pass_count; p++) {
+        live_count += live[p];
+    }
+
+    graph->order_count = 0;
+
+    while (graph->order_count < live_count) {
+        int next = -1;
+
+        for (int p = 0; p < graph->pass_count && next < 0; p++) {
+            if (!live[p] || done[p]) {
+                continue;
+            }
+
+            int ready = 1;
+            for (int q = 0; q < graph->pass_count; q++) {
+                if (deps[p][q] && live[q] && !done[q]) {
+                    ready = 0;
+                    break;
+                }
+            }
+
+            if (ready) {
+                next = p;
+            }
+        }
+
+        if (next < 0) {
+            fprintf(stderr, "Render graph has a dependency cycle\n");
+            return 1;
+        }
+
+        done[next] = 1;
+        graph->order[graph->order_count++] = next;
+    }
+
+    return 0;
+}
+
+static void attachment_size(struct render_graph *graph,
+                            const struct render_graph_attachment *attachment,
+                            GLsizei *width, GLsizei *height) {
+    *width = attachment->width ? attachment->width : graph->drawable_width;
+    *height = attachment->height ? attachment->height : graph->drawable_height;
+}
+
+static int is_depth_format(GLenum format) {
+    return format == GL_DEPTH_COMPONENT16 ||
+           format == GL_DEPTH_COMPONENT24 ||
+           format == GL_DEPTH_COMPONENT32F ||
+           format == GL_DEPTH24_STENCIL8 ||
+           format == GL_DEPTH32F_STENCIL8;
+}
+
+static GLenum depth_attachment_point(GLenum format) {
+    if (format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8) {
+        return GL_DEPTH_STENCIL_ATTACHMENT;
+    }
+
+    return GL_DEPTH_ATTACHMENT;
+}
+
+// glTexImage2D wants a format and type to go with the internal format even
+// when there's no data
+static void pixel_transfer_format(GLenum internal_format, GLenum *format,
+                                  GLenum *type) {
+    switch (internal_format) {
+    case GL_DEPTH_COMPONENT16:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+        *format = GL_DEPTH_COMPONENT;
+        *type = GL_FLOAT;
+        break;
+    case GL_DEPTH24_STENCIL8:
+        *format = GL_DEPTH_STENCIL;
+        *type = GL_UNSIGNED_INT_24_8;
+        break;
+    case GL_DEPTH32F_STENCIL8:
+        *format = GL_DEPTH_STENCIL;
+        *type = GL_FLOAT_32_UNSIGNED_INT_24_8_REV;
+        break;
+    case GL_R8:
+    case GL_R16F:
+    case GL_R32F:
+        *format = GL_RED;
+        *type = GL_FLOAT;
+        break;
+    case GL_RG8:
+    case GL_RG16F:
+    case GL_RG32F:
+        *format = GL_RG;
+        *type = GL_FLOAT;
+        break;
+    case GL_R11F_G11F_B10F:
+        *format = GL_RGB;
+        *type = GL_FLOAT;
+        break;
+    default:
+        *format = GL_RGBA;
+        *type = GL_UNSIGNED_BYTE;
+        break;
+    }
+}
+
+// What the driver most likely stores per pixel, for memory accounting
+static size_t bytes_per_pixel(GLenum internal_format) {
+    switch (internal_format) {
+    case GL_R8:
+        return 1;
+    case GL_RG8:
+    case GL_R16F:
+    case GL_DEPTH_COMPONENT16:
+        return 2;
+    case GL_RG16F:
+    case GL_R32F:
+    case GL_R11F_G11F_B10F:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+    case GL_DEPTH24_STENCIL8:
+        return 4;
+    case GL_RGBA16F:
+    case GL_RG32F:
+    case GL_DEPTH32F_STENCIL8:
+        return 8;
+    case GL_RGBA32F:
+        return 16;
+    default:
+        return 4;
+    }
+}
+
+static int find_lifetimes(struct render_graph *graph) {
+    for (int a = 0; a < graph->attachment_count; a++) {
+        graph->attachments[a].first_use = -1;
+        graph->attachments[a].last_use = -1;
+        graph->attachments[a].texture = -1;
+    }
+
+    for (int i = 0; i < graph->order_count; i++) {
+        struct render_graph_pass *pass = &graph->passes[graph->order[i]];
+
+        for (int a = 0; a < graph->attachment_count; a++) {
+            if (!pass_writes(pass, a) && !pass_reads(pass, a)) {
+                continue;
+            }
+
+            struct render_graph_attachment *attachment = &graph->attachments[a];
+
+            if (attachment->first_use < 0) {
+                if (!pass_writes(pass, a) && !attachment->persistent) {
+                    fprintf(stderr, "Render graph pass '%s' reads '%s' "
+                            "before anything writes it\n",
+                            pass->name, attachment->name);
+                    return 1;
+                }
+                attachment->first_use = i;
+            }
+            attachment->last_use = i;
+        }
+    }
+
+    graph->drawable_sized = 0;
+    for (int a = 0; a < graph->attachment_count; a++) {
+        struct render_graph_attachment *attachment = &graph->attachments[a];
+        if (!attachment->imported && attachment->first_use >= 0 &&
+            (!attachment->width || !attachment->height)) {
+            graph->drawable_sized = 1;
+        }
+    }
+
+    return 0;
+}
+
+// Hands out textures in order of first use, reusing one whose previous
+// attachment is dead by the time this one is first written
+static int allocate_textures(struct render_graph *graph) {
+    int assigned[RENDER_GRAPH_MAX_ATTACHMENTS] = {0};
+
+    for (;;) {
+        int next = -1;
+        for (int a = 0; a < graph->attachment_count; a++) {
+            struct render_graph_attachment *attachment = &graph->attachments[a];
+            if (assigned[a] || attachment->imported ||
+                attachment->first_use < 0) {
+                continue;
+            }
+            if (next < 0 ||
+                attachment->first_use < graph->attachments[next].first_use) {
+                next = a;
+            }
+        }
+
+        if (next < 0) {
+            break;
+        }
+        assigned[next] = 1;
+
+        struct render_graph_attachment *attachment = &graph->attachments[next];
+
+        GLsizei width, height;
+        attachment_size(graph, attachment, &width, &height);
+
+        int texture = -1;
+        for (int t = 0; t < graph->texture_count && !attachment->persistent;
+             t++) {
+            struct render_graph_texture *candidate = &graph->textures[t];
+            if (candidate->width == width && candidate->height == height &&
+                candidate->format == attachment->format &&
+                candidate->last_use < attachment->first_use) {
+                texture = t;
+                break;
+            }
+        }
+
+        if (texture < 0) {
+            texture = graph->texture_count++;
+
+            struct render_graph_texture *t = &graph->textures[texture];
+            t->width = width;
+            t->height = height;
+            t->format = attachment->format;
+
+            GLenum format, type;
+            pixel_transfer_format(attachment->format, &format, &type);
+
+            glGenTextures(1, &t->name);
+            glBindTexture(GL_TEXTURE_2D, t->name);
+            glTexImage2D(GL_TEXTURE_2D, 0, attachment->format, width, height, 0,
+                         format, type, NULL);
+            memory_gpu_alloc(graph->memory, MEMORY_GPU_TEXTURE, t->name,
+                             (size_t)width * height *
+                                 bytes_per_pixel(attachment->format),
+                             attachment->format, "render graph");
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        } else {
+            log_debug("Render graph attachment '%s' aliases texture %d",
+                   attachment->name, texture);
+        }
+
+        graph->textures[texture].last_use =
+            attachment->persistent ? INT_MAX : attachment->last_use;
+        attachment->texture = texture;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return 0;
+}
+
+// Transient attachments are undefined when first written and dead after
+// their last use, so the driver doesn't have to load or store them
+static void find_discards(struct render_graph *graph, int position,
+                          struct render_graph_pass *pass) {
+    pass->discard_begin_count = 0;
+    pass->discard_end_count = 0;
+    pass->dead_input_count = 0;
+
+    int count = pass->color_count + (pass->depth >= 0 ? 1 : 0);
+    for (int i = 0; i < count; i++) {
+        int a = i < pass->color_count ? pass->colors[i] : pass->depth;
+        struct render_graph_attachment *attachment = &graph->attachments[a];
+        if (attachment->imported || attachment->persistent) {
+            continue;
+        }
+
+        GLenum point = i < pass->color_count
+                           ? GL_COLOR_ATTACHMENT0 + (GLenum)i
+                           : depth_attachment_point(attachment->format);
+
+        if (attachment->first_use == position) {
+            pass->discard_begin[pass->discard_begin_count++] = point;
+        }
+        if (attachment->last_use == position) {
+            pass->discard_end[pass->discard_end_count++] = point;
+        }
+    }
+
+    for (int i = 0; i < pass->input_count; i++) {
+        struct render_graph_attachment *attachment =
+            &graph->attachments[pass->inputs[i]];
+        if (attachment->persistent || attachment->last_use != position) {
+            continue;
+        }
+
+        pass->dead_inputs[pass->dead_input_count++] =
+            graph->textures[attachment->texture].name;
+    }
+}
+
+static int create_framebuffer(struct render_graph *graph,
+                              struct render_graph_pass *pass) {
+    int backbuffer = 0;
+    for (int i = 0; i < pass->color_count; i++) {
+        backbuffer |= graph->attachments[pass->colors[i]].imported;
+    }
+
+    if (backbuffer) {
+        if (pass->color_count != 1 || pass->depth >= 0) {
+            fprintf(stderr, "Render graph pass '%s' can't mix the backbuffer "
+                    "with other attachments\n", pass->name);
+            return 1;
+        }
+
+        pass->framebuffer = 0;
+        pass->width = graph->drawable_width;
+        pass->height = graph->drawable_height;
+        return 0;
+    }
+
+    glGenFramebuffers(1, &pass->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, pass->framebuffer);
+
+    GLenum draw_buffers[RENDER_GRAPH_MAX_COLORS];
+    for (int i = 0; i < pass->color_count; i++) {
+        struct render_graph_attachment *attachment =
+            &graph->attachments[pass->colors[i]];
+
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i,
+                               GL_TEXTURE_2D,
+                               graph->textures[attachment->texture].name, 0);
+        draw_buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    glDrawBuffers(pass->color_count, draw_buffers);
+
+    int size_from = pass->color_count > 0 ? pass->colors[0] : pass->depth;
+
+    if (pass->depth >= 0) {
+        struct render_graph_attachment *attachment =
+            &graph->attachments[pass->depth];
+
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               depth_attachment_point(attachment->format),
+                               GL_TEXTURE_2D,
+                               graph->textures[attachment->texture].name, 0);
+    }
+
+    attachment_size(graph, &graph->attachments[size_from], &pass->width,
+                    &pass->height);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Render graph pass '%s' framebuffer is incomplete: "
+                "0x%x\n", pass->name, status);
+        return 1;
+    }
+
+    return 0;
+}
+
+int render_graph_compile(struct render_graph *graph, struct draw_data *data) {
+    release_gl_objects(graph);
+    graph->memory = data->memory;
+    graph->handles = &data->handles;
+
+    int width, height;
+    SDL_GL_GetDrawableSize(data->window, &width, &height);
+    graph->drawable_width = width;
+    graph->drawable_height = height;
+
+    graph->can_invalidate =
+        SDL_GL_ExtensionSupported("GL_ARB_invalidate_subdata");
+
+    char deps[RENDER_GRAPH_MAX_PASSES][RENDER_GRAPH_MAX_PASSES];
+    find_dependencies(graph, deps);
+
+    // Passes are live if they write something visible outside the graph, or
+    // something a live pass depends on
+    char live[RENDER_GRAPH_MAX_PASSES] = {0};
+    for (int p = 0; p < graph->pass_count; p++) {
+        for (int a = 0; a < graph->attachment_count; a++) {
+            if (graph->attachments[a].persistent &&
+                pass_writes(&graph->passes[p], a)) {
+                live[p] = 1;
+            }
+        }
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int p = 0; p < graph->pass_count; p++) {
+            for (int q = 0; q < graph->pass_count; q++) {
+                if (live[p] && deps[p][q] && !live[q]) {
+                    live[q] = 1;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    for (int p = 0; p < graph->pass_count; p++) {
+        if (!live[p]) {
+            log_debug("Render graph pass '%s' is unused, culling it",
+                   graph->passes[p].name);
+        }
+    }
+
+    if (order_passes(graph, deps, live) != 0) {
+        return 1;
+    }
+    if (find_lifetimes(graph) != 0) {
+        return 1;
+    }
+    if (allocate_textures(graph) != 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < graph->order_count; i++) {
+        struct render_graph_pass *pass = &graph->passes[graph->order[i]];
+
+        if (create_framebuffer(graph, pass) != 0) {
+            release_gl_objects(graph);
+            return 1;
+        }
+
+        find_discards(graph, i, pass);
+    }
+
+    log_debug("Compiled render graph: %d of %d passes, %d textures for %d "
+           "attachments", graph->order_count, graph->pass_count,
+           graph->texture_count, graph->attachment_count - 1);
+
+    graph->compiled = 1;
+
+    return 0;
+}
+
+// Pass callbacks are called with the pass name, then the `nargs` values on
+// top of the stack. Passes writing the backbuffer draw to the target, which
+// is left bound afterwards.
+void render_graph_execute(struct render_graph *graph, lua_State *L,
+                          int nargs, const struct render_graph_target *target) {
+    int args = lua_gettop(L) - nargs + 1;
+
+    for (int i = 0; i < graph->order_count; i++) {
+        struct render_graph_pass *pass = &graph->passes[graph->order[i]];
+
+        if (pass->framebuffer) {
+            glBindFramebuffer(GL_FRAMEBUFFER, pass->framebuffer);
+            glViewport(0, 0, pass->width, pass->height);
+        } else {
+            glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+            glViewport(0, 0, target->width, target->height);
+        }
+
+        if (graph->can_invalidate && pass->discard_begin_count > 0) {
+            glInvalidateFramebuffer(GL_FRAMEBUFFER, pass->discard_begin_count,
+                                    pass->discard_begin);
+        }
+
+        for (int j = 0; j < pass->input_count; j++) {
+            struct render_graph_attachment *attachment =
+                &graph->attachments[pass->inputs[j]];
+
+            glActiveTexture(GL_TEXTURE0 + j);
+            glBindTexture(GL_TEXTURE_2D,
+                          graph->textures[attachment->texture].name);
+            if (j == 0) {
+                // For C code drawing in the callback to put back
+                handle_bind_texture(graph->handles,
+                                    graph->textures[attachment->texture].name);
+            }
+        }
+        glActiveTexture(GL_TEXTURE0);
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pass->callback);
+        lua_pushstring(L, pass->name);
+        for (int j = 0; j < nargs; j++) {
+            lua_pushvalue(L, args + j);
+        }
+        lua_call(L, nargs + 1, 0);
+
+        for (int j = 0; j < pass->input_count; j++) {
+            glActiveTexture(GL_TEXTURE0 + j);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        handle_bind_texture(graph->handles, 0);
+
+        if (graph->can_invalidate) {
+            if (pass->discard_end_count > 0) {
+                glInvalidateFramebuffer(GL_FRAMEBUFFER, pass->discard_end_count,
+                                        pass->discard_end);
+            }
+            for (int j = 0; j < pass->dead_input_count; j++) {
+                glInvalidateTexImage(pass->dead_inputs[j], 0);
+            }
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+    glViewport(0, 0, target->width, target->height);
+}
+
+int draw_lua_CreateRenderGraph(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct render_graph *graph = render_graph_create();
+    if (!graph) {
+        return luaL_error(L, "Error creating render graph");
+    }
+
+    lua_pushlightuserdata(L, graph);
+
+    return 1;
+}
+
+int draw_lua_DeleteRenderGraph(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct render_graph *graph = lua_touserdata(L, 1);
+
+    render_graph_destroy(graph, L);
+
+    return 0;
+}
+
+// graph, name, width, height, format, persistent
+int draw_lua_RenderGraphAttachment(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct render_graph *graph = lua_touserdata(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+
+    if (render_graph_find_attachment(graph, name) >= 0) {
+        return luaL_error(L, "Render graph already has attachment '%s'", name);
+    }
+
+    int index = render_graph_add_attachment(graph, name, luaL_checkinteger(L, 3),
+                                            luaL_checkinteger(L, 4),
+                                            luaL_checkinteger(L, 5),
+                                            lua_toboolean(L, 6));
+    if (index < 0) {
+        return luaL_error(L, "Too many render graph attachments");
+    }
+
+    return 0;
+}
+
+// Reads a list of attachment names from field `field` of the table at
+// `index` into `out`. Returns the number read.
+static int read_attachment_list(lua_State *L, struct render_graph *graph,
+                                int index, const char *field, int *out,
+                                int max) {
+    lua_getfield(L, index, field);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    int count = get_lua_len(L, -1);
+    if (count > max) {
+        return luaL_error(L, "Render graph pass has too many %s", field);
+    }
+
+    for (int i = 0; i < count; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        const char *name = luaL_checkstring(L, -1);
+
+        out[i] = render_graph_find_attachment(graph, name);
+        if (out[i] < 0) {
+            return luaL_error(L, "Unknown render graph attachment '%s'", name);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    return count;
+}
+
+// graph, name, {colors = {...}, depth = name, inputs = {...}}, function
+int draw_lua_RenderGraphPass(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct render_graph *graph = lua_touserdata(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    int colors[RENDER_GRAPH_MAX_COLORS];
+    int inputs[RENDER_GRAPH_MAX_INPUTS];
+    int color_count = read_attachment_list(L, graph, 3, "colors", colors,
+                                           RENDER_GRAPH_MAX_COLORS);
+    int input_count = read_attachment_list(L, graph, 3, "inputs", inputs,
+                                           RENDER_GRAPH_MAX_INPUTS);
+
+    for (int i = 0; i < input_count; i++) {
+        if (graph->attachments[inputs[i]].imported) {
+            return luaL_error(L, "Render graph pass '%s' can't read '%s'",
+                              name, graph->attachments[inputs[i]].name);
+        }
+    }
+
+    int depth = -1;
+    lua_getfield(L, 3, "depth");
+    if (!lua_isnil(L, -1)) {
+        const char *depth_name = luaL_checkstring(L, -1);
+        depth = render_graph_find_attachment(graph, depth_name);
+        if (depth < 0 ||
+            !is_depth_format(graph->attachments[depth].format)) {
+            return luaL_error(L, "'%s' isn't a depth attachment", depth_name);
+        }
+    }
+    lua_pop(L, 1);
+
+    if (color_count == 0 && depth < 0) {
+        return luaL_error(L, "Render graph pass '%s' has no attachments", name);
+    }
+
+    for (int i = 0; i < input_count; i++) {
+        int feedback = inputs[i] == depth;
+        for (int j = 0; j < color_count; j++) {
+            feedback |= inputs[i] == colors[j];
+        }
+
+        if (feedback) {
+            return luaL_error(L, "Render graph pass '%s' reads and writes '%s'",
+                              name, graph->attachments[inputs[i]].name);
+        }
+    }
+
+    lua_pushvalue(L, 4);
+    int callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    int index = render_graph_add_pass(graph, name, callback);
+    if (index < 0) {
+        luaL_unref(L, LUA_REGISTRYINDEX, callback);
+        return luaL_error(L, "Too many render graph passes");
+    }
+
+    struct render_graph_pass *pass = &graph->passes[index];
+    memcpy(pass->colors, colors, sizeof(colors[0]) * color_count);
+    pass->color_count = color_count;
+    memcpy(pass->inputs, inputs, sizeof(inputs[0]) * input_count);
+    pass->input_count = input_count;
+    pass->depth = depth;
+
+    return 0;
+}
+
+int draw_lua_CompileRenderGraph(struct draw_data *data, lua_State *L) {
+    struct render_graph *graph = lua_touserdata(L, 1);
+
+    if (render_graph_compile(graph, data) != 0) {
+        return luaL_error(L, "Error compiling render graph");
+    }
+
+    return 0;
+}
+
+// graph, then any arguments to pass on to the pass functions
+int draw_lua_ExecuteRenderGraph(struct draw_data *data, lua_State *L) {
+    struct render_graph *graph = lua_touserdata(L, 1);
+
+    if (!graph->compiled && render_graph_compile(graph, data) != 0) {
+        return luaL_error(L, "Error compiling render graph");
+    }
+
+    // Inside a dynamic resolution frame the backbuffer is the scaler's
+    // target, at the scaled size
+    struct render_graph_target target = {0};
+    struct resolution_scaler *scaler = data->frame_scaler;
+    if (scaler) {
+        if (graph->drawable_sized) {
+            return luaL_error(L, "Render graph attachments sized to the "
+                              "window can't be used with dynamic resolution");
+        }
+
+        target.framebuffer = scaler->direct ? 0 : scaler->framebuffer;
+        target.width = scaler->viewport_width;
+        target.height = scaler->viewport_height;
+    } else {
+        int width, height;
+        SDL_GL_GetDrawableSize(data->window, &width, &height);
+        target.width = width;
+        target.height = height;
+    }
+
+    render_graph_execute(graph, L, lua_gettop(L) - 1, &target);
+
+    return 0;
+}
+
+// Texture backing an attachment after compiling, e.g. for reading a
+// persistent attachment outside the graph. nil if it has none.
+int draw_lua_RenderGraphTexture(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct render_graph *graph = lua_touserdata(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+
+    int index = render_graph_find_attachment(graph, name);
+    if (index < 0 || !graph->compiled ||
+        graph->attachments[index].texture < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    int texture = graph->attachments[index].texture;
+    lua_pushlightuserdata(L, (void *)(uintptr_t)graph->textures[texture].name);
+
+    return 1;
+}
+
+void render_graph_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateRenderGraph);
+    REGISTER_FUNC(DeleteRenderGraph);
+    REGISTER_FUNC(RenderGraphAttachment);
+    REGISTER_FUNC(RenderGraphPass);
+    REGISTER_FUNC(CompileRenderGraph);
+    REGISTER_FUNC(ExecuteRenderGraph);
+    REGISTER_FUNC(RenderGraphTexture);
+
+    REGISTER_CONST(GL_R8);
+    REGISTER_CONST(GL_RG8);
+    REGISTER_CONST(GL_RGBA8);
+    REGISTER_CONST(GL_R16F);
+    REGISTER_CONST(GL_RG16F);
+    REGISTER_CONST(GL_RGBA16F);
+    REGISTER_CONST(GL_R32F);
+    REGISTER_CONST(GL_RG32F);
+    REGISTER_CONST(GL_RGBA32F);
+    REGISTER_CONST(GL_R11F_G11F_B10F);
+    REGISTER_CONST(GL_DEPTH_COMPONENT16);
+    REGISTER_CONST(GL_DEPTH_COMPONENT24);
+    REGISTER_CONST(GL_DEPTH_COMPONENT32F);
+    REGISTER_CONST(GL_DEPTH24_STENCIL8);
+    REGISTER_CONST(GL_DEPTH32F_STENCIL8);
+}
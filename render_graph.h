@@ -0,0 +1,124 @@
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include "lua.h"
+#include "draw.h"
+
+#define RENDER_GRAPH_MAX_PASSES 32
+#define RENDER_GRAPH_MAX_ATTACHMENTS 32
+#define RENDER_GRAPH_MAX_COLORS 4
+#define RENDER_GRAPH_MAX_INPUTS 8
+
+// Name of the default framebuffer's color attachment, which every graph
+// has. Passes writing it draw to the window.
+#define RENDER_GRAPH_BACKBUFFER "backbuffer"
+
+struct render_graph_attachment {
+    char *name;
+    // 0 for the drawable size of the window. Graphs using these can't run
+    // inside a dynamic resolution frame, whose backbuffer is a changing
+    // fraction of that size.
+    GLsizei width;
+    GLsizei height;
+    GLenum format;
+    // Persistent attachments keep their contents between frames, so they're
+    // never aliased or invalidated
+    int persistent;
+    int imported;
+
+    // Filled by compile. Positions in the execution order, -1 if unused.
+    int first_use;
+    int last_use;
+    int texture;
+};
+
+// A GL texture that one or more attachments alias
+struct render_graph_texture {
+    GLuint name;
+    GLsizei width;
+    GLsizei height;
+    GLenum format;
+    int last_use;
+};
+
+struct render_graph_pass {
+    char *name;
+    int colors[RENDER_GRAPH_MAX_COLORS];
+    int color_count;
+    // -1 for none
+    int depth;
+    // Bound to texture units 0..input_count-1 in order while the pass runs
+    int inputs[RENDER_GRAPH_MAX_INPUTS];
+    int input_count;
+    // Registry reference to the Lua function that draws the pass
+    int callback;
+
+    // Filled by compile
+    GLuint framebuffer;
+    GLsizei width;
+    GLsizei height;
+    // Attachment points whose contents are undefined on entry and dead on
+    // exit, for glInvalidateFramebuffer
+    GLenum discard_begin[RENDER_GRAPH_MAX_COLORS + 1];
+    int discard_begin_count;
+    GLenum discard_end[RENDER_GRAPH_MAX_COLORS + 1];
+    int discard_end_count;
+    // Inputs read for the last time by this pass, for glInvalidateTexImage
+    GLuint dead_inputs[RENDER_GRAPH_MAX_INPUTS];
+    int dead_input_count;
+};
+
+struct render_graph {
+    struct render_graph_attachment attachments[RENDER_GRAPH_MAX_ATTACHMENTS];
+    int attachment_count;
+
+    struct render_graph_pass passes[RENDER_GRAPH_MAX_PASSES];
+    int pass_count;
+
+    // Filled by compile
+    int order[RENDER_GRAPH_MAX_PASSES];
+    int order_count;
+    struct render_graph_texture textures[RENDER_GRAPH_MAX_ATTACHMENTS];
+    int texture_count;
+    GLsizei drawable_width;
+    GLsizei drawable_height;
+    // Whether a live attachment is sized to the drawable
+    int drawable_sized;
+    int can_invalidate;
+    int compiled;
+    // Where the textures are counted, set by compile
+    struct memory_stats *memory;
+    // Told which texture a pass's draws find on unit 0, set by compile
+    struct handle_table *handles;
+};
+
+// Framebuffer and size that passes writing the backbuffer draw to
+struct render_graph_target {
+    GLuint framebuffer;
+    GLsizei width;
+    GLsizei height;
+};
+
+struct render_graph *render_graph_create(void);
+void render_graph_destroy(struct render_graph *, lua_State *);
+
+// Returns the index of the attachment, or -1 if the graph is full
+int render_graph_add_attachment(struct render_graph *, const char *,
+                                GLsizei, GLsizei, GLenum, int);
+int render_graph_find_attachment(struct render_graph *, const char *);
+// Returns the index of the pass, or -1 if the graph is full. Its attachments
+// and inputs are filled in directly.
+int render_graph_add_pass(struct render_graph *, const char *, int);
+
+// Orders passes by their dependencies, drops ones that don't contribute to
+// the backbuffer or a persistent attachment, and allocates textures and
+// framebuffers. Transient attachments with the same size and format share a
+// texture when their lifetimes don't overlap. Can be called again, e.g. when
+// the window size changes.
+int render_graph_compile(struct render_graph *, struct draw_data *);
+void render_graph_execute(struct render_graph *, lua_State *, int,
+                          const struct render_graph_target *);
+
+void render_graph_register(lua_State *, struct draw_data *);
+
+#endif
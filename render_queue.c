@@ -0,0 +1,413 @@
+#include "render_queue.h"
+
+#include "draw_interface.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Id shared by every state past the table's limit
+#define SHARED_STATE_ID (RENDER_QUEUE_MAX_STATES - 1)
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+struct render_queue *render_queue_create(size_t capacity, GLuint material_binding,
+                                         struct handle_table *handles) {
+    struct render_queue *queue = calloc(1, sizeof(*queue));
+    if (!queue) {
+        return NULL;
+    }
+    queue->material_binding = material_binding;
+    queue->handles = handles;
+
+    if (capacity < 64) {
+        capacity = 64;
+    }
+
+    queue->items = malloc(capacity * sizeof(*queue->items));
+    queue->sort = malloc(capacity * sizeof(*queue->sort));
+    queue->sort_tmp = malloc(capacity * sizeof(*queue->sort_tmp));
+    queue->capacity = capacity;
+
+    if (!queue->items || !queue->sort || !queue->sort_tmp) {
+        render_queue_destroy(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+void render_queue_destroy(struct render_queue *queue) {
+    if (!queue) {
+        return;
+    }
+
+    free(queue->items);
+    free(queue->sort);
+    free(queue->sort_tmp);
+    free(queue);
+}
+
+// Dense id for the state, assigned in the order states are first seen this
+// frame
+static uint64_t state_id(struct render_state_table *table, uint64_t state) {
+    uint64_t key = state + 1;
+    size_t mask = RENDER_QUEUE_TABLE_SIZE - 1;
+    size_t slot = (key * 0x9e3779b97f4a7c15ull) >> 40 & mask;
+
+    while (table->keys[slot]) {
+        if (table->keys[slot] == key) {
+            return table->ids[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (table->count >= SHARED_STATE_ID) {
+        return SHARED_STATE_ID;
+    }
+
+    table->keys[slot] = key;
+    table->ids[slot] = table->count;
+
+    return table->count++;
+}
+
+// Positive floats order the same as their bits, so depth goes into the key
+// as is. Anything behind the camera sorts with depth 0.
+static uint64_t depth_bits(float depth) {
+    if (!(depth > 0)) {
+        return 0;
+    }
+
+    uint32_t bits;
+    memcpy(&bits, &depth, sizeof(bits));
+
+    return bits;
+}
+
+// Opaque, from the top bit down:
+//   0 | program | material | vertex array | unused | depth (32)
+// Translucent:
+//   1 | inverted depth (32) | program | material | vertex array | unused
+// State fields are RENDER_QUEUE_STATE_BITS wide.
+static uint64_t render_sort_key(struct render_queue *queue,
+                                const struct render_item *item) {
+    uint64_t program = state_id(&queue->states[RENDER_QUEUE_PROGRAM],
+                                item->program);
+    uint64_t material = state_id(&queue->states[RENDER_QUEUE_MATERIAL],
+                                 (uint64_t)item->material << 32 |
+                                 (uint32_t)item->material_offset);
+    uint64_t vertex_array = state_id(&queue->states[RENDER_QUEUE_VERTEX_ARRAY],
+                                     item->vertex_array);
+    uint64_t state = program << (2 * RENDER_QUEUE_STATE_BITS) |
+                     material << RENDER_QUEUE_STATE_BITS |
+                     vertex_array;
+    uint64_t depth = depth_bits(item->depth);
+
+    if (item->translucent) {
+        return 1ull << 63 | (~depth & 0xffffffff) << 31 | state << 1;
+    }
+
+    return state << 33 | depth;
+}
+
+int render_queue_submit(struct render_queue *queue, const struct render_item *item) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity * 2;
+
+        struct render_item *items = realloc(queue->items, capacity * sizeof(*items));
+        if (!items) {
+            return 1;
+        }
+        queue->items = items;
+
+        struct sort_entry *sort = realloc(queue->sort, capacity * sizeof(*sort));
+        if (!sort) {
+            return 1;
+        }
+        queue->sort = sort;
+
+        struct sort_entry *sort_tmp =
+            realloc(queue->sort_tmp, capacity * sizeof(*sort_tmp));
+        if (!sort_tmp) {
+            return 1;
+        }
+        queue->sort_tmp = sort_tmp;
+
+        queue->capacity = capacity;
+    }
+
+    // Keys are made here rather than on execute, so the state tables are
+    // warm while Lua is still submitting
+    struct sort_entry *entry = &queue->sort[queue->count];
+    entry->key = render_sort_key(queue, item);
+    entry->index = queue->count;
+
+    queue->items[queue->count++] = *item;
+
+    return 0;
+}
+
+// What's bound while walking the queue. Items without a material leave the
+// last one bound.
+struct render_bound {
+    int valid;
+    GLuint program;
+    GLuint vertex_array;
+    GLuint material;
+    GLintptr material_offset;
+    GLsizeiptr material_size;
+};
+
+// Records the item's state as bound, returning a bit per
+// render_queue_state that changed
+static unsigned render_bind(struct render_bound *bound,
+                            const struct render_item *item) {
+    unsigned changed = 0;
+
+    if (!bound->valid || bound->program != item->program) {
+        changed |= 1 << RENDER_QUEUE_PROGRAM;
+    }
+    if (!bound->valid || bound->vertex_array != item->vertex_array) {
+        changed |= 1 << RENDER_QUEUE_VERTEX_ARRAY;
+    }
+    if (item->material &&
+        (bound->material != item->material ||
+         bound->material_offset != item->material_offset ||
+         bound->material_size != item->material_size)) {
+        changed |= 1 << RENDER_QUEUE_MATERIAL;
+        bound->material = item->material;
+        bound->material_offset = item->material_offset;
+        bound->material_size = item->material_size;
+    }
+
+    bound->valid = 1;
+    bound->program = item->program;
+    bound->vertex_array = item->vertex_array;
+
+    return changed;
+}
+
+static void count_changes(size_t *changes, unsigned changed) {
+    for (int i = 0; i < RENDER_QUEUE_STATE_COUNT; i++) {
+        if (changed & 1 << i) {
+            changes[i]++;
+        }
+    }
+}
+
+static void render_draw(const struct render_item *item) {
+    if (item->index_type) {
+        glDrawElementsBaseVertex(item->mode, item->count, item->index_type,
+                                 (GLvoid *)item->first, item->base_vertex);
+    } else {
+        glDrawArrays(item->mode, item->first, item->count);
+    }
+}
+
+size_t render_queue_execute(struct render_queue *queue,
+                            const struct draw_data *draw) {
+    size_t count = queue->count;
+    struct render_queue_stats *stats = &queue->stats;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->items = count;
+
+    if (!count) {
+        return 0;
+    }
+
+    // What drawing in submission order would have cost, for comparison
+    struct render_bound bound = {0};
+    for (size_t i = 0; i < count; i++) {
+        count_changes(stats->unsorted_changes,
+                      render_bind(&bound, &queue->items[i]));
+    }
+
+    uint64_t start = now_ns();
+    // The same sort as sprite batches. With few states in use most of the
+    // state bytes are skipped, leaving the passes over depth.
+    radix_sort(&queue->sort, &queue->sort_tmp, count, 64);
+    stats->sort_ns = now_ns() - start;
+
+    int translucent = 0;
+    memset(&bound, 0, sizeof(bound));
+
+    for (size_t i = 0; i < count; i++) {
+        const struct render_item *item = &queue->items[queue->sort[i].index];
+
+        // Translucent items all sort after opaque ones
+        if (item->translucent && !translucent) {
+            translucent = 1;
+            stats->translucent = count - i;
+
+            glEnable(GL_BLEND);
+            glDepthMask(GL_FALSE);
+        }
+
+        unsigned changed = render_bind(&bound, item);
+        count_changes(stats->changes, changed);
+
+        if (changed & 1 << RENDER_QUEUE_PROGRAM) {
+            glUseProgram(item->program);
+        }
+        if (changed & 1 << RENDER_QUEUE_VERTEX_ARRAY) {
+            glBindVertexArray(item->vertex_array);
+        }
+        if (changed & 1 << RENDER_QUEUE_MATERIAL) {
+            if (item->material_size > 0) {
+                glBindBufferRange(GL_UNIFORM_BUFFER, queue->material_binding,
+                                  item->material, item->material_offset,
+                                  item->material_size);
+            } else {
+                glBindBufferBase(GL_UNIFORM_BUFFER, queue->material_binding,
+                                 item->material);
+            }
+        }
+
+        render_draw(item);
+    }
+
+    if (translucent) {
+        if (!(draw->capabilities & DRAW_BLEND)) {
+            glDisable(GL_BLEND);
+        }
+        glDepthMask(draw->depth_mask);
+    }
+
+    handle_restore_bindings(queue->handles);
+    // Binding a range binds the generic uniform buffer target too
+    if (stats->changes[RENDER_QUEUE_MATERIAL]) {
+        glBindBuffer(GL_UNIFORM_BUFFER,
+                     handle_bound_buffer(queue->handles, GL_UNIFORM_BUFFER));
+    }
+    glUseProgram(0);
+
+    log_trace("Render queue drew %zu items, %zu program changes (%zu unsorted)",
+              count, stats->changes[RENDER_QUEUE_PROGRAM],
+              stats->unsorted_changes[RENDER_QUEUE_PROGRAM]);
+
+    for (int i = 0; i < RENDER_QUEUE_STATE_COUNT; i++) {
+        memset(&queue->states[i], 0, sizeof(queue->states[i]));
+    }
+    queue->count = 0;
+
+    return count;
+}
+
+int draw_lua_CreateRenderQueue(struct draw_data *data, lua_State *L) {
+    GLuint material_binding = luaL_optinteger(L, 1, 0);
+    size_t capacity = luaL_optinteger(L, 2, 1024);
+
+    struct render_queue *queue =
+        render_queue_create(capacity, material_binding, &data->handles);
+    if (!queue) {
+        return luaL_error(L, "Error creating render queue");
+    }
+
+    lua_pushlightuserdata(L, queue);
+
+    return 1;
+}
+
+static struct render_queue *check_queue(lua_State *L, int index) {
+    struct render_queue *queue = lua_touserdata(L, index);
+    if (!queue) {
+        luaL_error(L, "Expected a render queue");
+    }
+
+    return queue;
+}
+
+int draw_lua_DeleteRenderQueue(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct render_queue *queue = check_queue(L, 1);
+
+    render_queue_destroy(queue);
+
+    return 0;
+}
+
+// Arguments are read in place, like SpriteBatchAdd, since this is called
+// once per draw: queue, program, vertex array, material buffer (or nil),
+// material offset, material size (0 binds the whole buffer), depth,
+// translucent, mode, count, first vertex or index byte offset, and
+// optionally index type (nil draws arrays) and base vertex
+int render_queue_lua_RenderQueueSubmit(lua_State *L) {
+    struct render_queue *queue = check_queue(L, 1);
+
+    struct render_item item = {
+        .program = handle_check(L, queue->handles, 2, HANDLE_PROGRAM),
+        .vertex_array = handle_check(L, queue->handles, 3, HANDLE_VERTEX_ARRAY),
+        .material = handle_check(L, queue->handles, 4, HANDLE_BUFFER),
+        .material_offset = lua_tointeger(L, 5),
+        .material_size = lua_tointeger(L, 6),
+        .depth = lua_tonumber(L, 7),
+        .translucent = lua_toboolean(L, 8),
+        .mode = lua_tointeger(L, 9),
+        .count = lua_tointeger(L, 10),
+        .first = lua_tointeger(L, 11),
+        .index_type = lua_tointeger(L, 12),
+        .base_vertex = lua_tointeger(L, 13),
+    };
+
+    if (render_queue_submit(queue, &item)) {
+        return luaL_error(L, "Error growing render queue");
+    }
+
+    return 0;
+}
+
+int draw_lua_RenderQueueExecute(struct draw_data *data, lua_State *L) {
+    struct render_queue *queue = check_queue(L, 1);
+
+    lua_pushinteger(L, render_queue_execute(queue, data));
+
+    return 1;
+}
+
+static void set_number(lua_State *L, const char *name, lua_Number value) {
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+}
+
+static void set_changes(lua_State *L, const char *name, const size_t *changes) {
+    lua_createtable(L, 0, RENDER_QUEUE_STATE_COUNT);
+    set_number(L, "program", changes[RENDER_QUEUE_PROGRAM]);
+    set_number(L, "vertex_array", changes[RENDER_QUEUE_VERTEX_ARRAY]);
+    set_number(L, "material", changes[RENDER_QUEUE_MATERIAL]);
+    lua_setfield(L, -2, name);
+}
+
+// From the last execute. changes counts binds in sorted order, and
+// unsorted_changes the binds drawing in submission order would have made.
+int render_queue_lua_RenderQueueStats(lua_State *L) {
+    struct render_queue *queue = check_queue(L, 1);
+    struct render_queue_stats *stats = &queue->stats;
+
+    lua_createtable(L, 0, 6);
+    set_number(L, "items", stats->items);
+    set_number(L, "opaque", stats->items - stats->translucent);
+    set_number(L, "translucent", stats->translucent);
+    set_number(L, "sort_ms", stats->sort_ns / 1e6);
+    set_changes(L, "changes", stats->changes);
+    set_changes(L, "unsorted_changes", stats->unsorted_changes);
+
+    return 1;
+}
+
+void render_queue_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateRenderQueue);
+    REGISTER_FUNC(DeleteRenderQueue);
+    REGISTER_FUNC(RenderQueueExecute);
+
+    // These don't touch GL. Submit gets called once per draw.
+    lua_register(L, "draw_RenderQueueSubmit", render_queue_lua_RenderQueueSubmit);
+    lua_register(L, "draw_RenderQueueStats", render_queue_lua_RenderQueueStats);
+}
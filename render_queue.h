@@ -0,0 +1,104 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include "lua.h"
+#include "draw.h"
+#include "radix_sort.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Programs, vertex arrays and materials each get an id of this many bits in
+// the sort key. States past the limit share the last id, which only costs
+// grouping: draws still bind what they asked for.
+#define RENDER_QUEUE_STATE_BITS 10
+#define RENDER_QUEUE_MAX_STATES (1 << RENDER_QUEUE_STATE_BITS)
+// Open addressed, at most half full
+#define RENDER_QUEUE_TABLE_SIZE (RENDER_QUEUE_MAX_STATES * 2)
+
+enum render_queue_state {
+    RENDER_QUEUE_PROGRAM,
+    RENDER_QUEUE_VERTEX_ARRAY,
+    RENDER_QUEUE_MATERIAL,
+    RENDER_QUEUE_STATE_COUNT,
+};
+
+// One draw and the state it needs. A material is a range of a uniform
+// buffer, bound at the queue's material binding; buffer 0 binds nothing.
+struct render_item {
+    GLuint program;
+    GLuint vertex_array;
+    GLuint material;
+    GLintptr material_offset;
+    GLsizeiptr material_size;
+
+    // Distance from the camera
+    float depth;
+    int translucent;
+
+    GLenum mode;
+    GLsizei count;
+    // First vertex, or byte offset into the element array buffer
+    GLintptr first;
+    // 0 draws arrays
+    GLenum index_type;
+    GLint base_vertex;
+};
+
+// Maps a state, e.g. a program's name, to its id in the sort key. Cleared
+// after every execute, so ids only have to be unique within a frame.
+struct render_state_table {
+    // State + 1, so 0 is an empty slot
+    uint64_t keys[RENDER_QUEUE_TABLE_SIZE];
+    uint16_t ids[RENDER_QUEUE_TABLE_SIZE];
+    uint32_t count;
+};
+
+struct render_queue_stats {
+    size_t items;
+    size_t translucent;
+    // Binds made drawing in sorted order, and the ones submission order
+    // would have needed
+    size_t changes[RENDER_QUEUE_STATE_COUNT];
+    size_t unsorted_changes[RENDER_QUEUE_STATE_COUNT];
+    uint64_t sort_ns;
+};
+
+// Draws submitted during the frame, sorted on execute so each program,
+// vertex array and material is bound as few times as possible. Opaque
+// items come first, grouped by program, then material, then vertex array,
+// and front to back within a group. Translucent items follow back to front,
+// with state only breaking ties in depth.
+//
+// Translucent items are drawn with blending on and depth writes off, using
+// whatever blend function is set. Both are put back afterwards.
+struct render_queue {
+    struct render_item *items;
+    struct sort_entry *sort;
+    struct sort_entry *sort_tmp;
+    size_t count;
+    size_t capacity;
+
+    GLuint material_binding;
+    struct render_state_table states[RENDER_QUEUE_STATE_COUNT];
+
+    // For checking handles as items are submitted
+    struct handle_table *handles;
+
+    // From the last execute
+    struct render_queue_stats stats;
+};
+
+struct render_queue *render_queue_create(size_t, GLuint,
+                                         struct handle_table *);
+void render_queue_destroy(struct render_queue *);
+// Returns 1 if the queue couldn't grow
+int render_queue_submit(struct render_queue *, const struct render_item *);
+// Sorts and draws everything submitted, then empties the queue. Returns the
+// number of draws. Blending and the depth mask are put back the way Lua
+// left them in the draw data.
+size_t render_queue_execute(struct render_queue *, const struct draw_data *);
+
+void render_queue_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,50 @@
+local M = {}
+
+-- Render queue functions exposed from C
+local copy_funcs = {
+  CreateRenderQueue="create",
+  DeleteRenderQueue="delete",
+  RenderQueueSubmit="submit_draw",
+  RenderQueueExecute="execute",
+  RenderQueueStats="stats",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["draw_" .. c_name]
+end
+
+-- Queues a draw described by a table:
+--   program, vertex_array
+--   material: uniform buffer bound at the queue's material binding, with
+--     material_offset and material_size for a range of it (optional)
+--   depth: distance from the camera
+--   translucent: drawn after opaque items, back to front, with blending
+--   mode (default triangles), count, first
+--   index_type: e.g. draw_GL_UNSIGNED_INT to draw elements, with first as
+--     the byte offset of the first index and base_vertex (optional)
+-- Tables are convenient but cost a lookup per field. Per-object code can
+-- call submit_draw with the same fields as arguments instead.
+function M.submit(queue, item)
+  M.submit_draw(queue, item.program, item.vertex_array, item.material,
+                item.material_offset or 0, item.material_size or 0,
+                item.depth or 0, item.translucent,
+                item.mode or draw_GL_TRIANGLES, item.count, item.first or 0,
+                item.index_type, item.base_vertex or 0)
+end
+
+-- Summary of the last execute, with the binds sorting saved
+function M.report(queue)
+  local stats = M.stats(queue)
+  local sorted, unsorted = stats.changes, stats.unsorted_changes
+
+  return string.format(
+    "%d items (%d opaque, %d translucent) sorted in %.3f ms. " ..
+    "Program changes %d (unsorted %d), vertex array changes %d (%d), " ..
+    "material changes %d (%d)",
+    stats.items, stats.opaque, stats.translucent, stats.sort_ms,
+    sorted.program, unsorted.program,
+    sorted.vertex_array, unsorted.vertex_array,
+    sorted.material, unsorted.material)
+end
+
+return M
@@ -0,0 +1,1057 @@
+// gl-replay: replays a trace written by capture.c and times it.
+//
+// Usage: gl-replay [--repeat N] [--timed] <trace>
+//
+// Everything recorded before the capture window runs untimed to rebuild the
+// state the window started in. The window's frames are then replayed,
+// --repeat times over with the program, vertex array, framebuffers and
+// viewport put back between passes, timing every GL call on the CPU and
+// every frame on the GPU, and the results are printed per frame, per GL
+// call and per draw function. --timed waits between frames as long as the
+// captured process did, for looking at the replay rather than profiling it.
+#include "capture_format.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_opengl.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Captured names of one kind to ours
+struct name_map {
+    GLuint *names;
+    size_t size;
+};
+
+// Captured uniform locations or block indices of one program to ours, -1
+// for unknown
+struct index_map {
+    GLint *values;
+    size_t size;
+};
+
+struct op_stats {
+    long count;
+    Uint64 ticks;
+    Uint64 max_ticks;
+};
+
+struct marker_stats {
+    char *name;
+    long count;
+    long calls;
+    Uint64 ticks;
+};
+
+struct frame_stats {
+    Uint64 cpu_ticks;
+    Uint64 wall_ticks;
+    GLuint queries[2];
+};
+
+enum name_kind {
+    NAME_BUFFER,
+    NAME_TEXTURE,
+    NAME_VERTEX_ARRAY,
+    NAME_FRAMEBUFFER,
+    NAME_RENDERBUFFER,
+    NAME_QUERY,
+    NAME_PROGRAM,
+    NAME_KIND_COUNT,
+};
+
+struct replay {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    int error;
+
+    SDL_Window *window;
+    SDL_GLContext context;
+
+    struct name_map names[NAME_KIND_COUNT];
+    struct index_map *locations;
+    struct index_map *blocks;
+    size_t program_count;
+    // Captured names of the program in use and of the last one read
+    uint64_t current_program;
+    uint64_t last_program;
+
+    // Scratch space for uniform values and pointer arrays
+    void *scratch;
+    size_t scratch_size;
+
+    // Offset just past the WINDOW record, to rewind to for each repeat
+    size_t window_offset;
+    // State the window started in, put back before each repeat since the
+    // window's last frame leaves its own bound
+    GLint window_program;
+    GLint window_vertex_array;
+    GLint window_draw_framebuffer;
+    GLint window_read_framebuffer;
+    GLint window_viewport[4];
+    uint64_t window_current_program;
+    int in_window;
+    int frame_open;
+    int frame;
+    int window_frames;
+    Uint64 frame_start;
+    Uint64 last_frame_end;
+    struct frame_stats *frames;
+
+    struct op_stats ops[CAPTURE_OP_COUNT];
+    struct marker_stats *markers;
+    size_t marker_count;
+    long current_marker;
+
+    int repeat;
+    int timed;
+};
+
+static const char *op_names[CAPTURE_OP_COUNT] = {
+    [CAPTURE_OP_MAP_WRITE] = "glMapBufferRange (write)",
+#define CAPTURE_CALL(name, ...) [CAPTURE_OP_ ## name] = #name,
+#define CAPTURE_CALL1 CAPTURE_CALL
+#define CAPTURE_CALL2 CAPTURE_CALL
+#define CAPTURE_CALL3 CAPTURE_CALL
+#define CAPTURE_CALL4 CAPTURE_CALL
+#define CAPTURE_CALL5 CAPTURE_CALL
+#define CAPTURE_CALL6 CAPTURE_CALL
+#define CAPTURE_CALL10 CAPTURE_CALL
+#define CAPTURE_UNIFORM CAPTURE_CALL
+#define CAPTURE_MATRIX CAPTURE_CALL
+#define CAPTURE_SPECIAL CAPTURE_CALL
+#define CAPTURE_NAMES(generate, delete, kind) \
+    [CAPTURE_OP_ ## generate] = #generate, [CAPTURE_OP_ ## delete] = #delete,
+    CAPTURE_CALLS
+    CAPTURE_UNIFORMS
+    CAPTURE_MATRICES
+    CAPTURE_NAME_CALLS
+    CAPTURE_SPECIALS
+#undef CAPTURE_CALL
+#undef CAPTURE_CALL1
+#undef CAPTURE_CALL2
+#undef CAPTURE_CALL3
+#undef CAPTURE_CALL4
+#undef CAPTURE_CALL5
+#undef CAPTURE_CALL6
+#undef CAPTURE_CALL10
+#undef CAPTURE_UNIFORM
+#undef CAPTURE_MATRIX
+#undef CAPTURE_SPECIAL
+#undef CAPTURE_NAMES
+};
+
+static struct replay replay;
+
+static void print_sdl_error(const char *prefix) {
+    fprintf(stderr, "%s: %s\n", prefix, SDL_GetError());
+}
+
+static double ticks_to_ms(Uint64 ticks) {
+    return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+static uint8_t get_byte(void) {
+    if (replay.offset >= replay.size) {
+        replay.error = 1;
+        return CAPTURE_OP_END;
+    }
+
+    return replay.data[replay.offset++];
+}
+
+static uint64_t get_unsigned(void) {
+    uint64_t value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = get_byte();
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+
+    replay.error = 1;
+    return value;
+}
+
+static int64_t get_signed(void) {
+    uint64_t value = get_unsigned();
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static const void *get_bytes(size_t size) {
+    if (size > replay.size - replay.offset) {
+        replay.error = 1;
+        replay.offset = replay.size;
+        return NULL;
+    }
+
+    const void *bytes = replay.data + replay.offset;
+    replay.offset += size;
+    return bytes;
+}
+
+static const void *get_data(size_t *size) {
+    *size = get_unsigned();
+    return get_bytes(*size);
+}
+
+static int grow(void **array, size_t element, size_t *size, size_t needed,
+                int fill) {
+    if (needed <= *size) {
+        return 0;
+    }
+
+    size_t new_size = *size ? *size * 2 : 64;
+    while (new_size < needed) {
+        new_size *= 2;
+    }
+
+    void *grown = realloc(*array, new_size * element);
+    if (!grown) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    memset((char *)grown + *size * element, fill, (new_size - *size) * element);
+    *array = grown;
+    *size = new_size;
+    return 0;
+}
+
+static void map_set(enum name_kind kind, uint64_t captured, GLuint name) {
+    struct name_map *map = &replay.names[kind];
+    grow((void **)&map->names, sizeof(*map->names), &map->size, captured + 1,
+         0);
+    map->names[captured] = name;
+}
+
+static GLuint map_get(enum name_kind kind, uint64_t captured) {
+    const struct name_map *map = &replay.names[kind];
+    return captured < map->size ? map->names[captured] : 0;
+}
+
+// Maps of the given program, made as needed
+static struct index_map *program_map(struct index_map **maps,
+                                     uint64_t program) {
+    if (program >= replay.program_count) {
+        size_t count = replay.program_count;
+        grow((void **)&replay.locations, sizeof(*replay.locations), &count,
+             program + 1, 0);
+        count = replay.program_count;
+        grow((void **)&replay.blocks, sizeof(*replay.blocks), &count,
+             program + 1, 0);
+        replay.program_count = count;
+    }
+
+    return &(*maps)[program];
+}
+
+static void index_set(struct index_map *map, int64_t captured, GLint value) {
+    if (captured < 0) {
+        return;
+    }
+
+    grow((void **)&map->values, sizeof(*map->values), &map->size,
+         captured + 1, 0xff);
+    map->values[captured] = value;
+}
+
+static GLint index_get(struct index_map *map, int64_t captured) {
+    if (captured < 0 || (uint64_t)captured >= map->size) {
+        return -1;
+    }
+
+    return map->values[captured];
+}
+
+static void *scratch(size_t size) {
+    grow(&replay.scratch, 1, &replay.scratch_size, size, 0);
+    return replay.scratch;
+}
+
+// Argument kinds, see capture_format.h
+static GLenum get_ENUM(void) { return get_unsigned(); }
+static GLuint get_UINT(void) { return get_unsigned(); }
+static GLboolean get_BOOL(void) { return get_unsigned(); }
+static GLbitfield get_BITS(void) { return get_unsigned(); }
+static GLint get_INT(void) { return get_signed(); }
+static GLsizei get_SIZEI(void) { return get_signed(); }
+static GLintptr get_INTPTR(void) { return get_signed(); }
+static const void *get_OFFSET(void) { return (const void *)get_signed(); }
+
+static GLfloat get_FLOAT(void) {
+    GLfloat value = 0;
+    const void *bytes = get_bytes(sizeof(value));
+    if (bytes) {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+static GLdouble get_DOUBLE(void) {
+    GLdouble value = 0;
+    const void *bytes = get_bytes(sizeof(value));
+    if (bytes) {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+static GLuint get_BUFFER(void) { return map_get(NAME_BUFFER, get_unsigned()); }
+static GLuint get_TEXTURE(void) {
+    return map_get(NAME_TEXTURE, get_unsigned());
+}
+static GLuint get_VERTEX_ARRAY(void) {
+    return map_get(NAME_VERTEX_ARRAY, get_unsigned());
+}
+static GLuint get_FRAMEBUFFER(void) {
+    return map_get(NAME_FRAMEBUFFER, get_unsigned());
+}
+static GLuint get_RENDERBUFFER(void) {
+    return map_get(NAME_RENDERBUFFER, get_unsigned());
+}
+static GLuint get_QUERY(void) { return map_get(NAME_QUERY, get_unsigned()); }
+
+static GLuint get_PROGRAM(void) {
+    replay.last_program = get_unsigned();
+    return map_get(NAME_PROGRAM, replay.last_program);
+}
+
+static GLint get_LOCATION(void) {
+    int64_t location = get_signed();
+    return index_get(program_map(&replay.locations, replay.current_program),
+                     location);
+}
+
+static GLuint get_BLOCK(void) {
+    int64_t block = get_unsigned();
+    return index_get(program_map(&replay.blocks, replay.last_program), block);
+}
+
+// Opens the frame at the first call in it, so the content snapshots at the
+// start of the window aren't counted in the first frame
+static void begin_frame(void) {
+    if (!replay.in_window || replay.frame_open ||
+        replay.frame >= replay.window_frames) {
+        return;
+    }
+
+    struct frame_stats *frame = &replay.frames[replay.frame];
+    frame->cpu_ticks = 0;
+    glQueryCounter(frame->queries[0], GL_TIMESTAMP);
+
+    replay.frame_open = 1;
+    replay.frame_start = SDL_GetPerformanceCounter();
+}
+
+static void account(enum capture_op op, Uint64 ticks) {
+    if (!replay.frame_open) {
+        return;
+    }
+
+    struct op_stats *stats = &replay.ops[op];
+    stats->count++;
+    stats->ticks += ticks;
+    if (ticks > stats->max_ticks) {
+        stats->max_ticks = ticks;
+    }
+
+    replay.frames[replay.frame].cpu_ticks += ticks;
+
+    if (replay.current_marker >= 0) {
+        struct marker_stats *marker = &replay.markers[replay.current_marker];
+        marker->calls++;
+        marker->ticks += ticks;
+    }
+}
+
+#define TIMED(op, call) \
+    do { \
+        begin_frame(); \
+        Uint64 start = SDL_GetPerformanceCounter(); \
+        call; \
+        account(op, SDL_GetPerformanceCounter() - start); \
+    } while (0)
+
+static void end_frame(uint64_t captured_ns) {
+    if (!replay.frame_open) {
+        return;
+    }
+
+    struct frame_stats *frame = &replay.frames[replay.frame];
+    glQueryCounter(frame->queries[1], GL_TIMESTAMP);
+    SDL_GL_SwapWindow(replay.window);
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    frame->wall_ticks = now - replay.frame_start;
+
+    if (replay.timed) {
+        double elapsed_ms = ticks_to_ms(now - replay.last_frame_end);
+        double captured_ms = captured_ns / 1000000.0;
+        if (captured_ms > elapsed_ms) {
+            SDL_Delay(captured_ms - elapsed_ms);
+        }
+    }
+    replay.last_frame_end = SDL_GetPerformanceCounter();
+
+    replay.frame_open = 0;
+    replay.frame++;
+}
+
+static void print_frames(int pass) {
+    for (int i = 0; i < replay.frame; i++) {
+        struct frame_stats *frame = &replay.frames[i];
+
+        GLuint64 begin, end;
+        glGetQueryObjectui64v(frame->queries[0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(frame->queries[1], GL_QUERY_RESULT, &end);
+
+        printf("pass %d frame %3d: cpu %7.3f ms  wall %7.3f ms  gpu %7.3f ms\n",
+               pass, i, ticks_to_ms(frame->cpu_ticks),
+               ticks_to_ms(frame->wall_ticks), (end - begin) / 1000000.0);
+    }
+}
+
+static int compare_ops(const void *a, const void *b) {
+    const struct op_stats *x = &replay.ops[*(const int *)a];
+    const struct op_stats *y = &replay.ops[*(const int *)b];
+    return (x->ticks < y->ticks) - (x->ticks > y->ticks);
+}
+
+static int compare_markers(const void *a, const void *b) {
+    const struct marker_stats *x = &replay.markers[*(const size_t *)a];
+    const struct marker_stats *y = &replay.markers[*(const size_t *)b];
+    return (x->ticks < y->ticks) - (x->ticks > y->ticks);
+}
+
+static void print_report(void) {
+    int order[CAPTURE_OP_COUNT];
+    for (int i = 0; i < CAPTURE_OP_COUNT; i++) {
+        order[i] = i;
+    }
+    qsort(order, CAPTURE_OP_COUNT, sizeof(*order), compare_ops);
+
+    printf("\n%-32s %9s %10s %10s %10s\n", "GL call", "count", "total ms",
+           "avg us", "max us");
+    for (int i = 0; i < CAPTURE_OP_COUNT; i++) {
+        struct op_stats *stats = &replay.ops[order[i]];
+        if (stats->count == 0) {
+            continue;
+        }
+
+        printf("%-32s %9ld %10.3f %10.3f %10.3f\n", op_names[order[i]],
+               stats->count, ticks_to_ms(stats->ticks),
+               ticks_to_ms(stats->ticks) * 1000.0 / stats->count,
+               ticks_to_ms(stats->max_ticks) * 1000.0);
+    }
+
+    if (replay.marker_count == 0) {
+        return;
+    }
+
+    size_t *markers = malloc(replay.marker_count * sizeof(*markers));
+    if (!markers) {
+        return;
+    }
+    for (size_t i = 0; i < replay.marker_count; i++) {
+        markers[i] = i;
+    }
+    qsort(markers, replay.marker_count, sizeof(*markers), compare_markers);
+
+    printf("\n%-32s %9s %9s %10s %10s\n", "Draw function", "count",
+           "GL calls", "total ms", "avg us");
+    for (size_t i = 0; i < replay.marker_count; i++) {
+        struct marker_stats *marker = &replay.markers[markers[i]];
+        if (marker->count == 0) {
+            continue;
+        }
+
+        printf("%-32s %9ld %9ld %10.3f %10.3f\n", marker->name, marker->count,
+               marker->calls, ticks_to_ms(marker->ticks),
+               ticks_to_ms(marker->ticks) * 1000.0 / marker->count);
+    }
+
+    free(markers);
+}
+
+static void open_window(void) {
+    int frames = get_unsigned();
+
+    if (!replay.frames) {
+        replay.window_frames = frames;
+        replay.frames = calloc(frames, sizeof(*replay.frames));
+        if (!replay.frames) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (int i = 0; i < frames; i++) {
+            glGenQueries(2, replay.frames[i].queries);
+        }
+    }
+
+    glGetIntegerv(GL_CURRENT_PROGRAM, &replay.window_program);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &replay.window_vertex_array);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING,
+                  &replay.window_draw_framebuffer);
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING,
+                  &replay.window_read_framebuffer);
+    glGetIntegerv(GL_VIEWPORT, replay.window_viewport);
+    replay.window_current_program = replay.current_program;
+
+    replay.window_offset = replay.offset;
+    replay.in_window = 1;
+    replay.frame = 0;
+    replay.last_frame_end = SDL_GetPerformanceCounter();
+}
+
+static void restore_window_state(void) {
+    glUseProgram(replay.window_program);
+    glBindVertexArray(replay.window_vertex_array);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, replay.window_draw_framebuffer);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, replay.window_read_framebuffer);
+    glViewport(replay.window_viewport[0], replay.window_viewport[1],
+               replay.window_viewport[2], replay.window_viewport[3]);
+    replay.current_program = replay.window_current_program;
+}
+
+static void buffer_contents(void) {
+    GLuint buffer = get_BUFFER();
+    size_t size;
+    const void *data = get_data(&size);
+    if (!data) {
+        return;
+    }
+
+    GLint previous;
+    glGetIntegerv(GL_COPY_WRITE_BUFFER_BINDING, &previous);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, 0, size, data);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, previous);
+}
+
+static void texture_contents(void) {
+    GLuint texture = get_TEXTURE();
+    GLsizei width = get_SIZEI();
+    GLsizei height = get_SIZEI();
+    GLenum format = get_ENUM();
+    GLenum type = get_ENUM();
+    GLuint previous = get_TEXTURE();
+    GLint alignment = get_INT();
+    size_t size;
+    const void *data = get_data(&size);
+    if (!data) {
+        return;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, data);
+    glBindTexture(GL_TEXTURE_2D, previous);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+}
+
+static void marker_string(void) {
+    uint64_t id = get_unsigned();
+    size_t size;
+    const char *name = get_data(&size);
+    if (!name) {
+        return;
+    }
+
+    grow((void **)&replay.markers, sizeof(*replay.markers),
+         &replay.marker_count, id + 1, 0);
+    if (!replay.markers[id].name) {
+        replay.markers[id].name = strndup(name, size);
+    }
+}
+
+static void marker_begin(void) {
+    uint64_t id = get_unsigned();
+
+    if (id < replay.marker_count && replay.in_window) {
+        replay.current_marker = id;
+        replay.markers[id].count++;
+    }
+}
+
+static void map_write(void) {
+    GLenum target = get_ENUM();
+    GLintptr offset = get_INTPTR();
+    GLsizeiptr length = get_INTPTR();
+    GLbitfield access = get_BITS();
+    size_t size;
+    const void *data = get_data(&size);
+    if (!data) {
+        return;
+    }
+
+    // The whole range is written back at once, so there's nothing to flush
+    access &= ~GL_MAP_FLUSH_EXPLICIT_BIT;
+
+    TIMED(CAPTURE_OP_MAP_WRITE, {
+        void *pointer = glMapBufferRange(target, offset, length, access);
+        if (pointer) {
+            memcpy(pointer, data, size);
+            glUnmapBuffer(target);
+        }
+    });
+}
+
+// Replays one record. Returns 1 at the end of the trace.
+static int replay_record(void) {
+    enum capture_op op = get_byte();
+
+    switch (op) {
+    case CAPTURE_OP_FRAME:
+        end_frame(get_unsigned());
+        break;
+    case CAPTURE_OP_WINDOW:
+        open_window();
+        break;
+    case CAPTURE_OP_STRING:
+        marker_string();
+        break;
+    case CAPTURE_OP_MARKER_BEGIN:
+        marker_begin();
+        break;
+    case CAPTURE_OP_MARKER_END:
+        replay.current_marker = -1;
+        break;
+    case CAPTURE_OP_BUFFER_CONTENTS:
+        buffer_contents();
+        break;
+    case CAPTURE_OP_TEXTURE_CONTENTS:
+        texture_contents();
+        break;
+    case CAPTURE_OP_MAP_WRITE:
+        map_write();
+        break;
+    case CAPTURE_OP_END:
+        return 1;
+
+#define CAPTURE_CALL1(name, category, k0, t0) \
+    case CAPTURE_OP_ ## name: { \
+        t0 a0 = get_ ## k0(); \
+        TIMED(op, name(a0)); \
+        break; \
+    }
+#define CAPTURE_CALL2(name, category, k0, t0, k1, t1) \
+    case CAPTURE_OP_ ## name: { \
+        t0 a0 = get_ ## k0(); t1 a1 = get_ ## k1(); \
+        TIMED(op, name(a0, a1)); \
+        break; \
+    }
+#define CAPTURE_CALL3(name, category, k0, t0, k1, t1, k2, t2) \
+    case CAPTURE_OP_ ## name: { \
+        t0 a0 = get_ ## k0(); t1 a1 = get_ ## k1(); t2 a2 = get_ ## k2(); \
+        TIMED(op, name(a0, a1, a2)); \
+        break; \
+    }
+#define CAPTURE_CALL4(name, category, k0, t0, k1, t1, k2, t2, k3, t3) \
+    case CAPTURE_OP_ ## name: { \
+        t0 a0 = get_ ## k0(); t1 a1 = get_ ## k1(); t2 a2 = get_ ## k2(); \
+        t3 a3 = get_ ## k3(); \
+        TIMED(op, name(a0, a1, a2, a3)); \
+        break; \
+    }
+#define CAPTURE_CALL5(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                      k4, t4) \
+    case CAPTURE_OP_ ## name: { \
+        t0 a0 = get_ ## k0(); t1 a1 = get_ ## k1(); t2 a2 = get_ ## k2(); \
+        t3 a3 = get_ ## k3(); t4 a4 = get_ ## k4(); \
+        TIMED(op, name(a0, a1, a2, a3, a4)); \
+        break; \
+    }
+#define CAPTURE_CALL6(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                      k4, t4, k5, t5) \
+    case CAPTURE_OP_ ## name: { \
+        t0 a0 = get_ ## k0(); t1 a1 = get_ ## k1(); t2 a2 = get_ ## k2(); \
+        t3 a3 = get_ ## k3(); t4 a4 = get_ ## k4(); t5 a5 = get_ ## k5(); \
+        TIMED(op, name(a0, a1, a2, a3, a4, a5)); \
+        break; \
+    }
+#define CAPTURE_CALL10(name, category, k0, t0, k1, t1, k2, t2, k3, t3, \
+                       k4, t4, k5, t5, k6, t6, k7, t7, k8, t8, k9, t9) \
+    case CAPTURE_OP_ ## name: { \
+        t0 a0 = get_ ## k0(); t1 a1 = get_ ## k1(); t2 a2 = get_ ## k2(); \
+        t3 a3 = get_ ## k3(); t4 a4 = get_ ## k4(); t5 a5 = get_ ## k5(); \
+        t6 a6 = get_ ## k6(); t7 a7 = get_ ## k7(); t8 a8 = get_ ## k8(); \
+        t9 a9 = get_ ## k9(); \
+        TIMED(op, name(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9)); \
+        break; \
+    }
+#define CAPTURE_UNIFORM(name, kind, type, components) \
+    case CAPTURE_OP_ ## name: { \
+        GLint location = get_LOCATION(); \
+        GLsizei count = get_SIZEI(); \
+        size_t values_count = count > 0 ? (size_t)count * components : 0; \
+        type *values = scratch(values_count * sizeof(type)); \
+        for (size_t i = 0; i < values_count; i++) { \
+            values[i] = get_ ## kind(); \
+        } \
+        TIMED(op, name(location, count, values)); \
+        break; \
+    }
+#define CAPTURE_MATRIX(name, components) \
+    case CAPTURE_OP_ ## name: { \
+        GLint location = get_LOCATION(); \
+        GLsizei count = get_SIZEI(); \
+        GLboolean transpose = get_BOOL(); \
+        size_t values_count = count > 0 ? (size_t)count * components : 0; \
+        GLfloat *values = scratch(values_count * sizeof(GLfloat)); \
+        for (size_t i = 0; i < values_count; i++) { \
+            values[i] = get_FLOAT(); \
+        } \
+        TIMED(op, name(location, count, transpose, values)); \
+        break; \
+    }
+#define CAPTURE_NAMES(generate, delete, kind) \
+    case CAPTURE_OP_ ## generate: { \
+        GLsizei count = get_SIZEI(); \
+        GLuint *names = scratch(count * sizeof(GLuint)); \
+        TIMED(op, generate(count, names)); \
+        for (GLsizei i = 0; i < count; i++) { \
+            map_set(NAME_ ## kind, get_unsigned(), names[i]); \
+        } \
+        break; \
+    } \
+    case CAPTURE_OP_ ## delete: { \
+        GLsizei count = get_SIZEI(); \
+        GLuint *names = scratch(count * sizeof(GLuint)); \
+        for (GLsizei i = 0; i < count; i++) { \
+            uint64_t captured = get_unsigned(); \
+            names[i] = map_get(NAME_ ## kind, captured); \
+            if (captured < replay.names[NAME_ ## kind].size) { \
+                replay.names[NAME_ ## kind].names[captured] = 0; \
+            } \
+        } \
+        TIMED(op, delete(count, names)); \
+        break; \
+    }
+    CAPTURE_CALLS
+    CAPTURE_UNIFORMS
+    CAPTURE_MATRICES
+    CAPTURE_NAME_CALLS
+#undef CAPTURE_CALL1
+#undef CAPTURE_CALL2
+#undef CAPTURE_CALL3
+#undef CAPTURE_CALL4
+#undef CAPTURE_CALL5
+#undef CAPTURE_CALL6
+#undef CAPTURE_CALL10
+#undef CAPTURE_UNIFORM
+#undef CAPTURE_MATRIX
+#undef CAPTURE_NAMES
+
+    case CAPTURE_OP_glCreateShader: {
+        GLenum type = get_ENUM();
+        uint64_t captured = get_unsigned();
+        GLuint shader;
+        TIMED(op, shader = glCreateShader(type));
+        map_set(NAME_PROGRAM, captured, shader);
+        break;
+    }
+    case CAPTURE_OP_glCreateProgram: {
+        uint64_t captured = get_unsigned();
+        GLuint program;
+        TIMED(op, program = glCreateProgram());
+        map_set(NAME_PROGRAM, captured, program);
+        break;
+    }
+    case CAPTURE_OP_glShaderSource: {
+        GLuint shader = get_PROGRAM();
+        GLsizei count = get_SIZEI();
+        if (count <= 0) {
+            break;
+        }
+
+        const GLchar **strings = scratch(count * (sizeof(*strings) +
+                                                  sizeof(GLint)));
+        GLint *lengths = (GLint *)(strings + count);
+        for (GLsizei i = 0; i < count; i++) {
+            size_t length;
+            strings[i] = get_data(&length);
+            lengths[i] = length;
+        }
+        TIMED(op, glShaderSource(shader, count, strings, lengths));
+        break;
+    }
+    case CAPTURE_OP_glGetUniformLocation:
+    case CAPTURE_OP_glGetUniformBlockIndex: {
+        GLuint program = get_PROGRAM();
+        uint64_t captured_program = replay.last_program;
+        size_t length;
+        const char *name = get_data(&length);
+        int64_t captured = op == CAPTURE_OP_glGetUniformLocation ?
+            get_signed() : (int64_t)get_unsigned();
+        if (!name) {
+            break;
+        }
+
+        char *terminated = scratch(length + 1);
+        memcpy(terminated, name, length);
+        terminated[length] = '\0';
+
+        if (op == CAPTURE_OP_glGetUniformLocation) {
+            GLint location;
+            TIMED(op, location = glGetUniformLocation(program, terminated));
+            index_set(program_map(&replay.locations, captured_program),
+                      captured, location);
+        } else {
+            GLuint index;
+            TIMED(op, index = glGetUniformBlockIndex(program, terminated));
+            index_set(program_map(&replay.blocks, captured_program),
+                      captured, index);
+        }
+        break;
+    }
+    case CAPTURE_OP_glBufferData: {
+        GLenum target = get_ENUM();
+        GLsizeiptr size = get_INTPTR();
+        GLenum usage = get_ENUM();
+        const void *data = NULL;
+        if (get_BOOL()) {
+            size_t data_size;
+            data = get_data(&data_size);
+        }
+        TIMED(op, glBufferData(target, size, data, usage));
+        break;
+    }
+    case CAPTURE_OP_glBufferSubData: {
+        GLenum target = get_ENUM();
+        GLintptr offset = get_INTPTR();
+        size_t size;
+        const void *data = get_data(&size);
+        TIMED(op, glBufferSubData(target, offset, size, data));
+        break;
+    }
+    case CAPTURE_OP_glTexImage2D: {
+        GLenum target = get_ENUM();
+        GLint level = get_INT();
+        GLint internal_format = get_INT();
+        GLsizei width = get_SIZEI();
+        GLsizei height = get_SIZEI();
+        GLint border = get_INT();
+        GLenum format = get_ENUM();
+        GLenum type = get_ENUM();
+        const void *pixels = NULL;
+        if (get_BOOL()) {
+            size_t size;
+            pixels = get_data(&size);
+        }
+        TIMED(op, glTexImage2D(target, level, internal_format, width, height,
+                               border, format, type, pixels));
+        break;
+    }
+    case CAPTURE_OP_glTexSubImage2D: {
+        GLenum target = get_ENUM();
+        GLint level = get_INT();
+        GLint x = get_INT();
+        GLint y = get_INT();
+        GLsizei width = get_SIZEI();
+        GLsizei height = get_SIZEI();
+        GLenum format = get_ENUM();
+        GLenum type = get_ENUM();
+        size_t size;
+        const void *pixels = get_data(&size);
+        if (!pixels) {
+            break;
+        }
+        TIMED(op, glTexSubImage2D(target, level, x, y, width, height, format,
+                                  type, pixels));
+        break;
+    }
+    case CAPTURE_OP_glDrawBuffers: {
+        GLsizei count = get_SIZEI();
+        GLenum *buffers = scratch(count * sizeof(GLenum));
+        for (GLsizei i = 0; i < count; i++) {
+            buffers[i] = get_ENUM();
+        }
+        TIMED(op, glDrawBuffers(count, buffers));
+        break;
+    }
+    case CAPTURE_OP_glInvalidateFramebuffer: {
+        GLenum target = get_ENUM();
+        GLsizei count = get_SIZEI();
+        GLenum *attachments = scratch(count * sizeof(GLenum));
+        for (GLsizei i = 0; i < count; i++) {
+            attachments[i] = get_ENUM();
+        }
+        TIMED(op, glInvalidateFramebuffer(target, count, attachments));
+        break;
+    }
+
+    default:
+        fprintf(stderr, "Unknown record %d at offset %zu\n", op,
+                replay.offset - 1);
+        replay.error = 1;
+        return 1;
+    }
+
+    if (op == CAPTURE_OP_glUseProgram) {
+        replay.current_program = replay.last_program;
+    }
+
+    return 0;
+}
+
+static int setup(const struct capture_header *header) {
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        print_sdl_error("Error initializing SDL");
+        return 1;
+    }
+
+    int major = header->gl_major;
+    int minor = header->gl_minor;
+    int profile = major > 3 || minor > 3 ? SDL_GL_CONTEXT_PROFILE_CORE : 0;
+    if (SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, major) < 0 ||
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, minor) < 0 ||
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, profile) < 0) {
+        print_sdl_error("Error setting SDL context version");
+        SDL_Quit();
+        return 1;
+    }
+
+    replay.window = SDL_CreateWindow("Replay", 0, 0, header->width,
+                                     header->height, SDL_WINDOW_OPENGL);
+    if (!replay.window) {
+        print_sdl_error("Error creating SDL window");
+        SDL_Quit();
+        return 1;
+    }
+
+    replay.context = SDL_GL_CreateContext(replay.window);
+    if (!replay.context) {
+        print_sdl_error("Error getting SDL OpenGL context");
+        SDL_DestroyWindow(replay.window);
+        SDL_Quit();
+        return 1;
+    }
+
+    // Frames go as fast as they can, unless --timed
+    SDL_GL_SetSwapInterval(0);
+
+    return 0;
+}
+
+static int read_trace(const char *file_name) {
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        fprintf(stderr, "Error opening trace %s\n", file_name);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    if (!data || fread(data, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Error reading trace %s\n", file_name);
+        free(data);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    replay.data = data;
+    replay.size = size;
+    return 0;
+}
+
+int main(int argc, const char *argv[]) {
+    const char *file_name = NULL;
+    replay.repeat = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            replay.repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timed") == 0) {
+            replay.timed = 1;
+        } else {
+            file_name = argv[i];
+        }
+    }
+
+    if (!file_name || replay.repeat < 1) {
+        fprintf(stderr, "Usage: %s [--repeat N] [--timed] <trace>\n", argv[0]);
+        return 1;
+    }
+
+    if (read_trace(file_name) != 0) {
+        return 1;
+    }
+
+    struct capture_header header;
+    if (replay.size < sizeof(header)) {
+        fprintf(stderr, "%s isn't a trace\n", file_name);
+        return 1;
+    }
+    memcpy(&header, replay.data, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s isn't a trace\n", file_name);
+        return 1;
+    }
+    if (header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is version %u, expected %d\n", file_name,
+                header.version, CAPTURE_VERSION);
+        return 1;
+    }
+    replay.offset = sizeof(header);
+    replay.current_marker = -1;
+
+    if (setup(&header) != 0) {
+        return 1;
+    }
+
+    printf("Replaying %s: OpenGL %u.%u, %ux%u\n", file_name, header.gl_major,
+           header.gl_minor, header.width, header.height);
+
+    for (int pass = 0; pass < replay.repeat; pass++) {
+        if (pass > 0) {
+            restore_window_state();
+            replay.offset = replay.window_offset;
+            replay.frame = 0;
+            replay.last_frame_end = SDL_GetPerformanceCounter();
+        }
+
+        while (!replay_record() && !replay.error) {
+            // Keep the window responsive during long replays
+            if (replay.frame_open == 0) {
+                SDL_PumpEvents();
+            }
+        }
+
+        if (replay.error) {
+            fprintf(stderr, "Trace is truncated or corrupt at offset %zu\n",
+                    replay.offset);
+            break;
+        }
+        if (!replay.in_window) {
+            fprintf(stderr, "Trace has no capture window\n");
+            break;
+        }
+
+        // A frame cut off by the end of the capture isn't counted
+        replay.frame_open = 0;
+        replay.current_marker = -1;
+
+        print_frames(pass);
+    }
+
+    print_report();
+
+    SDL_GL_DeleteContext(replay.context);
+    SDL_DestroyWindow(replay.window);
+    SDL_Quit();
+
+    return replay.error;
+}
@@ -0,0 +1,396 @@
+#include "resolution.h"
+
+#include "draw_interface.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Largest scale the target can be made for, per axis
+#define MAX_SCALE 4.0f
+
+struct resolution_scaler *resolution_scaler_create(float min_scale,
+                                                   float max_scale,
+                                                   float target_ms,
+                                                   struct draw_data *data) {
+    struct resolution_scaler *scaler = calloc(1, sizeof(*scaler));
+    if (!scaler) {
+        return NULL;
+    }
+
+    scaler->min_scale = min_scale;
+    scaler->max_scale = max_scale;
+    scaler->target_ms = target_ms;
+    // Start at full resolution, or as close as the limits allow
+    scaler->scale = fminf(fmaxf(1.0f, min_scale), max_scale);
+    scaler->last_result = -1;
+
+    scaler->timers = &data->gpu_timers;
+    scaler->memory = data->memory;
+
+    glGenVertexArrays(1, &scaler->vertex_array);
+
+    return scaler;
+}
+
+static void release_target(struct resolution_scaler *scaler) {
+    if (!scaler->allocated) {
+        return;
+    }
+
+    memory_gpu_free(scaler->memory, MEMORY_GPU_TEXTURE, scaler->color);
+    memory_gpu_free(scaler->memory, MEMORY_GPU_RENDERBUFFER, scaler->depth);
+
+    glDeleteFramebuffers(1, &scaler->framebuffer);
+    glDeleteTextures(1, &scaler->color);
+    glDeleteRenderbuffers(1, &scaler->depth);
+
+    scaler->allocated = 0;
+}
+
+void resolution_scaler_destroy(struct resolution_scaler *scaler) {
+    release_target(scaler);
+    glDeleteVertexArrays(1, &scaler->vertex_array);
+
+    free(scaler);
+}
+
+static int allocate_target(struct resolution_scaler *scaler,
+                           GLsizei drawable_width, GLsizei drawable_height) {
+    release_target(scaler);
+
+    GLsizei width = ceilf(drawable_width * scaler->max_scale);
+    GLsizei height = ceilf(drawable_height * scaler->max_scale);
+
+    glGenTextures(1, &scaler->color);
+    glBindTexture(GL_TEXTURE_2D, scaler->color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &scaler->depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, scaler->depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &scaler->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, scaler->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           scaler->color, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                              GL_RENDERBUFFER, scaler->depth);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    memory_gpu_alloc(scaler->memory, MEMORY_GPU_TEXTURE, scaler->color,
+                     (size_t)width * height * 4, GL_RGBA8,
+                     "dynamic resolution");
+    memory_gpu_alloc(scaler->memory, MEMORY_GPU_RENDERBUFFER, scaler->depth,
+                     (size_t)width * height * 4, GL_DEPTH24_STENCIL8,
+                     "dynamic resolution");
+
+    scaler->width = width;
+    scaler->height = height;
+    scaler->drawable_width = drawable_width;
+    scaler->drawable_height = drawable_height;
+    scaler->allocated = 1;
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Dynamic resolution framebuffer is incomplete: 0x%x\n",
+                status);
+        release_target(scaler);
+        return 1;
+    }
+
+    log_debug("Made dynamic resolution target of %dx%d", width, height);
+
+    return 0;
+}
+
+static void set_scale(struct resolution_scaler *scaler, float scale) {
+    scaler->over_budget = 0;
+    scaler->under_budget = 0;
+
+    scale = fminf(fmaxf(scale, scaler->min_scale), scaler->max_scale);
+    // Not worth throwing away the measurements for
+    if (fabsf(scale - scaler->scale) < 0.005f) {
+        return;
+    }
+
+    log_debug("Dynamic resolution scale %.3f -> %.3f at %.2f ms", scaler->scale,
+           scale, scaler->ms);
+
+    scaler->scale = scale;
+    scaler->ms = 0;
+    scaler->changed_frame = scaler->timers->frame;
+}
+
+void resolution_update(struct resolution_scaler *scaler) {
+    const struct gpu_timer_scope *scope =
+        gpu_timer_find(scaler->timers, RESOLUTION_TIMER_SCOPE);
+    if (!scope || scope->result_frame <= scaler->last_result) {
+        return;
+    }
+
+    scaler->last_result = scope->result_frame;
+    if (scope->result_frame < scaler->changed_frame) {
+        return;
+    }
+
+    scaler->ms = scope->ms;
+    if (scaler->ms <= 0) {
+        return;
+    }
+
+    // GPU time goes roughly with the number of pixels, the square of the
+    // scale. Aim between the headroom line and the budget so a change
+    // doesn't immediately call for another one back.
+    float aim = scaler->target_ms * (1.0f + RESOLUTION_HEADROOM) / 2;
+    float estimate = scaler->scale * sqrtf(aim / scaler->ms);
+
+    if (scaler->ms > scaler->target_ms) {
+        scaler->under_budget = 0;
+        if (++scaler->over_budget >= RESOLUTION_DOWN_FRAMES) {
+            set_scale(scaler, estimate);
+        }
+    } else if (scaler->ms < scaler->target_ms * RESOLUTION_HEADROOM) {
+        scaler->over_budget = 0;
+        if (++scaler->under_budget >= RESOLUTION_UP_FRAMES) {
+            set_scale(scaler,
+                      fminf(estimate, scaler->scale + RESOLUTION_UP_STEP));
+        }
+    } else {
+        scaler->over_budget = 0;
+        scaler->under_budget = 0;
+    }
+}
+
+int resolution_begin(struct resolution_scaler *scaler,
+                     struct draw_data *data) {
+    resolution_update(scaler);
+
+    int drawable_width, drawable_height;
+    SDL_GL_GetDrawableSize(data->window, &drawable_width, &drawable_height);
+
+    scaler->output_width = drawable_width;
+    scaler->output_height = drawable_height;
+    scaler->viewport_width = fmaxf(1.0f, roundf(drawable_width * scaler->scale));
+    scaler->viewport_height =
+        fmaxf(1.0f, roundf(drawable_height * scaler->scale));
+
+    // At full scale there's nothing to upscale, so skip the copy
+    scaler->direct = scaler->viewport_width == drawable_width &&
+                     scaler->viewport_height == drawable_height;
+
+    if (!scaler->direct &&
+        (!scaler->allocated || scaler->drawable_width != drawable_width ||
+         scaler->drawable_height != drawable_height) &&
+        allocate_target(scaler, drawable_width, drawable_height) != 0) {
+        return 1;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, scaler->direct ? 0 : scaler->framebuffer);
+    glViewport(0, 0, scaler->viewport_width, scaler->viewport_height);
+
+    gpu_timer_begin(scaler->timers, RESOLUTION_TIMER_SCOPE);
+    data->frame_scaler = scaler;
+
+    return 0;
+}
+
+// Draws a triangle covering the window with the program, which samples the
+// target from texture unit 0
+static void draw_upscale(struct resolution_scaler *scaler,
+                         struct draw_data *data, GLuint program) {
+    if (program != scaler->program) {
+        scaler->program = program;
+        scaler->source_scale_location =
+            glGetUniformLocation(program, "source_scale");
+        scaler->texel_size_location =
+            glGetUniformLocation(program, "texel_size");
+    }
+
+    // Only what Lua turned on needs turning off and back on
+    int depth_test = data->capabilities & DRAW_DEPTH_TEST;
+    int cull_face = data->capabilities & DRAW_CULL_FACE;
+    if (depth_test) {
+        glDisable(GL_DEPTH_TEST);
+    }
+    if (cull_face) {
+        glDisable(GL_CULL_FACE);
+    }
+
+    glUseProgram(program);
+    glUniform2f(scaler->source_scale_location,
+                (float)scaler->viewport_width / scaler->width,
+                (float)scaler->viewport_height / scaler->height);
+    glUniform2f(scaler->texel_size_location, 1.0f / scaler->width,
+                1.0f / scaler->height);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, scaler->color);
+    glBindVertexArray(scaler->vertex_array);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    handle_restore_bindings(&data->handles);
+    glUseProgram(0);
+
+    if (depth_test) {
+        glEnable(GL_DEPTH_TEST);
+    }
+    if (cull_face) {
+        glEnable(GL_CULL_FACE);
+    }
+}
+
+void resolution_end(struct resolution_scaler *scaler, struct draw_data *data,
+                    GLuint program) {
+    gpu_timer_end(scaler->timers);
+    data->frame_scaler = NULL;
+
+    if (scaler->direct) {
+        return;
+    }
+
+    if (program) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, scaler->output_width, scaler->output_height);
+        draw_upscale(scaler, data, program);
+    } else {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, scaler->framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, scaler->viewport_width, scaler->viewport_height,
+                          0, 0, scaler->output_width, scaler->output_height,
+                          GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, scaler->output_width, scaler->output_height);
+    }
+}
+
+static struct resolution_scaler *check_scaler(lua_State *L, int index) {
+    struct resolution_scaler *scaler = lua_touserdata(L, index);
+    if (!scaler) {
+        luaL_error(L, "Expected a resolution scaler");
+    }
+
+    return scaler;
+}
+
+static void check_limits(lua_State *L, float min_scale, float max_scale,
+                         float target_ms) {
+    if (!(min_scale > 0 && min_scale <= max_scale && max_scale <= MAX_SCALE)) {
+        luaL_error(L, "Bad resolution scale limits %f to %f", min_scale,
+                   max_scale);
+    }
+    if (!(target_ms > 0)) {
+        luaL_error(L, "Bad resolution target frame time %f", target_ms);
+    }
+}
+
+// min scale, max scale, target GPU milliseconds for the scaled frame
+int draw_lua_CreateResolutionScaler(struct draw_data *data, lua_State *L) {
+    float min_scale = luaL_checknumber(L, 1);
+    float max_scale = luaL_checknumber(L, 2);
+    float target_ms = luaL_checknumber(L, 3);
+    check_limits(L, min_scale, max_scale, target_ms);
+
+    struct resolution_scaler *scaler =
+        resolution_scaler_create(min_scale, max_scale, target_ms, data);
+    if (!scaler) {
+        return luaL_error(L, "Error creating resolution scaler");
+    }
+
+    lua_pushlightuserdata(L, scaler);
+
+    return 1;
+}
+
+int draw_lua_DeleteResolutionScaler(struct draw_data *data, lua_State *L) {
+    struct resolution_scaler *scaler = check_scaler(L, 1);
+    if (data->frame_scaler == scaler) {
+        data->frame_scaler = NULL;
+    }
+
+    resolution_scaler_destroy(scaler);
+
+    return 0;
+}
+
+// scaler, min scale, max scale, target GPU milliseconds. Setting min and max
+// the same fixes the scale.
+int draw_lua_SetResolutionLimits(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct resolution_scaler *scaler = check_scaler(L, 1);
+    float min_scale = luaL_checknumber(L, 2);
+    float max_scale = luaL_checknumber(L, 3);
+    float target_ms = luaL_checknumber(L, 4);
+    check_limits(L, min_scale, max_scale, target_ms);
+
+    // The target is sized for the largest scale
+    if (max_scale != scaler->max_scale) {
+        release_target(scaler);
+    }
+
+    scaler->min_scale = min_scale;
+    scaler->max_scale = max_scale;
+    scaler->target_ms = target_ms;
+    set_scale(scaler, scaler->scale);
+
+    return 0;
+}
+
+// Binds the scaled target. Returns the width and height being drawn at.
+int draw_lua_ResolutionBegin(struct draw_data *data, lua_State *L) {
+    struct resolution_scaler *scaler = check_scaler(L, 1);
+
+    if (resolution_begin(scaler, data) != 0) {
+        return luaL_error(L, "Error making dynamic resolution target");
+    }
+
+    lua_pushinteger(L, scaler->viewport_width);
+    lua_pushinteger(L, scaler->viewport_height);
+
+    return 2;
+}
+
+// scaler, and optionally a program to upscale with. Without one the frame
+// is stretched with a bilinear blit.
+int draw_lua_ResolutionEnd(struct draw_data *data, lua_State *L) {
+    struct resolution_scaler *scaler = check_scaler(L, 1);
+    GLuint program = handle_check(L, &data->handles, 2, HANDLE_PROGRAM);
+
+    resolution_end(scaler, data, program);
+
+    return 0;
+}
+
+// Current scale, and the latest GPU milliseconds measured at it or nil
+int draw_lua_ResolutionScale(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct resolution_scaler *scaler = check_scaler(L, 1);
+
+    lua_pushnumber(L, scaler->scale);
+    if (scaler->ms > 0) {
+        lua_pushnumber(L, scaler->ms);
+    } else {
+        lua_pushnil(L);
+    }
+
+    return 2;
+}
+
+void resolution_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateResolutionScaler);
+    REGISTER_FUNC(DeleteResolutionScaler);
+    REGISTER_FUNC(SetResolutionLimits);
+    REGISTER_FUNC(ResolutionBegin);
+    REGISTER_FUNC(ResolutionEnd);
+    REGISTER_FUNC(ResolutionScale);
+}
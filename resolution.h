@@ -0,0 +1,87 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+#include "lua.h"
+#include "draw.h"
+
+// GPU timer scope measuring everything drawn between begin and end
+#define RESOLUTION_TIMER_SCOPE "dynamic resolution"
+
+// Frames in a row over budget before the scale drops
+#define RESOLUTION_DOWN_FRAMES 3
+// Frames in a row under RESOLUTION_HEADROOM of the budget before it rises
+#define RESOLUTION_UP_FRAMES 60
+#define RESOLUTION_HEADROOM 0.85f
+// Largest rise in scale at once. Drops go straight to the estimated scale.
+#define RESOLUTION_UP_STEP 0.05f
+
+// Draws the scene into an offscreen target at a fraction of the window's
+// resolution, then upscales it to the window. The fraction follows the GPU
+// time of the scaled frames: it drops quickly when they go over budget and
+// rises slowly while there's headroom, so it doesn't oscillate.
+//
+// The target is allocated once at the largest scale, and smaller scales
+// draw into its bottom left corner, so changing scale never reallocates.
+struct resolution_scaler {
+    float min_scale;
+    float max_scale;
+    // GPU time budget in milliseconds for what's drawn between begin and end
+    float target_ms;
+
+    float scale;
+    // Latest GPU time at the current scale, or 0 for none yet
+    double ms;
+
+    int over_budget;
+    int under_budget;
+    // GPU timer frame the scale last changed on. Results from before it were
+    // measured at the old scale.
+    long changed_frame;
+    long last_result;
+
+    GLuint framebuffer;
+    GLuint color;
+    GLuint depth;
+    // Size of the target, and of the drawable it was made for
+    GLsizei width;
+    GLsizei height;
+    GLsizei drawable_width;
+    GLsizei drawable_height;
+    int allocated;
+
+    // Sizes of the window and of what's drawn this frame
+    GLsizei output_width;
+    GLsizei output_height;
+    GLsizei viewport_width;
+    GLsizei viewport_height;
+    // Drawing straight to the window this frame, at full scale
+    int direct;
+
+    // Upscaling program the uniform locations were looked up for
+    GLuint program;
+    GLint source_scale_location;
+    GLint texel_size_location;
+    // Empty, for drawing the full screen triangle
+    GLuint vertex_array;
+
+    struct gpu_timers *timers;
+    struct memory_stats *memory;
+};
+
+struct resolution_scaler *resolution_scaler_create(float, float, float,
+                                                   struct draw_data *);
+void resolution_scaler_destroy(struct resolution_scaler *);
+
+// Moves the scale towards the budget from the latest GPU time
+void resolution_update(struct resolution_scaler *);
+
+// Binds the target and sets the viewport to the scaled size, and makes the
+// scaler the frame's. Returns 1 if the target couldn't be made.
+int resolution_begin(struct resolution_scaler *, struct draw_data *);
+// Upscales the frame to the window with the program, or with a bilinear
+// blit for 0, and leaves the default framebuffer bound
+void resolution_end(struct resolution_scaler *, struct draw_data *, GLuint);
+
+void resolution_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,68 @@
+-- Dynamic resolution. The scene is drawn into an offscreen target whose
+-- size follows the GPU time of the frame, then upscaled to the window,
+-- either with a bilinear blit or with a sharpening pass that hides some of
+-- the blur.
+local gl = require 'gl'
+
+local M = {}
+
+-- Options, all optional:
+--   min_scale, max_scale: fraction of the window's resolution per axis
+--   target_ms: GPU time budget for the scaled part of the frame
+--   sharpness: 0 to 1 for the sharpening upscale, nil for bilinear
+function M.create(options)
+  options = options or {}
+
+  local resolution = {
+    scaler = gl.create_resolution_scaler(
+      options.min_scale or 0.5, options.max_scale or 1,
+      options.target_ms or 12),
+  }
+
+  if options.sharpness then
+    resolution.program = gl.create_program({
+      {gl.VERTEX_SHADER, "upscale.vertex.glsl"},
+      {gl.FRAGMENT_SHADER, "upscale.fragment.glsl"},
+    })
+    gl.with_program(
+      resolution.program,
+      function()
+        gl.uniform_float(
+          gl.get_uniform_location(resolution.program, "sharpness"),
+          {options.sharpness})
+      end
+    )
+  end
+
+  return resolution
+end
+
+function M.delete(resolution)
+  gl.delete_resolution_scaler(resolution.scaler)
+  if resolution.program then
+    gl.delete_program(resolution.program)
+  end
+end
+
+-- Calls func with the width and height it's drawing at, with the scaled
+-- target bound, then upscales the result to the window. Render graphs
+-- executed inside draw their backbuffer passes into the target, and can't
+-- have attachments sized to the window.
+function M.frame(resolution, func)
+  local width, height = gl.resolution_begin(resolution.scaler)
+
+  func(width, height)
+
+  gl.resolution_end(resolution.scaler, resolution.program)
+end
+
+-- Current scale, and the GPU milliseconds measured at it or nil
+function M.scale(resolution)
+  return gl.resolution_scale(resolution.scaler)
+end
+
+function M.set_limits(resolution, min_scale, max_scale, target_ms)
+  gl.set_resolution_limits(resolution.scaler, min_scale, max_scale, target_ms)
+end
+
+return M
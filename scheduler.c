@@ -0,0 +1,579 @@
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Scheduler whose update is running, for the hook
+static struct scheduler *running = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#ifndef USE_LUAJIT
+// Yielding unwinds to lua_resume, which can't be done through a C function
+static int can_yield(lua_State *L) {
+    lua_Debug ar;
+    for (int level = 0; lua_getstack(L, level, &ar); level++) {
+        lua_getinfo(L, "S", &ar);
+        if (ar.what[0] == 'C') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void budget_hook(lua_State *L, lua_Debug *ar) {
+    (void)ar;
+
+    struct scheduler *scheduler = running;
+    if (!scheduler || scheduler->current < 0 ||
+        scheduler->tasks[scheduler->current].thread != L) {
+        return;
+    }
+
+    if (now_ns() < scheduler->deadline || !can_yield(L)) {
+        return;
+    }
+
+    scheduler->tasks[scheduler->current].preempted = 1;
+    lua_yield(L, 0);
+}
+#endif
+
+struct scheduler *scheduler_create(double budget_ms) {
+    struct scheduler *scheduler = calloc(1, sizeof(*scheduler));
+    if (!scheduler) {
+        return NULL;
+    }
+
+    scheduler->budget_ns = budget_ms * 1e6;
+    scheduler->next_id = 1;
+    scheduler->current = -1;
+
+    return scheduler;
+}
+
+static void release_task(struct scheduler *scheduler, lua_State *L,
+                         struct scheduler_task *task) {
+    luaL_unref(L, LUA_REGISTRYINDEX, task->predicate_ref);
+    task->predicate_ref = LUA_NOREF;
+
+    if (task->finished && scheduler->pool_count < SCHEDULER_POOL_SIZE) {
+        lua_settop(task->thread, 0);
+        scheduler->pool[scheduler->pool_count++] = (struct scheduler_thread){
+            task->thread, task->thread_ref,
+        };
+    } else {
+        luaL_unref(L, LUA_REGISTRYINDEX, task->thread_ref);
+    }
+
+    task->thread = NULL;
+    task->thread_ref = LUA_NOREF;
+}
+
+void scheduler_destroy(struct scheduler *scheduler, lua_State *L) {
+    for (size_t i = 0; i < scheduler->count; i++) {
+        scheduler->tasks[i].finished = 0;
+        release_task(scheduler, L, &scheduler->tasks[i]);
+    }
+    for (size_t i = 0; i < scheduler->pool_count; i++) {
+        luaL_unref(L, LUA_REGISTRYINDEX, scheduler->pool[i].ref);
+    }
+
+    free(scheduler->tasks);
+    free(scheduler);
+}
+
+// Removes dead tasks, keeping the order of the rest
+static void compact(struct scheduler *scheduler, lua_State *L) {
+    size_t kept = 0;
+    size_t next = 0;
+
+    for (size_t i = 0; i < scheduler->count; i++) {
+        struct scheduler_task *task = &scheduler->tasks[i];
+
+        if (i == scheduler->next) {
+            next = kept;
+        }
+
+        if (task->state == SCHEDULER_DEAD) {
+            release_task(scheduler, L, task);
+        } else {
+            scheduler->tasks[kept++] = *task;
+        }
+    }
+
+    scheduler->count = kept;
+    scheduler->next = next;
+}
+
+// A coroutine from the pool, or a new one
+static void get_thread(struct scheduler *scheduler, lua_State *L,
+                       struct scheduler_thread *thread) {
+    if (scheduler->pool_count > 0) {
+        *thread = scheduler->pool[--scheduler->pool_count];
+        return;
+    }
+
+    thread->thread = lua_newthread(L);
+    thread->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+#ifndef USE_LUAJIT
+    lua_sethook(thread->thread, budget_hook, LUA_MASKCOUNT,
+                SCHEDULER_HOOK_COUNT);
+#endif
+}
+
+uint32_t scheduler_spawn(struct scheduler *scheduler, lua_State *L,
+                         const char *name, int nargs) {
+    if (scheduler->count == scheduler->capacity) {
+        size_t capacity = scheduler->capacity ? scheduler->capacity * 2 : 16;
+        struct scheduler_task *tasks =
+            realloc(scheduler->tasks, capacity * sizeof(*tasks));
+        if (!tasks) {
+            return 0;
+        }
+
+        scheduler->tasks = tasks;
+        scheduler->capacity = capacity;
+    }
+
+    struct scheduler_thread thread;
+    get_thread(scheduler, L, &thread);
+    lua_xmove(L, thread.thread, nargs + 1);
+
+    struct scheduler_task *task = &scheduler->tasks[scheduler->count++];
+    memset(task, 0x0, sizeof(*task));
+    task->id = scheduler->next_id++;
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    task->thread = thread.thread;
+    task->thread_ref = thread.ref;
+    task->predicate_ref = LUA_NOREF;
+    task->state = SCHEDULER_READY;
+    task->args = nargs;
+
+    return task->id;
+}
+
+struct scheduler_task *scheduler_find(struct scheduler *scheduler,
+                                      uint32_t id) {
+    for (size_t i = 0; i < scheduler->count; i++) {
+        if (scheduler->tasks[i].id == id &&
+            scheduler->tasks[i].state != SCHEDULER_DEAD) {
+            return &scheduler->tasks[i];
+        }
+    }
+
+    return NULL;
+}
+
+// A task cancelled during an update is removed at the end of it, since it
+// may be the one running
+void scheduler_cancel(struct scheduler *scheduler, lua_State *L,
+                      uint32_t id) {
+    struct scheduler_task *task = scheduler_find(scheduler, id);
+    if (!task) {
+        return;
+    }
+
+    task->state = SCHEDULER_DEAD;
+    if (scheduler->current < 0) {
+        compact(scheduler, L);
+    }
+}
+
+static void task_error(lua_State *L, struct scheduler_task *task,
+                       lua_State *thread) {
+    luaL_traceback(L, thread, lua_tostring(thread, -1), 0);
+    fprintf(stderr, "Error in task '%s': %s\n", task->name,
+            lua_tostring(L, -1));
+    lua_pop(L, 1);
+
+    task->state = SCHEDULER_DEAD;
+}
+
+// Whether a waiting task's predicate is true now. Its results are left on
+// the task's stack for the resume.
+static int poll(lua_State *L, struct scheduler_task *task) {
+    uint64_t begin = now_ns();
+
+    int top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, task->predicate_ref);
+    int status = lua_pcall(L, 0, LUA_MULTRET, 0);
+
+    task->frame_ns += now_ns() - begin;
+
+    if (status != LUA_OK) {
+        fprintf(stderr, "Error in wait of task '%s': %s\n", task->name,
+                lua_tostring(L, -1));
+        lua_settop(L, top);
+        task->state = SCHEDULER_DEAD;
+        return 0;
+    }
+
+    int results = lua_gettop(L) - top;
+    if (results == 0 || !lua_toboolean(L, top + 1)) {
+        lua_settop(L, top);
+        return 0;
+    }
+
+    lua_xmove(L, task->thread, results);
+    task->args = results;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, task->predicate_ref);
+    task->predicate_ref = LUA_NOREF;
+    task->state = SCHEDULER_READY;
+
+    return 1;
+}
+
+// Sets what the task waits for from the values it yielded, the top results
+// of its stack
+static void wait_for(struct scheduler *scheduler, lua_State *L,
+                     struct scheduler_task *task, int results) {
+    lua_State *thread = task->thread;
+    int first = lua_gettop(thread) - results + 1;
+
+    task->state = SCHEDULER_READY;
+
+    if (results == 0 || lua_isnil(thread, first)) {
+        return;
+    }
+
+    if (lua_type(thread, first) == LUA_TNUMBER) {
+        lua_Integer frames = lua_tointeger(thread, first);
+        if (frames > 1) {
+            task->state = SCHEDULER_SLEEPING;
+            task->wake_frame = scheduler->frame + frames;
+        }
+    } else if (lua_type(thread, first) == LUA_TFUNCTION) {
+        lua_pushvalue(thread, first);
+        lua_xmove(thread, L, 1);
+        task->predicate_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        task->state = SCHEDULER_WAITING;
+    } else {
+        fprintf(stderr, "Task '%s' yielded a %s, waiting a frame\n",
+                task->name, luaL_typename(thread, first));
+    }
+}
+
+static void resume(struct scheduler *scheduler, lua_State *L, size_t index) {
+    struct scheduler_task *task = &scheduler->tasks[index];
+    lua_State *thread = task->thread;
+    int args = task->args;
+
+    task->args = 0;
+    task->preempted = 0;
+    scheduler->current = index;
+
+    uint64_t begin = now_ns();
+    int results;
+    int status = lua_resume(thread, L, args, &results);
+    uint64_t elapsed = now_ns() - begin;
+
+    scheduler->current = -1;
+
+    // The task may have spawned others, moving the array
+    task = &scheduler->tasks[index];
+    task->frame_ns += elapsed;
+    task->total_ns += elapsed;
+    if (elapsed > task->max_ns) {
+        task->max_ns = elapsed;
+    }
+    task->resumes++;
+
+    if (status == LUA_YIELD && task->preempted) {
+        // The stack is the interrupted function's, so it's left alone
+        task->preemptions++;
+        if (task->state != SCHEDULER_DEAD) {
+            task->state = SCHEDULER_READY;
+        }
+    } else if (status == LUA_YIELD) {
+        if (task->state != SCHEDULER_DEAD) {
+            wait_for(scheduler, L, task, results);
+        }
+        lua_settop(thread, 0);
+    } else if (status == LUA_OK) {
+        task->finished = 1;
+        task->state = SCHEDULER_DEAD;
+        lua_settop(thread, 0);
+    } else {
+        task_error(L, task, thread);
+    }
+}
+
+// Whether the task would run this update if there were time
+static int due(const struct scheduler *scheduler,
+               const struct scheduler_task *task) {
+    switch (task->state) {
+    case SCHEDULER_READY:
+    case SCHEDULER_WAITING:
+        return 1;
+    case SCHEDULER_SLEEPING:
+        return scheduler->frame >= task->wake_frame;
+    default:
+        return 0;
+    }
+}
+
+int scheduler_update(struct scheduler *scheduler, lua_State *L) {
+    if (scheduler->current >= 0) {
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    scheduler->deadline = start + scheduler->budget_ns;
+    scheduler->frame++;
+    scheduler->ran = 0;
+    scheduler->deferred = 0;
+
+    for (size_t i = 0; i < scheduler->count; i++) {
+        scheduler->tasks[i].frame_ns = 0;
+    }
+
+    struct scheduler *previous = running;
+    running = scheduler;
+
+    // Tasks spawned during the update start on the next one
+    size_t count = scheduler->count;
+    size_t first = count > 0 ? scheduler->next % count : 0;
+    int out_of_time = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t index = (first + i) % count;
+        struct scheduler_task *task = &scheduler->tasks[index];
+
+        if (!due(scheduler, task)) {
+            continue;
+        }
+
+        // Every update runs at least one task
+        if (!out_of_time && scheduler->ran > 0 &&
+            now_ns() >= scheduler->deadline) {
+            out_of_time = 1;
+            scheduler->next = index;
+        }
+        if (out_of_time) {
+            scheduler->deferred++;
+            continue;
+        }
+
+        if (task->state == SCHEDULER_WAITING && !poll(L, task)) {
+            continue;
+        }
+
+        resume(scheduler, L, index);
+        scheduler->ran++;
+    }
+
+    if (!out_of_time) {
+        scheduler->next = first;
+    }
+
+    running = previous;
+
+    uint64_t end = now_ns();
+    scheduler->frame_ns = end - start;
+    scheduler->late_ns = end > scheduler->deadline ?
+        end - scheduler->deadline : 0;
+    if (scheduler->late_ns > scheduler->max_late_ns) {
+        scheduler->max_late_ns = scheduler->late_ns;
+    }
+
+    compact(scheduler, L);
+
+    return 0;
+}
+
+int scheduler_over_budget(const struct scheduler *scheduler) {
+    return scheduler->current >= 0 && now_ns() >= scheduler->deadline;
+}
+
+static struct scheduler *check_scheduler(lua_State *L, int index) {
+    struct scheduler *scheduler = lua_touserdata(L, index);
+    if (!scheduler) {
+        luaL_error(L, "Expected a scheduler");
+    }
+
+    return scheduler;
+}
+
+// Optional per frame budget in milliseconds, 2 by default
+int scheduler_lua_Create(lua_State *L) {
+    double budget_ms = luaL_optnumber(L, 1, 2.0);
+    if (budget_ms < 0) {
+        return luaL_error(L, "Bad scheduler budget %f", budget_ms);
+    }
+
+    struct scheduler *scheduler = scheduler_create(budget_ms);
+    if (!scheduler) {
+        return luaL_error(L, "Error creating scheduler");
+    }
+
+    lua_pushlightuserdata(L, scheduler);
+
+    return 1;
+}
+
+int scheduler_lua_Delete(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+    if (scheduler->current >= 0) {
+        return luaL_error(L, "Can't delete a scheduler from its own task");
+    }
+
+    scheduler_destroy(scheduler, L);
+
+    return 0;
+}
+
+// scheduler, name or nil, function, arguments... Returns the task's id.
+int scheduler_lua_Spawn(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+    const char *name = luaL_optstring(L, 2, NULL);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+
+    lua_Debug ar;
+    char where[sizeof(ar.short_src) + 16];
+    if (!name) {
+        lua_pushvalue(L, 3);
+        lua_getinfo(L, ">S", &ar);
+        snprintf(where, sizeof(where), "%s:%d", ar.short_src,
+                 ar.linedefined);
+        name = where;
+    }
+
+    uint32_t id = scheduler_spawn(scheduler, L, name, lua_gettop(L) - 3);
+    if (id == 0) {
+        return luaL_error(L, "Error spawning task");
+    }
+
+    lua_pushinteger(L, id);
+
+    return 1;
+}
+
+int scheduler_lua_Cancel(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+
+    scheduler_cancel(scheduler, L, id);
+
+    return 0;
+}
+
+static const char *state_names[] = {
+    [SCHEDULER_READY] = "ready",
+    [SCHEDULER_SLEEPING] = "sleeping",
+    [SCHEDULER_WAITING] = "waiting",
+    [SCHEDULER_DEAD] = "dead",
+};
+
+// "running", "ready", "sleeping" or "waiting", or nil once it's finished
+int scheduler_lua_Status(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+    uint32_t id = luaL_checkinteger(L, 2);
+
+    struct scheduler_task *task = scheduler_find(scheduler, id);
+    if (!task) {
+        lua_pushnil(L);
+    } else if (scheduler->current >= 0 &&
+               &scheduler->tasks[scheduler->current] == task) {
+        lua_pushstring(L, "running");
+    } else {
+        lua_pushstring(L, state_names[task->state]);
+    }
+
+    return 1;
+}
+
+int scheduler_lua_Update(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+
+    if (scheduler_update(scheduler, L) != 0) {
+        return luaL_error(L, "Can't update a scheduler from its own task");
+    }
+
+    lua_pushinteger(L, scheduler->ran);
+    lua_pushinteger(L, scheduler->deferred);
+
+    return 2;
+}
+
+int scheduler_lua_OverBudget(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+
+    lua_pushboolean(L, scheduler_over_budget(scheduler));
+
+    return 1;
+}
+
+int scheduler_lua_SetBudget(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+    double budget_ms = luaL_checknumber(L, 2);
+    if (budget_ms < 0) {
+        return luaL_error(L, "Bad scheduler budget %f", budget_ms);
+    }
+
+    scheduler->budget_ns = budget_ms * 1e6;
+
+    return 0;
+}
+
+static void set_number(lua_State *L, const char *name, lua_Number value) {
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+}
+
+// The last update, and each task's CPU time in it and overall
+int scheduler_lua_Stats(lua_State *L) {
+    struct scheduler *scheduler = check_scheduler(L, 1);
+
+    lua_createtable(L, 0, 8);
+    set_number(L, "frame_ms", scheduler->frame_ns / 1e6);
+    set_number(L, "budget_ms", scheduler->budget_ns / 1e6);
+    set_number(L, "ran", scheduler->ran);
+    set_number(L, "deferred", scheduler->deferred);
+    set_number(L, "late_ms", scheduler->late_ns / 1e6);
+    set_number(L, "max_late_ms", scheduler->max_late_ns / 1e6);
+    set_number(L, "pooled", scheduler->pool_count);
+
+    lua_createtable(L, scheduler->count, 0);
+    for (size_t i = 0; i < scheduler->count; i++) {
+        struct scheduler_task *task = &scheduler->tasks[i];
+
+        lua_createtable(L, 0, 8);
+        set_number(L, "id", task->id);
+        lua_pushstring(L, task->name);
+        lua_setfield(L, -2, "name");
+        lua_pushstring(L, state_names[task->state]);
+        lua_setfield(L, -2, "state");
+        set_number(L, "ms", task->frame_ns / 1e6);
+        set_number(L, "total_ms", task->total_ns / 1e6);
+        set_number(L, "max_ms", task->max_ns / 1e6);
+        set_number(L, "resumes", task->resumes);
+        set_number(L, "preemptions", task->preemptions);
+
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "tasks");
+
+    return 1;
+}
+
+void scheduler_register(lua_State *L) {
+    lua_register(L, "scheduler_Create", scheduler_lua_Create);
+    lua_register(L, "scheduler_Delete", scheduler_lua_Delete);
+    lua_register(L, "scheduler_Spawn", scheduler_lua_Spawn);
+    lua_register(L, "scheduler_Cancel", scheduler_lua_Cancel);
+    lua_register(L, "scheduler_Status", scheduler_lua_Status);
+    lua_register(L, "scheduler_Update", scheduler_lua_Update);
+    lua_register(L, "scheduler_OverBudget", scheduler_lua_OverBudget);
+    lua_register(L, "scheduler_SetBudget", scheduler_lua_SetBudget);
+    lua_register(L, "scheduler_Stats", scheduler_lua_Stats);
+}
@@ -0,0 +1,118 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "lua.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Instructions between budget checks while a task runs
+#define SCHEDULER_HOOK_COUNT 1000
+// Finished coroutines kept for reuse by later tasks
+#define SCHEDULER_POOL_SIZE 32
+#define SCHEDULER_NAME_SIZE 32
+
+enum scheduler_task_state {
+    SCHEDULER_READY,
+    // Until wake_frame
+    SCHEDULER_SLEEPING,
+    // Until the predicate returns true
+    SCHEDULER_WAITING,
+    // Finished, failed or cancelled, and removed at the end of the update
+    SCHEDULER_DEAD,
+};
+
+struct scheduler_task {
+    uint32_t id;
+    char name[SCHEDULER_NAME_SIZE];
+
+    lua_State *thread;
+    // Registry references keeping the coroutine and the predicate alive
+    int thread_ref;
+    int predicate_ref;
+
+    enum scheduler_task_state state;
+    long wake_frame;
+    // Values waiting on the coroutine's stack for the next resume: the
+    // arguments at first, then what the predicate returned
+    int args;
+    // Returned normally, so the coroutine can be reused
+    int finished;
+
+    // Set by the hook when it yields the task for going over budget
+    int preempted;
+
+    // CPU time in nanoseconds, including polling the predicate
+    uint64_t frame_ns;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    long resumes;
+    long preemptions;
+};
+
+struct scheduler_thread {
+    lua_State *thread;
+    int ref;
+};
+
+// Runs Lua functions as coroutines across frames, within a time budget per
+// frame. A task yields to wait:
+//   - with nothing, until the next frame
+//   - with a number n, for n frames
+//   - with a function, until it returns true, e.g. for a load to finish
+//
+// Outside LuaJIT, a count hook also yields tasks that run past the budget,
+// so a long loop needn't yield by hand. It only does so when there's no C
+// function on the task's stack, since those can't be yielded across.
+// LuaJIT doesn't run hooks in compiled code, so tasks there have to check
+// the budget themselves.
+//
+// Tasks take turns: the update after one that ran out of budget starts with
+// the task it didn't get to.
+struct scheduler {
+    struct scheduler_task *tasks;
+    size_t count;
+    size_t capacity;
+
+    struct scheduler_thread pool[SCHEDULER_POOL_SIZE];
+    size_t pool_count;
+
+    uint32_t next_id;
+    size_t next;
+    long frame;
+
+    uint64_t budget_ns;
+    uint64_t deadline;
+    // Index of the task being resumed, or -1 outside of an update
+    long current;
+
+    // From the last update
+    uint64_t frame_ns;
+    size_t ran;
+    // Tasks that were due but didn't fit in the budget
+    size_t deferred;
+    // How far past the deadline the last update and the worst one ran.
+    // Tasks are stopped within SCHEDULER_HOOK_COUNT instructions, unless
+    // they're in a C function.
+    uint64_t late_ns;
+    uint64_t max_late_ns;
+};
+
+struct scheduler *scheduler_create(double);
+void scheduler_destroy(struct scheduler *, lua_State *);
+
+// Runs the function on top of the stack with the nargs values after it as a
+// new task. Returns its id, or 0 on allocation failure.
+uint32_t scheduler_spawn(struct scheduler *, lua_State *, const char *, int);
+void scheduler_cancel(struct scheduler *, lua_State *, uint32_t);
+struct scheduler_task *scheduler_find(struct scheduler *, uint32_t);
+
+// Resumes the tasks that are due until the budget runs out. Returns 1 if
+// called from inside one of its tasks.
+int scheduler_update(struct scheduler *, lua_State *);
+// Whether the task running now should yield
+int scheduler_over_budget(const struct scheduler *);
+
+void scheduler_register(lua_State *);
+
+#endif
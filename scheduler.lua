@@ -0,0 +1,84 @@
+-- Runs functions as coroutines spread over frames, within a time budget per
+-- frame. Call update once a frame, e.g. from update(). Inside a task, wait
+-- with the functions below rather than running long loops to the end.
+local M = {}
+
+-- Scheduler functions exposed from C
+local copy_funcs = {
+  Create="create",
+  Delete="delete",
+  Spawn="spawn",
+  Cancel="cancel",
+  Status="status",
+  Update="update",
+  OverBudget="over_budget",
+  SetBudget="set_budget",
+  Stats="stats",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["scheduler_" .. c_name]
+end
+
+-- Waits until the next frame, or n frames
+function M.wait_frames(n)
+  coroutine.yield(n)
+end
+
+-- Waits until predicate returns true, checked once a frame. Returns what it
+-- returned.
+function M.wait_until(predicate)
+  return coroutine.yield(predicate)
+end
+
+-- Yields if the frame's budget is used up. Hooks do this on their own
+-- outside LuaJIT, but only where there's no C function on the stack, so
+-- call this between steps of work done through C, or anywhere under
+-- LuaJIT.
+function M.check(scheduler)
+  if M.over_budget(scheduler) then
+    coroutine.yield()
+  end
+end
+
+-- A value that's filled in later, e.g. by a load finishing
+function M.future()
+  return {done = false}
+end
+
+function M.complete(future, value)
+  future.value = value
+  future.done = true
+end
+
+-- Waits for the future to be completed and returns its value
+function M.await(future)
+  if not future.done then
+    M.wait_until(function() return future.done end)
+  end
+  return future.value
+end
+
+-- Prints each task's CPU time, busiest first
+function M.report(scheduler, file)
+  file = file or io.stderr
+
+  local stats = M.stats(scheduler)
+  table.sort(stats.tasks, function(a, b) return a.total_ms > b.total_ms end)
+
+  file:write(string.format(
+    "Scheduler: %.3f of %.3f ms, %d ran, %d deferred, " ..
+      "%.3f ms late (worst %.3f)\n",
+    stats.frame_ms, stats.budget_ms, stats.ran, stats.deferred,
+    stats.late_ms, stats.max_late_ms
+  ))
+  for _, task in ipairs(stats.tasks) do
+    file:write(string.format(
+      "  %-32s %-8s %8.3f ms %10.3f total %8.3f max %6d resumes %6d preempted\n",
+      task.name, task.state, task.ms, task.total_ms, task.max_ms,
+      task.resumes, task.preemptions
+    ))
+  end
+end
+
+return M
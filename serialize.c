@@ -0,0 +1,733 @@
+#include "serialize.h"
+
+#include "handle.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every encoded value starts with one of these tags
+enum {
+    SER_NIL,
+    SER_FALSE,
+    SER_TRUE,
+    SER_INTEGER,   // zigzag varint
+    SER_NUMBER,    // 8 byte double, host byte order
+    SER_STRING,    // varint length, then bytes
+    SER_TABLE,     // key, value, key, value, ..., SER_END
+    SER_REF,       // varint id of an already written table
+    SER_POINTER,   // 8 byte light userdata, only valid inside one process
+    SER_HANDLE,    // varint type, slot index and generation of a GL handle
+    SER_END
+};
+
+#define SERIALIZE_VERSION 2
+#define SERIALIZE_MAX_DEPTH 200
+
+// Before Lua 5.3 every number is a double, and ones that are whole and fit
+// in a double's mantissa get stored as varints, which is 1-3 bytes for most
+// of what ends up in a state table. From 5.3 on integers are their own
+// subtype, so they're the varints and floats always stay doubles.
+#define SERIALIZE_MAX_INTEGER 9007199254740992.0
+
+// Delta encoding parameters. A copy is only worth emitting for runs of at
+// least DELTA_MIN_MATCH bytes, and when the two buffers get out of step we
+// look at most DELTA_WINDOW bytes either way to find where they line up.
+#define DELTA_MIN_MATCH 4
+#define DELTA_WINDOW 32
+
+void serialize_buffer_init(struct serialize_buffer *buffer) {
+    memset(buffer, 0x0, sizeof(*buffer));
+}
+
+void serialize_buffer_reset(struct serialize_buffer *buffer) {
+    buffer->size = 0;
+}
+
+void serialize_buffer_free(struct serialize_buffer *buffer) {
+    free(buffer->data);
+    memset(buffer, 0x0, sizeof(*buffer));
+}
+
+static int buffer_reserve(struct serialize_buffer *buffer, size_t extra) {
+    if (buffer->size + extra <= buffer->capacity) {
+        return 0;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+    while (capacity < buffer->size + extra) {
+        capacity *= 2;
+    }
+
+    char *data = realloc(buffer->data, capacity);
+    if (!data) {
+        fprintf(stderr, "Error growing serialize buffer to %zu bytes\n",
+                capacity);
+        return 1;
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+
+    return 0;
+}
+
+static int buffer_write(struct serialize_buffer *buffer,
+                        const void *data, size_t size) {
+    if (buffer_reserve(buffer, size)) {
+        return 1;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+
+    return 0;
+}
+
+static int buffer_write_byte(struct serialize_buffer *buffer, uint8_t byte) {
+    return buffer_write(buffer, &byte, 1);
+}
+
+static int buffer_write_varint(struct serialize_buffer *buffer, uint64_t value) {
+    uint8_t bytes[10];
+    size_t count = 0;
+
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            byte |= 0x80;
+        }
+        bytes[count++] = byte;
+    } while (value);
+
+    return buffer_write(buffer, bytes, count);
+}
+
+static uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+struct reader {
+    const char *data;
+    size_t size;
+    size_t pos;
+};
+
+static int read_byte(struct reader *r, uint8_t *byte) {
+    if (r->pos >= r->size) {
+        return 1;
+    }
+    *byte = (uint8_t)r->data[r->pos++];
+    return 0;
+}
+
+static int read_bytes(struct reader *r, void *out, size_t size) {
+    if (size > r->size - r->pos) {
+        return 1;
+    }
+    memcpy(out, r->data + r->pos, size);
+    r->pos += size;
+    return 0;
+}
+
+static int read_varint(struct reader *r, uint64_t *value) {
+    *value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte;
+        if (read_byte(r, &byte)) {
+            return 1;
+        }
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/***** ENCODING *****/
+
+struct encoder {
+    lua_State *L;
+    // Stack index of a table mapping already written tables to their ids
+    int seen;
+    uint64_t next_id;
+    struct serialize_buffer *out;
+};
+
+static int encode_value(struct encoder *e, int index, int depth);
+
+static int encode_integer(struct encoder *e, int64_t n) {
+    return buffer_write_byte(e->out, SER_INTEGER) ||
+           buffer_write_varint(e->out, zigzag_encode(n));
+}
+
+static int encode_number(struct encoder *e, lua_Number n) {
+#if LUA_VERSION_NUM < 503
+    // -0.0 compares equal to 0 but wouldn't survive the trip through an int
+    if (n >= -SERIALIZE_MAX_INTEGER && n <= SERIALIZE_MAX_INTEGER &&
+        n == (lua_Number)(int64_t)n && !(n == 0 && signbit(n))) {
+        return encode_integer(e, (int64_t)n);
+    }
+#endif
+
+    double d = n;
+    return buffer_write_byte(e->out, SER_NUMBER) ||
+           buffer_write(e->out, &d, sizeof(d));
+}
+
+static int encode_table(struct encoder *e, int index, int depth) {
+    lua_State *L = e->L;
+
+    if (depth > SERIALIZE_MAX_DEPTH) {
+        fprintf(stderr, "Error serializing: tables nested too deeply\n");
+        return 1;
+    }
+
+    lua_pushvalue(L, index);
+    lua_rawget(L, e->seen);
+    if (!lua_isnil(L, -1)) {
+        uint64_t id = (uint64_t)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        return buffer_write_byte(e->out, SER_REF) ||
+               buffer_write_varint(e->out, id);
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, index);
+    lua_pushinteger(L, e->next_id++);
+    lua_rawset(L, e->seen);
+
+    if (buffer_write_byte(e->out, SER_TABLE)) {
+        return 1;
+    }
+
+    luaL_checkstack(L, 3, "serializing table");
+
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        int top = lua_gettop(L);
+        if (encode_value(e, top - 1, depth + 1) ||
+            encode_value(e, top, depth + 1)) {
+            lua_pop(L, 2);
+            return 1;
+        }
+        lua_pop(L, 1);
+    }
+
+    return buffer_write_byte(e->out, SER_END);
+}
+
+static int encode_value(struct encoder *e, int index, int depth) {
+    lua_State *L = e->L;
+
+    switch (lua_type(L, index)) {
+        case LUA_TNIL:
+            return buffer_write_byte(e->out, SER_NIL);
+
+        case LUA_TBOOLEAN:
+            return buffer_write_byte(e->out,
+                                     lua_toboolean(L, index) ? SER_TRUE : SER_FALSE);
+
+        case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, index)) {
+                return encode_integer(e, lua_tointeger(L, index));
+            }
+#endif
+            return encode_number(e, lua_tonumber(L, index));
+
+        case LUA_TSTRING: {
+            size_t len;
+            const char *str = lua_tolstring(L, index, &len);
+            return buffer_write_byte(e->out, SER_STRING) ||
+                   buffer_write_varint(e->out, len) ||
+                   buffer_write(e->out, str, len);
+        }
+
+        case LUA_TLIGHTUSERDATA: {
+            uint64_t pointer = (uint64_t)(uintptr_t)lua_touserdata(L, index);
+            return buffer_write_byte(e->out, SER_POINTER) ||
+                   buffer_write(e->out, &pointer, sizeof(pointer));
+        }
+
+        case LUA_TTABLE:
+            return encode_table(e, index, depth);
+
+        case LUA_TUSERDATA: {
+            const struct handle *handle = handle_test(L, index);
+            if (handle) {
+                return buffer_write_byte(e->out, SER_HANDLE) ||
+                       buffer_write_varint(e->out, handle->type) ||
+                       buffer_write_varint(e->out, handle->index) ||
+                       buffer_write_varint(e->out, handle->generation);
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    fprintf(stderr, "Error serializing: can't serialize a %s\n",
+            luaL_typename(L, index));
+    return 1;
+}
+
+int serialize_value(lua_State *L, int index, struct serialize_buffer *out) {
+    index = lua_absindex(L, index);
+
+    lua_newtable(L);
+
+    struct encoder e = {
+        .L = L,
+        .seen = lua_gettop(L),
+        .next_id = 1,
+        .out = out,
+    };
+
+    serialize_buffer_reset(out);
+
+    int err = buffer_write_byte(out, SERIALIZE_VERSION) ||
+              encode_value(&e, index, 0);
+
+    lua_pop(L, 1);
+
+    return err;
+}
+
+/***** DECODING *****/
+
+struct decoder {
+    lua_State *L;
+    // Stack index of a table mapping ids to already read tables
+    int tables;
+    uint64_t next_id;
+    struct reader r;
+};
+
+static int decode_value(struct decoder *d, int depth);
+
+static int decode_table(struct decoder *d, int depth) {
+    lua_State *L = d->L;
+
+    if (depth > SERIALIZE_MAX_DEPTH) {
+        fprintf(stderr, "Error deserializing: tables nested too deeply\n");
+        return 1;
+    }
+
+    luaL_checkstack(L, 3, "deserializing table");
+
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, d->tables, (int)d->next_id++);
+
+    int table = lua_gettop(L);
+
+    for (;;) {
+        if (d->r.pos < d->r.size && (uint8_t)d->r.data[d->r.pos] == SER_END) {
+            d->r.pos++;
+            return 0;
+        }
+
+        if (decode_value(d, depth + 1)) {
+            return 1;
+        }
+        if (lua_isnil(L, -1)) {
+            fprintf(stderr, "Error deserializing: nil table key\n");
+            return 1;
+        }
+        if (decode_value(d, depth + 1)) {
+            return 1;
+        }
+
+        lua_rawset(L, table);
+    }
+}
+
+static int decode_value(struct decoder *d, int depth) {
+    lua_State *L = d->L;
+
+    uint8_t tag;
+    if (read_byte(&d->r, &tag)) {
+        fprintf(stderr, "Error deserializing: unexpected end of data\n");
+        return 1;
+    }
+
+    switch (tag) {
+        case SER_NIL:
+            lua_pushnil(L);
+            return 0;
+
+        case SER_FALSE:
+        case SER_TRUE:
+            lua_pushboolean(L, tag == SER_TRUE);
+            return 0;
+
+        case SER_INTEGER: {
+            uint64_t value;
+            if (read_varint(&d->r, &value)) {
+                break;
+            }
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger(L, (lua_Integer)zigzag_decode(value));
+#else
+            lua_pushnumber(L, (lua_Number)zigzag_decode(value));
+#endif
+            return 0;
+        }
+
+        case SER_NUMBER: {
+            double n;
+            if (read_bytes(&d->r, &n, sizeof(n))) {
+                break;
+            }
+            lua_pushnumber(L, n);
+            return 0;
+        }
+
+        case SER_STRING: {
+            uint64_t len;
+            if (read_varint(&d->r, &len) || len > d->r.size - d->r.pos) {
+                break;
+            }
+            lua_pushlstring(L, d->r.data + d->r.pos, len);
+            d->r.pos += len;
+            return 0;
+        }
+
+        case SER_POINTER: {
+            uint64_t pointer;
+            if (read_bytes(&d->r, &pointer, sizeof(pointer))) {
+                break;
+            }
+            lua_pushlightuserdata(L, (void *)(uintptr_t)pointer);
+            return 0;
+        }
+
+        case SER_HANDLE: {
+            uint64_t type, index, generation;
+            if (read_varint(&d->r, &type) || type >= HANDLE_TYPE_COUNT ||
+                read_varint(&d->r, &index) || index > UINT32_MAX ||
+                read_varint(&d->r, &generation) || generation > UINT32_MAX) {
+                break;
+            }
+            struct handle handle = {
+                .index = (uint32_t)index,
+                .generation = (uint32_t)generation,
+                .type = (uint32_t)type,
+            };
+            handle_push_copy(L, &handle);
+            return 0;
+        }
+
+        case SER_TABLE:
+            return decode_table(d, depth);
+
+        case SER_REF: {
+            uint64_t id;
+            if (read_varint(&d->r, &id) || id >= d->next_id) {
+                break;
+            }
+            lua_rawgeti(L, d->tables, (int)id);
+            return 0;
+        }
+
+        default:
+            fprintf(stderr, "Error deserializing: bad tag %d\n", tag);
+            return 1;
+    }
+
+    fprintf(stderr, "Error deserializing: malformed value with tag %d\n", tag);
+    return 1;
+}
+
+int deserialize_value(lua_State *L, const char *data, size_t size) {
+    uint8_t version;
+    struct reader r = { data, size, 0 };
+
+    if (read_byte(&r, &version) || version != SERIALIZE_VERSION) {
+        fprintf(stderr, "Error deserializing: unknown version\n");
+        return 1;
+    }
+
+    int top = lua_gettop(L);
+
+    lua_newtable(L);
+
+    struct decoder d = {
+        .L = L,
+        .tables = lua_gettop(L),
+        .next_id = 1,
+        .r = r,
+    };
+
+    if (decode_value(&d, 0)) {
+        lua_settop(L, top);
+        return 1;
+    }
+
+    if (d.r.pos != d.r.size) {
+        fprintf(stderr, "Error deserializing: %zu trailing bytes\n",
+                d.r.size - d.r.pos);
+        lua_settop(L, top);
+        return 1;
+    }
+
+    lua_remove(L, -2);
+
+    return 0;
+}
+
+/***** DELTAS *****/
+
+// A delta is the size of the new buffer followed by ops. Each op starts with
+// a varint of (length << 1 | is_copy). Copies are followed by a zigzag
+// varint of how far the source is from the read cursor in `prev`; literals
+// are followed by their bytes. The cursor in `prev` moves forward with every
+// op, so when nothing has changed every copy has an offset of zero.
+
+static size_t match_length(const struct serialize_buffer *prev, size_t pp,
+                           const struct serialize_buffer *next, size_t np) {
+    size_t len = 0;
+    while (pp + len < prev->size && np + len < next->size &&
+           prev->data[pp + len] == next->data[np + len]) {
+        len++;
+    }
+    return len;
+}
+
+static int delta_write_literal(struct serialize_buffer *out,
+                               const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    return buffer_write_varint(out, (uint64_t)len << 1) ||
+           buffer_write(out, data, len);
+}
+
+int serialize_delta(const struct serialize_buffer *prev,
+                    const struct serialize_buffer *next,
+                    struct serialize_buffer *out) {
+    serialize_buffer_reset(out);
+
+    if (buffer_write_varint(out, next->size)) {
+        return 1;
+    }
+
+    size_t pp = 0;
+    size_t np = 0;
+    size_t literal_start = 0;
+
+    while (np < next->size) {
+        size_t source = pp;
+        size_t len = match_length(prev, pp, next, np);
+
+        // Search nearby for a place where the buffers line up again, for
+        // when a value changed size
+        for (size_t d = 1; len < DELTA_MIN_MATCH && d <= DELTA_WINDOW; d++) {
+            if (pp + d < prev->size) {
+                len = match_length(prev, pp + d, next, np);
+                source = pp + d;
+            }
+            if (len < DELTA_MIN_MATCH && d <= pp) {
+                len = match_length(prev, pp - d, next, np);
+                source = pp - d;
+            }
+        }
+
+        if (len < DELTA_MIN_MATCH) {
+            np++;
+            pp++;
+            continue;
+        }
+
+        if (delta_write_literal(out, next->data + literal_start,
+                                np - literal_start)) {
+            return 1;
+        }
+
+        int64_t offset = (int64_t)source - (int64_t)pp;
+        if (buffer_write_varint(out, (uint64_t)len << 1 | 1) ||
+            buffer_write_varint(out, zigzag_encode(offset))) {
+            return 1;
+        }
+
+        np += len;
+        pp = source + len;
+        literal_start = np;
+    }
+
+    return delta_write_literal(out, next->data + literal_start,
+                               np - literal_start);
+}
+
+int serialize_apply_delta(const struct serialize_buffer *prev,
+                          const char *delta, size_t delta_size,
+                          struct serialize_buffer *out) {
+    struct reader r = { delta, delta_size, 0 };
+
+    serialize_buffer_reset(out);
+
+    uint64_t size;
+    if (read_varint(&r, &size) || buffer_reserve(out, size)) {
+        fprintf(stderr, "Error applying delta: bad header\n");
+        return 1;
+    }
+
+    size_t pp = 0;
+
+    while (out->size < size) {
+        uint64_t op;
+        if (read_varint(&r, &op)) {
+            fprintf(stderr, "Error applying delta: unexpected end of data\n");
+            return 1;
+        }
+
+        uint64_t len = op >> 1;
+        if (len > size - out->size) {
+            fprintf(stderr, "Error applying delta: op overruns buffer\n");
+            return 1;
+        }
+
+        if (op & 1) {
+            uint64_t offset;
+            if (read_varint(&r, &offset)) {
+                fprintf(stderr, "Error applying delta: unexpected end of data\n");
+                return 1;
+            }
+
+            int64_t source = (int64_t)pp + zigzag_decode(offset);
+            if (source < 0 || (uint64_t)source + len > prev->size) {
+                fprintf(stderr, "Error applying delta: copy out of range\n");
+                return 1;
+            }
+
+            memcpy(out->data + out->size, prev->data + source, len);
+            pp = source + len;
+        } else {
+            if (read_bytes(&r, out->data + out->size, len)) {
+                fprintf(stderr, "Error applying delta: unexpected end of data\n");
+                return 1;
+            }
+            pp += len;
+        }
+
+        out->size += len;
+    }
+
+    return 0;
+}
+
+/***** LUA INTERFACE *****/
+
+#define SERIALIZE_BUFFER_META "serialize_buffer"
+
+static int serialize_buffer_gc(lua_State *L) {
+    struct serialize_buffer *buffer = lua_touserdata(L, 1);
+    serialize_buffer_free(buffer);
+    return 0;
+}
+
+static struct serialize_buffer *get_scratch(lua_State *L) {
+    return (struct serialize_buffer *)lua_touserdata(L, lua_upvalueindex(1));
+}
+
+// Points a buffer at a lua string's data without copying it
+static void string_buffer(lua_State *L, int index,
+                          struct serialize_buffer *buffer) {
+    buffer->data = (char *)luaL_checklstring(L, index, &buffer->size);
+    buffer->capacity = buffer->size;
+}
+
+int serialize_lua_Encode(lua_State *L) {
+    struct serialize_buffer *scratch = get_scratch(L);
+
+    if (serialize_value(L, 1, scratch)) {
+        return luaL_error(L, "Error serializing value");
+    }
+
+    lua_pushlstring(L, scratch->data, scratch->size);
+
+    return 1;
+}
+
+int serialize_lua_Decode(lua_State *L) {
+    size_t size;
+    const char *data = luaL_checklstring(L, 1, &size);
+
+    if (deserialize_value(L, data, size)) {
+        return luaL_error(L, "Error deserializing value");
+    }
+
+    return 1;
+}
+
+int serialize_lua_Delta(lua_State *L) {
+    struct serialize_buffer *scratch = get_scratch(L);
+
+    struct serialize_buffer prev, next;
+    string_buffer(L, 1, &prev);
+    string_buffer(L, 2, &next);
+
+    if (serialize_delta(&prev, &next, scratch)) {
+        return luaL_error(L, "Error making delta");
+    }
+
+    lua_pushlstring(L, scratch->data, scratch->size);
+
+    return 1;
+}
+
+int serialize_lua_ApplyDelta(lua_State *L) {
+    struct serialize_buffer *scratch = get_scratch(L);
+
+    struct serialize_buffer prev;
+    string_buffer(L, 1, &prev);
+
+    size_t size;
+    const char *delta = luaL_checklstring(L, 2, &size);
+
+    if (serialize_apply_delta(&prev, delta, size, scratch)) {
+        return luaL_error(L, "Error applying delta");
+    }
+
+    lua_pushlstring(L, scratch->data, scratch->size);
+
+    return 1;
+}
+
+#define REGISTER_SERIALIZE_FUNC(func) \
+    lua_pushvalue(L, -1); \
+    lua_pushcclosure(L, serialize_lua_ ## func, 1); \
+    lua_setglobal(L, "serialize_" #func)
+
+void serialize_register(lua_State *L) {
+    // All of the functions share one scratch buffer, which lua frees
+    struct serialize_buffer *scratch = lua_newuserdata(L, sizeof(*scratch));
+    serialize_buffer_init(scratch);
+
+    luaL_newmetatable(L, SERIALIZE_BUFFER_META);
+    lua_pushcfunction(L, serialize_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    REGISTER_SERIALIZE_FUNC(Encode);
+    REGISTER_SERIALIZE_FUNC(Decode);
+    REGISTER_SERIALIZE_FUNC(Delta);
+    REGISTER_SERIALIZE_FUNC(ApplyDelta);
+
+    lua_pop(L, 1);
+
+    log_trace("Registered serialize functions");
+}
@@ -0,0 +1,42 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include "lua.h"
+
+#include <stddef.h>
+
+// A growable byte buffer. Resetting it keeps the allocation around, so a
+// buffer that is reused every frame stops allocating once it has grown to
+// the size of the largest snapshot.
+struct serialize_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+void serialize_buffer_init(struct serialize_buffer *);
+void serialize_buffer_reset(struct serialize_buffer *);
+void serialize_buffer_free(struct serialize_buffer *);
+
+// Encodes the value at the given index (nil, booleans, numbers, strings,
+// light userdata, GL handles and tables made of those) into the buffer.
+// Tables that show up more than once are written once and referenced
+// afterwards, so shared and cyclic references survive a round trip. Handles
+// decode as copies that don't own their object.
+int serialize_value(lua_State *, int, struct serialize_buffer *);
+// Decodes an encoded value and pushes it onto the stack.
+int deserialize_value(lua_State *, const char *, size_t);
+
+// Encodes `next` as a list of copies out of `prev` and literal bytes. Most of
+// a frame's state is unchanged from the last one, so this is usually tiny.
+int serialize_delta(const struct serialize_buffer *prev,
+                    const struct serialize_buffer *next,
+                    struct serialize_buffer *out);
+// Rebuilds the buffer that a delta was made from.
+int serialize_apply_delta(const struct serialize_buffer *prev,
+                          const char *, size_t,
+                          struct serialize_buffer *out);
+
+void serialize_register(lua_State *);
+
+#endif
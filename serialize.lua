@@ -0,0 +1,31 @@
+local M = {}
+
+-- Serialization functions exposed from C
+local copy_funcs = {
+  Encode="encode",
+  Decode="decode",
+  Delta="delta",
+  ApplyDelta="apply_delta",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["serialize_" .. c_name]
+end
+
+-- Encodes a value and a delta against the previously encoded value.
+-- Returns the new snapshot, which should be passed back in as `prev` next
+-- time, and the delta.
+function M.encode_delta(prev, value)
+  local snapshot = M.encode(value)
+
+  return snapshot, M.delta(prev or "", snapshot)
+end
+
+-- Inverse of encode_delta. Returns the rebuilt snapshot and the decoded value.
+function M.decode_delta(prev, delta)
+  local snapshot = M.apply_delta(prev or "", delta)
+
+  return snapshot, M.decode(snapshot)
+end
+
+return M
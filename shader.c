@@ -0,0 +1,790 @@
+#include "shader.h"
+
+#include "draw.h"
+#include "draw_interface.h"
+#include "util.h"
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// Deep enough for any sane include tree, and stops runaway recursion
+#define SHADER_MAX_INCLUDE_DEPTH 16
+
+void shader_source_free(struct shader_source *source) {
+    for (size_t i = 0; i < source->file_count; i++) {
+        free(source->files[i]);
+    }
+    free(source->files);
+    free(source->text);
+
+    memset(source, 0x0, sizeof(*source));
+}
+
+static int append(struct shader_source *source, const char *text,
+                  size_t length) {
+    if (source->length + length + 1 > source->capacity) {
+        size_t capacity = source->capacity ? source->capacity * 2 : 4096;
+        while (capacity < source->length + length + 1) {
+            capacity *= 2;
+        }
+
+        char *grown = realloc(source->text, capacity);
+        if (!grown) {
+            return 1;
+        }
+        source->text = grown;
+        source->capacity = capacity;
+    }
+
+    memcpy(source->text + source->length, text, length);
+    source->length += length;
+    source->text[source->length] = '\0';
+
+    return 0;
+}
+
+static int appendf(struct shader_source *source, const char *format, ...) {
+    char buffer[512];
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if (length < 0 || (size_t)length >= sizeof(buffer)) {
+        return 1;
+    }
+
+    return append(source, buffer, length);
+}
+
+// If the line is the preprocessor directive, returns what follows it
+static const char *match_directive(const char *line, const char *directive) {
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    if (*line != '#') {
+        return NULL;
+    }
+    line++;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+
+    size_t length = strlen(directive);
+    if (strncmp(line, directive, length) != 0) {
+        return NULL;
+    }
+    line += length;
+    if (*line != ' ' && *line != '\t' && *line != '\n' && *line != '\r' &&
+        *line != '\0') {
+        return NULL;
+    }
+
+    return line;
+}
+
+static int has_version(const char *text) {
+    while (*text) {
+        if (match_directive(text, "version")) {
+            return 1;
+        }
+
+        text = strchr(text, '\n');
+        if (!text) {
+            break;
+        }
+        text++;
+    }
+
+    return 0;
+}
+
+static int append_defines(struct shader_source *source, const char **defines,
+                          size_t define_count) {
+    for (size_t i = 0; i < define_count; i++) {
+        if (appendf(source, "#define %s\n", defines[i]) != 0) {
+            fprintf(stderr, "Shader define too long: %s\n", defines[i]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Path of the include relative to the directory of the file including it
+static char *include_path(const char *from, const char *name,
+                          size_t name_length) {
+    size_t dir_length = 0;
+    const char *slash = strrchr(from, '/');
+    if (slash && name[0] != '/') {
+        dir_length = slash - from + 1;
+    }
+
+    char *path = malloc(dir_length + name_length + 1);
+    if (!path) {
+        return NULL;
+    }
+
+    memcpy(path, from, dir_length);
+    memcpy(path + dir_length, name, name_length);
+    path[dir_length + name_length] = '\0';
+
+    return path;
+}
+
+static int process_file(struct shader_source *, const char *, int,
+                        const char **, size_t);
+
+static int process_include(struct shader_source *source, const char *from,
+                           int line_number, const char *rest, int depth) {
+    while (*rest == ' ' || *rest == '\t') {
+        rest++;
+    }
+
+    char close = *rest == '"' ? '"' : *rest == '<' ? '>' : '\0';
+    const char *end = close ? strchr(rest + 1, close) : NULL;
+    const char *newline = strchr(rest, '\n');
+    if (!end || (newline && end > newline)) {
+        fprintf(stderr, "%s:%d: Bad #include\n", from, line_number);
+        return 1;
+    }
+
+    char *path = include_path(from, rest + 1, end - rest - 1);
+    if (!path) {
+        return 1;
+    }
+
+    int result = process_file(source, path, depth + 1, NULL, 0);
+    free(path);
+
+    return result;
+}
+
+// Included files are only expanded the first time, so headers don't need
+// guards
+static int process_file(struct shader_source *source, const char *path,
+                        int depth, const char **defines,
+                        size_t define_count) {
+    if (depth > SHADER_MAX_INCLUDE_DEPTH) {
+        fprintf(stderr, "Shader includes nested too deeply at %s\n", path);
+        return 1;
+    }
+
+    for (size_t i = 0; i < source->file_count; i++) {
+        if (strcmp(source->files[i], path) == 0) {
+            return 0;
+        }
+    }
+
+    char *text = read_whole_file(path);
+    if (!text) {
+        fprintf(stderr, "Error reading shader %s\n", path);
+        return 1;
+    }
+
+    char **files = realloc(source->files,
+                           (source->file_count + 1) * sizeof(*files));
+    char *name = strdup(path);
+    if (files) {
+        source->files = files;
+    }
+    if (!files || !name) {
+        free(name);
+        free(text);
+        return 1;
+    }
+    int index = source->file_count;
+    source->files[source->file_count++] = name;
+
+    // Defines go after #version, which has to come first, or at the very
+    // top if there isn't one
+    int root = depth == 0;
+    int versioned = root && has_version(text);
+    if (root && !versioned &&
+        append_defines(source, defines, define_count) != 0) {
+        free(text);
+        return 1;
+    }
+    // Nothing but comments can come before #version, so the root file
+    // keeps its natural numbering until after it
+    if (!versioned && appendf(source, "#line 1 %d\n", index) != 0) {
+        free(text);
+        return 1;
+    }
+
+    int result = 0;
+    int line_number = 1;
+    const char *line = text;
+    while (*line && result == 0) {
+        const char *end = strchr(line, '\n');
+        size_t length = end ? (size_t)(end - line) : strlen(line);
+
+        const char *rest;
+        if (match_directive(line, "version")) {
+            if (root) {
+                result = append(source, line, length) ||
+                         append(source, "\n", 1) ||
+                         append_defines(source, defines, define_count) ||
+                         appendf(source, "#line %d %d\n", line_number + 1,
+                                 index);
+            } else {
+                // Only the root file's #version counts
+                result = append(source, "\n", 1);
+            }
+        } else if ((rest = match_directive(line, "include"))) {
+            result = process_include(source, path, line_number, rest,
+                                     depth) ||
+                     appendf(source, "#line %d %d\n", line_number + 1,
+                             index);
+        } else {
+            result = append(source, line, length) || append(source, "\n", 1);
+        }
+
+        line += end ? length + 1 : length;
+        line_number++;
+    }
+
+    free(text);
+
+    return result;
+}
+
+int shader_preprocess(struct shader_source *source, const char *path,
+                      const char **defines, size_t define_count) {
+    memset(source, 0x0, sizeof(*source));
+
+    if (process_file(source, path, 0, defines, define_count) != 0) {
+        shader_source_free(source);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Compilers start each message with the source string number, e.g.
+// "0:12(3): error" or "ERROR: 0:12:" or "0(12) : error". Swap the number for
+// the file name where it's one of ours.
+static void print_log(const char *file_name, const char *log,
+                      const struct shader_source *source) {
+    fprintf(stderr, "Error compiling shader %s:\n", file_name);
+
+    const char *line = log;
+    while (*line) {
+        const char *end = strchr(line, '\n');
+        int length = end ? end - line : (int)strlen(line);
+
+        const char *digits = line;
+        while (digits < line + length && !(*digits >= '0' && *digits <= '9')) {
+            digits++;
+        }
+
+        char *after;
+        unsigned long file = strtoul(digits, &after, 10);
+        if (digits < line + length && after < line + length &&
+            (*after == ':' || *after == '(') && file < source->file_count) {
+            fprintf(stderr, "%.*s%s%.*s\n", (int)(digits - line), line,
+                    source->files[file], (int)(line + length - after), after);
+        } else {
+            fprintf(stderr, "%.*s\n", length, line);
+        }
+
+        line += end ? length + 1 : length;
+    }
+}
+
+static GLuint start_compile(GLenum type, const struct shader_source *source) {
+    GLuint shader = glCreateShader(type);
+
+    const GLchar *text = source->text;
+    glShaderSource(shader, 1, &text, NULL);
+    glCompileShader(shader);
+
+    return shader;
+}
+
+// Blocks until the shader is compiled, and prints the log if it failed.
+// Returns 1 if it failed.
+static int finish_compile(GLuint shader, const char *file_name,
+                          const struct shader_source *source) {
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status == GL_TRUE) {
+        return 0;
+    }
+
+    GLint log_length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_length);
+
+    GLchar *log = malloc(log_length > 0 ? log_length : 1);
+    if (!log) {
+        fprintf(stderr, "Error compiling shader %s\n", file_name);
+        return 1;
+    }
+    log[0] = '\0';
+    glGetShaderInfoLog(shader, log_length, NULL, log);
+
+    print_log(file_name, log, source);
+
+    free(log);
+
+    return 1;
+}
+
+static uint64_t hash_source(const char *text) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+void shader_cache_init(struct shader_cache *cache) {
+    memset(cache, 0x0, sizeof(*cache));
+
+    const char *extensions[] = {
+        "GL_KHR_parallel_shader_compile",
+        "GL_ARB_parallel_shader_compile",
+    };
+    const char *functions[] = {
+        "glMaxShaderCompilerThreadsKHR",
+        "glMaxShaderCompilerThreadsARB",
+    };
+
+    for (int i = 0; i < 2 && !cache->parallel; i++) {
+        if (!SDL_GL_ExtensionSupported(extensions[i])) {
+            continue;
+        }
+
+        void (*max_threads)(GLuint) =
+            (void (*)(GLuint))SDL_GL_GetProcAddress(functions[i]);
+        if (max_threads) {
+            // Let the driver pick how many threads
+            max_threads(0xFFFFFFFF);
+            cache->parallel = 1;
+            log_debug("Compiling shaders in parallel with %s", extensions[i]);
+        }
+    }
+}
+
+// Drops the entry and the variants naming it. The last entry moves into
+// its place.
+static void remove_entry(struct shader_cache *cache, size_t index) {
+    struct shader_cache_entry *entry = &cache->entries[index];
+    free(entry->file_name);
+    shader_source_free(&entry->source);
+
+    size_t last = --cache->count;
+    if (index != last) {
+        cache->entries[index] = cache->entries[last];
+    }
+
+    for (size_t i = 0; i < cache->variant_count;) {
+        struct shader_cache_variant *variant = &cache->variants[i];
+        if (variant->entry == index) {
+            free(variant->name);
+            // Looks at the one moved in on the next pass
+            *variant = cache->variants[--cache->variant_count];
+        } else {
+            if (variant->entry == last) {
+                variant->entry = index;
+            }
+            i++;
+        }
+    }
+}
+
+static void finish_entry(struct shader_cache *cache, size_t index) {
+    struct shader_cache_entry *entry = &cache->entries[index];
+    if (!entry->file_name) {
+        return;
+    }
+
+    int failed = finish_compile(entry->shader, entry->file_name,
+                                &entry->source);
+    free(entry->file_name);
+    entry->file_name = NULL;
+    if (!failed) {
+        return;
+    }
+
+    GLuint *shaders = realloc(cache->failed,
+                              (cache->failed_count + 1) * sizeof(*shaders));
+    if (!shaders) {
+        // Left cached rather than deleted under the handles using it
+        return;
+    }
+    cache->failed = shaders;
+    cache->failed[cache->failed_count++] = entry->shader;
+
+    remove_entry(cache, index);
+}
+
+void shader_cache_finish(struct shader_cache *cache, GLuint shader) {
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shader == shader) {
+            finish_entry(cache, i);
+            return;
+        }
+    }
+}
+
+void shader_cache_cleanup(struct shader_cache *cache) {
+    log_debug("Shader cache: %zu shaders, %zu hits, %zu misses", cache->count,
+           cache->hits, cache->misses);
+
+    for (size_t i = 0; i < cache->count; i++) {
+        struct shader_cache_entry *entry = &cache->entries[i];
+
+        free(entry->file_name);
+        shader_source_free(&entry->source);
+        glDeleteShader(entry->shader);
+    }
+    free(cache->entries);
+
+    for (size_t i = 0; i < cache->variant_count; i++) {
+        free(cache->variants[i].name);
+    }
+    free(cache->variants);
+
+    for (size_t i = 0; i < cache->failed_count; i++) {
+        glDeleteShader(cache->failed[i]);
+    }
+    free(cache->failed);
+
+    memset(cache, 0x0, sizeof(*cache));
+}
+
+static int compare_defines(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// File name and defines as one string, to find the variant by
+static char *variant_name(const char *file_name, const char **defines,
+                          size_t define_count) {
+    size_t length = strlen(file_name) + 1;
+    for (size_t i = 0; i < define_count; i++) {
+        length += strlen(defines[i]) + 1;
+    }
+
+    char *name = malloc(length);
+    if (!name) {
+        return NULL;
+    }
+
+    char *end = stpcpy(name, file_name);
+    for (size_t i = 0; i < define_count; i++) {
+        *end++ = '\n';
+        end = stpcpy(end, defines[i]);
+    }
+
+    return name;
+}
+
+// Takes the name. Returns 1 if the variant couldn't be added.
+static int add_variant(struct shader_cache *cache, uint64_t key, GLenum type,
+                       char *name, size_t entry) {
+    if (cache->variant_count == cache->variant_capacity) {
+        size_t capacity =
+            cache->variant_capacity ? cache->variant_capacity * 2 : 16;
+        struct shader_cache_variant *variants =
+            realloc(cache->variants, capacity * sizeof(*variants));
+        if (!variants) {
+            return 1;
+        }
+        cache->variants = variants;
+        cache->variant_capacity = capacity;
+    }
+
+    cache->variants[cache->variant_count++] = (struct shader_cache_variant){
+        .key = key,
+        .type = type,
+        .name = name,
+        .entry = entry,
+    };
+
+    return 0;
+}
+
+// Preprocesses the file, and finds a shader with the same source or starts
+// compiling it. Returns the entry, or -1 on error.
+static ptrdiff_t find_source(struct shader_cache *cache, GLenum type,
+                             const char *file_name, const char **defines,
+                             size_t define_count) {
+    struct shader_source source;
+    if (shader_preprocess(&source, file_name, defines, define_count) != 0) {
+        return -1;
+    }
+
+    uint64_t key = hash_source(source.text);
+    for (size_t i = 0; i < cache->count; i++) {
+        struct shader_cache_entry *entry = &cache->entries[i];
+        if (entry->key == key && entry->type == type &&
+            strcmp(entry->source.text, source.text) == 0) {
+            shader_source_free(&source);
+            cache->hits++;
+            return i;
+        }
+    }
+
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 16;
+        struct shader_cache_entry *entries =
+            realloc(cache->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            shader_source_free(&source);
+            return -1;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+
+    char *name = strdup(file_name);
+    if (!name) {
+        shader_source_free(&source);
+        return -1;
+    }
+
+    struct shader_cache_entry *entry = &cache->entries[cache->count];
+    entry->key = key;
+    entry->type = type;
+    entry->shader = start_compile(type, &source);
+    entry->file_name = name;
+    entry->source = source;
+    cache->misses++;
+
+    return cache->count++;
+}
+
+// Finds the shader in the cache, or starts compiling it without waiting for
+// the result. Returns the entry, or -1 on error.
+static ptrdiff_t cache_lookup(struct shader_cache *cache, GLenum type,
+                              const char *file_name, const char **defines,
+                              size_t define_count) {
+    // Same set of defines in any order is the same variant
+    qsort(defines, define_count, sizeof(*defines), compare_defines);
+
+    char *name = variant_name(file_name, defines, define_count);
+    if (!name) {
+        return -1;
+    }
+
+    uint64_t key = hash_source(name);
+    for (size_t i = 0; i < cache->variant_count; i++) {
+        struct shader_cache_variant *variant = &cache->variants[i];
+        if (variant->key == key && variant->type == type &&
+            strcmp(variant->name, name) == 0) {
+            free(name);
+            cache->hits++;
+            return variant->entry;
+        }
+    }
+
+    ptrdiff_t index = find_source(cache, type, file_name, defines,
+                                  define_count);
+    // Without the variant, the next lookup just preprocesses again
+    if (index < 0 || add_variant(cache, key, type, name, index) != 0) {
+        free(name);
+    }
+
+    return index;
+}
+
+const char **shader_read_defines(lua_State *L, int index, size_t *count) {
+    lua_newtable(L);
+    int strings = lua_gettop(L);
+    *count = 0;
+
+    if (!lua_isnoneornil(L, index)) {
+        luaL_checktype(L, index, LUA_TTABLE);
+
+        lua_pushnil(L);
+        while (lua_next(L, index) != 0) {
+            if (lua_type(L, -2) == LUA_TNUMBER) {
+                lua_pushstring(L, luaL_checkstring(L, -1));
+                lua_rawseti(L, strings, ++*count);
+            } else if (lua_toboolean(L, -1)) {
+                const char *name = luaL_checkstring(L, -2);
+                if (lua_isboolean(L, -1)) {
+                    lua_pushstring(L, name);
+                } else {
+                    lua_pushfstring(L, "%s %s", name, luaL_checkstring(L, -1));
+                }
+                lua_rawseti(L, strings, ++*count);
+            }
+
+            lua_pop(L, 1);
+        }
+    }
+
+    const char **defines = malloc((*count > 0 ? *count : 1) * sizeof(*defines));
+    if (!defines) {
+        luaL_error(L, "Error reading shader defines");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+        lua_rawgeti(L, strings, i + 1);
+        defines[i] = lua_tostring(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return defines;
+}
+
+// type, file name, defines. Like CreateShaderFromFile, but the shader comes
+// from the cache if this variant was compiled before.
+int draw_lua_CompileShader(struct draw_data *data, lua_State *L) {
+    GLenum type = luaL_checkinteger(L, 1);
+    const char *file_name = luaL_checkstring(L, 2);
+
+    size_t define_count;
+    const char **defines = shader_read_defines(L, 3, &define_count);
+
+    ptrdiff_t index = cache_lookup(&data->shaders, type, file_name, defines,
+                                   define_count);
+    free(defines);
+    if (index < 0) {
+        return luaL_error(L, "Error preprocessing shader %s", file_name);
+    }
+
+    GLuint shader = data->shaders.entries[index].shader;
+    finish_entry(&data->shaders, index);
+
+    lua_settop(L, 0);
+    handle_push_borrowed(L, &data->handles, HANDLE_SHADER, shader);
+
+    return 1;
+}
+
+// List of {type, file name, defines}. Returns a list of shader handles in
+// the same order as soon as the compiles are started, so with parallel
+// compile they overlap with whatever runs before the link. ShadersReady
+// says when they're done.
+int draw_lua_CompileShaders(struct draw_data *data, lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer count = get_lua_len(L, 1);
+
+    // Userdata, so it's collected if an argument turns out to be bad
+    ptrdiff_t *indices =
+        lua_newuserdata(L, (count > 0 ? count : 1) * sizeof(*indices));
+
+    for (lua_Integer i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        int variant = lua_gettop(L);
+        luaL_checktype(L, variant, LUA_TTABLE);
+
+        lua_rawgeti(L, variant, 1);
+        lua_rawgeti(L, variant, 2);
+        lua_rawgeti(L, variant, 3);
+        GLenum type = luaL_checkinteger(L, variant + 1);
+        const char *file_name = luaL_checkstring(L, variant + 2);
+
+        size_t define_count;
+        const char **defines = shader_read_defines(L, variant + 3,
+                                                   &define_count);
+
+        indices[i] = cache_lookup(&data->shaders, type, file_name, defines,
+                                  define_count);
+        free(defines);
+        if (indices[i] < 0) {
+            return luaL_error(L, "Error preprocessing shader %s", file_name);
+        }
+
+        lua_settop(L, 2);
+    }
+
+    lua_createtable(L, count, 0);
+    for (lua_Integer i = 0; i < count; i++) {
+        struct shader_cache_entry *entry = &data->shaders.entries[indices[i]];
+        handle_push_borrowed(L, &data->handles, HANDLE_SHADER, entry->shader);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+// List of shader handles. Whether they've all finished compiling, without
+// blocking. Always true without parallel compile.
+int draw_lua_ShadersReady(struct draw_data *data, lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    int ready = 1;
+    if (data->shaders.parallel) {
+        lua_Integer count = get_lua_len(L, 1);
+        for (lua_Integer i = 1; i <= count && ready; i++) {
+            lua_rawgeti(L, 1, i);
+            GLuint shader = handle_check(L, &data->handles, -1, HANDLE_SHADER);
+            lua_pop(L, 1);
+
+            GLint status = GL_TRUE;
+            glGetShaderiv(shader, GL_COMPLETION_STATUS_KHR, &status);
+            ready = status == GL_TRUE;
+            if (ready) {
+                // Doesn't block now, and reports errors as soon as known
+                shader_cache_finish(&data->shaders, shader);
+            }
+        }
+    }
+
+    lua_settop(L, 0);
+    lua_pushboolean(L, ready);
+
+    return 1;
+}
+
+// Shaders in the cache, lookups served from it, and lookups that compiled
+int draw_lua_ShaderCacheStats(struct draw_data *data, lua_State *L) {
+    lua_pushinteger(L, data->shaders.count);
+    lua_pushinteger(L, data->shaders.hits);
+    lua_pushinteger(L, data->shaders.misses);
+
+    return 3;
+}
+
+GLuint shader_compile(GLenum type, const char *file_name,
+                      const char **defines, size_t define_count) {
+    struct shader_source source;
+    if (shader_preprocess(&source, file_name, defines, define_count) != 0) {
+        return 0;
+    }
+
+    GLuint shader = start_compile(type, &source);
+    finish_compile(shader, file_name, &source);
+
+    shader_source_free(&source);
+
+    return shader;
+}
+
+int draw_lua_CreateShaderFromFile(struct draw_data *data, lua_State *L) {
+    GLenum shader_type = get_integer_arg(L);
+    const char *file_name = get_string_arg(L);
+
+    GLuint shader = shader_compile(shader_type, file_name, NULL, 0);
+    if (!shader) {
+        return luaL_error(L, "Error preprocessing shader %s", file_name);
+    }
+
+    handle_push(L, &data->handles, HANDLE_SHADER, shader);
+
+    return 1;
+}
+
+void shader_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateShaderFromFile);
+    REGISTER_FUNC(CompileShader);
+    REGISTER_FUNC(CompileShaders);
+    REGISTER_FUNC(ShadersReady);
+    REGISTER_FUNC(ShaderCacheStats);
+}
@@ -0,0 +1,105 @@
+#ifndef SHADER_H
+#define SHADER_H
+
+#include "lua.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct draw_data;
+
+// Shader source after #include expansion. Each file gets a source string
+// number in #line directives, so compile errors can be mapped back to the
+// file they came from.
+struct shader_source {
+    char *text;
+    size_t length;
+    size_t capacity;
+
+    char **files;
+    size_t file_count;
+};
+
+// Expands #includes in the file and injects a #define for each of the
+// defines, which are "NAME" or "NAME VALUE", after the #version line.
+// Returns 1 on error, having printed why.
+int shader_preprocess(struct shader_source *, const char *, const char **,
+                      size_t);
+void shader_source_free(struct shader_source *);
+
+// Preprocesses and compiles the file outside the cache, printing the log if
+// the compile fails. Returns 0 if preprocessing failed. Only uses the
+// current context, so the loader thread calls it too.
+GLuint shader_compile(GLenum, const char *, const char **, size_t);
+
+// Reads defines from the table at the index, either a list of "NAME" or
+// "NAME VALUE" strings, or NAME=value pairs where true means no value. The
+// strings are kept alive in a table left on the stack, and the returned
+// array of them is freed by the caller.
+const char **shader_read_defines(lua_State *, int, size_t *);
+
+struct shader_cache_entry {
+    // Hash of the preprocessed source, which includes the defines
+    uint64_t key;
+    GLenum type;
+    GLuint shader;
+    // Kept to compare against on a hash match, and to map compile errors
+    // back to files
+    struct shader_source source;
+    // File name for errors, until the compile status has been checked
+    char *file_name;
+};
+
+// A file and set of defines looked up before, so a hit doesn't read or
+// preprocess anything. Several variants can share an entry when their
+// sources come out the same.
+struct shader_cache_variant {
+    uint64_t key;
+    GLenum type;
+    // File name, then each define in sorted order, one per line
+    char *name;
+    size_t entry;
+};
+
+// Compiled shaders, kept until cleanup so every program that wants the same
+// variant shares one shader object. Handles to cached shaders are borrowed,
+// so deleting them leaves the cache alone.
+//
+// Compiles are only waited on when a shader is first linked, or when
+// ShadersReady finds them done. One that failed is dropped from the cache,
+// so asking again after fixing the file recompiles it.
+struct shader_cache {
+    struct shader_cache_entry *entries;
+    size_t count;
+    size_t capacity;
+
+    struct shader_cache_variant *variants;
+    size_t variant_count;
+    size_t variant_capacity;
+
+    // Shaders that failed to compile, kept alive until cleanup for the
+    // handles already given out
+    GLuint *failed;
+    size_t failed_count;
+
+    // GL_KHR_parallel_shader_compile: compiles happen on driver threads
+    // and only block when the status is checked
+    int parallel;
+
+    size_t hits;
+    size_t misses;
+};
+
+// Needs the GL context
+void shader_cache_init(struct shader_cache *);
+void shader_cache_cleanup(struct shader_cache *);
+// Waits for the shader if it's a cached one still compiling, printing the
+// log if it failed. Call before linking with it.
+void shader_cache_finish(struct shader_cache *, GLuint);
+
+void shader_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,16 @@
+// Linear blend skinning from the bone palettes written by
+// gl.stream_palettes. Include from a vertex shader compiled with MAX_BONES
+// defined as the skeleton's bone count, and bind each character's range of
+// the palette buffer to the Palette block with animation.bind_palette.
+
+layout(std140) uniform Palette {
+    mat4 bones[MAX_BONES];
+};
+
+// joints holds four bone indices, weights their weights summing to 1
+mat4 skin_matrix(vec4 joints, vec4 weights) {
+    return bones[int(joints.x)] * weights.x +
+           bones[int(joints.y)] * weights.y +
+           bones[int(joints.z)] * weights.z +
+           bones[int(joints.w)] * weights.w;
+}
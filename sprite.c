@@ -0,0 +1,412 @@
+#include "sprite.h"
+
+#include "draw_interface.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Floats per sprite in the flat arrays taken by SpriteBatchAddArray:
+// x, y, width, height, rotation, u0, v0, u1, v1, r, g, b, a
+#define SPRITE_ARRAY_STRIDE 13
+
+struct sprite_batch *sprite_batch_create(size_t capacity,
+                                         struct memory_stats *memory,
+                                         struct handle_table *handles) {
+    struct sprite_batch *batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        return NULL;
+    }
+    batch->memory = memory;
+    batch->handles = handles;
+
+    if (capacity < 64) {
+        capacity = 64;
+    }
+
+    batch->sprites = malloc(capacity * sizeof(*batch->sprites));
+    batch->sort = malloc(capacity * sizeof(*batch->sort));
+    batch->sort_tmp = malloc(capacity * sizeof(*batch->sort_tmp));
+    batch->capacity = capacity;
+
+    if (!batch->sprites || !batch->sort || !batch->sort_tmp) {
+        sprite_batch_destroy(batch);
+        return NULL;
+    }
+
+    glGenVertexArrays(1, &batch->vertex_array);
+    glGenBuffers(1, &batch->vertex_buffer);
+    glGenBuffers(1, &batch->index_buffer);
+
+    // The attribute layout never changes, so set it up once
+    glBindVertexArray(batch->vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER, batch->vertex_buffer);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(struct sprite_vertex),
+                          (GLvoid *)offsetof(struct sprite_vertex, x));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(struct sprite_vertex),
+                          (GLvoid *)offsetof(struct sprite_vertex, u));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct sprite_vertex),
+                          (GLvoid *)offsetof(struct sprite_vertex, color));
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->index_buffer);
+
+    handle_restore_bindings(batch->handles);
+
+    return batch;
+}
+
+void sprite_batch_destroy(struct sprite_batch *batch) {
+    if (batch->vertex_array) {
+        memory_gpu_free(batch->memory, MEMORY_GPU_BUFFER, batch->vertex_buffer);
+        memory_gpu_free(batch->memory, MEMORY_GPU_BUFFER, batch->index_buffer);
+        glDeleteVertexArrays(1, &batch->vertex_array);
+        glDeleteBuffers(1, &batch->vertex_buffer);
+        glDeleteBuffers(1, &batch->index_buffer);
+    }
+
+    free(batch->sprites);
+    free(batch->sort);
+    free(batch->sort_tmp);
+    free(batch);
+}
+
+int sprite_batch_add(struct sprite_batch *batch, const struct sprite *sprite) {
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity * 2;
+
+        struct sprite *sprites = realloc(batch->sprites, capacity * sizeof(*sprites));
+        if (!sprites) {
+            return 1;
+        }
+        batch->sprites = sprites;
+
+        struct sort_entry *sort = realloc(batch->sort, capacity * sizeof(*sort));
+        if (!sort) {
+            return 1;
+        }
+        batch->sort = sort;
+
+        struct sort_entry *sort_tmp =
+            realloc(batch->sort_tmp, capacity * sizeof(*sort_tmp));
+        if (!sort_tmp) {
+            return 1;
+        }
+        batch->sort_tmp = sort_tmp;
+
+        batch->capacity = capacity;
+    }
+
+    batch->sprites[batch->count++] = *sprite;
+
+    return 0;
+}
+
+// Layer in the high bits, texture in the low bits, so sorting groups sprites
+// by layer first and then by texture within each layer.
+static uint64_t sprite_sort_key(const struct sprite *sprite) {
+    int layer = sprite->layer;
+    if (layer < INT16_MIN) {
+        layer = INT16_MIN;
+    } else if (layer > INT16_MAX) {
+        layer = INT16_MAX;
+    }
+
+    return ((uint64_t)(layer - INT16_MIN) << 32) | sprite->texture;
+}
+
+// Passes over the 16 bits of layer and 32 of texture
+static void sprite_batch_sort(struct sprite_batch *batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->sort[i].key = sprite_sort_key(&batch->sprites[i]);
+        batch->sort[i].index = i;
+    }
+
+    radix_sort(&batch->sort, &batch->sort_tmp, batch->count, 48);
+}
+
+static void sprite_write_vertices(const struct sprite *sprite,
+                                  struct sprite_vertex *v) {
+    float hw = sprite->width * 0.5f;
+    float hh = sprite->height * 0.5f;
+
+    // Corner offsets from the center, counter-clockwise from bottom left
+    float dx[4] = { -hw,  hw, hw, -hw };
+    float dy[4] = { -hh, -hh, hh,  hh };
+
+    float u[4] = { sprite->u0, sprite->u1, sprite->u1, sprite->u0 };
+    float t[4] = { sprite->v0, sprite->v0, sprite->v1, sprite->v1 };
+
+    if (sprite->rotation == 0.0f) {
+        for (int i = 0; i < 4; i++) {
+            v[i].x = sprite->x + dx[i];
+            v[i].y = sprite->y + dy[i];
+            v[i].u = u[i];
+            v[i].v = t[i];
+            v[i].color = sprite->color;
+        }
+    } else {
+        float c = cosf(sprite->rotation);
+        float s = sinf(sprite->rotation);
+
+        for (int i = 0; i < 4; i++) {
+            v[i].x = sprite->x + dx[i] * c - dy[i] * s;
+            v[i].y = sprite->y + dx[i] * s + dy[i] * c;
+            v[i].u = u[i];
+            v[i].v = t[i];
+            v[i].color = sprite->color;
+        }
+    }
+}
+
+// Grows the GL buffers to hold at least `count` sprites. The index buffer
+// is the same two triangles per quad repeated, so it only gets written here.
+static void sprite_batch_reserve_buffers(struct sprite_batch *batch, size_t count) {
+    if (count <= batch->buffer_capacity) {
+        return;
+    }
+
+    size_t capacity = batch->buffer_capacity ? batch->buffer_capacity : 1024;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+
+    log_debug("Growing sprite buffers to %zu sprites", capacity);
+
+    GLuint *indices = malloc(capacity * 6 * sizeof(*indices));
+    for (size_t i = 0; i < capacity; i++) {
+        GLuint base = i * 4;
+        indices[i * 6 + 0] = base + 0;
+        indices[i * 6 + 1] = base + 1;
+        indices[i * 6 + 2] = base + 2;
+        indices[i * 6 + 3] = base + 2;
+        indices[i * 6 + 4] = base + 3;
+        indices[i * 6 + 5] = base + 0;
+    }
+
+    // The element array binding is part of the vertex array's state
+    glBindVertexArray(batch->vertex_array);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, capacity * 6 * sizeof(*indices),
+                 indices, GL_STATIC_DRAW);
+    memory_gpu_alloc(batch->memory, MEMORY_GPU_BUFFER, batch->index_buffer,
+                     capacity * 6 * sizeof(*indices), GL_STATIC_DRAW,
+                     "sprite batch");
+
+    free(indices);
+
+    batch->buffer_capacity = capacity;
+}
+
+void sprite_batch_draw(struct sprite_batch *batch) {
+    size_t count = batch->count;
+
+    batch->last_count = count;
+    batch->last_draw_calls = 0;
+
+    if (count == 0) {
+        return;
+    }
+
+    sprite_batch_sort(batch);
+    sprite_batch_reserve_buffers(batch, count);
+
+    glBindBuffer(GL_ARRAY_BUFFER, batch->vertex_buffer);
+
+    // Orphan the old storage so we never wait on the GPU to finish reading
+    // last frame's vertices
+    GLsizeiptr size = batch->buffer_capacity * 4 * sizeof(struct sprite_vertex);
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+    memory_gpu_alloc(batch->memory, MEMORY_GPU_BUFFER, batch->vertex_buffer,
+                     size, GL_STREAM_DRAW, "sprite batch");
+
+    struct sprite_vertex *vertices = glMapBufferRange(
+        GL_ARRAY_BUFFER, 0, count * 4 * sizeof(struct sprite_vertex),
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!vertices) {
+        fprintf(stderr, "Error mapping sprite vertex buffer\n");
+        handle_restore_bindings(batch->handles);
+        batch->count = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        sprite_write_vertices(&batch->sprites[batch->sort[i].index],
+                              &vertices[i * 4]);
+    }
+
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+
+    glBindVertexArray(batch->vertex_array);
+    glActiveTexture(GL_TEXTURE0);
+
+    // Sprites are sorted by layer then texture, so each run of sprites with
+    // the same texture is contiguous and goes out in one call
+    size_t start = 0;
+    while (start < count) {
+        GLuint texture = batch->sprites[batch->sort[start].index].texture;
+
+        size_t end = start + 1;
+        while (end < count &&
+               batch->sprites[batch->sort[end].index].texture == texture) {
+            end++;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glDrawElements(GL_TRIANGLES, (end - start) * 6, GL_UNSIGNED_INT,
+                       (const GLvoid *)(start * 6 * sizeof(GLuint)));
+        batch->last_draw_calls++;
+
+        start = end;
+    }
+
+    handle_restore_bindings(batch->handles);
+
+    batch->count = 0;
+}
+
+static uint32_t pack_color(lua_Number r, lua_Number g, lua_Number b, lua_Number a) {
+    lua_Number channels[4] = { r, g, b, a };
+    uint32_t color = 0;
+
+    for (int i = 0; i < 4; i++) {
+        lua_Number c = channels[i];
+        c = c < 0 ? 0 : (c > 1 ? 1 : c);
+        color |= (uint32_t)(c * 255.0 + 0.5) << (i * 8);
+    }
+
+    return color;
+}
+
+static GLuint get_texture(lua_State *L, int index) {
+    return lua_isnoneornil(L, index) ? 0 : (GLuint)(intptr_t)lua_touserdata(L, index);
+}
+
+int draw_lua_CreateSpriteBatch(struct draw_data *data, lua_State *L) {
+    size_t capacity = luaL_optinteger(L, 1, 1024);
+
+    struct sprite_batch *batch = sprite_batch_create(capacity, data->memory,
+                                                     &data->handles);
+    if (!batch) {
+        return luaL_error(L, "Error creating sprite batch");
+    }
+
+    lua_pushlightuserdata(L, batch);
+
+    return 1;
+}
+
+int draw_lua_DeleteSpriteBatch(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct sprite_batch *batch = lua_touserdata(L, 1);
+
+    sprite_batch_destroy(batch);
+
+    return 0;
+}
+
+// Arguments are read in place rather than with get_*_arg, since removing
+// sixteen arguments one at a time is a noticeable cost at 100k sprites:
+// batch, texture, layer, x, y, width, height, rotation, u0, v0, u1, v1,
+// and optionally r, g, b, a (default white)
+int sprite_lua_SpriteBatchAdd(lua_State *L) {
+    struct sprite_batch *batch = lua_touserdata(L, 1);
+
+    struct sprite sprite = {
+        .texture = get_texture(L, 2),
+        .layer = lua_tointeger(L, 3),
+        .x = lua_tonumber(L, 4),
+        .y = lua_tonumber(L, 5),
+        .width = lua_tonumber(L, 6),
+        .height = lua_tonumber(L, 7),
+        .rotation = lua_tonumber(L, 8),
+        .u0 = lua_tonumber(L, 9),
+        .v0 = lua_tonumber(L, 10),
+        .u1 = lua_tonumber(L, 11),
+        .v1 = lua_tonumber(L, 12),
+        .color = pack_color(luaL_optnumber(L, 13, 1.0),
+                            luaL_optnumber(L, 14, 1.0),
+                            luaL_optnumber(L, 15, 1.0),
+                            luaL_optnumber(L, 16, 1.0)),
+    };
+
+    if (sprite_batch_add(batch, &sprite)) {
+        return luaL_error(L, "Error growing sprite batch");
+    }
+
+    return 0;
+}
+
+// batch, texture, layer, array of SPRITE_ARRAY_STRIDE floats per sprite
+int sprite_lua_SpriteBatchAddArray(lua_State *L) {
+    struct sprite_batch *batch = lua_touserdata(L, 1);
+    GLuint texture = get_texture(L, 2);
+    int layer = lua_tointeger(L, 3);
+
+    lua_Integer len = get_lua_len(L, 4);
+
+    for (lua_Integer i = 0; i + SPRITE_ARRAY_STRIDE <= len; i += SPRITE_ARRAY_STRIDE) {
+        lua_Number values[SPRITE_ARRAY_STRIDE];
+        for (int j = 0; j < SPRITE_ARRAY_STRIDE; j++) {
+            lua_rawgeti(L, 4, i + j + 1);
+            values[j] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+
+        struct sprite sprite = {
+            .texture = texture,
+            .layer = layer,
+            .x = values[0],
+            .y = values[1],
+            .width = values[2],
+            .height = values[3],
+            .rotation = values[4],
+            .u0 = values[5],
+            .v0 = values[6],
+            .u1 = values[7],
+            .v1 = values[8],
+            .color = pack_color(values[9], values[10], values[11], values[12]),
+        };
+
+        if (sprite_batch_add(batch, &sprite)) {
+            return luaL_error(L, "Error growing sprite batch");
+        }
+    }
+
+    return 0;
+}
+
+int draw_lua_SpriteBatchDraw(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct sprite_batch *batch = lua_touserdata(L, 1);
+
+    sprite_batch_draw(batch);
+
+    return 0;
+}
+
+int sprite_lua_SpriteBatchStats(lua_State *L) {
+    struct sprite_batch *batch = lua_touserdata(L, 1);
+
+    lua_pushinteger(L, batch->last_count);
+    lua_pushinteger(L, batch->last_draw_calls);
+
+    return 2;
+}
+
+void sprite_interface_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateSpriteBatch);
+    REGISTER_FUNC(DeleteSpriteBatch);
+    REGISTER_FUNC(SpriteBatchDraw);
+
+    // These don't touch GL, so they skip the glGetError checks in
+    // drawfunction_wrapper. They get called once per sprite.
+    lua_register(L, "draw_SpriteBatchAdd", sprite_lua_SpriteBatchAdd);
+    lua_register(L, "draw_SpriteBatchAddArray", sprite_lua_SpriteBatchAddArray);
+    lua_register(L, "draw_SpriteBatchStats", sprite_lua_SpriteBatchStats);
+}
@@ -0,0 +1,63 @@
+#ifndef SPRITE_H
+#define SPRITE_H
+
+#include "lua.h"
+#include "draw.h"
+#include "radix_sort.h"
+
+#include <stdint.h>
+
+struct sprite {
+    // Center of the sprite, and rotation around it in radians
+    float x, y;
+    float width, height;
+    float rotation;
+    float u0, v0, u1, v1;
+    // RGBA, 8 bits per channel
+    uint32_t color;
+    GLuint texture;
+    int layer;
+};
+
+// Vertex layout written into the streaming buffer:
+//   location 0: vec2 position
+//   location 1: vec2 texture coordinate
+//   location 2: vec4 color, normalized from unsigned bytes
+struct sprite_vertex {
+    float x, y;
+    float u, v;
+    uint32_t color;
+};
+
+// Sprites are queued up on the CPU, then sorted by layer and texture and
+// drawn with one draw call per run of sprites sharing a texture.
+struct sprite_batch {
+    struct sprite *sprites;
+    struct sort_entry *sort;
+    struct sort_entry *sort_tmp;
+    size_t count;
+    size_t capacity;
+
+    GLuint vertex_array;
+    GLuint vertex_buffer;
+    GLuint index_buffer;
+    // Number of sprites the GL buffers have room for
+    size_t buffer_capacity;
+    struct memory_stats *memory;
+    // Lua's bindings, put back after binding the batch's own
+    struct handle_table *handles;
+
+    // Stats from the last draw
+    size_t last_count;
+    int last_draw_calls;
+};
+
+struct sprite_batch *sprite_batch_create(size_t, struct memory_stats *,
+                                         struct handle_table *);
+void sprite_batch_destroy(struct sprite_batch *);
+int sprite_batch_add(struct sprite_batch *, const struct sprite *);
+void sprite_batch_draw(struct sprite_batch *);
+
+void sprite_interface_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,30 @@
+local M = {}
+
+-- Sprite batch functions exposed from C
+local copy_funcs = {
+  CreateSpriteBatch="create_batch",
+  DeleteSpriteBatch="delete_batch",
+  SpriteBatchAdd="add",
+  SpriteBatchAddArray="add_array",
+  SpriteBatchDraw="draw",
+  SpriteBatchStats="stats",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["draw_" .. c_name]
+end
+
+-- Batches draw with whatever program is bound. It has to read
+--   location 0: vec2 position
+--   location 1: vec2 texture coordinate
+--   location 2: vec4 color
+-- and sample its texture from texture unit 0.
+function M.draw_with_program(batch, program)
+  draw_glUseProgram(program)
+
+  M.draw(batch)
+
+  draw_glUseProgram(nil)
+end
+
+return M
@@ -0,0 +1,82 @@
+#include "stats.h"
+
+#include "log.h"
+
+double stats_counter_to_ms(Uint64 counter) {
+    return 1000.0 * counter / SDL_GetPerformanceFrequency();
+}
+
+void stats_init(struct frame_stats *stats) {
+    memset(stats, 0x0, sizeof(*stats));
+
+    stats->ticks = SDL_GetTicks();
+}
+
+void stats_input_latency(struct frame_stats *stats, Uint64 latency) {
+    stats->input_latency_total += latency;
+    stats->input_latency_count++;
+    if (latency > stats->input_latency_max) {
+        stats->input_latency_max = latency;
+    }
+}
+
+void stats_gpu_timers(struct frame_stats *stats,
+                      const struct gpu_timers *timers) {
+    stats->gpu_timers = timers;
+
+    long frame = timers->frame - GPU_TIMER_FRAMES;
+    for (int i = 0; i < timers->scope_count; i++) {
+        const struct gpu_timer_scope *scope = &timers->scopes[i];
+        if (scope->result_frame != frame) {
+            continue;
+        }
+
+        stats->gpu_ms_total[i] += scope->ms;
+        stats->gpu_count[i]++;
+        stats->gpu_primitives[i] = scope->primitives;
+        if (scope->ms > stats->gpu_ms_max[i]) {
+            stats->gpu_ms_max[i] = scope->ms;
+        }
+    }
+}
+
+void stats_frame_end(struct frame_stats *stats) {
+    stats->frame_count++;
+    if (SDL_GetTicks() <= stats->ticks + 1000) {
+        return;
+    }
+
+    log_info("%d frames per second", stats->frame_count);
+    if (stats->input_latency_count > 0) {
+        log_info("Input latency: %.2fms average, %.2fms max",
+               stats_counter_to_ms(stats->input_latency_total) /
+                   stats->input_latency_count,
+               stats_counter_to_ms(stats->input_latency_max));
+    }
+    if (stats->gpu_timers) {
+        for (int i = 0; i < stats->gpu_timers->scope_count; i++) {
+            if (stats->gpu_count[i] == 0) {
+                continue;
+            }
+
+            log_info("GPU '%s': %.2fms average, %.2fms max, %u primitives",
+                   stats->gpu_timers->scopes[i].name,
+                   stats->gpu_ms_total[i] / stats->gpu_count[i],
+                   stats->gpu_ms_max[i], stats->gpu_primitives[i]);
+        }
+    }
+
+    stats_init(stats);
+}
+
+// Milliseconds on the performance counter, for scripts timing their own
+// work
+int stats_lua_Now(lua_State *L) {
+    lua_pushnumber(L, stats_counter_to_ms(SDL_GetPerformanceCounter()));
+
+    return 1;
+}
+
+void stats_register(lua_State *L) {
+    lua_register(L, "stats_Now", stats_lua_Now);
+}
@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "gpu_timer.h"
+#include "lua.h"
+
+#include <SDL2/SDL.h>
+
+// Per-second frame statistics, logged at info level
+struct frame_stats {
+    unsigned int ticks;
+    int frame_count;
+
+    // Time from SDL receiving an event to the end of the frame that handed
+    // it to update(), in performance counter units
+    Uint64 input_latency_total;
+    Uint64 input_latency_max;
+    int input_latency_count;
+
+    // GPU time of each timer scope, indexed like gpu_timers->scopes
+    const struct gpu_timers *gpu_timers;
+    double gpu_ms_total[GPU_TIMER_MAX_SCOPES];
+    double gpu_ms_max[GPU_TIMER_MAX_SCOPES];
+    GLuint gpu_primitives[GPU_TIMER_MAX_SCOPES];
+    int gpu_count[GPU_TIMER_MAX_SCOPES];
+};
+
+double stats_counter_to_ms(Uint64);
+
+void stats_init(struct frame_stats *);
+void stats_input_latency(struct frame_stats *, Uint64);
+// Picks up the GPU timer results that came in this frame
+void stats_gpu_timers(struct frame_stats *, const struct gpu_timers *);
+void stats_frame_end(struct frame_stats *);
+
+void stats_register(lua_State *);
+
+#endif
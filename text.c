@@ -0,0 +1,1035 @@
+#include "text.h"
+
+#include "draw_interface.h"
+#include "util.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RUN_TABLE_SIZE (TEXT_MAX_RUNS * 2)
+
+// Floats per vertex: x, y, u, v
+#define VERTEX_FLOATS 4
+
+#define ROUND_UP_4(n) (((n) + 3) & ~3)
+
+static int glyph_row_bytes(const struct text_glyph *glyph) {
+    return (glyph->width + 7) / 8;
+}
+
+static int compare_glyphs(const void *a, const void *b) {
+    uint32_t x = ((const struct text_glyph *)a)->codepoint;
+    uint32_t y = ((const struct text_glyph *)b)->codepoint;
+    return (x > y) - (x < y);
+}
+
+static int32_t find_glyph(const struct text_font *font, uint32_t codepoint) {
+    size_t low = 0;
+    size_t high = font->glyph_count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        uint32_t found = font->glyphs[middle].codepoint;
+        if (found == codepoint) {
+            return middle;
+        } else if (found < codepoint) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return -1;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int grow(void **array, size_t size, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = *capacity ? *capacity * 2 : 256;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+
+    void *grown = realloc(*array, new_capacity * size);
+    if (!grown) {
+        return 1;
+    }
+
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static void font_free(struct text_font *font) {
+    free(font->glyphs);
+    free(font->bits);
+    free(font);
+}
+
+// Reads the BDF keywords we need. Everything else, including glyphs without
+// an encoding, is skipped.
+static int parse_bdf(struct text_font *font, char *source,
+                     const char *file_name) {
+    size_t glyph_capacity = 0;
+    size_t bits_size = 0, bits_capacity = 0;
+    int box_height = 0, box_y = 0;
+    int default_char = -1;
+    int ascent = -1, descent = -1;
+
+    struct text_glyph glyph;
+    int in_char = 0;
+    int rows_left = 0;
+
+    for (char *line = strtok(source, "\r\n"); line;
+         line = strtok(NULL, "\r\n")) {
+        if (rows_left > 0) {
+            uint8_t *row = &font->bits[bits_size];
+            int bytes = glyph_row_bytes(&glyph);
+            int digits = strlen(line);
+            for (int i = 0; i < bytes; i++) {
+                int high = i * 2 + 1 < digits ? hex_digit(line[i * 2]) : -1;
+                int low = high < 0 ? -1 : hex_digit(line[i * 2 + 1]);
+                row[i] = high < 0 || low < 0 ? 0 : high << 4 | low;
+            }
+            bits_size += bytes;
+            rows_left--;
+            continue;
+        }
+
+        int a, b, c, d;
+        if (sscanf(line, "FONTBOUNDINGBOX %d %d %d %d", &a, &b, &c, &d) == 4) {
+            box_height = b;
+            box_y = d;
+        } else if (sscanf(line, "PIXEL_SIZE %d", &a) == 1) {
+            font->pixel_size = a;
+        } else if (sscanf(line, "FONT_ASCENT %d", &a) == 1) {
+            ascent = a;
+        } else if (sscanf(line, "FONT_DESCENT %d", &a) == 1) {
+            descent = a;
+        } else if (sscanf(line, "DEFAULT_CHAR %d", &a) == 1) {
+            default_char = a;
+        } else if (strncmp(line, "STARTCHAR", 9) == 0) {
+            memset(&glyph, 0x0, sizeof(glyph));
+            glyph.cell = -1;
+            in_char = 1;
+        } else if (!in_char) {
+            continue;
+        } else if (sscanf(line, "ENCODING %d", &a) == 1) {
+            // -1 is a glyph with no standard encoding
+            if (a < 0) {
+                in_char = 0;
+            }
+            glyph.codepoint = a;
+        } else if (sscanf(line, "DWIDTH %d", &a) == 1) {
+            glyph.advance = a;
+        } else if (sscanf(line, "BBX %d %d %d %d", &a, &b, &c, &d) == 4) {
+            if (a < 0 || b < 0 || a > 1024 || b > 1024) {
+                fprintf(stderr, "%s: bad glyph size %dx%d\n", file_name, a, b);
+                return 1;
+            }
+            glyph.width = a;
+            glyph.height = b;
+            glyph.x_offset = c;
+            glyph.y_offset = d;
+        } else if (strcmp(line, "BITMAP") == 0) {
+            size_t size = (size_t)glyph_row_bytes(&glyph) * glyph.height;
+            if (grow((void **)&font->bits, 1, &bits_capacity,
+                     bits_size + size)) {
+                return 1;
+            }
+            glyph.bits = bits_size;
+            rows_left = glyph.height;
+        } else if (strcmp(line, "ENDCHAR") == 0) {
+            if (grow((void **)&font->glyphs, sizeof(glyph), &glyph_capacity,
+                     font->glyph_count + 1)) {
+                return 1;
+            }
+            font->glyphs[font->glyph_count++] = glyph;
+            in_char = 0;
+        }
+    }
+
+    if (font->glyph_count == 0) {
+        fprintf(stderr, "%s has no glyphs\n", file_name);
+        return 1;
+    }
+
+    qsort(font->glyphs, font->glyph_count, sizeof(*font->glyphs),
+          compare_glyphs);
+
+    if (font->pixel_size <= 0) {
+        font->pixel_size = box_height > 0 ? box_height : 1;
+    }
+    font->ascent = ascent >= 0 ? ascent : box_height + box_y;
+    font->descent = descent >= 0 ? descent : -box_y;
+
+    font->fallback = default_char >= 0 ? find_glyph(font, default_char) : -1;
+    if (font->fallback < 0) {
+        font->fallback = find_glyph(font, '?');
+    }
+
+    return 0;
+}
+
+struct text_font *text_font_load(struct text_context *context,
+                                 const char *file_name) {
+    char *source = read_whole_file(file_name);
+    if (!source) {
+        fprintf(stderr, "Error reading font %s\n", file_name);
+        return NULL;
+    }
+
+    struct text_font *font = calloc(1, sizeof(*font));
+    if (!font) {
+        free(source);
+        return NULL;
+    }
+
+    int error = parse_bdf(font, source, file_name);
+    free(source);
+    if (error) {
+        font_free(font);
+        return NULL;
+    }
+
+    font->context = context;
+    font->next = context->fonts;
+    context->fonts = font;
+
+    log_debug("Loaded font %s with %zu glyphs", file_name, font->glyph_count);
+
+    return font;
+}
+
+struct text_context *text_context_create(int size, int sdf,
+                                         struct memory_stats *memory,
+                                         struct handle_table *handles) {
+    struct text_context *context = calloc(1, sizeof(*context));
+    if (!context) {
+        return NULL;
+    }
+
+    context->size = size;
+    context->sdf = sdf;
+    context->memory = memory;
+    context->handles = handles;
+    context->max_shelves = size / 4;
+    context->shelves = calloc(context->max_shelves, sizeof(*context->shelves));
+    if (!context->shelves) {
+        free(context);
+        return NULL;
+    }
+
+    context->offset_location = -1;
+    context->color_location = -1;
+
+    glGenTextures(1, &context->texture);
+    glBindTexture(GL_TEXTURE_2D, context->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, size, size, 0, GL_RED,
+                 GL_UNSIGNED_BYTE, NULL);
+    // Bitmap glyphs stay crisp at whole number scales. Distance fields need
+    // filtering to find the edge between texels.
+    GLint filter = sdf ? GL_LINEAR : GL_NEAREST;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    handle_restore_bindings(context->handles);
+
+    memory_gpu_alloc(memory, MEMORY_GPU_TEXTURE, context->texture,
+                     (size_t)size * size, GL_R8, "text atlas");
+
+    return context;
+}
+
+static void run_destroy(struct text_context *context, struct text_run *run) {
+    for (size_t i = 0; i < run->cell_count; i++) {
+        int32_t cell = run->cells[i];
+        context->shelves[cell >> 16].cells[cell & 0xffff].pins--;
+    }
+
+    memory_gpu_free(context->memory, MEMORY_GPU_BUFFER, run->buffer);
+    glDeleteVertexArrays(1, &run->vertex_array);
+    glDeleteBuffers(1, &run->buffer);
+
+    free(run->cells);
+    free(run->string);
+    free(run);
+}
+
+void text_context_destroy(struct text_context *context) {
+    for (size_t i = 0; i < context->run_count; i++) {
+        run_destroy(context, context->runs[i]);
+    }
+
+    for (int i = 0; i < context->shelf_count; i++) {
+        free(context->shelves[i].cells);
+    }
+    free(context->shelves);
+
+    while (context->fonts) {
+        struct text_font *next = context->fonts->next;
+        font_free(context->fonts);
+        context->fonts = next;
+    }
+
+    memory_gpu_free(context->memory, MEMORY_GPU_TEXTURE, context->texture);
+    glDeleteTextures(1, &context->texture);
+
+    free(context);
+}
+
+static int glyph_padding(const struct text_context *context) {
+    return context->sdf ? TEXT_SDF_SPREAD : 1;
+}
+
+static int glyph_bit(const struct text_font *font,
+                     const struct text_glyph *glyph, int x, int y) {
+    if (x < 0 || y < 0 || x >= glyph->width || y >= glyph->height) {
+        return 0;
+    }
+
+    const uint8_t *row = &font->bits[glyph->bits + y * glyph_row_bytes(glyph)];
+    return row[x / 8] >> (7 - x % 8) & 1;
+}
+
+// Distance from each texel to the nearest texel on the other side of the
+// glyph's edge, found by brute force within the spread. Glyphs are small,
+// and this only runs on an atlas miss.
+static uint8_t distance_texel(const struct text_font *font,
+                              const struct text_glyph *glyph, int x, int y) {
+    int inside = glyph_bit(font, glyph, x, y);
+    int nearest = (TEXT_SDF_SPREAD + 1) * (TEXT_SDF_SPREAD + 1);
+
+    for (int dy = -TEXT_SDF_SPREAD; dy <= TEXT_SDF_SPREAD; dy++) {
+        for (int dx = -TEXT_SDF_SPREAD; dx <= TEXT_SDF_SPREAD; dx++) {
+            int squared = dx * dx + dy * dy;
+            if (squared < nearest &&
+                glyph_bit(font, glyph, x + dx, y + dy) != inside) {
+                nearest = squared;
+            }
+        }
+    }
+
+    // The edge is half a texel short of the nearest opposite texel
+    float distance = sqrtf(nearest) - 0.5f;
+    if (!inside) {
+        distance = -distance;
+    }
+
+    float value = 128 + distance * 127 / TEXT_SDF_SPREAD;
+    return value < 0 ? 0 : (value > 255 ? 255 : (uint8_t)value);
+}
+
+// Writes the glyph into its cell, padding included, so nothing left over
+// from an evicted glyph bleeds in
+static void upload_glyph(struct text_context *context,
+                         const struct text_font *font,
+                         const struct text_glyph *glyph,
+                         const struct text_shelf *shelf, int cell) {
+    int width = shelf->cell_width;
+    int height = shelf->cell_height;
+    int padding = glyph_padding(context);
+
+    uint8_t *texels = calloc((size_t)width * height, 1);
+    if (!texels) {
+        return;
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int gx = x - padding;
+            int gy = y - padding;
+            texels[y * width + x] = context->sdf ?
+                distance_texel(font, glyph, gx, gy) :
+                glyph_bit(font, glyph, gx, gy) * 255;
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, context->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, cell * width, shelf->y, width, height,
+                    GL_RED, GL_UNSIGNED_BYTE, texels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    handle_restore_bindings(context->handles);
+
+    free(texels);
+}
+
+static void evict_cell(struct text_context *context, struct text_cell *cell) {
+    if (cell->font) {
+        cell->font->glyphs[cell->glyph].cell = -1;
+        cell->font = NULL;
+        context->stats.glyph_evictions++;
+    }
+}
+
+static int reset_shelf(struct text_context *context, struct text_shelf *shelf,
+                       int cell_width, int cell_height) {
+    for (int i = 0; i < shelf->cell_count; i++) {
+        evict_cell(context, &shelf->cells[i]);
+    }
+    free(shelf->cells);
+
+    shelf->cell_width = cell_width;
+    shelf->cell_height = cell_height;
+    shelf->cell_count = context->size / cell_width;
+    shelf->cells = calloc(shelf->cell_count, sizeof(*shelf->cells));
+
+    return shelf->cells ? 0 : 1;
+}
+
+static int32_t encode_cell(int shelf, int cell) {
+    return shelf << 16 | cell;
+}
+
+// Finds a cell of the given size: a free one, then a new shelf, then the
+// least recently used unpinned glyph of that size, then the least recently
+// used shelf with nothing pinned, remade for the new size. Returns -1 if
+// everything is pinned.
+static int32_t allocate_cell(struct text_context *context, int width,
+                             int height) {
+    int lru_shelf = -1, lru_cell = -1;
+    uint64_t lru_cell_used = UINT64_MAX;
+
+    if (width > context->size || height > context->size) {
+        return -1;
+    }
+
+    for (int i = 0; i < context->shelf_count; i++) {
+        struct text_shelf *shelf = &context->shelves[i];
+        if (shelf->cell_width != width || shelf->cell_height != height) {
+            continue;
+        }
+
+        for (int j = 0; j < shelf->cell_count; j++) {
+            struct text_cell *cell = &shelf->cells[j];
+            if (!cell->font) {
+                return encode_cell(i, j);
+            }
+            if (cell->pins == 0 && cell->last_used < lru_cell_used) {
+                lru_shelf = i;
+                lru_cell = j;
+                lru_cell_used = cell->last_used;
+            }
+        }
+    }
+
+    int top = 0;
+    if (context->shelf_count > 0) {
+        struct text_shelf *last = &context->shelves[context->shelf_count - 1];
+        top = last->y + last->height;
+    }
+    if (top + height <= context->size &&
+        context->shelf_count < context->max_shelves) {
+        struct text_shelf *shelf = &context->shelves[context->shelf_count];
+        shelf->y = top;
+        shelf->height = height;
+        if (reset_shelf(context, shelf, width, height) != 0) {
+            return -1;
+        }
+        return encode_cell(context->shelf_count++, 0);
+    }
+
+    if (lru_shelf >= 0) {
+        evict_cell(context, &context->shelves[lru_shelf].cells[lru_cell]);
+        return encode_cell(lru_shelf, lru_cell);
+    }
+
+    int reuse = -1;
+    uint64_t reuse_used = UINT64_MAX;
+    for (int i = 0; i < context->shelf_count; i++) {
+        struct text_shelf *shelf = &context->shelves[i];
+        if (shelf->height < height) {
+            continue;
+        }
+
+        uint64_t used = 0;
+        int pinned = 0;
+        for (int j = 0; j < shelf->cell_count && !pinned; j++) {
+            pinned = shelf->cells[j].pins > 0;
+            if (shelf->cells[j].font && shelf->cells[j].last_used > used) {
+                used = shelf->cells[j].last_used;
+            }
+        }
+
+        if (!pinned && used < reuse_used) {
+            reuse = i;
+            reuse_used = used;
+        }
+    }
+
+    if (reuse >= 0 &&
+        reset_shelf(context, &context->shelves[reuse], width, height) == 0) {
+        return encode_cell(reuse, 0);
+    }
+
+    return -1;
+}
+
+// Puts the glyph in the atlas if it isn't already, and pins it. Returns its
+// cell, or -1 if there's no room.
+static int32_t acquire_glyph(struct text_context *context,
+                             struct text_font *font, int32_t index) {
+    struct text_glyph *glyph = &font->glyphs[index];
+
+    if (glyph->cell >= 0) {
+        context->stats.glyph_hits++;
+    } else {
+        int padding = glyph_padding(context);
+        int32_t cell = allocate_cell(context,
+                                     ROUND_UP_4(glyph->width + padding * 2),
+                                     ROUND_UP_4(glyph->height + padding * 2));
+        if (cell < 0) {
+            return -1;
+        }
+        context->stats.glyph_misses++;
+
+        struct text_shelf *shelf = &context->shelves[cell >> 16];
+        shelf->cells[cell & 0xffff] = (struct text_cell){
+            .font = font,
+            .glyph = index,
+        };
+        upload_glyph(context, font, glyph, shelf, cell & 0xffff);
+        glyph->cell = cell;
+    }
+
+    struct text_cell *cell =
+        &context->shelves[glyph->cell >> 16].cells[glyph->cell & 0xffff];
+    cell->pins++;
+    cell->last_used = context->tick;
+
+    return glyph->cell;
+}
+
+// Decodes one UTF-8 character and advances past it. Malformed bytes come out
+// as U+FFFD.
+static uint32_t next_codepoint(const char **string, const char *end) {
+    const uint8_t *s = (const uint8_t *)*string;
+    uint32_t codepoint;
+    int extra;
+
+    if (s[0] < 0x80) {
+        codepoint = s[0];
+        extra = 0;
+    } else if ((s[0] & 0xe0) == 0xc0) {
+        codepoint = s[0] & 0x1f;
+        extra = 1;
+    } else if ((s[0] & 0xf0) == 0xe0) {
+        codepoint = s[0] & 0x0f;
+        extra = 2;
+    } else if ((s[0] & 0xf8) == 0xf0) {
+        codepoint = s[0] & 0x07;
+        extra = 3;
+    } else {
+        *string += 1;
+        return 0xfffd;
+    }
+
+    if ((const char *)s + extra >= end) {
+        *string = end;
+        return 0xfffd;
+    }
+
+    for (int i = 1; i <= extra; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            *string += i;
+            return 0xfffd;
+        }
+        codepoint = codepoint << 6 | (s[i] & 0x3f);
+    }
+
+    *string += extra + 1;
+    return codepoint;
+}
+
+static int32_t lookup_glyph(const struct text_font *font, uint32_t codepoint) {
+    int32_t index = find_glyph(font, codepoint);
+    return index >= 0 ? index : font->fallback;
+}
+
+void text_measure(const struct text_font *font, float size,
+                  const char *string, size_t length, float *width,
+                  float *height) {
+    float scale = size / font->pixel_size;
+    float line_height = (font->ascent + font->descent) * scale;
+    const char *end = string + length;
+    float x = 0;
+
+    *width = 0;
+    *height = length > 0 ? line_height : 0;
+
+    while (string < end) {
+        uint32_t codepoint = next_codepoint(&string, end);
+        if (codepoint == '\n') {
+            x = 0;
+            *height += line_height;
+            continue;
+        }
+
+        int32_t index = lookup_glyph(font, codepoint);
+        if (index >= 0) {
+            x += font->glyphs[index].advance * scale;
+            *width = fmaxf(*width, x);
+        }
+    }
+}
+
+static uint64_t run_hash(const struct text_font *font, float size,
+                         const char *string, size_t length) {
+    // FNV-1a over the string, then the font and size
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)string[i]) * 0x100000001b3;
+    }
+
+    uint32_t size_bits;
+    memcpy(&size_bits, &size, sizeof(size_bits));
+    hash = (hash ^ (uintptr_t)font) * 0x100000001b3;
+    hash = (hash ^ size_bits) * 0x100000001b3;
+
+    return hash;
+}
+
+// Slot in the run table holding the run, or the empty slot it would go in
+static size_t find_slot(const struct text_context *context, uint64_t hash,
+                        const struct text_font *font, float size,
+                        const char *string, size_t length) {
+    size_t slot = hash & (RUN_TABLE_SIZE - 1);
+
+    while (context->run_table[slot]) {
+        const struct text_run *run = context->runs[context->run_table[slot] - 1];
+        if (run->hash == hash && run->font == font && run->size == size &&
+            run->length == length && memcmp(run->string, string, length) == 0) {
+            break;
+        }
+        slot = (slot + 1) & (RUN_TABLE_SIZE - 1);
+    }
+
+    return slot;
+}
+
+static size_t slot_of_run(const struct text_context *context, size_t index) {
+    const struct text_run *run = context->runs[index];
+    return find_slot(context, run->hash, run->font, run->size, run->string,
+                     run->length);
+}
+
+// Removes a slot from the run table, moving later entries of the probe
+// sequence back so lookups don't stop at the gap
+static void clear_slot(struct text_context *context, size_t slot) {
+    size_t mask = RUN_TABLE_SIZE - 1;
+    size_t gap = slot;
+
+    context->run_table[gap] = 0;
+    for (size_t i = (gap + 1) & mask; context->run_table[i];
+         i = (i + 1) & mask) {
+        size_t home =
+            context->runs[context->run_table[i] - 1]->hash & mask;
+        // Move the entry if its home slot isn't between the gap and it
+        if (((i - home) & mask) >= ((i - gap) & mask)) {
+            context->run_table[gap] = context->run_table[i];
+            context->run_table[i] = 0;
+            gap = i;
+        }
+    }
+}
+
+static void evict_run(struct text_context *context, size_t index) {
+    clear_slot(context, slot_of_run(context, index));
+    run_destroy(context, context->runs[index]);
+    context->stats.run_evictions++;
+
+    // Move the last run into the hole and point its slot at the new index
+    size_t last = --context->run_count;
+    if (index != last) {
+        size_t slot = slot_of_run(context, last);
+        context->runs[index] = context->runs[last];
+        context->run_table[slot] = index + 1;
+    }
+}
+
+static void evict_lru_run(struct text_context *context) {
+    size_t lru = 0;
+    for (size_t i = 1; i < context->run_count; i++) {
+        if (context->runs[i]->last_used < context->runs[lru]->last_used) {
+            lru = i;
+        }
+    }
+
+    evict_run(context, lru);
+}
+
+static void write_quad(float *v, float x0, float y0, float x1, float y1,
+                       float u0, float v0, float u1, float v1) {
+    const float corners[6][4] = {
+        {x0, y0, u0, v0}, {x1, y0, u1, v0}, {x1, y1, u1, v1},
+        {x1, y1, u1, v1}, {x0, y1, u0, v1}, {x0, y0, u0, v0},
+    };
+    memcpy(v, corners, sizeof(corners));
+}
+
+// Lays out the string with y down from the top left corner, writing two
+// triangles per visible glyph and pinning their cells
+static int layout_run(struct text_context *context, struct text_run *run,
+                      float *vertices) {
+    struct text_font *font = (struct text_font *)run->font;
+    float scale = run->size / font->pixel_size;
+    float line_height = (font->ascent + font->descent) * scale;
+    int padding = glyph_padding(context);
+    float texel = 1.0f / context->size;
+
+    const char *string = run->string;
+    const char *end = string + run->length;
+    float x = 0;
+    float baseline = font->ascent * scale;
+
+    run->width = 0;
+    run->height = run->length > 0 ? line_height : 0;
+
+    while (string < end) {
+        uint32_t codepoint = next_codepoint(&string, end);
+        if (codepoint == '\n') {
+            x = 0;
+            baseline += line_height;
+            run->height += line_height;
+            continue;
+        }
+
+        int32_t index = lookup_glyph(font, codepoint);
+        if (index < 0) {
+            continue;
+        }
+        const struct text_glyph *glyph = &font->glyphs[index];
+
+        if (glyph->width > 0 && glyph->height > 0) {
+            int32_t cell = acquire_glyph(context, font, index);
+            // Make room by dropping old runs, which unpins their glyphs
+            while (cell < 0 && context->run_count > 0) {
+                evict_lru_run(context);
+                cell = acquire_glyph(context, font, index);
+            }
+
+            if (cell < 0) {
+                context->stats.glyph_failures++;
+            } else {
+                run->cells[run->cell_count++] = cell;
+
+                const struct text_shelf *shelf = &context->shelves[cell >> 16];
+                float u0 = ((cell & 0xffff) * shelf->cell_width + padding) *
+                           texel;
+                float v0 = (shelf->y + padding) * texel;
+
+                float left = x + glyph->x_offset * scale;
+                float top = baseline - (glyph->y_offset + glyph->height) *
+                                       scale;
+                write_quad(&vertices[run->vertex_count * VERTEX_FLOATS],
+                           left, top, left + glyph->width * scale,
+                           top + glyph->height * scale, u0, v0,
+                           u0 + glyph->width * texel,
+                           v0 + glyph->height * texel);
+                run->vertex_count += 6;
+            }
+        }
+
+        x += glyph->advance * scale;
+        run->width = fmaxf(run->width, x);
+    }
+
+    return 0;
+}
+
+static struct text_run *create_run(struct text_context *context,
+                                   const struct text_font *font, float size,
+                                   const char *string, size_t length,
+                                   uint64_t hash) {
+    struct text_run *run = calloc(1, sizeof(*run));
+    if (!run) {
+        return NULL;
+    }
+
+    run->hash = hash;
+    run->font = font;
+    run->size = size;
+    run->length = length;
+    run->string = malloc(length > 0 ? length : 1);
+    // At most one glyph per byte
+    run->cells = malloc((length > 0 ? length : 1) * sizeof(*run->cells));
+    float *vertices = malloc((length > 0 ? length : 1) * 6 * VERTEX_FLOATS *
+                             sizeof(*vertices));
+    if (!run->string || !run->cells || !vertices) {
+        free(run->string);
+        free(run->cells);
+        free(run);
+        free(vertices);
+        return NULL;
+    }
+    memcpy(run->string, string, length);
+
+    layout_run(context, run, vertices);
+
+    size_t vertex_size = VERTEX_FLOATS * sizeof(float);
+    size_t buffer_size = run->vertex_count * vertex_size;
+
+    glGenVertexArrays(1, &run->vertex_array);
+    glGenBuffers(1, &run->buffer);
+    glBindVertexArray(run->vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER, run->buffer);
+    glBufferData(GL_ARRAY_BUFFER, buffer_size, vertices, GL_STATIC_DRAW);
+    memory_gpu_alloc(context->memory, MEMORY_GPU_BUFFER, run->buffer,
+                     buffer_size, GL_STATIC_DRAW, "text");
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, vertex_size,
+                          (GLvoid *)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, vertex_size,
+                          (GLvoid *)(2 * sizeof(float)));
+
+    handle_restore_bindings(context->handles);
+
+    free(vertices);
+
+    return run;
+}
+
+struct text_run *text_get_run(struct text_context *context,
+                              const struct text_font *font, float size,
+                              const char *string, size_t length) {
+    context->tick++;
+
+    uint64_t hash = run_hash(font, size, string, length);
+    size_t slot = find_slot(context, hash, font, size, string, length);
+
+    if (context->run_table[slot]) {
+        struct text_run *run = context->runs[context->run_table[slot] - 1];
+        run->last_used = context->tick;
+        context->stats.run_hits++;
+        return run;
+    }
+
+    context->stats.run_misses++;
+
+    if (context->run_count == TEXT_MAX_RUNS) {
+        evict_lru_run(context);
+    }
+
+    struct text_run *run = create_run(context, font, size, string, length,
+                                      hash);
+    if (!run) {
+        return NULL;
+    }
+    run->last_used = context->tick;
+
+    // Laying out may have evicted runs and moved entries around the table
+    slot = find_slot(context, hash, font, size, string, length);
+    context->runs[context->run_count] = run;
+    context->run_table[slot] = ++context->run_count;
+
+    return run;
+}
+
+static struct text_context *check_context(lua_State *L, int index) {
+    struct text_context *context = lua_touserdata(L, index);
+    if (!context) {
+        luaL_error(L, "Expected a text context");
+    }
+
+    return context;
+}
+
+static struct text_font *check_font(lua_State *L, int index) {
+    struct text_font *font = lua_touserdata(L, index);
+    if (!font) {
+        luaL_error(L, "Expected a font");
+    }
+
+    return font;
+}
+
+// atlas size in texels, and whether glyphs are signed distance fields
+int draw_lua_CreateTextContext(struct draw_data *data, lua_State *L) {
+    lua_Integer size = luaL_optinteger(L, 1, 1024);
+    int sdf = lua_toboolean(L, 2);
+    if (size < 16 || size > 16384) {
+        return luaL_error(L, "Bad text atlas size %d", (int)size);
+    }
+
+    struct text_context *context = text_context_create(size, sdf,
+                                                       data->memory,
+                                                       &data->handles);
+    if (!context) {
+        return luaL_error(L, "Error creating text context");
+    }
+
+    lua_pushlightuserdata(L, context);
+
+    return 1;
+}
+
+// Also frees the context's fonts
+int draw_lua_DeleteTextContext(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    text_context_destroy(check_context(L, 1));
+
+    return 0;
+}
+
+// context, program. Looks up the offset and color uniforms runs are drawn
+// with.
+int draw_lua_SetTextProgram(struct draw_data *data, lua_State *L) {
+    struct text_context *context = check_context(L, 1);
+    GLuint program = handle_check(L, &data->handles, 2, HANDLE_PROGRAM);
+
+    context->offset_location = glGetUniformLocation(program, "offset");
+    context->color_location = glGetUniformLocation(program, "color");
+
+    return 0;
+}
+
+// Arguments are read in place, like SpriteBatchAdd, since this is called
+// for every string every frame: context, font, size, string, x, y, and
+// optionally r, g, b, a (default white). Draws with the program in use,
+// sampling the atlas from texture unit 0. Returns the width and height of
+// the text.
+int draw_lua_DrawText(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct text_context *context = check_context(L, 1);
+    struct text_font *font = check_font(L, 2);
+    float size = luaL_checknumber(L, 3);
+    size_t length;
+    const char *string = luaL_checklstring(L, 4, &length);
+    float x = luaL_checknumber(L, 5);
+    float y = luaL_checknumber(L, 6);
+
+    if (font->context != context) {
+        return luaL_error(L, "Font belongs to a different text context");
+    }
+
+    struct text_run *run = text_get_run(context, font, size, string, length);
+    if (!run) {
+        return luaL_error(L, "Error laying out text");
+    }
+
+    if (run->vertex_count > 0) {
+        glUniform2f(context->offset_location, x, y);
+        glUniform4f(context->color_location, luaL_optnumber(L, 7, 1.0),
+                    luaL_optnumber(L, 8, 1.0), luaL_optnumber(L, 9, 1.0),
+                    luaL_optnumber(L, 10, 1.0));
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, context->texture);
+        glBindVertexArray(run->vertex_array);
+        glDrawArrays(GL_TRIANGLES, 0, run->vertex_count);
+        handle_restore_bindings(context->handles);
+    }
+
+    lua_pushnumber(L, run->width);
+    lua_pushnumber(L, run->height);
+
+    return 2;
+}
+
+// context, BDF file name
+int text_lua_LoadFont(lua_State *L) {
+    struct text_context *context = check_context(L, 1);
+    const char *file_name = luaL_checkstring(L, 2);
+
+    struct text_font *font = text_font_load(context, file_name);
+    if (!font) {
+        return luaL_error(L, "Error loading font %s", file_name);
+    }
+
+    lua_pushlightuserdata(L, font);
+
+    return 1;
+}
+
+// Size in pixels the font was drawn at, ascent, descent
+int text_lua_FontMetrics(lua_State *L) {
+    struct text_font *font = check_font(L, 1);
+
+    lua_pushinteger(L, font->pixel_size);
+    lua_pushinteger(L, font->ascent);
+    lua_pushinteger(L, font->descent);
+
+    return 3;
+}
+
+// font, size, string. Returns the width and height DrawText would give.
+int text_lua_Measure(lua_State *L) {
+    struct text_font *font = check_font(L, 1);
+    float size = luaL_checknumber(L, 2);
+    size_t length;
+    const char *string = luaL_checklstring(L, 3, &length);
+
+    float width, height;
+    text_measure(font, size, string, length, &width, &height);
+
+    lua_pushnumber(L, width);
+    lua_pushnumber(L, height);
+
+    return 2;
+}
+
+static void set_count(lua_State *L, const char *name, uint64_t value) {
+    lua_pushnumber(L, (lua_Number)value);
+    lua_setfield(L, -2, name);
+}
+
+// Cache counters since the context was made, plus what's in it now
+int text_lua_Stats(lua_State *L) {
+    struct text_context *context = check_context(L, 1);
+    const struct text_stats *stats = &context->stats;
+
+    size_t glyphs = 0;
+    for (int i = 0; i < context->shelf_count; i++) {
+        for (int j = 0; j < context->shelves[i].cell_count; j++) {
+            glyphs += context->shelves[i].cells[j].font != NULL;
+        }
+    }
+
+    lua_createtable(L, 0, 10);
+    set_count(L, "glyph_hits", stats->glyph_hits);
+    set_count(L, "glyph_misses", stats->glyph_misses);
+    set_count(L, "glyph_evictions", stats->glyph_evictions);
+    set_count(L, "glyph_failures", stats->glyph_failures);
+    set_count(L, "run_hits", stats->run_hits);
+    set_count(L, "run_misses", stats->run_misses);
+    set_count(L, "run_evictions", stats->run_evictions);
+    set_count(L, "glyphs", glyphs);
+    set_count(L, "runs", context->run_count);
+    set_count(L, "shelves", context->shelf_count);
+
+    return 1;
+}
+
+void text_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateTextContext);
+    REGISTER_FUNC(DeleteTextContext);
+    REGISTER_FUNC(SetTextProgram);
+    REGISTER_FUNC(DrawText);
+
+    lua_register(L, "text_LoadFont", text_lua_LoadFont);
+    lua_register(L, "text_FontMetrics", text_lua_FontMetrics);
+    lua_register(L, "text_Measure", text_lua_Measure);
+    lua_register(L, "text_Stats", text_lua_Stats);
+}
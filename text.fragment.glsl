@@ -0,0 +1,22 @@
+#version 330
+
+in vec2 uv;
+
+uniform sampler2D atlas;
+uniform vec4 color;
+
+out vec4 out_color;
+
+void main() {
+    float value = texture(atlas, uv).r;
+
+#ifdef SDF
+    // The edge is at 0.5. Antialias over about a pixel on screen.
+    float width = fwidth(value);
+    float alpha = smoothstep(0.5 - width, 0.5 + width, value);
+#else
+    float alpha = value;
+#endif
+
+    out_color = vec4(color.rgb, color.a * alpha);
+}
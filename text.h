@@ -0,0 +1,151 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include "lua.h"
+#include "draw.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Distance in atlas texels covered by the ramp of a signed distance field
+// glyph, on each side of the edge
+#define TEXT_SDF_SPREAD 4
+
+// Laid out strings kept at once. The least recently drawn one goes first.
+#define TEXT_MAX_RUNS 512
+
+// A glyph as it comes from the font file: one bit per pixel, rows padded to
+// whole bytes, top row first. Offsets and advance are in font pixels, with y
+// up from the baseline like BDF.
+struct text_glyph {
+    uint32_t codepoint;
+    int16_t width, height;
+    int16_t x_offset, y_offset;
+    int16_t advance;
+    uint32_t bits;
+
+    // Atlas cell holding the glyph, shelf << 16 | cell, or -1
+    int32_t cell;
+};
+
+struct text_context;
+
+// A bitmap font loaded from a BDF file. Glyphs are sorted by codepoint.
+struct text_font {
+    struct text_context *context;
+    struct text_font *next;
+
+    struct text_glyph *glyphs;
+    size_t glyph_count;
+    uint8_t *bits;
+
+    int pixel_size;
+    int ascent, descent;
+    // Drawn for codepoints the font doesn't have, or -1
+    int32_t fallback;
+};
+
+// A fixed size slot in the atlas, and the glyph in it
+struct text_cell {
+    struct text_font *font;
+    int32_t glyph;
+    // Cached runs using the glyph. Only unpinned glyphs can be evicted, so a
+    // run's vertices never point at a cell that has been reused.
+    uint32_t pins;
+    uint64_t last_used;
+};
+
+// A row of the atlas split into cells of one size. Glyphs get the first
+// shelf with a free cell of their size, rounded up to a multiple of four.
+struct text_shelf {
+    int y;
+    int height;
+    int cell_width;
+    int cell_height;
+    int cell_count;
+    struct text_cell *cells;
+};
+
+// A string laid out in one font and size, in its own vertex buffer: two
+// triangles per glyph with positions relative to the top left of the run.
+struct text_run {
+    uint64_t hash;
+    char *string;
+    size_t length;
+    const struct text_font *font;
+    float size;
+
+    GLuint vertex_array;
+    GLuint buffer;
+    GLsizei vertex_count;
+    float width, height;
+
+    // Cells pinned by the run
+    int32_t *cells;
+    size_t cell_count;
+
+    uint64_t last_used;
+};
+
+struct text_stats {
+    uint64_t glyph_hits;
+    uint64_t glyph_misses;
+    uint64_t glyph_evictions;
+    // Glyphs left out because every cell was pinned
+    uint64_t glyph_failures;
+    uint64_t run_hits;
+    uint64_t run_misses;
+    uint64_t run_evictions;
+};
+
+// One glyph atlas texture, the fonts that draw from it, and the cache of
+// laid out runs. Drawing a run that's already cached costs a hash lookup
+// and a draw call.
+struct text_context {
+    GLuint texture;
+    int size;
+    // Glyphs are stored as distance fields and sampled linearly
+    int sdf;
+    struct memory_stats *memory;
+    // Lua's bindings, put back after uploads and draws
+    struct handle_table *handles;
+
+    struct text_shelf *shelves;
+    int shelf_count;
+    int max_shelves;
+
+    struct text_font *fonts;
+
+    struct text_run *runs[TEXT_MAX_RUNS];
+    size_t run_count;
+    // Open addressing table of run indices plus one, zero for empty
+    uint32_t run_table[TEXT_MAX_RUNS * 2];
+
+    // Uniforms of the program runs are drawn with
+    GLint offset_location;
+    GLint color_location;
+
+    uint64_t tick;
+    struct text_stats stats;
+};
+
+// Returns NULL on error, having printed why
+struct text_context *text_context_create(int, int, struct memory_stats *,
+                                         struct handle_table *);
+void text_context_destroy(struct text_context *);
+
+// Loads a BDF font for drawing with the context. The context owns it.
+// Returns NULL on error, having printed why.
+struct text_font *text_font_load(struct text_context *, const char *);
+
+// Returns the run for the string, laying it out and uploading it if it
+// isn't cached. Returns NULL on allocation failure.
+struct text_run *text_get_run(struct text_context *, const struct text_font *,
+                              float, const char *, size_t);
+// Size of the string laid out in the font without touching the atlas
+void text_measure(const struct text_font *, float, const char *, size_t,
+                  float *, float *);
+
+void text_register(lua_State *, struct draw_data *);
+
+#endif
@@ -0,0 +1,83 @@
+-- Text drawn from a glyph atlas. Strings are laid out once and cached, so
+-- drawing the same string again in the same font and size only costs a
+-- draw call. Fonts are BDF files; with sdf set the atlas holds distance
+-- fields made from their bitmaps, which stay smooth when scaled up.
+local gl = require 'gl'
+
+local M = {}
+
+-- Text functions exposed from C
+local copy_funcs = {
+  LoadFont="load_font",
+  FontMetrics="font_metrics",
+  Measure="measure",
+  Stats="stats",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["text_" .. c_name]
+end
+
+-- Drawing functions, which need the GL context
+local copy_draw_funcs = {
+  CreateTextContext="create_context",
+  DeleteTextContext="delete_context",
+  SetTextProgram="set_program",
+  DrawText="draw",
+}
+
+for c_name, lua_name in pairs(copy_draw_funcs) do
+  M[lua_name] = _G["draw_" .. c_name]
+end
+
+-- A context with an atlas of the given size and the program to draw it
+-- with. Draw between begin and finish.
+function M.create_renderer(atlas_size, sdf)
+  local defines = {}
+  if sdf then
+    defines.SDF = "1"
+  end
+
+  local renderer = {
+    context = M.create_context(atlas_size, sdf),
+    program = gl.create_program({
+      {gl.VERTEX_SHADER, "text.vertex.glsl"},
+      {gl.FRAGMENT_SHADER, "text.fragment.glsl", defines},
+    }),
+  }
+  renderer.projection = gl.get_uniform_location(renderer.program,
+                                                "projection")
+  M.set_program(renderer.context, renderer.program)
+
+  return renderer
+end
+
+function M.delete_renderer(renderer)
+  M.delete_context(renderer.context)
+  gl.delete_program(renderer.program)
+end
+
+-- Sets up alpha blending and a projection in pixels, with y down from the
+-- top left of a width by height viewport
+function M.begin(renderer, width, height)
+  gl.use_program(renderer.program)
+  gl.uniform_matrix_float(renderer.projection, 4, 4, {
+    2 / width, 0, 0, 0,
+    0, -2 / height, 0, 0,
+    0, 0, -1, 0,
+    -1, 1, 0, 1,
+  })
+
+  gl.disable(gl.DEPTH_TEST)
+  gl.enable(gl.BLEND)
+  gl.blend_func(gl.SRC_ALPHA, gl.ONE_MINUS_SRC_ALPHA)
+end
+
+-- Turns depth testing back on, as the rest of the frame expects
+function M.finish()
+  gl.disable(gl.BLEND)
+  gl.enable(gl.DEPTH_TEST)
+  gl.use_program(nil)
+end
+
+return M
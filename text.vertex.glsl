@@ -0,0 +1,15 @@
+#version 330
+
+layout(location = 0) in vec2 position;
+layout(location = 1) in vec2 texture_coordinate;
+
+uniform mat4 projection;
+// Top left corner of the text, in pixels
+uniform vec2 offset;
+
+out vec2 uv;
+
+void main() {
+    gl_Position = projection * vec4(position + offset, 0.0, 1.0);
+    uv = texture_coordinate;
+}
@@ -0,0 +1,469 @@
+#include "transform.h"
+
+#include "draw_interface.h"
+#include "mat4.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GROW(array, capacity) \
+    grow_array((void **)&(array), sizeof(*(array)), (capacity))
+
+static int grow_array(void **array, size_t size, size_t capacity) {
+    void *grown = realloc(*array, size * capacity);
+    if (!grown) {
+        return 1;
+    }
+
+    *array = grown;
+    return 0;
+}
+
+static int reserve(struct transform_store *store, size_t capacity) {
+    if (capacity <= store->capacity) {
+        return 0;
+    }
+
+    if (GROW(store->parent, capacity) ||
+        GROW(store->first_child, capacity) ||
+        GROW(store->next_sibling, capacity) ||
+        GROW(store->depth, capacity) ||
+        GROW(store->translation, capacity * 3) ||
+        GROW(store->rotation, capacity * 4) ||
+        GROW(store->scale, capacity * 3) ||
+        GROW(store->world, capacity * 16) ||
+        GROW(store->order, capacity) ||
+        GROW(store->position, capacity) ||
+        GROW(store->dirty, capacity) ||
+        GROW(store->dirty_list, capacity) ||
+        GROW(store->dirty_keys, capacity)) {
+        return 1;
+    }
+
+    store->capacity = capacity;
+
+    return 0;
+}
+
+struct transform_store *transform_store_create(size_t capacity) {
+    struct transform_store *store = calloc(1, sizeof(*store));
+    if (!store) {
+        return NULL;
+    }
+
+    if (reserve(store, capacity > 0 ? capacity : 64) != 0) {
+        transform_store_destroy(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+void transform_store_destroy(struct transform_store *store) {
+    free(store->parent);
+    free(store->first_child);
+    free(store->next_sibling);
+    free(store->depth);
+    free(store->translation);
+    free(store->rotation);
+    free(store->scale);
+    free(store->world);
+    free(store->order);
+    free(store->position);
+    free(store->dirty);
+    free(store->dirty_list);
+    free(store->dirty_keys);
+
+    free(store);
+}
+
+static void mark_dirty(struct transform_store *store, int32_t node) {
+    if (!store->dirty[node]) {
+        store->dirty[node] = 1;
+        store->dirty_list[store->dirty_count++] = node;
+    }
+}
+
+static void link_child(struct transform_store *store, int32_t node,
+                       int32_t parent) {
+    store->parent[node] = parent;
+    store->next_sibling[node] = -1;
+    store->depth[node] = 0;
+
+    if (parent >= 0) {
+        store->next_sibling[node] = store->first_child[parent];
+        store->first_child[parent] = node;
+        store->depth[node] = store->depth[parent] + 1;
+    }
+}
+
+int32_t transform_create_node(struct transform_store *store, int32_t parent) {
+    if (store->count == store->capacity &&
+        reserve(store, store->capacity * 2) != 0) {
+        return -1;
+    }
+
+    int32_t node = store->count++;
+
+    store->first_child[node] = -1;
+    link_child(store, node, parent);
+
+    memset(&store->translation[node * 3], 0x0, 3 * sizeof(float));
+    memset(&store->rotation[node * 4], 0x0, 3 * sizeof(float));
+    store->rotation[node * 4 + 3] = 1.0f;
+    for (int i = 0; i < 3; i++) {
+        store->scale[node * 3 + i] = 1.0f;
+    }
+
+    // A new node's parent already exists, so it can go on the end of the
+    // order without breaking the sort
+    store->order[node] = node;
+    store->position[node] = node;
+
+    store->dirty[node] = 0;
+    mark_dirty(store, node);
+
+    return node;
+}
+
+static void update_depths(struct transform_store *store, int32_t node) {
+    for (int32_t child = store->first_child[node]; child >= 0;
+         child = store->next_sibling[child]) {
+        store->depth[child] = store->depth[node] + 1;
+        update_depths(store, child);
+    }
+}
+
+int transform_set_parent(struct transform_store *store, int32_t node,
+                         int32_t parent) {
+    for (int32_t ancestor = parent; ancestor >= 0;
+         ancestor = store->parent[ancestor]) {
+        if (ancestor == node) {
+            return 1;
+        }
+    }
+
+    int32_t old_parent = store->parent[node];
+    if (old_parent == parent) {
+        return 0;
+    }
+
+    if (old_parent >= 0) {
+        int32_t *link = &store->first_child[old_parent];
+        while (*link != node) {
+            link = &store->next_sibling[*link];
+        }
+        *link = store->next_sibling[node];
+    }
+
+    link_child(store, node, parent);
+    update_depths(store, node);
+
+    store->order_dirty = 1;
+    mark_dirty(store, node);
+
+    return 0;
+}
+
+void transform_set_translation(struct transform_store *store, int32_t node,
+                               float x, float y, float z) {
+    float *t = &store->translation[node * 3];
+    t[0] = x;
+    t[1] = y;
+    t[2] = z;
+
+    mark_dirty(store, node);
+}
+
+void transform_set_rotation(struct transform_store *store, int32_t node,
+                            float x, float y, float z, float angle) {
+    float s = sinf(angle / 2.0f);
+
+    float *q = &store->rotation[node * 4];
+    q[0] = x * s;
+    q[1] = y * s;
+    q[2] = z * s;
+    q[3] = cosf(angle / 2.0f);
+
+    mark_dirty(store, node);
+}
+
+void transform_set_scale(struct transform_store *store, int32_t node,
+                         float x, float y, float z) {
+    float *s = &store->scale[node * 3];
+    s[0] = x;
+    s[1] = y;
+    s[2] = z;
+
+    mark_dirty(store, node);
+}
+
+// Counting sort of the nodes by depth. Only needed after reparenting.
+static int sort_order(struct transform_store *store) {
+    uint32_t max_depth = 0;
+    for (size_t i = 0; i < store->count; i++) {
+        if (store->depth[i] > max_depth) {
+            max_depth = store->depth[i];
+        }
+    }
+
+    size_t *starts = calloc(max_depth + 2, sizeof(*starts));
+    if (!starts) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < store->count; i++) {
+        starts[store->depth[i] + 1]++;
+    }
+    for (uint32_t d = 0; d <= max_depth; d++) {
+        starts[d + 1] += starts[d];
+    }
+
+    for (size_t i = 0; i < store->count; i++) {
+        size_t position = starts[store->depth[i]]++;
+        store->order[position] = i;
+        store->position[i] = position;
+    }
+
+    free(starts);
+
+    store->order_dirty = 0;
+
+    return 0;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int transform_update(struct transform_store *store) {
+    // The order is left dirty, so the next update tries again
+    if (store->order_dirty && sort_order(store)) {
+        return 1;
+    }
+
+    // Pull in the descendants of everything that changed. dirty_count grows
+    // as we go, so each subtree is walked once.
+    for (size_t i = 0; i < store->dirty_count; i++) {
+        int32_t node = store->dirty_list[i];
+        for (int32_t child = store->first_child[node]; child >= 0;
+             child = store->next_sibling[child]) {
+            mark_dirty(store, child);
+        }
+    }
+
+    // Parents before children. When most of the scene moved it's cheaper
+    // to walk the whole order than to sort the dirty nodes.
+    size_t dirty_count = store->dirty_count;
+    if (dirty_count * 8 > store->count) {
+        dirty_count = 0;
+        for (size_t i = 0; i < store->count; i++) {
+            int32_t node = store->order[i];
+            if (store->dirty[node]) {
+                store->dirty_keys[dirty_count++] = (uint32_t)node;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < dirty_count; i++) {
+            int32_t node = store->dirty_list[i];
+            store->dirty_keys[i] = (uint64_t)store->position[node] << 32 |
+                                   (uint32_t)node;
+        }
+        qsort(store->dirty_keys, dirty_count, sizeof(*store->dirty_keys),
+              compare_keys);
+    }
+
+    for (size_t i = 0; i < dirty_count; i++) {
+        int32_t node = (int32_t)(uint32_t)store->dirty_keys[i];
+        float *world = &store->world[node * 16];
+
+        mat4_from_trs(world, &store->translation[node * 3],
+                      &store->rotation[node * 4], &store->scale[node * 3]);
+
+        int32_t parent = store->parent[node];
+        if (parent >= 0) {
+            mat4_multiply(world, &store->world[parent * 16], world);
+        }
+
+        store->dirty[node] = 0;
+    }
+
+    store->last_updated = store->dirty_count;
+    store->dirty_count = 0;
+
+    return 0;
+}
+
+static struct transform_store *check_store(lua_State *L, int index) {
+    struct transform_store *store = lua_touserdata(L, index);
+    if (!store) {
+        luaL_error(L, "Expected a transform store");
+    }
+
+    return store;
+}
+
+static int32_t check_node(lua_State *L, struct transform_store *store,
+                          int index) {
+    lua_Integer node = luaL_checkinteger(L, index);
+    if (node < 0 || (size_t)node >= store->count) {
+        return luaL_error(L, "Bad transform node %d", (int)node);
+    }
+
+    return node;
+}
+
+int transform_lua_CreateStore(lua_State *L) {
+    struct transform_store *store =
+        transform_store_create(luaL_optinteger(L, 1, 64));
+    if (!store) {
+        return luaL_error(L, "Error creating transform store");
+    }
+
+    lua_pushlightuserdata(L, store);
+
+    return 1;
+}
+
+int transform_lua_DeleteStore(lua_State *L) {
+    transform_store_destroy(check_store(L, 1));
+
+    return 0;
+}
+
+// store, parent or nil
+int transform_lua_CreateNode(lua_State *L) {
+    struct transform_store *store = check_store(L, 1);
+    int32_t parent = lua_isnoneornil(L, 2) ? -1 : check_node(L, store, 2);
+
+    int32_t node = transform_create_node(store, parent);
+    if (node < 0) {
+        return luaL_error(L, "Error creating transform node");
+    }
+
+    lua_pushinteger(L, node);
+
+    return 1;
+}
+
+int transform_lua_SetParent(lua_State *L) {
+    struct transform_store *store = check_store(L, 1);
+    int32_t node = check_node(L, store, 2);
+    int32_t parent = lua_isnoneornil(L, 3) ? -1 : check_node(L, store, 3);
+
+    if (transform_set_parent(store, node, parent) != 0) {
+        return luaL_error(L, "Transform node %d can't be its own ancestor",
+                          (int)node);
+    }
+
+    return 0;
+}
+
+int transform_lua_SetTranslation(lua_State *L) {
+    struct transform_store *store = check_store(L, 1);
+    int32_t node = check_node(L, store, 2);
+
+    transform_set_translation(store, node, luaL_checknumber(L, 3),
+                              luaL_checknumber(L, 4), luaL_checknumber(L, 5));
+
+    return 0;
+}
+
+// store, node, axis x, y, z, angle
+int transform_lua_SetRotation(lua_State *L) {
+    struct transform_store *store = check_store(L, 1);
+    int32_t node = check_node(L, store, 2);
+
+    transform_set_rotation(store, node, luaL_checknumber(L, 3),
+                           luaL_checknumber(L, 4), luaL_checknumber(L, 5),
+                           luaL_checknumber(L, 6));
+
+    return 0;
+}
+
+int transform_lua_SetScale(lua_State *L) {
+    struct transform_store *store = check_store(L, 1);
+    int32_t node = check_node(L, store, 2);
+
+    transform_set_scale(store, node, luaL_checknumber(L, 3),
+                        luaL_checknumber(L, 4), luaL_checknumber(L, 5));
+
+    return 0;
+}
+
+int transform_lua_Update(lua_State *L) {
+    struct transform_store *store = check_store(L, 1);
+    if (transform_update(store)) {
+        return luaL_error(L, "Error updating transforms");
+    }
+
+    lua_pushinteger(L, store->last_updated);
+
+    return 1;
+}
+
+// World matrix as a table of 16 numbers, column-major
+int transform_lua_World(lua_State *L) {
+    struct transform_store *store = check_store(L, 1);
+    const float *world = transform_world(store, check_node(L, store, 2));
+
+    lua_createtable(L, 16, 0);
+    for (int i = 0; i < 16; i++) {
+        lua_pushnumber(L, world[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+// location, store, node
+int draw_lua_TransformUniform(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    GLint location = get_userdata_arg(L);
+    struct transform_store *store = check_store(L, 1);
+    int32_t node = check_node(L, store, 2);
+
+    glUniformMatrix4fv(location, 1, GL_FALSE, transform_world(store, node));
+
+    return 0;
+}
+
+// target, offset, store, first node, count. Copies the world matrices of a
+// range of nodes into the bound buffer, e.g. for instancing.
+int draw_lua_BufferTransforms(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    GLenum target = get_integer_arg(L);
+    GLintptr offset = get_integer_arg(L);
+    struct transform_store *store = check_store(L, 1);
+    int32_t first = check_node(L, store, 2);
+    lua_Integer count = luaL_optinteger(L, 3, store->count - first);
+
+    if (count < 0 || (size_t)(first + count) > store->count) {
+        return luaL_error(L, "Transform range out of bounds");
+    }
+
+    glBufferSubData(target, offset, count * 16 * sizeof(float),
+                    transform_world(store, first));
+
+    return 0;
+}
+
+void transform_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(TransformUniform);
+    REGISTER_FUNC(BufferTransforms);
+
+    lua_register(L, "transform_CreateStore", transform_lua_CreateStore);
+    lua_register(L, "transform_DeleteStore", transform_lua_DeleteStore);
+    lua_register(L, "transform_CreateNode", transform_lua_CreateNode);
+    lua_register(L, "transform_SetParent", transform_lua_SetParent);
+    lua_register(L, "transform_SetTranslation", transform_lua_SetTranslation);
+    lua_register(L, "transform_SetRotation", transform_lua_SetRotation);
+    lua_register(L, "transform_SetScale", transform_lua_SetScale);
+    lua_register(L, "transform_Update", transform_lua_Update);
+    lua_register(L, "transform_World", transform_lua_World);
+}
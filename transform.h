@@ -0,0 +1,74 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "lua.h"
+#include "draw.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Scene graph transforms, stored as parallel arrays indexed by node. Nodes
+// are kept in an order sorted by depth, so parents are always updated
+// before their children. Only nodes whose local transform changed, and
+// their descendants, get their world matrix recomputed.
+struct transform_store {
+    size_t count;
+    size_t capacity;
+
+    // -1 for roots
+    int32_t *parent;
+    int32_t *first_child;
+    int32_t *next_sibling;
+    uint32_t *depth;
+
+    // Local transform: translation, unit quaternion (x, y, z, w), scale
+    float *translation;
+    float *rotation;
+    float *scale;
+
+    // 16 floats per node, column-major, so ranges of nodes can be copied
+    // straight into uniform or instance buffers
+    float *world;
+
+    // Nodes sorted by depth, and each node's position in that order
+    int32_t *order;
+    uint32_t *position;
+    int order_dirty;
+
+    uint8_t *dirty;
+    int32_t *dirty_list;
+    size_t dirty_count;
+    uint64_t *dirty_keys;
+
+    // Nodes recomputed by the last update
+    size_t last_updated;
+};
+
+struct transform_store *transform_store_create(size_t);
+void transform_store_destroy(struct transform_store *);
+
+// Returns the new node, or -1 on allocation failure
+int32_t transform_create_node(struct transform_store *, int32_t);
+// Returns 1 if the new parent would make a cycle
+int transform_set_parent(struct transform_store *, int32_t, int32_t);
+
+void transform_set_translation(struct transform_store *, int32_t, float,
+                               float, float);
+// Rotation around the (normalized) axis x, y, z by angle radians
+void transform_set_rotation(struct transform_store *, int32_t, float, float,
+                            float, float);
+void transform_set_scale(struct transform_store *, int32_t, float, float,
+                         float);
+
+// Recomputes the world matrices of changed subtrees, counting them in
+// last_updated. Returns 1 if there wasn't memory to order the nodes.
+int transform_update(struct transform_store *);
+
+static inline const float *transform_world(const struct transform_store *store,
+                                           int32_t node) {
+    return store->world + (size_t)node * 16;
+}
+
+void transform_register(lua_State *, struct draw_data *);
+
+#endif
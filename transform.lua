@@ -0,0 +1,20 @@
+local M = {}
+
+-- Transform hierarchy functions exposed from C
+local copy_funcs = {
+  CreateStore="create_store",
+  DeleteStore="delete_store",
+  CreateNode="create_node",
+  SetParent="set_parent",
+  SetTranslation="set_translation",
+  SetRotation="set_rotation",
+  SetScale="set_scale",
+  Update="update",
+  World="world",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["transform_" .. c_name]
+end
+
+return M
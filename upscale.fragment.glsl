@@ -0,0 +1,39 @@
+#version 330
+
+in vec2 uv;
+
+uniform sampler2D source;
+uniform vec2 source_scale;
+uniform vec2 texel_size;
+// 0 for plain bilinear, up to 1
+uniform float sharpness;
+
+out vec4 out_color;
+
+vec3 fetch(vec2 offset) {
+    // Stay inside the part of the texture drawn this frame
+    vec2 limit = source_scale - texel_size * 0.5;
+    return texture(source, clamp(uv + offset * texel_size,
+                                 texel_size * 0.5, limit)).rgb;
+}
+
+// Contrast adaptive sharpening over the cross of neighbours: the negative
+// lobe is weaker where the neighbourhood already has strong contrast, so
+// edges sharpen without ringing
+void main() {
+    vec3 center = fetch(vec2(0.0, 0.0));
+    vec3 up = fetch(vec2(0.0, 1.0));
+    vec3 down = fetch(vec2(0.0, -1.0));
+    vec3 left = fetch(vec2(-1.0, 0.0));
+    vec3 right = fetch(vec2(1.0, 0.0));
+
+    vec3 low = min(center, min(min(up, down), min(left, right)));
+    vec3 high = max(center, max(max(up, down), max(left, right)));
+
+    vec3 amount = sqrt(clamp(min(low, 1.0 - high) / max(high, 1e-4), 0.0, 1.0));
+    vec3 lobe = -amount * 0.2 * sharpness;
+
+    vec3 color = (center + (up + down + left + right) * lobe) /
+                 (1.0 + 4.0 * lobe);
+    out_color = vec4(clamp(color, 0.0, 1.0), 1.0);
+}
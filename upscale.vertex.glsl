@@ -0,0 +1,13 @@
+#version 330
+
+// Part of the source texture holding the frame
+uniform vec2 source_scale;
+
+out vec2 uv;
+
+// One triangle covering the screen, from the vertex index alone
+void main() {
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+    uv = corner * source_scale;
+}
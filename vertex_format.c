@@ -0,0 +1,417 @@
+#include "vertex_format.h"
+
+#include "draw_interface.h"
+#include "log.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+static size_t type_size(GLenum type, GLint components) {
+    switch (type) {
+        case GL_FLOAT:
+            return 4 * components;
+        case GL_HALF_FLOAT:
+        case GL_SHORT:
+        case GL_UNSIGNED_SHORT:
+            return 2 * components;
+        case GL_BYTE:
+        case GL_UNSIGNED_BYTE:
+            return components;
+        case GL_INT_2_10_10_10_REV:
+        case GL_UNSIGNED_INT_2_10_10_10_REV:
+            return components == 4 ? 4 : 0;
+        default:
+            return 0;
+    }
+}
+
+void vertex_layout_init(struct vertex_layout *layout) {
+    memset(layout, 0x0, sizeof(*layout));
+}
+
+int vertex_layout_add(struct vertex_layout *layout, GLuint location,
+                      GLint components, GLenum type, GLboolean normalized) {
+    if (layout->count == VERTEX_MAX_ATTRIBUTES ||
+        components < 1 || components > 4) {
+        return 1;
+    }
+
+    size_t size = type_size(type, components);
+    if (size == 0) {
+        return 1;
+    }
+
+    struct vertex_attribute *attribute = &layout->attributes[layout->count++];
+
+    attribute->location = location;
+    attribute->components = components;
+    attribute->type = type;
+    attribute->normalized = normalized;
+    attribute->offset = layout->stride;
+
+    // Keep every attribute 4-byte aligned
+    layout->stride += (size + 3) & ~(size_t)3;
+
+    return 0;
+}
+
+void vertex_layout_setup(const struct vertex_layout *layout, GLintptr base) {
+    for (int i = 0; i < layout->count; i++) {
+        const struct vertex_attribute *attribute = &layout->attributes[i];
+
+        glEnableVertexAttribArray(attribute->location);
+        glVertexAttribPointer(attribute->location, attribute->components,
+                              attribute->type, attribute->normalized,
+                              layout->stride,
+                              (const GLvoid *)(base + attribute->offset));
+    }
+}
+
+/***** CONVERSION KERNELS *****/
+
+static uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mantissa = x & 0x7fffff;
+    int exponent = (x >> 23) & 0xff;
+
+    // Infinity and NaN
+    if (exponent == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+
+    exponent = exponent - 127 + 15;
+
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+
+    uint32_t half, remainder, halfway;
+
+    if (exponent <= 0) {
+        // Subnormal halves, or too small and flushed to zero
+        if (exponent < -10) {
+            return sign;
+        }
+
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+
+        half = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        half = (exponent << 10) | (mantissa >> 13);
+        remainder = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    // Round to nearest even. A carry out of the mantissa correctly bumps the
+    // exponent.
+    if (remainder > halfway || (remainder == halfway && (half & 1))) {
+        half++;
+    }
+
+    return sign | half;
+}
+
+static double clamp(double value, double min, double max) {
+    return value < min ? min : (value > max ? max : value);
+}
+
+// Normalized values are scaled to the integer range; unnormalized ones are
+// just rounded. Either way they're clamped to what fits.
+static long to_integer(double value, GLboolean normalized, long min, long max) {
+    if (normalized) {
+        value = clamp(value, min < 0 ? -1.0 : 0.0, 1.0) * max;
+    }
+    return (long)lrint(clamp(value, min, max));
+}
+
+static void convert_scalar(const struct vertex_attribute *attribute,
+                           const double *src, char *dest) {
+    GLint components = attribute->components;
+    GLboolean normalized = attribute->normalized;
+
+    switch (attribute->type) {
+        case GL_FLOAT: {
+            float values[4];
+            for (int i = 0; i < components; i++) {
+                values[i] = src[i];
+            }
+            memcpy(dest, values, components * sizeof(*values));
+            break;
+        }
+
+        case GL_HALF_FLOAT: {
+            uint16_t values[4];
+            for (int i = 0; i < components; i++) {
+                values[i] = float_to_half(src[i]);
+            }
+            memcpy(dest, values, components * sizeof(*values));
+            break;
+        }
+
+        case GL_BYTE:
+            for (int i = 0; i < components; i++) {
+                ((int8_t *)dest)[i] = to_integer(src[i], normalized, INT8_MIN, INT8_MAX);
+            }
+            break;
+
+        case GL_UNSIGNED_BYTE:
+            for (int i = 0; i < components; i++) {
+                ((uint8_t *)dest)[i] = to_integer(src[i], normalized, 0, UINT8_MAX);
+            }
+            break;
+
+        case GL_SHORT: {
+            int16_t values[4];
+            for (int i = 0; i < components; i++) {
+                values[i] = to_integer(src[i], normalized, INT16_MIN, INT16_MAX);
+            }
+            memcpy(dest, values, components * sizeof(*values));
+            break;
+        }
+
+        case GL_UNSIGNED_SHORT: {
+            uint16_t values[4];
+            for (int i = 0; i < components; i++) {
+                values[i] = to_integer(src[i], normalized, 0, UINT16_MAX);
+            }
+            memcpy(dest, values, components * sizeof(*values));
+            break;
+        }
+
+        case GL_INT_2_10_10_10_REV: {
+            uint32_t packed =
+                ((uint32_t)to_integer(src[0], normalized, -512, 511) & 0x3ff) |
+                ((uint32_t)to_integer(src[1], normalized, -512, 511) & 0x3ff) << 10 |
+                ((uint32_t)to_integer(src[2], normalized, -512, 511) & 0x3ff) << 20 |
+                ((uint32_t)to_integer(src[3], normalized, -2, 1) & 0x3) << 30;
+            memcpy(dest, &packed, sizeof(packed));
+            break;
+        }
+
+        case GL_UNSIGNED_INT_2_10_10_10_REV: {
+            uint32_t packed =
+                (uint32_t)to_integer(src[0], normalized, 0, 1023) |
+                (uint32_t)to_integer(src[1], normalized, 0, 1023) << 10 |
+                (uint32_t)to_integer(src[2], normalized, 0, 1023) << 20 |
+                (uint32_t)to_integer(src[3], normalized, 0, 3) << 30;
+            memcpy(dest, &packed, sizeof(packed));
+            break;
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Four component attributes are the common case (positions and colors), and
+// one vertex fits in a register, so they get SSE2 versions.
+static int convert_simd4(const struct vertex_attribute *attribute, size_t stride,
+                         const double *src, size_t count, char *dest) {
+    if (attribute->components != 4) {
+        return 0;
+    }
+
+    if (attribute->type == GL_FLOAT) {
+        for (size_t i = 0; i < count; i++) {
+            __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i * 4));
+            __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i * 4 + 2));
+            _mm_storeu_ps((float *)(dest + i * stride), _mm_movelh_ps(lo, hi));
+        }
+        return 1;
+    }
+
+#if defined(__F16C__)
+    if (attribute->type == GL_HALF_FLOAT) {
+        for (size_t i = 0; i < count; i++) {
+            __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i * 4));
+            __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i * 4 + 2));
+            __m128i half = _mm_cvtps_ph(_mm_movelh_ps(lo, hi), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storel_epi64((__m128i *)(dest + i * stride), half);
+        }
+        return 1;
+    }
+#endif
+
+    if (attribute->type == GL_UNSIGNED_BYTE && attribute->normalized) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 scale = _mm_set1_ps(255.0f);
+
+        for (size_t i = 0; i < count; i++) {
+            __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i * 4));
+            __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i * 4 + 2));
+            __m128 v = _mm_min_ps(_mm_max_ps(_mm_movelh_ps(lo, hi), zero), one);
+
+            // Round to nearest, then narrow 32 -> 16 -> 8 bits
+            __m128i ints = _mm_cvtps_epi32(_mm_mul_ps(v, scale));
+            __m128i shorts = _mm_packs_epi32(ints, ints);
+            __m128i bytes = _mm_packus_epi16(shorts, shorts);
+
+            uint32_t packed = (uint32_t)_mm_cvtsi128_si32(bytes);
+            memcpy(dest + i * stride, &packed, sizeof(packed));
+        }
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+void vertex_convert(const struct vertex_attribute *attribute, size_t stride,
+                    const double *src, size_t count, char *dest) {
+    dest += attribute->offset;
+
+#if defined(__SSE2__)
+    if (convert_simd4(attribute, stride, src, count, dest)) {
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        convert_scalar(attribute, src + i * attribute->components,
+                       dest + i * stride);
+    }
+}
+
+/***** LUA INTERFACE *****/
+
+// Takes a list of attributes, each a table of
+//   { location, components, type, normalized }
+// and returns a layout handle.
+int draw_lua_CreateVertexLayout(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct vertex_layout *layout = malloc(sizeof(*layout));
+    vertex_layout_init(layout);
+
+    lua_Integer count = get_lua_len(L, 1);
+    for (lua_Integer i = 1; i <= count; i++) {
+        lua_rawgeti(L, 1, i);
+
+        GLuint location, components, type, normalized;
+        lua_rawgeti(L, -1, 1);
+        location = lua_tointeger(L, -1);
+        lua_rawgeti(L, -2, 2);
+        components = lua_tointeger(L, -1);
+        lua_rawgeti(L, -3, 3);
+        type = lua_tointeger(L, -1);
+        lua_rawgeti(L, -4, 4);
+        // Accept either a lua boolean or gl.TRUE/gl.FALSE
+        normalized = lua_isboolean(L, -1) ?
+            lua_toboolean(L, -1) : lua_tointeger(L, -1) != GL_FALSE;
+        lua_pop(L, 5);
+
+        if (vertex_layout_add(layout, location, components, type, normalized)) {
+            free(layout);
+            return luaL_error(L, "Unsupported vertex attribute %d", (int)i);
+        }
+    }
+
+    lua_pop(L, 1);
+
+    log_debug("Made vertex layout with %d attributes, %zu bytes per vertex",
+           layout->count, layout->stride);
+
+    lua_pushlightuserdata(L, layout);
+
+    return 1;
+}
+
+int draw_lua_DeleteVertexLayout(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct vertex_layout *layout = lua_touserdata(L, 1);
+    free(layout);
+
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+int draw_lua_VertexLayoutStride(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct vertex_layout *layout = lua_touserdata(L, 1);
+    lua_pop(L, 1);
+
+    lua_pushinteger(L, layout->stride);
+
+    return 1;
+}
+
+int draw_lua_SetupVertexLayout(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct vertex_layout *layout = (struct vertex_layout *)get_userdata_arg(L);
+    GLintptr base = luaL_optinteger(L, 1, 0);
+
+    vertex_layout_setup(layout, base);
+
+    return 0;
+}
+
+// target, offset, layout, then one array per attribute. The vertex count
+// comes from the first array. Returns the number of bytes written.
+int draw_lua_BufferVertexData(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    GLenum target = get_integer_arg(L);
+    GLintptr offset = get_integer_arg(L);
+    struct vertex_layout *layout = (struct vertex_layout *)get_userdata_arg(L);
+
+    if (lua_gettop(L) != layout->count) {
+        return luaL_error(L, "Expected %d attribute arrays, got %d",
+                          layout->count, lua_gettop(L));
+    }
+
+    size_t vertex_count = get_lua_len(L, 1) / layout->attributes[0].components;
+
+    char *vertices = malloc(vertex_count * layout->stride);
+    double *values = malloc(vertex_count * 4 * sizeof(*values));
+
+    for (int i = 0; i < layout->count; i++) {
+        const struct vertex_attribute *attribute = &layout->attributes[i];
+        size_t value_count = vertex_count * attribute->components;
+
+        if ((size_t)get_lua_len(L, i + 1) < value_count) {
+            free(vertices);
+            free(values);
+            return luaL_error(L, "Attribute array %d is too short", i + 1);
+        }
+
+        read_into_double_array(L, i + 1, value_count, values);
+        vertex_convert(attribute, layout->stride, values, vertex_count, vertices);
+    }
+
+    size_t size = vertex_count * layout->stride;
+    glBufferSubData(target, offset, size, vertices);
+
+    free(vertices);
+    free(values);
+
+    lua_settop(L, 0);
+    lua_pushinteger(L, size);
+
+    return 1;
+}
+
+void vertex_format_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateVertexLayout);
+    REGISTER_FUNC(DeleteVertexLayout);
+    REGISTER_FUNC(VertexLayoutStride);
+    REGISTER_FUNC(SetupVertexLayout);
+    REGISTER_FUNC(BufferVertexData);
+}
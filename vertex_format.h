@@ -0,0 +1,47 @@
+#ifndef VERTEX_FORMAT_H
+#define VERTEX_FORMAT_H
+
+#include "lua.h"
+#include "draw.h"
+
+#include <stddef.h>
+
+#define VERTEX_MAX_ATTRIBUTES 16
+
+// One attribute in an interleaved vertex. Source data always comes in as
+// doubles (lua numbers) and is converted to `type` when packed.
+struct vertex_attribute {
+    GLuint location;
+    GLint components;
+    // GL_FLOAT, GL_HALF_FLOAT, GL_(UNSIGNED_)BYTE, GL_(UNSIGNED_)SHORT or
+    // GL_(UNSIGNED_)INT_2_10_10_10_REV
+    GLenum type;
+    GLboolean normalized;
+    // Byte offset inside the vertex
+    size_t offset;
+};
+
+struct vertex_layout {
+    struct vertex_attribute attributes[VERTEX_MAX_ATTRIBUTES];
+    int count;
+    // Bytes per vertex, padded to 4 bytes
+    size_t stride;
+};
+
+void vertex_layout_init(struct vertex_layout *);
+// Appends an attribute after the existing ones. Returns 1 if the type or
+// component count isn't supported.
+int vertex_layout_add(struct vertex_layout *, GLuint location, GLint components,
+                      GLenum type, GLboolean normalized);
+// Points the currently bound vertex array's attributes at the currently
+// bound array buffer, starting at `base`.
+void vertex_layout_setup(const struct vertex_layout *, GLintptr base);
+
+// Converts `count` vertices worth of one attribute from tightly packed
+// doubles into the interleaved destination.
+void vertex_convert(const struct vertex_attribute *, size_t stride,
+                    const double *src, size_t count, char *dest);
+
+void vertex_format_register(lua_State *, struct draw_data *);
+
+#endif
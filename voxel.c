@@ -0,0 +1,1330 @@
+#include "voxel.h"
+
+#include "draw_interface.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Free ranges in a page are separated by used ones of at least
+// VOXEL_RANGE_ALIGN vertices, so there can't be more than this many
+#define VOXEL_MAX_FREE_RANGES (VOXEL_PAGE_VERTICES / VOXEL_RANGE_ALIGN / 2 + 1)
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static size_t local_index(int x, int y, int z) {
+    return x + VOXEL_CHUNK_SIZE * (y + VOXEL_CHUNK_SIZE * z);
+}
+
+static size_t padded_index(int x, int y, int z) {
+    return (x + 1) + VOXEL_PADDED_SIZE * ((y + 1) + VOXEL_PADDED_SIZE * (z + 1));
+}
+
+static uint32_t unpack(const uint64_t *data, int bits, size_t index) {
+    size_t bit = index * bits;
+    return (data[bit >> 6] >> (bit & 63)) & (((uint64_t)1 << bits) - 1);
+}
+
+static void pack(uint64_t *data, int bits, size_t index, uint32_t value) {
+    size_t bit = index * bits;
+    uint64_t mask = (((uint64_t)1 << bits) - 1) << (bit & 63);
+    data[bit >> 6] = (data[bit >> 6] & ~mask) |
+                     ((uint64_t)value << (bit & 63));
+}
+
+static size_t chunk_words(int bits) {
+    return (size_t)VOXEL_CHUNK_VOLUME * bits / 64;
+}
+
+// The palette entry, or the block id with 16 bits
+static uint32_t chunk_read(const struct voxel_chunk *chunk, size_t index) {
+    return chunk->bits ? unpack(chunk->data, chunk->bits, index) : 0;
+}
+
+static uint16_t chunk_get(const struct voxel_chunk *chunk, size_t index) {
+    uint32_t value = chunk_read(chunk, index);
+
+    return chunk->bits == 16 ? value : chunk->palette[value];
+}
+
+static struct voxel_chunk *chunk_create(int x, int y, int z) {
+    struct voxel_chunk *chunk = calloc(1, sizeof(*chunk));
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->x = x;
+    chunk->y = y;
+    chunk->z = z;
+    // All air
+    chunk->palette_count = 1;
+    chunk->page = -1;
+
+    return chunk;
+}
+
+// Makes every block the same, dropping the chunk's data
+static void chunk_fill(struct voxel_chunk *chunk, uint16_t block) {
+    free(chunk->data);
+    chunk->data = NULL;
+    chunk->bits = 0;
+    chunk->palette[0] = block;
+    chunk->palette_count = 1;
+    chunk->solid = block ? VOXEL_CHUNK_VOLUME : 0;
+}
+
+// Stores the blocks with more bits to an entry. Going to 16 bits replaces
+// the palette entries with the blocks themselves. Returns 1 out of memory.
+static int chunk_repack(struct voxel_chunk *chunk, int bits) {
+    uint64_t *data = calloc(chunk_words(bits), sizeof(*data));
+    if (!data) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < VOXEL_CHUNK_VOLUME; i++) {
+        uint32_t value = chunk_read(chunk, i);
+        pack(data, bits, i, bits == 16 ? chunk->palette[value] : value);
+    }
+
+    free(chunk->data);
+    chunk->data = data;
+    chunk->bits = bits;
+
+    return 0;
+}
+
+// Drops palette entries no block uses any more. Returns 1 if they're all in
+// use.
+static int chunk_compact(struct voxel_chunk *chunk) {
+    if (chunk->bits == 0) {
+        return 1;
+    }
+
+    uint32_t uses[VOXEL_MAX_PALETTE] = {0};
+    for (size_t i = 0; i < VOXEL_CHUNK_VOLUME; i++) {
+        uses[chunk_read(chunk, i)]++;
+    }
+
+    uint16_t remap[VOXEL_MAX_PALETTE];
+    uint32_t count = 0;
+    for (uint32_t entry = 0; entry < chunk->palette_count; entry++) {
+        if (uses[entry]) {
+            remap[entry] = count;
+            chunk->palette[count++] = chunk->palette[entry];
+        }
+    }
+
+    if (count == chunk->palette_count) {
+        return 1;
+    }
+
+    // Entries only move down, so this can be done in place
+    for (size_t i = 0; i < VOXEL_CHUNK_VOLUME; i++) {
+        pack(chunk->data, chunk->bits, i, remap[chunk_read(chunk, i)]);
+    }
+    chunk->palette_count = count;
+
+    return 0;
+}
+
+// Returns 1 if the block changed, or -1 out of memory
+static int chunk_set(struct voxel_chunk *chunk, size_t index,
+                     uint16_t block) {
+    uint16_t old = chunk_get(chunk, index);
+    if (old == block) {
+        return 0;
+    }
+
+    uint32_t value = block;
+    if (chunk->bits != 16) {
+        for (value = 0; value < chunk->palette_count; value++) {
+            if (chunk->palette[value] == block) {
+                break;
+            }
+        }
+
+        if (value == chunk->palette_count) {
+            if (value == 1u << chunk->bits && chunk_compact(chunk) &&
+                chunk_repack(chunk, chunk->bits ? chunk->bits * 2 : 1)) {
+                return -1;
+            }
+
+            if (chunk->bits == 16) {
+                value = block;
+            } else {
+                value = chunk->palette_count++;
+                chunk->palette[value] = block;
+            }
+        }
+    }
+
+    pack(chunk->data, chunk->bits, index, value);
+    chunk->solid += (block != 0) - (old != 0);
+
+    return 1;
+}
+
+static struct voxel_chunk *chunk_at(const struct voxel_world *world, int x,
+                                    int y, int z) {
+    if (x < 0 || y < 0 || z < 0 || x >= world->size[0] ||
+        y >= world->size[1] || z >= world->size[2]) {
+        return NULL;
+    }
+
+    return world->chunks[x + world->size[0] * (y + world->size[1] * z)];
+}
+
+static int inside(const struct voxel_world *world, int x, int y, int z) {
+    return x >= 0 && y >= 0 && z >= 0 &&
+           x < world->size[0] * VOXEL_CHUNK_SIZE &&
+           y < world->size[1] * VOXEL_CHUNK_SIZE &&
+           z < world->size[2] * VOXEL_CHUNK_SIZE;
+}
+
+static void queue_chunk(struct voxel_world *world,
+                        struct voxel_chunk *chunk) {
+    // A chunk being meshed goes back in the queue when its mesh comes back
+    // out of date
+    if (chunk->queued || chunk->in_flight) {
+        return;
+    }
+
+    size_t index = chunk->x + world->size[0] *
+                   (chunk->y + world->size[1] * chunk->z);
+    world->dirty[(world->dirty_head + world->dirty_count) %
+                 world->chunk_count] = index;
+    world->dirty_count++;
+    chunk->queued = 1;
+}
+
+static void mark_dirty(struct voxel_world *world, int x, int y, int z) {
+    struct voxel_chunk *chunk = chunk_at(world, x, y, z);
+    if (!chunk) {
+        return;
+    }
+
+    chunk->version++;
+    if (!chunk->dirty_ns) {
+        chunk->dirty_ns = now_ns();
+    }
+    queue_chunk(world, chunk);
+}
+
+// Marks the chunk, and the neighbours on each side whose border blocks face
+// the changed box, local coordinates min to max inclusive
+static void mark_box_dirty(struct voxel_world *world,
+                           const struct voxel_chunk *chunk, const int *min,
+                           const int *max) {
+    int x = chunk->x, y = chunk->y, z = chunk->z;
+
+    mark_dirty(world, x, y, z);
+
+    if (min[0] == 0) {
+        mark_dirty(world, x - 1, y, z);
+    }
+    if (max[0] == VOXEL_CHUNK_SIZE - 1) {
+        mark_dirty(world, x + 1, y, z);
+    }
+    if (min[1] == 0) {
+        mark_dirty(world, x, y - 1, z);
+    }
+    if (max[1] == VOXEL_CHUNK_SIZE - 1) {
+        mark_dirty(world, x, y + 1, z);
+    }
+    if (min[2] == 0) {
+        mark_dirty(world, x, y, z - 1);
+    }
+    if (max[2] == VOXEL_CHUNK_SIZE - 1) {
+        mark_dirty(world, x, y, z + 1);
+    }
+}
+
+// Creates the chunk holding the block if it doesn't exist yet
+static struct voxel_chunk *get_chunk(struct voxel_world *world, int x, int y,
+                                     int z) {
+    int cx = x / VOXEL_CHUNK_SIZE;
+    int cy = y / VOXEL_CHUNK_SIZE;
+    int cz = z / VOXEL_CHUNK_SIZE;
+    struct voxel_chunk **chunk =
+        &world->chunks[cx + world->size[0] * (cy + world->size[1] * cz)];
+
+    if (!*chunk) {
+        *chunk = chunk_create(cx, cy, cz);
+    }
+
+    return *chunk;
+}
+
+struct voxel_world *voxel_world_create(const int *size,
+                                       struct memory_stats *memory,
+                                       struct handle_table *handles) {
+    struct voxel_world *world = calloc(1, sizeof(*world));
+    if (!world) {
+        return NULL;
+    }
+
+    memcpy(world->size, size, sizeof(world->size));
+    world->chunk_count = (size_t)size[0] * size[1] * size[2];
+    world->chunks = calloc(world->chunk_count, sizeof(*world->chunks));
+    world->dirty = malloc(world->chunk_count * sizeof(*world->dirty));
+    world->memory = memory;
+    world->handles = handles;
+
+    if (!world->chunks || !world->dirty) {
+        free(world->chunks);
+        free(world->dirty);
+        free(world);
+        return NULL;
+    }
+
+    return world;
+}
+
+uint16_t voxel_get_block(const struct voxel_world *world, int x, int y,
+                         int z) {
+    if (!inside(world, x, y, z)) {
+        return 0;
+    }
+
+    const struct voxel_chunk *chunk =
+        chunk_at(world, x / VOXEL_CHUNK_SIZE, y / VOXEL_CHUNK_SIZE,
+                 z / VOXEL_CHUNK_SIZE);
+    if (!chunk) {
+        return 0;
+    }
+
+    return chunk_get(chunk, local_index(x % VOXEL_CHUNK_SIZE,
+                                        y % VOXEL_CHUNK_SIZE,
+                                        z % VOXEL_CHUNK_SIZE));
+}
+
+int voxel_set_block(struct voxel_world *world, int x, int y, int z,
+                    uint16_t block) {
+    if (!inside(world, x, y, z)) {
+        return 0;
+    }
+
+    // Air doesn't need a chunk made for it
+    if (block == 0 && !chunk_at(world, x / VOXEL_CHUNK_SIZE,
+                                y / VOXEL_CHUNK_SIZE, z / VOXEL_CHUNK_SIZE)) {
+        return 0;
+    }
+
+    struct voxel_chunk *chunk = get_chunk(world, x, y, z);
+    if (!chunk) {
+        return 1;
+    }
+
+    int local[3] = {x % VOXEL_CHUNK_SIZE, y % VOXEL_CHUNK_SIZE,
+                    z % VOXEL_CHUNK_SIZE};
+    int changed = chunk_set(chunk, local_index(local[0], local[1], local[2]),
+                            block);
+    if (changed < 0) {
+        return 1;
+    }
+    if (changed) {
+        mark_box_dirty(world, chunk, local, local);
+    }
+
+    return 0;
+}
+
+int voxel_fill(struct voxel_world *world, const int *min, const int *max,
+               uint16_t block) {
+    int lo[3], hi[3];
+    for (int i = 0; i < 3; i++) {
+        lo[i] = min[i] > 0 ? min[i] : 0;
+        hi[i] = max[i] < world->size[i] * VOXEL_CHUNK_SIZE - 1 ?
+                max[i] : world->size[i] * VOXEL_CHUNK_SIZE - 1;
+        if (lo[i] > hi[i]) {
+            return 0;
+        }
+    }
+
+    for (int cz = lo[2] / VOXEL_CHUNK_SIZE; cz <= hi[2] / VOXEL_CHUNK_SIZE;
+         cz++) {
+        for (int cy = lo[1] / VOXEL_CHUNK_SIZE;
+             cy <= hi[1] / VOXEL_CHUNK_SIZE; cy++) {
+            for (int cx = lo[0] / VOXEL_CHUNK_SIZE;
+                 cx <= hi[0] / VOXEL_CHUNK_SIZE; cx++) {
+                int origin[3] = {cx * VOXEL_CHUNK_SIZE, cy * VOXEL_CHUNK_SIZE,
+                                 cz * VOXEL_CHUNK_SIZE};
+                int from[3], to[3];
+                int whole = 1;
+                for (int i = 0; i < 3; i++) {
+                    from[i] = lo[i] > origin[i] ? lo[i] - origin[i] : 0;
+                    to[i] = hi[i] < origin[i] + VOXEL_CHUNK_SIZE - 1 ?
+                            hi[i] - origin[i] : VOXEL_CHUNK_SIZE - 1;
+                    whole &= from[i] == 0 && to[i] == VOXEL_CHUNK_SIZE - 1;
+                }
+
+                struct voxel_chunk *chunk = chunk_at(world, cx, cy, cz);
+                if (!chunk && block == 0) {
+                    continue;
+                }
+                if (!chunk) {
+                    chunk = get_chunk(world, origin[0], origin[1],
+                                      origin[2]);
+                    if (!chunk) {
+                        return 1;
+                    }
+                }
+
+                int changed = 0;
+                if (whole) {
+                    changed = chunk->bits != 0 || chunk->palette[0] != block;
+                    chunk_fill(chunk, block);
+                } else {
+                    for (int z = from[2]; z <= to[2]; z++) {
+                        for (int y = from[1]; y <= to[1]; y++) {
+                            for (int x = from[0]; x <= to[0]; x++) {
+                                int result = chunk_set(
+                                    chunk, local_index(x, y, z), block);
+                                if (result < 0) {
+                                    return 1;
+                                }
+                                changed |= result;
+                            }
+                        }
+                    }
+                }
+
+                if (changed) {
+                    mark_box_dirty(world, chunk, from, to);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Copies the chunk and the layer of each neighbour touching it. Missing
+// chunks and the outside of the world are air.
+static void copy_blocks(const struct voxel_world *world,
+                        const struct voxel_chunk *chunk, uint16_t *blocks) {
+    memset(blocks, 0, VOXEL_PADDED_VOLUME * sizeof(*blocks));
+
+    for (int z = 0; z < VOXEL_CHUNK_SIZE; z++) {
+        for (int y = 0; y < VOXEL_CHUNK_SIZE; y++) {
+            uint16_t *row = &blocks[padded_index(0, y, z)];
+            size_t index = local_index(0, y, z);
+            for (int x = 0; x < VOXEL_CHUNK_SIZE; x++) {
+                row[x] = chunk_get(chunk, index + x);
+            }
+        }
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        int u = (axis + 1) % 3;
+        int v = (axis + 2) % 3;
+
+        for (int side = 0; side < 2; side++) {
+            int position[3] = {chunk->x, chunk->y, chunk->z};
+            position[axis] += side ? 1 : -1;
+            const struct voxel_chunk *neighbour =
+                chunk_at(world, position[0], position[1], position[2]);
+            if (!neighbour) {
+                continue;
+            }
+
+            int from[3], to[3];
+            from[axis] = side ? 0 : VOXEL_CHUNK_SIZE - 1;
+            to[axis] = side ? VOXEL_CHUNK_SIZE : -1;
+            for (int j = 0; j < VOXEL_CHUNK_SIZE; j++) {
+                for (int i = 0; i < VOXEL_CHUNK_SIZE; i++) {
+                    from[u] = to[u] = i;
+                    from[v] = to[v] = j;
+                    blocks[padded_index(to[0], to[1], to[2])] = chunk_get(
+                        neighbour, local_index(from[0], from[1], from[2]));
+                }
+            }
+        }
+    }
+}
+
+// Corners of a w by h face in the plane of the two axes after its own,
+// wound clockwise seen from the side it faces, like the demo's cube
+static const uint8_t corners[2][4][2] = {
+    {{0, 0}, {1, 0}, {1, 1}, {0, 1}},
+    {{0, 0}, {0, 1}, {1, 1}, {1, 0}},
+};
+
+static int emit_quad(struct voxel_job *job, int axis, int side, int plane,
+                     int i, int j, int w, int h, uint16_t block) {
+    if ((job->quad_count + 1) * 4 > job->vertex_capacity) {
+        size_t capacity = job->vertex_capacity ? job->vertex_capacity * 2 :
+                                                 4096;
+        struct voxel_vertex *vertices =
+            realloc(job->vertices, capacity * sizeof(*vertices));
+        if (!vertices) {
+            return 1;
+        }
+
+        job->vertices = vertices;
+        job->vertex_capacity = capacity;
+    }
+
+    int u = (axis + 1) % 3;
+    int v = (axis + 2) % 3;
+    struct voxel_vertex *vertex = &job->vertices[job->quad_count * 4];
+
+    for (int k = 0; k < 4; k++) {
+        int du = corners[side][k][0] * w;
+        int dv = corners[side][k][1] * h;
+
+        uint8_t position[3];
+        position[axis] = plane;
+        position[u] = i + du;
+        position[v] = j + dv;
+
+        vertex[k] = (struct voxel_vertex){
+            .x = position[0],
+            .y = position[1],
+            .z = position[2],
+            .face = axis * 2 + side,
+            .block = block,
+            .u = du,
+            .v = dv,
+        };
+    }
+
+    job->quad_count++;
+
+    return 0;
+}
+
+void voxel_mesh(struct voxel_job *job) {
+    const uint16_t *blocks = job->blocks;
+    const int stride[3] = {1, VOXEL_PADDED_SIZE,
+                           VOXEL_PADDED_SIZE * VOXEL_PADDED_SIZE};
+    uint16_t mask[VOXEL_CHUNK_SIZE * VOXEL_CHUNK_SIZE];
+
+    job->quad_count = 0;
+    job->failed = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        int u = (axis + 1) % 3;
+        int v = (axis + 2) % 3;
+
+        for (int side = 0; side < 2; side++) {
+            int step = side ? stride[axis] : -stride[axis];
+
+            for (int slice = 0; slice < VOXEL_CHUNK_SIZE; slice++) {
+                // The faces of this slice's blocks that aren't against
+                // another block on this side
+                int position[3];
+                position[axis] = slice;
+                for (int j = 0; j < VOXEL_CHUNK_SIZE; j++) {
+                    for (int i = 0; i < VOXEL_CHUNK_SIZE; i++) {
+                        position[u] = i;
+                        position[v] = j;
+                        size_t index = padded_index(position[0], position[1],
+                                                    position[2]);
+                        uint16_t block = blocks[index];
+                        mask[j * VOXEL_CHUNK_SIZE + i] =
+                            block && !blocks[index + step] ? block : 0;
+                    }
+                }
+
+                // Grow each face along u as far as the block goes, then
+                // along v while the whole row matches
+                for (int j = 0; j < VOXEL_CHUNK_SIZE; j++) {
+                    uint16_t *row = &mask[j * VOXEL_CHUNK_SIZE];
+                    for (int i = 0; i < VOXEL_CHUNK_SIZE;) {
+                        uint16_t block = row[i];
+                        if (!block) {
+                            i++;
+                            continue;
+                        }
+
+                        int w = 1;
+                        while (i + w < VOXEL_CHUNK_SIZE && row[i + w] == block) {
+                            w++;
+                        }
+
+                        int h = 1;
+                        for (; j + h < VOXEL_CHUNK_SIZE; h++) {
+                            uint16_t *next = &row[h * VOXEL_CHUNK_SIZE + i];
+                            int k = 0;
+                            while (k < w && next[k] == block) {
+                                k++;
+                            }
+                            if (k < w) {
+                                break;
+                            }
+                        }
+
+                        if (emit_quad(job, axis, side, slice + side, i, j, w,
+                                      h, block)) {
+                            job->failed = 1;
+                            return;
+                        }
+
+                        for (int k = 0; k < h; k++) {
+                            memset(&row[k * VOXEL_CHUNK_SIZE + i], 0,
+                                   w * sizeof(*row));
+                        }
+                        i += w;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct voxel_workers *workers = arg;
+
+    pthread_mutex_lock(&workers->lock);
+    for (;;) {
+        while (!workers->pending && !workers->quit) {
+            pthread_cond_wait(&workers->work, &workers->lock);
+        }
+        if (workers->quit) {
+            break;
+        }
+
+        struct voxel_job *job = workers->pending;
+        workers->pending = job->next;
+        if (!workers->pending) {
+            workers->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&workers->lock);
+
+        uint64_t start = now_ns();
+        voxel_mesh(job);
+        job->mesh_ns = now_ns() - start;
+
+        pthread_mutex_lock(&workers->lock);
+        job->next = NULL;
+        if (workers->done_tail) {
+            workers->done_tail->next = job;
+        } else {
+            workers->done = job;
+        }
+        workers->done_tail = job;
+    }
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+// Jobs left on the lists are the caller's to free
+static void stop_workers(struct voxel_workers *workers) {
+    pthread_mutex_lock(&workers->lock);
+    workers->quit = 1;
+    pthread_cond_broadcast(&workers->work);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (int i = 0; i < workers->count; i++) {
+        pthread_join(workers->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&workers->lock);
+    pthread_cond_destroy(&workers->work);
+}
+
+// One fewer than there are cores, but at least one, since meshing is kept
+// off the calling thread even on a single core
+static struct voxel_workers *start_workers(void) {
+    struct voxel_workers *workers = calloc(1, sizeof(*workers));
+    if (!workers) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->work, NULL);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores - 1 < 1 ? 1 :
+                 cores - 1 < VOXEL_MAX_WORKERS ? cores - 1 :
+                                                 VOXEL_MAX_WORKERS;
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&workers->threads[i], NULL, worker_main,
+                           workers) != 0) {
+            fprintf(stderr, "Error starting voxel worker\n");
+            break;
+        }
+        workers->count++;
+    }
+
+    if (workers->count == 0) {
+        stop_workers(workers);
+        free(workers);
+        return NULL;
+    }
+
+    log_debug("Started %d voxel workers", workers->count);
+
+    return workers;
+}
+
+static void free_jobs(struct voxel_job *job) {
+    while (job) {
+        struct voxel_job *next = job->next;
+        free(job->blocks);
+        free(job->vertices);
+        free(job);
+        job = next;
+    }
+}
+
+static struct voxel_job *get_job(struct voxel_world *world) {
+    struct voxel_job *job = world->free_jobs;
+    if (job) {
+        world->free_jobs = job->next;
+        return job;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        return NULL;
+    }
+
+    job->blocks = malloc(VOXEL_PADDED_VOLUME * sizeof(*job->blocks));
+    if (!job->blocks) {
+        free(job);
+        return NULL;
+    }
+
+    return job;
+}
+
+size_t voxel_world_update(struct voxel_world *world) {
+    world->stats.submitted = 0;
+
+    if (world->dirty_count == 0) {
+        return 0;
+    }
+
+    if (!world->workers) {
+        world->workers = start_workers();
+        if (!world->workers) {
+            return 0;
+        }
+    }
+
+    // Snapshots are taken here, so the workers never see the world while
+    // it's being edited
+    struct voxel_job *head = NULL, *tail = NULL;
+    while (world->dirty_count > 0 && world->in_flight < VOXEL_MAX_JOBS) {
+        struct voxel_job *job = get_job(world);
+        if (!job) {
+            break;
+        }
+
+        size_t index = world->dirty[world->dirty_head];
+        world->dirty_head = (world->dirty_head + 1) % world->chunk_count;
+        world->dirty_count--;
+
+        struct voxel_chunk *chunk = world->chunks[index];
+        chunk->queued = 0;
+        chunk->in_flight = 1;
+
+        job->next = NULL;
+        job->chunk = index;
+        job->version = chunk->version;
+        copy_blocks(world, chunk, job->blocks);
+
+        if (tail) {
+            tail->next = job;
+        } else {
+            head = job;
+        }
+        tail = job;
+
+        world->in_flight++;
+        world->stats.submitted++;
+    }
+
+    if (head) {
+        struct voxel_workers *workers = world->workers;
+
+        pthread_mutex_lock(&workers->lock);
+        if (workers->pending_tail) {
+            workers->pending_tail->next = head;
+        } else {
+            workers->pending = head;
+        }
+        workers->pending_tail = tail;
+        pthread_cond_broadcast(&workers->work);
+        pthread_mutex_unlock(&workers->lock);
+    }
+
+    return world->stats.submitted;
+}
+
+// Fills the shared index buffer with enough quads: 0 1 2 0 2 3, then the
+// same four vertices on
+static int reserve_indices(struct voxel_world *world, uint32_t quads) {
+    if (quads <= world->index_quads) {
+        return 0;
+    }
+
+    uint32_t count = world->index_quads ? world->index_quads : 4096;
+    while (count < quads) {
+        count *= 2;
+    }
+
+    size_t size = (size_t)count * 6 * sizeof(GLuint);
+    GLuint *indices = malloc(size);
+    if (!indices) {
+        return 1;
+    }
+
+    static const GLuint quad[6] = {0, 1, 2, 0, 2, 3};
+    for (uint32_t i = 0; i < count; i++) {
+        for (int k = 0; k < 6; k++) {
+            indices[i * 6 + k] = i * 4 + quad[k];
+        }
+    }
+
+    if (!world->index_buffer) {
+        glGenBuffers(1, &world->index_buffer);
+    }
+
+    // Filled through the array buffer binding, since the element array
+    // binding belongs to whichever vertex array is bound
+    glBindBuffer(GL_ARRAY_BUFFER, world->index_buffer);
+    glBufferData(GL_ARRAY_BUFFER, size, indices, GL_STATIC_DRAW);
+    memory_gpu_alloc(world->memory, MEMORY_GPU_BUFFER, world->index_buffer,
+                     size, GL_STATIC_DRAW, "voxel indices");
+
+    free(indices);
+    world->index_quads = count;
+
+    return 0;
+}
+
+static int create_page(struct voxel_world *world) {
+    struct voxel_page *page = &world->pages[world->page_count];
+
+    page->free = malloc(VOXEL_MAX_FREE_RANGES * sizeof(*page->free));
+    if (!page->free) {
+        return 1;
+    }
+    page->free[0] = (struct voxel_range){0, VOXEL_PAGE_VERTICES};
+    page->free_count = 1;
+    page->used = 0;
+
+    size_t size = VOXEL_PAGE_VERTICES * sizeof(struct voxel_vertex);
+    size_t stride = sizeof(struct voxel_vertex);
+
+    glGenVertexArrays(1, &page->vertex_array);
+    glGenBuffers(1, &page->buffer);
+    glBindVertexArray(page->vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER, page->buffer);
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    memory_gpu_alloc(world->memory, MEMORY_GPU_BUFFER, page->buffer, size,
+                     GL_DYNAMIC_DRAW, "voxel pool");
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_UNSIGNED_BYTE, GL_FALSE, stride,
+                          (GLvoid *)offsetof(struct voxel_vertex, x));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 1, GL_UNSIGNED_SHORT, GL_FALSE, stride,
+                          (GLvoid *)offsetof(struct voxel_vertex, block));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_UNSIGNED_BYTE, GL_FALSE, stride,
+                          (GLvoid *)offsetof(struct voxel_vertex, u));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world->index_buffer);
+
+    world->page_count++;
+
+    return 0;
+}
+
+// First fit from the page's free ranges
+static int page_take(struct voxel_page *page, uint32_t count,
+                     uint32_t *first) {
+    for (size_t i = 0; i < page->free_count; i++) {
+        struct voxel_range *range = &page->free[i];
+        if (range->count < count) {
+            continue;
+        }
+
+        *first = range->first;
+        range->first += count;
+        range->count -= count;
+        if (range->count == 0) {
+            page->free_count--;
+            memmove(range, range + 1,
+                    (page->free_count - i) * sizeof(*range));
+        }
+        page->used += count;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static void page_give(struct voxel_page *page, uint32_t first,
+                      uint32_t count) {
+    size_t i = 0;
+    while (i < page->free_count && page->free[i].first < first) {
+        i++;
+    }
+
+    page->used -= count;
+
+    struct voxel_range *before = i > 0 ? &page->free[i - 1] : NULL;
+    struct voxel_range *after = i < page->free_count ? &page->free[i] : NULL;
+    int joins_before = before && before->first + before->count == first;
+    int joins_after = after && first + count == after->first;
+
+    if (joins_before && joins_after) {
+        before->count += count + after->count;
+        page->free_count--;
+        memmove(after, after + 1, (page->free_count - i) * sizeof(*after));
+    } else if (joins_before) {
+        before->count += count;
+    } else if (joins_after) {
+        after->first = first;
+        after->count += count;
+    } else {
+        memmove(&page->free[i + 1], &page->free[i],
+                (page->free_count - i) * sizeof(*page->free));
+        page->free[i] = (struct voxel_range){first, count};
+        page->free_count++;
+    }
+}
+
+static void release_mesh(struct voxel_world *world,
+                         struct voxel_chunk *chunk) {
+    if (chunk->page >= 0) {
+        page_give(&world->pages[chunk->page], chunk->first, chunk->capacity);
+    }
+
+    chunk->page = -1;
+    chunk->first = 0;
+    chunk->capacity = 0;
+    chunk->vertex_count = 0;
+}
+
+static int reserve_mesh(struct voxel_world *world, struct voxel_chunk *chunk,
+                        uint32_t count) {
+    // Remeshes that still fit, and don't leave most of the range empty,
+    // stay where they are
+    if (chunk->page >= 0 && count <= chunk->capacity &&
+        count > chunk->capacity / 4) {
+        return 0;
+    }
+
+    release_mesh(world, chunk);
+
+    uint32_t capacity = (count + VOXEL_RANGE_ALIGN - 1) /
+                        VOXEL_RANGE_ALIGN * VOXEL_RANGE_ALIGN;
+    for (int i = 0;; i++) {
+        if (i == world->page_count &&
+            (world->page_count == VOXEL_MAX_PAGES || create_page(world))) {
+            return 1;
+        }
+
+        if (page_take(&world->pages[i], capacity, &chunk->first)) {
+            chunk->page = i;
+            chunk->capacity = capacity;
+            return 0;
+        }
+    }
+}
+
+static int upload_mesh(struct voxel_world *world, struct voxel_chunk *chunk,
+                       const struct voxel_job *job) {
+    uint32_t count = job->quad_count * 4;
+    if (count == 0) {
+        release_mesh(world, chunk);
+        return 0;
+    }
+
+    if (reserve_indices(world, job->quad_count)) {
+        fprintf(stderr, "Error growing voxel index buffer\n");
+        return 1;
+    }
+
+    if (reserve_mesh(world, chunk, count)) {
+        fprintf(stderr, "Voxel vertex pool is full, dropping chunk %d, %d, "
+                "%d\n", chunk->x, chunk->y, chunk->z);
+        return 1;
+    }
+
+    size_t size = count * sizeof(struct voxel_vertex);
+    glBindBuffer(GL_ARRAY_BUFFER, world->pages[chunk->page].buffer);
+    glBufferSubData(GL_ARRAY_BUFFER,
+                    chunk->first * sizeof(struct voxel_vertex), size,
+                    job->vertices);
+
+    chunk->vertex_count = count;
+    world->stats.upload_bytes += size;
+
+    return 0;
+}
+
+size_t voxel_world_upload(struct voxel_world *world, size_t max) {
+    struct voxel_stats *stats = &world->stats;
+    stats->uploaded = 0;
+    stats->upload_bytes = 0;
+
+    if (world->workers) {
+        struct voxel_workers *workers = world->workers;
+
+        pthread_mutex_lock(&workers->lock);
+        if (workers->done) {
+            if (world->ready_tail) {
+                world->ready_tail->next = workers->done;
+            } else {
+                world->ready = workers->done;
+            }
+            world->ready_tail = workers->done_tail;
+            workers->done = workers->done_tail = NULL;
+        }
+        pthread_mutex_unlock(&workers->lock);
+    }
+
+    while (world->ready && stats->uploaded < max) {
+        struct voxel_job *job = world->ready;
+        world->ready = job->next;
+        if (!world->ready) {
+            world->ready_tail = NULL;
+        }
+
+        struct voxel_chunk *chunk = world->chunks[job->chunk];
+        chunk->in_flight = 0;
+        world->in_flight--;
+
+        stats->meshes++;
+        stats->mesh_ns += job->mesh_ns;
+        if (job->mesh_ns > stats->max_mesh_ns) {
+            stats->max_mesh_ns = job->mesh_ns;
+        }
+
+        int dropped = job->failed || upload_mesh(world, chunk, job);
+        if (job->failed) {
+            fprintf(stderr, "Out of memory meshing voxel chunk %d, %d, %d\n",
+                    chunk->x, chunk->y, chunk->z);
+        }
+
+        if (chunk->version != job->version) {
+            // Edited while it was being meshed
+            queue_chunk(world, chunk);
+        } else {
+            if (dropped) {
+                stats->dropped++;
+            } else if (chunk->dirty_ns) {
+                uint64_t latency = now_ns() - chunk->dirty_ns;
+                stats->remeshes++;
+                stats->latency_ns += latency;
+                stats->last_latency_ns = latency;
+                if (latency > stats->max_latency_ns) {
+                    stats->max_latency_ns = latency;
+                }
+            }
+            chunk->dirty_ns = 0;
+        }
+
+        job->next = world->free_jobs;
+        world->free_jobs = job;
+        stats->uploaded++;
+    }
+
+    // Uploads leave the pool's vertex arrays and buffers bound
+    if (stats->uploaded > 0) {
+        handle_restore_bindings(world->handles);
+    }
+
+    return stats->uploaded;
+}
+
+size_t voxel_world_draw(struct voxel_world *world, GLint origin_location) {
+    size_t draws = 0;
+    int bound = -1;
+
+    for (size_t i = 0; i < world->chunk_count; i++) {
+        const struct voxel_chunk *chunk = world->chunks[i];
+        if (!chunk || chunk->vertex_count == 0) {
+            continue;
+        }
+
+        if (chunk->page != bound) {
+            glBindVertexArray(world->pages[chunk->page].vertex_array);
+            bound = chunk->page;
+        }
+
+        GLfloat origin[3] = {
+            chunk->x * VOXEL_CHUNK_SIZE,
+            chunk->y * VOXEL_CHUNK_SIZE,
+            chunk->z * VOXEL_CHUNK_SIZE,
+        };
+        glUniform3fv(origin_location, 1, origin);
+        glDrawElementsBaseVertex(GL_TRIANGLES, chunk->vertex_count / 4 * 6,
+                                 GL_UNSIGNED_INT, NULL, chunk->first);
+        draws++;
+    }
+
+    if (bound >= 0) {
+        handle_restore_bindings(world->handles);
+    }
+
+    return draws;
+}
+
+void voxel_world_destroy(struct voxel_world *world) {
+    if (world->workers) {
+        stop_workers(world->workers);
+        free_jobs(world->workers->pending);
+        free_jobs(world->workers->done);
+        free(world->workers);
+    }
+    free_jobs(world->ready);
+    free_jobs(world->free_jobs);
+
+    for (size_t i = 0; i < world->chunk_count; i++) {
+        if (world->chunks[i]) {
+            free(world->chunks[i]->data);
+            free(world->chunks[i]);
+        }
+    }
+
+    for (int i = 0; i < world->page_count; i++) {
+        struct voxel_page *page = &world->pages[i];
+        memory_gpu_free(world->memory, MEMORY_GPU_BUFFER, page->buffer);
+        glDeleteVertexArrays(1, &page->vertex_array);
+        glDeleteBuffers(1, &page->buffer);
+        free(page->free);
+    }
+
+    if (world->index_buffer) {
+        memory_gpu_free(world->memory, MEMORY_GPU_BUFFER,
+                        world->index_buffer);
+        glDeleteBuffers(1, &world->index_buffer);
+    }
+
+    free(world->chunks);
+    free(world->dirty);
+    free(world);
+}
+
+static struct voxel_world *check_world(lua_State *L, int index) {
+    struct voxel_world *world = lua_touserdata(L, index);
+    if (!world) {
+        luaL_error(L, "Expected a voxel world");
+    }
+
+    return world;
+}
+
+static uint16_t check_block(lua_State *L, int index) {
+    lua_Integer block = luaL_checkinteger(L, index);
+    if (block < 0 || block > UINT16_MAX) {
+        luaL_error(L, "Bad voxel block %d", (int)block);
+    }
+
+    return block;
+}
+
+static void check_position(lua_State *L, int index, int *position) {
+    for (int i = 0; i < 3; i++) {
+        position[i] = luaL_checkinteger(L, index + i);
+    }
+}
+
+// Size in chunks along x, y and z
+int draw_lua_CreateVoxelWorld(struct draw_data *data, lua_State *L) {
+    int size[3];
+    check_position(L, 1, size);
+    for (int i = 0; i < 3; i++) {
+        if (size[i] < 1 || size[i] > 1024) {
+            return luaL_error(L, "Bad voxel world size %d, %d, %d", size[0],
+                              size[1], size[2]);
+        }
+    }
+
+    struct voxel_world *world = voxel_world_create(size, data->memory,
+                                                  &data->handles);
+    if (!world) {
+        return luaL_error(L, "Error creating voxel world");
+    }
+
+    lua_pushlightuserdata(L, world);
+
+    return 1;
+}
+
+// Waits for meshes being made, then frees the world and its buffers
+int draw_lua_DeleteVoxelWorld(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    voxel_world_destroy(check_world(L, 1));
+
+    return 0;
+}
+
+// world, and optionally the most meshes to upload. Returns how many were.
+int draw_lua_UploadVoxelMeshes(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct voxel_world *world = check_world(L, 1);
+    lua_Integer max = luaL_optinteger(L, 2, -1);
+
+    lua_pushinteger(L, voxel_world_upload(world, max < 0 ? SIZE_MAX :
+                                                           (size_t)max));
+
+    return 1;
+}
+
+// world, chunk origin uniform location. Draws with the program in use, and
+// returns the number of chunks drawn.
+int draw_lua_DrawVoxels(struct draw_data *data, lua_State *L) {
+    (void)data;
+
+    struct voxel_world *world = check_world(L, 1);
+    GLint location = (intptr_t)lua_touserdata(L, 2);
+
+    lua_pushinteger(L, voxel_world_draw(world, location));
+
+    return 1;
+}
+
+// world, x, y, z. Outside the world is air.
+int voxel_lua_GetBlock(lua_State *L) {
+    struct voxel_world *world = check_world(L, 1);
+    int position[3];
+    check_position(L, 2, position);
+
+    lua_pushinteger(L, voxel_get_block(world, position[0], position[1],
+                                       position[2]));
+
+    return 1;
+}
+
+// world, x, y, z, block
+int voxel_lua_SetBlock(lua_State *L) {
+    struct voxel_world *world = check_world(L, 1);
+    int position[3];
+    check_position(L, 2, position);
+    uint16_t block = check_block(L, 5);
+
+    if (!inside(world, position[0], position[1], position[2])) {
+        return luaL_error(L, "Block %d, %d, %d is outside the voxel world",
+                          position[0], position[1], position[2]);
+    }
+
+    if (voxel_set_block(world, position[0], position[1], position[2],
+                        block)) {
+        return luaL_error(L, "Out of memory setting voxel block");
+    }
+
+    return 0;
+}
+
+// world, x0, y0, z0, x1, y1, z1, block. Fills the box between the corners
+// inclusive, clipped to the world.
+int voxel_lua_Fill(lua_State *L) {
+    struct voxel_world *world = check_world(L, 1);
+    int min[3], max[3];
+    check_position(L, 2, min);
+    check_position(L, 5, max);
+    uint16_t block = check_block(L, 8);
+
+    if (voxel_fill(world, min, max, block)) {
+        return luaL_error(L, "Out of memory filling voxel blocks");
+    }
+
+    return 0;
+}
+
+// Starts meshing the chunks changed since the last update. Returns how many
+// were sent to the workers.
+int voxel_lua_Update(lua_State *L) {
+    lua_pushinteger(L, voxel_world_update(check_world(L, 1)));
+
+    return 1;
+}
+
+static void set_number(lua_State *L, const char *name, lua_Number value) {
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+}
+
+// What the world holds now, the last update and upload, and remesh times
+// since it was made
+int voxel_lua_Stats(lua_State *L) {
+    struct voxel_world *world = check_world(L, 1);
+    const struct voxel_stats *stats = &world->stats;
+
+    size_t chunks = 0, uniform = 0, meshed = 0, vertices = 0;
+    size_t storage = 0;
+    for (size_t i = 0; i < world->chunk_count; i++) {
+        const struct voxel_chunk *chunk = world->chunks[i];
+        if (!chunk) {
+            continue;
+        }
+
+        chunks++;
+        uniform += chunk->bits == 0;
+        meshed += chunk->vertex_count > 0;
+        vertices += chunk->vertex_count;
+        storage += sizeof(*chunk) + chunk_words(chunk->bits) * 8;
+    }
+
+    size_t pool_used = 0;
+    for (int i = 0; i < world->page_count; i++) {
+        pool_used += world->pages[i].used;
+    }
+
+    lua_createtable(L, 0, 24);
+    set_number(L, "chunks", chunks);
+    set_number(L, "uniform_chunks", uniform);
+    set_number(L, "meshed_chunks", meshed);
+    set_number(L, "storage_bytes", storage);
+    set_number(L, "vertices", vertices);
+    set_number(L, "triangles", vertices / 2);
+
+    set_number(L, "dirty", world->dirty_count);
+    set_number(L, "in_flight", world->in_flight);
+    set_number(L, "workers", world->workers ? world->workers->count : 0);
+    set_number(L, "submitted", stats->submitted);
+    set_number(L, "uploaded", stats->uploaded);
+    set_number(L, "upload_bytes", stats->upload_bytes);
+
+    set_number(L, "meshes", stats->meshes);
+    set_number(L, "mesh_ms", stats->meshes ?
+               stats->mesh_ns / 1e6 / stats->meshes : 0);
+    set_number(L, "max_mesh_ms", stats->max_mesh_ns / 1e6);
+    set_number(L, "remeshes", stats->remeshes);
+    set_number(L, "latency_ms", stats->remeshes ?
+               stats->latency_ns / 1e6 / stats->remeshes : 0);
+    set_number(L, "last_latency_ms", stats->last_latency_ns / 1e6);
+    set_number(L, "max_latency_ms", stats->max_latency_ns / 1e6);
+    set_number(L, "dropped", stats->dropped);
+
+    set_number(L, "pages", world->page_count);
+    set_number(L, "pool_bytes", (size_t)world->page_count *
+               VOXEL_PAGE_VERTICES * sizeof(struct voxel_vertex));
+    set_number(L, "pool_used_bytes",
+               pool_used * sizeof(struct voxel_vertex));
+
+    return 1;
+}
+
+void voxel_register(lua_State *L, struct draw_data *draw) {
+    REGISTER_FUNC(CreateVoxelWorld);
+    REGISTER_FUNC(DeleteVoxelWorld);
+    REGISTER_FUNC(UploadVoxelMeshes);
+    REGISTER_FUNC(DrawVoxels);
+
+    lua_register(L, "voxel_GetBlock", voxel_lua_GetBlock);
+    lua_register(L, "voxel_SetBlock", voxel_lua_SetBlock);
+    lua_register(L, "voxel_Fill", voxel_lua_Fill);
+    lua_register(L, "voxel_Update", voxel_lua_Update);
+    lua_register(L, "voxel_Stats", voxel_lua_Stats);
+}
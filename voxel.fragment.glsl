@@ -0,0 +1,18 @@
+#version 330
+
+in vec3 normal;
+in vec2 uv;
+flat in float block_id;
+
+out vec4 out_color;
+
+void main() {
+    // A color per block, with the edges of each block darkened so they
+    // still show on merged faces
+    vec3 color = 0.5 + 0.5 * cos(vec3(0.0, 2.1, 4.2) + block_id * 1.7);
+    vec2 edge = min(fract(uv), 1.0 - fract(uv));
+    float line = smoothstep(0.0, 0.05, min(edge.x, edge.y));
+    float light = 0.4 + 0.6 * max(dot(normalize(normal),
+                                      normalize(vec3(0.3, 1.0, 0.5))), 0.0);
+    out_color = vec4(color * light * (0.7 + 0.3 * line), 1.0);
+}
@@ -0,0 +1,212 @@
+#ifndef VOXEL_H
+#define VOXEL_H
+
+#include "lua.h"
+#include "draw.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VOXEL_CHUNK_SIZE 32
+#define VOXEL_CHUNK_VOLUME (VOXEL_CHUNK_SIZE * VOXEL_CHUNK_SIZE * \
+                            VOXEL_CHUNK_SIZE)
+// A chunk plus a layer of each neighbour's blocks on every side, which is
+// all a mesher needs to tell which faces are hidden
+#define VOXEL_PADDED_SIZE (VOXEL_CHUNK_SIZE + 2)
+#define VOXEL_PADDED_VOLUME (VOXEL_PADDED_SIZE * VOXEL_PADDED_SIZE * \
+                             VOXEL_PADDED_SIZE)
+
+// Palette entries before a chunk switches to storing block ids directly
+#define VOXEL_MAX_PALETTE 256
+
+#define VOXEL_MAX_WORKERS 8
+// Chunks being meshed at once, which bounds the memory held by snapshots
+// and results waiting for upload
+#define VOXEL_MAX_JOBS 64
+
+// Vertices in each pooled vertex buffer. A chunk's mesh has to fit in one
+// page: the worst case, a 3D checkerboard, has 32^3 / 2 * 6 quads, which
+// is 393216 vertices.
+#define VOXEL_PAGE_VERTICES (1 << 20)
+#define VOXEL_MAX_PAGES 32
+// Ranges in a page are handed out in multiples of this many vertices, so a
+// remeshed chunk that grew a little usually still fits where it was
+#define VOXEL_RANGE_ALIGN 256
+
+// One corner of a merged face, relative to the chunk's origin. Every face
+// is a quad, drawn with the shared index buffer as two triangles.
+//   location 0: x, y, z and face, where face is axis * 2 + 1 for faces
+//               pointing along the positive axis
+//   location 1: block id
+//   location 2: u, v in blocks across the face, for repeating textures
+struct voxel_vertex {
+    uint8_t x, y, z;
+    uint8_t face;
+    uint16_t block;
+    uint8_t u, v;
+};
+
+// Blocks are indices into the chunk's palette, packed bits to an entry and
+// never straddling words. A chunk of one block has no data at all (bits 0),
+// and one with more than VOXEL_MAX_PALETTE kinds of block stores the ids
+// themselves (bits 16). Block 0 is air.
+struct voxel_chunk {
+    // In chunks
+    int x, y, z;
+
+    uint16_t palette[VOXEL_MAX_PALETTE];
+    uint32_t palette_count;
+    uint8_t bits;
+    uint64_t *data;
+    // Blocks that aren't air
+    uint32_t solid;
+
+    // Bumped by every edit, and compared with the version a mesh was made
+    // from when it comes back
+    uint32_t version;
+    // Waiting in the dirty queue, or in a worker's hands
+    int queued;
+    int in_flight;
+    // When the first edit since the chunk's last mesh was made
+    uint64_t dirty_ns;
+
+    // The uploaded mesh: vertex_count vertices starting at first in the
+    // page, out of capacity reserved there. page is -1 with no mesh.
+    int page;
+    uint32_t first;
+    uint32_t capacity;
+    uint32_t vertex_count;
+};
+
+// A chunk's blocks copied out for a worker, and the mesh it made of them
+struct voxel_job {
+    struct voxel_job *next;
+
+    size_t chunk;
+    uint32_t version;
+    uint16_t *blocks;
+
+    struct voxel_vertex *vertices;
+    size_t vertex_capacity;
+    uint32_t quad_count;
+    // Couldn't grow vertices
+    int failed;
+
+    uint64_t mesh_ns;
+};
+
+// Mesh chunks in the background. Jobs are taken from pending in order, and
+// put on done for the next upload to collect.
+struct voxel_workers {
+    pthread_t threads[VOXEL_MAX_WORKERS];
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct voxel_job *pending, *pending_tail;
+    struct voxel_job *done, *done_tail;
+    int quit;
+};
+
+struct voxel_range {
+    uint32_t first;
+    uint32_t count;
+};
+
+// A vertex buffer chunk meshes are suballocated from, with a vertex array
+// reading it through the shared index buffer. Free ranges are kept sorted
+// and merged with their neighbours.
+struct voxel_page {
+    GLuint buffer;
+    GLuint vertex_array;
+
+    struct voxel_range *free;
+    size_t free_count;
+    uint32_t used;
+};
+
+struct voxel_stats {
+    // From the last update and upload
+    size_t submitted;
+    size_t uploaded;
+    size_t upload_bytes;
+
+    // Since the world was made
+    uint64_t meshes;
+    uint64_t mesh_ns;
+    uint64_t max_mesh_ns;
+    // From a chunk's first edit to a mesh of its latest version being
+    // uploaded
+    uint64_t remeshes;
+    uint64_t latency_ns;
+    uint64_t max_latency_ns;
+    uint64_t last_latency_ns;
+    // Meshes that didn't fit in the pool, or that a worker ran out of
+    // memory making
+    uint64_t dropped;
+};
+
+// A fixed size grid of chunks, made as blocks are placed in them. Edits
+// queue the chunks they touch, including neighbours whose hidden faces
+// change, and update hands those to the workers. Only chunks that changed
+// are ever meshed again.
+struct voxel_world {
+    int size[3];
+    struct voxel_chunk **chunks;
+    size_t chunk_count;
+
+    // Ring of chunk indices waiting to be meshed, oldest first. A chunk is
+    // in it at most once, so it never holds more than chunk_count.
+    size_t *dirty;
+    size_t dirty_head;
+    size_t dirty_count;
+
+    // Started by the first update with something to mesh
+    struct voxel_workers *workers;
+    size_t in_flight;
+    // Jobs to reuse, and finished ones waiting for upload
+    struct voxel_job *free_jobs;
+    struct voxel_job *ready, *ready_tail;
+
+    struct voxel_page pages[VOXEL_MAX_PAGES];
+    int page_count;
+    GLuint index_buffer;
+    uint32_t index_quads;
+
+    struct memory_stats *memory;
+    // Lua's bindings, put back after uploading and drawing
+    struct handle_table *handles;
+    struct voxel_stats stats;
+};
+
+// Size in chunks along each axis
+struct voxel_world *voxel_world_create(const int *, struct memory_stats *,
+                                       struct handle_table *);
+void voxel_world_destroy(struct voxel_world *);
+
+// World block coordinates. Outside the world is air, and setting it does
+// nothing. Setting returns 1 out of memory.
+uint16_t voxel_get_block(const struct voxel_world *, int, int, int);
+int voxel_set_block(struct voxel_world *, int, int, int, uint16_t);
+// Sets every block in the box from min to max inclusive, clipped to the
+// world. Chunks it covers whole are stored as that one block. Returns 1 out
+// of memory.
+int voxel_fill(struct voxel_world *, const int *, const int *, uint16_t);
+
+// Hands dirty chunks to the workers, up to VOXEL_MAX_JOBS at once. Returns
+// how many were sent.
+size_t voxel_world_update(struct voxel_world *);
+// Uploads up to max finished meshes into the pool. Returns how many.
+size_t voxel_world_upload(struct voxel_world *, size_t);
+// Draws every chunk with a mesh, setting the chunk's origin in blocks at
+// the uniform location. Returns the number of draws.
+size_t voxel_world_draw(struct voxel_world *, GLint);
+
+// Greedily merges faces of the same block into quads. Blocks are a padded
+// snapshot, as made for jobs.
+void voxel_mesh(struct voxel_job *);
+
+void voxel_register(lua_State *, struct draw_data *);
+
+#endif
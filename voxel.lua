@@ -0,0 +1,107 @@
+-- Block worlds in chunks of 32^3. Edits only queue the chunks they touch;
+-- update hands those to worker threads, which merge each run of matching
+-- faces into one quad, and upload_meshes copies the finished meshes into
+-- pooled vertex buffers. Each chunk is then one draw.
+local gl = require 'gl'
+
+local M = {}
+
+-- Voxel functions exposed from C
+local copy_funcs = {
+  GetBlock="get_block",
+  SetBlock="set_block",
+  Fill="fill",
+  Update="update",
+  Stats="stats",
+}
+
+for c_name, lua_name in pairs(copy_funcs) do
+  M[lua_name] = _G["voxel_" .. c_name]
+end
+
+-- Drawing functions, which need the GL context
+local copy_draw_funcs = {
+  CreateVoxelWorld="create_world",
+  DeleteVoxelWorld="delete_world",
+  UploadVoxelMeshes="upload_meshes",
+  DrawVoxels="draw_chunks",
+}
+
+for c_name, lua_name in pairs(copy_draw_funcs) do
+  M[lua_name] = _G["draw_" .. c_name]
+end
+
+-- The program to draw worlds with. Blocks are one unit across, before the
+-- model matrix.
+function M.create_renderer(perspective_matrix, model_matrix)
+  local renderer = {
+    program = gl.create_program({
+      {gl.VERTEX_SHADER, "voxel.vertex.glsl"},
+      {gl.FRAGMENT_SHADER, "voxel.fragment.glsl"},
+    }),
+  }
+  renderer.chunk_origin = gl.get_uniform_location(renderer.program,
+                                                  "chunk_origin")
+  renderer.model_matrix = gl.get_uniform_location(renderer.program,
+                                                  "model_matrix")
+
+  gl.with_program(
+    renderer.program,
+    function()
+      gl.uniform_matrix_float(
+        gl.get_uniform_location(renderer.program, "perspective_matrix"), 4, 4,
+        perspective_matrix)
+      gl.uniform_matrix_float(renderer.model_matrix, 4, 4, model_matrix)
+    end
+  )
+
+  return renderer
+end
+
+-- Uploads up to max_uploads finished meshes (all of them by default), then
+-- draws every chunk. Returns the number of chunks drawn.
+function M.draw(renderer, world, max_uploads)
+  M.upload_meshes(world, max_uploads)
+
+  local draws = 0
+  gl.with_program(
+    renderer.program,
+    function()
+      draws = M.draw_chunks(world, renderer.chunk_origin)
+    end
+  )
+
+  return draws
+end
+
+function M.delete_renderer(renderer)
+  gl.delete_program(renderer.program)
+end
+
+function M.report(world, file)
+  file = file or io.stderr
+
+  local stats = M.stats(world)
+  file:write(string.format(
+    "Voxels: %d chunks (%d uniform, %d KB), %d meshed, %d triangles\n",
+    stats.chunks, stats.uniform_chunks, stats.storage_bytes / 1024,
+    stats.meshed_chunks, stats.triangles
+  ))
+  file:write(string.format(
+    "  %d dirty, %d meshing on %d workers, %d sent, %d uploaded (%d KB)\n",
+    stats.dirty, stats.in_flight, stats.workers, stats.submitted,
+    stats.uploaded, stats.upload_bytes / 1024
+  ))
+  file:write(string.format(
+    "  meshing %.3f ms (worst %.3f) over %d meshes, " ..
+      "remesh latency %.3f ms (last %.3f, worst %.3f), %d dropped\n",
+    stats.mesh_ms, stats.max_mesh_ms, stats.meshes, stats.latency_ms,
+    stats.last_latency_ms, stats.max_latency_ms, stats.dropped
+  ))
+  file:write(string.format(
+    "  pool %d of %d KB in %d pages\n",
+    stats.pool_used_bytes / 1024, stats.pool_bytes / 1024, stats.pages
+  ))
+end
+
+return M
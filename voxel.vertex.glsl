@@ -0,0 +1,29 @@
+#version 330
+
+// xyz is the corner in blocks from the chunk's origin, w the face
+layout(location = 0) in vec4 corner;
+layout(location = 1) in float block;
+// Blocks across the face, for repeating a texture along merged faces
+layout(location = 2) in vec2 face_uv;
+
+uniform mat4 perspective_matrix;
+uniform mat4 model_matrix;
+uniform vec3 chunk_origin;
+
+out vec3 normal;
+out vec2 uv;
+flat out float block_id;
+
+const vec3 normals[6] = vec3[6](
+    vec3(-1.0, 0.0, 0.0), vec3(1.0, 0.0, 0.0),
+    vec3(0.0, -1.0, 0.0), vec3(0.0, 1.0, 0.0),
+    vec3(0.0, 0.0, -1.0), vec3(0.0, 0.0, 1.0)
+);
+
+void main() {
+    vec4 position = vec4(chunk_origin + corner.xyz, 1.0);
+    gl_Position = perspective_matrix * model_matrix * position;
+    normal = mat3(model_matrix) * normals[int(corner.w)];
+    uv = face_uv;
+    block_id = block;
+}